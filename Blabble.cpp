@@ -13,6 +13,7 @@
 #include "BlabbleAPI.h"
 #include "Blabble.h"
 #include "BlabbleLogging.h"
+#include "BlabbleAudioManager.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 /// @fn Blabble::StaticInitialize()
@@ -38,6 +39,7 @@ void Blabble::StaticDeinitialize()
 {
     // Place one-time deinitialization stuff here. As of FireBreath 1.4 this should
     // always be called just before the plugin library is unloaded
+	BlabbleLogging::stopAsyncLogging();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -96,9 +98,15 @@ FB::JSAPIPtr Blabble::createJSAPI()
 	bool enableIce = false;
 	try 
 	{
-		if ((logging = this->getParam("logging")) && *logging == "true")
+		if ((logging = this->getParam("logging")) && (*logging == "true" || *logging == "async"))
 		{
 			BlabbleLogging::initLogging();
+			if (*logging == "async")
+			{
+				//logoverflow=block makes PJSIP threads wait for the writer instead of dropping lines
+				boost::optional<std::string> overflow = this->getParam("logoverflow");
+				BlabbleLogging::startAsyncLogging(overflow && *overflow == "block");
+			}
 		}
 		if ((ice = this->getParam("enableice")) && *ice == "true")
 		{
@@ -106,11 +114,23 @@ FB::JSAPIPtr Blabble::createJSAPI()
 		}
 		PjsuaManagerPtr manager = PjsuaManager::GetManager(this->m_filesystemPath,
 			enableIce, 
-			this->getParam("stunserver").get_value_or(""));
+			this->getParam("stunserver").get_value_or(""),
+			this->getParam("mediaprofile").get_value_or("default"),
+			this->getParam("transports").get_value_or(""),
+			this->getParam("nameservers").get_value_or(""),
+			this->getParam("eventloop").get_value_or(""),
+			this->getParam("codecs").get_value_or(""),
+			this->getParam("sounddevice").get_value_or(""));
 		if (!manager)
 		{
 			return boost::make_shared<BlabbleAPIInvalid>("Unable to create manager");
 		}
+		boost::optional<std::string> tonePlan = this->getParam("toneplan");
+		if (tonePlan && !manager->audio_manager()->SetTonePlan(*tonePlan))
+		{
+			BLABBLE_LOG_ERROR("Unknown tone plan " << tonePlan->c_str() << ", using " << 
+				manager->audio_manager()->tone_plan().c_str() << ".");
+		}
 		return boost::make_shared<BlabbleAPI>(m_host, manager);
 	}
 	catch (std::exception& e)
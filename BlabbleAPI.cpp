@@ -15,7 +15,12 @@ Copyright 2012 Andrew Ofisher
 #include "BlabbleAccount.h"
 #include "PjsuaManager.h"
 #include "BlabbleAudioManager.h"
+#include "BlabbleEventQueue.h"
 #include "BlabbleLogging.h"
+#include "BlabbleMetrics.h"
+#include "FBWriteOnlyProperty.h"
+#include <sstream>
+#include <algorithm>
 
 BlabbleAPIInvalid::BlabbleAPIInvalid(const char* err)
 { 
@@ -26,18 +31,51 @@ BlabbleAPIInvalid::BlabbleAPIInvalid(const char* err)
 BlabbleAPI::BlabbleAPI(const FB::BrowserHostPtr& host, const PjsuaManagerPtr& manager) :
 	browser_host_(host), manager_(manager)
 {
+	event_queue_ = boost::make_shared<BlabbleEventQueue>(host);
+
 	registerMethod("createAccount", make_method(this, &BlabbleAPI::CreateAccount));
+	registerMethod("createAccounts", make_method(this, &BlabbleAPI::CreateAccounts));
 	registerMethod("playWav", make_method(this, &BlabbleAPI::PlayWav));
 	registerMethod("stopWav", make_method(this, &BlabbleAPI::StopWav));
+	registerMethod("preloadWav", make_method(this, &BlabbleAPI::PreloadWav));
+	registerMethod("playBusySignal", make_method(this, &BlabbleAPI::PlayBusySignal));
+	registerMethod("playReorderSignal", make_method(this, &BlabbleAPI::PlayReorderSignal));
+	registerMethod("stopBusySignal", make_method(this, &BlabbleAPI::StopBusySignal));
+	registerProperty("tonePlan", make_property(this, &BlabbleAPI::tone_plan));
+	registerProperty("tonePlans", make_property(this, &BlabbleAPI::tone_plans));
+	registerMethod("setTonePlan", make_method(this, &BlabbleAPI::SetTonePlan));
 	registerMethod("log", make_method(this, &BlabbleAPI::Log));
+	registerMethod("getLogStats", make_method(this, &BlabbleAPI::GetLogStats));
+	registerMethod("getMetrics", make_method(this, &BlabbleAPI::GetMetrics));
 	registerProperty("tlsEnabled", make_property(this, &BlabbleAPI::has_tls));
+	registerProperty("transports", make_property(this, &BlabbleAPI::transports));
+	registerProperty("resolver", make_property(this, &BlabbleAPI::resolver));
+	registerProperty("eventLoop", make_property(this, &BlabbleAPI::event_loop));
+	registerProperty("memory", make_property(this, &BlabbleAPI::memory));
+	registerProperty("soundDevice", make_property(this, &BlabbleAPI::sound_device));
+	registerProperty("mediaProfile", make_property(this, &BlabbleAPI::media_profile));
+	registerProperty("mediaProfiles", make_property(this, &BlabbleAPI::media_profiles));
+	registerMethod("setMediaProfile", make_method(this, &BlabbleAPI::SetMediaProfile));
+	registerProperty("codecs", make_property(this, &BlabbleAPI::codecs));
+	registerMethod("setCodecPriority", make_method(this, &BlabbleAPI::SetCodecPriority));
+	registerMethod("benchmarkCodecs", make_method(this, &BlabbleAPI::BenchmarkCodecs));
+	registerMethod("autoCodecPriority", make_method(this, &BlabbleAPI::AutoCodecPriority));
 
 	registerMethod("getAudioDevices", make_method(this, &BlabbleAPI::GetAudioDevices));
+	registerMethod("refreshAudioDevices", make_method(this, &BlabbleAPI::RefreshAudioDevices));
 	registerMethod("setAudioDevice", make_method(this, &BlabbleAPI::SetAudioDevice));
 	registerMethod("getCurrentAudioDevice", make_method(this, &BlabbleAPI::GetCurrentAudioDevice));
 	registerMethod("getVolume", make_method(this, &BlabbleAPI::GetVolume));
 	registerMethod("setVolume", make_method(this, &BlabbleAPI::SetVolume));
 	registerMethod("getSignalLevel", make_method(this, &BlabbleAPI::GetSignalLevel));
+	registerMethod("startMetering", make_method(this, &BlabbleAPI::StartMetering));
+	registerMethod("stopMetering", make_method(this, &BlabbleAPI::StopMetering));
+
+	registerProperty("onEvents", make_write_only_property(this, &BlabbleAPI::set_on_events));
+	registerProperty("onAudioDevicesChanged", make_write_only_property(this, &BlabbleAPI::set_on_audio_devices_changed));
+
+	//Device changes reach the onEvents sink even without their own callback
+	manager_->audio_devices().Subscribe(event_queue_, FB::JSObjectPtr());
 }
 
 BlabbleAPI::~BlabbleAPI()
@@ -50,6 +88,9 @@ BlabbleAPI::~BlabbleAPI()
 		}
 	}
 	accounts_.clear();
+	manager_->level_meter().Unsubscribe(event_queue_);
+	manager_->audio_devices().Unsubscribe(event_queue_);
+	event_queue_->Shutdown();
 }
 
 void BlabbleAPI::Log(int level, const std::wstring& msg)
@@ -57,54 +98,174 @@ void BlabbleAPI::Log(int level, const std::wstring& msg)
 	BLABBLE_JS_LOG(level, msg);
 }
 
+FB::VariantMap BlabbleAPI::GetLogStats()
+{
+	BlabbleLogging::AsyncLogStats stats = BlabbleLogging::getAsyncLogStats();
+	FB::VariantMap map;
+	map["async"] = (bool)BlabbleLogging::async_logging;
+	map["written"] = stats.written;
+	map["dropped"] = stats.dropped;
+	map["truncated"] = stats.truncated;
+	map["blocked"] = stats.blocked;
+	return map;
+}
+
+FB::VariantMap BlabbleAPI::GetMetrics()
+{
+	return BlabbleMetrics::Snapshot();
+}
+
 BlabbleAccountWeakPtr BlabbleAPI::CreateAccount(const FB::VariantMap &params)
 {
-	BlabbleAccountPtr account = boost::make_shared<BlabbleAccount>(manager_);
+	BlabbleAccountPtr account;
 	try 
 	{
-		FB::VariantMap::const_iterator iter = params.find("host");
-		if (iter != params.end())
-			account->set_server(iter->second.cast<std::string>());
+		account = NewAccount(params);
+		account->Register();
+	}
+	catch (const std::exception &e)
+	{
+		throw FB::script_error(std::string("Unable to create account: ") + e.what());
+	}
 
-		if ((iter = params.find("username")) != params.end())
-			account->set_username(iter->second.cast<std::string>());
+	accounts_.push_back(account);
+	return BlabbleAccountWeakPtr(account);
+}
 
-		if ((iter = params.find("password")) != params.end())
-			account->set_password(iter->second.cast<std::string>());
+FB::VariantList BlabbleAPI::CreateAccounts(const FB::VariantList &params, 
+	const boost::optional<FB::VariantMap> &options)
+{
+	long window = 0, max_in_flight = 0;
+	bool set_max_in_flight = false;
+	if (options)
+	{
+		try
+		{
+			FB::VariantMap::const_iterator iter = options->find("window");
+			if (iter != options->end())
+				window = iter->second.convert_cast<long>();
 
-		if ((iter = params.find("useTls")) != params.end() &&
-			iter->second.is_of_type<bool>())
+			if ((iter = options->find("maxInFlight")) != options->end())
+			{
+				max_in_flight = iter->second.convert_cast<long>();
+				set_max_in_flight = true;
+			}
+		}
+		catch (const std::exception &e)
 		{
-			account->set_use_tls(iter->second.cast<bool>());
+			throw FB::script_error(std::string("Invalid createAccounts options: ") + e.what());
 		}
+	}
+	if (window < 0)
+		throw FB::script_error("Invalid createAccounts options: window must not be negative.");
+	if (set_max_in_flight)
+	{
+		if (max_in_flight < 1)
+			throw FB::script_error("Invalid createAccounts options: maxInFlight must be at least 1.");
+		manager_->reg_scheduler().set_max_in_flight((unsigned int)max_in_flight);
+	}
 
-		if ((iter = params.find("identity")) != params.end() &&
-			iter->second.is_of_type<std::string>())
+	//Check every entry before adding any so a bad one leaves nothing behind
+	std::vector<BlabbleAccountPtr> created;
+	for (FB::VariantList::const_iterator it = params.begin(); it != params.end(); it++)
+	{
+		try
 		{
-			account->set_default_identity(iter->second.cast<std::string>());
+			created.push_back(NewAccount(it->convert_cast<FB::VariantMap>()));
 		}
-
-		if ((iter = params.find("onIncomingCall")) != params.end() &&
-			iter->second.is_of_type<FB::JSObjectPtr>())
+		catch (const std::exception &e)
 		{
-			account->set_on_incoming_call(iter->second.cast<FB::JSObjectPtr>());
+			std::stringstream err;
+			err << "Unable to create account " << (it - params.begin()) << ": " << e.what();
+			throw FB::script_error(err.str());
 		}
+	}
 
-		if ((iter = params.find("onRegState")) != params.end() &&
-			iter->second.is_of_type<FB::JSObjectPtr>())
+	for (size_t i = 0; i < created.size(); i++)
+	{
+		try
 		{
-			account->set_on_reg_state(iter->second.cast<FB::JSObjectPtr>());
+			created[i]->Create(false);
+		}
+		catch (const std::exception &e)
+		{
+			//Nothing would ever register the ones already added
+			for (size_t j = 0; j < i; j++)
+				created[j]->Destroy();
+
+			std::stringstream err;
+			err << "Unable to create account " << i << ": " << e.what();
+			throw FB::script_error(err.str());
 		}
-		
-		account->Register();
 	}
-	catch (const std::exception &e)
+	accounts_.insert(accounts_.end(), created.begin(), created.end());
+
+	FB::VariantList result;
+	unsigned int count = (unsigned int)created.size();
+	for (unsigned int i = 0; i < count; i++)
 	{
-		throw FB::script_error(std::string("Unable to create account: ") + e.what());
+		//Spread over the registration timeout, or less for a handful of accounts
+		unsigned int spread = (unsigned int)window;
+		if (spread == 0)
+			spread = std::min(count * BLABBLE_REG_SPACING_MSEC, (unsigned int)created[i]->timeout() * 1000);
+
+		manager_->reg_scheduler().Schedule(created[i]->id(), created[i]->generation(),
+			BlabbleRegScheduler::Spread(i, count, spread));
+		result.push_back(BlabbleAccountWeakPtr(created[i]));
 	}
 
-	accounts_.push_back(account);
-	return BlabbleAccountWeakPtr(account);
+	return result;
+}
+
+BlabbleAccountPtr BlabbleAPI::NewAccount(const FB::VariantMap &params)
+{
+	BlabbleAccountPtr account = boost::make_shared<BlabbleAccount>(manager_);
+	account->set_event_queue(event_queue_);
+	FB::VariantMap::const_iterator iter = params.find("host");
+	if (iter != params.end())
+		account->set_server(iter->second.cast<std::string>());
+
+	if ((iter = params.find("username")) != params.end())
+		account->set_username(iter->second.cast<std::string>());
+
+	if ((iter = params.find("password")) != params.end())
+		account->set_password(iter->second.cast<std::string>());
+
+	if ((iter = params.find("useTls")) != params.end() &&
+		iter->second.is_of_type<bool>())
+	{
+		account->set_use_tls(iter->second.cast<bool>());
+	}
+
+	if ((iter = params.find("identity")) != params.end() &&
+		iter->second.is_of_type<std::string>())
+	{
+		account->set_default_identity(iter->second.cast<std::string>());
+	}
+
+	if ((iter = params.find("onIncomingCall")) != params.end() &&
+		iter->second.is_of_type<FB::JSObjectPtr>())
+	{
+		account->set_on_incoming_call(iter->second.cast<FB::JSObjectPtr>());
+	}
+
+	if ((iter = params.find("onRegState")) != params.end() &&
+		iter->second.is_of_type<FB::JSObjectPtr>())
+	{
+		account->set_on_reg_state(iter->second.cast<FB::JSObjectPtr>());
+	}
+
+	return account;
+}
+
+void BlabbleAPI::set_on_events(const FB::JSObjectPtr& v)
+{
+	event_queue_->set_sink(v);
+}
+
+void BlabbleAPI::set_on_audio_devices_changed(const FB::JSObjectPtr& v)
+{
+	manager_->audio_devices().Subscribe(event_queue_, v);
 }
 
 BlabbleAccountPtr BlabbleAPI::FindAcc(int acc_id)
@@ -122,57 +283,104 @@ void BlabbleAPI::StopWav()
 	manager_->audio_manager()->StopWav();
 }
 
+void BlabbleAPI::PlayBusySignal()
+{
+	manager_->audio_manager()->StartBusy(false);
+}
+
+void BlabbleAPI::PlayReorderSignal()
+{
+	manager_->audio_manager()->StartBusy(true);
+}
+
+void BlabbleAPI::StopBusySignal()
+{
+	manager_->audio_manager()->StopBusy();
+}
+
+std::string BlabbleAPI::tone_plan()
+{
+	return manager_->audio_manager()->tone_plan();
+}
+
+FB::VariantList BlabbleAPI::tone_plans()
+{
+	std::vector<std::string> names = BlabbleTonePlan::Names();
+	return FB::VariantList(names.begin(), names.end());
+}
+
+bool BlabbleAPI::SetTonePlan(const std::string& name)
+{
+	return manager_->audio_manager()->SetTonePlan(name);
+}
+
+FB::VariantList BlabbleAPI::media_profiles()
+{
+	std::vector<std::string> names = BlabbleMediaProfile::Names();
+	return FB::VariantList(names.begin(), names.end());
+}
+
+bool BlabbleAPI::SetMediaProfile(const std::string& name)
+{
+	return manager_->SetMediaProfile(name);
+}
+
+bool BlabbleAPI::SetCodecPriority(const std::string& id, int priority)
+{
+	return manager_->codecs().SetPriority(id, priority);
+}
+
+void BlabbleAPI::BenchmarkCodecs(const boost::optional<int> &frames,
+	const boost::optional<FB::JSObjectPtr> &callback)
+{
+	int count = frames.get_value_or(BLABBLE_CODEC_BENCH_FRAMES);
+	if (count <= 0)
+		throw FB::script_error("frames must be positive.");
+
+	manager_->codecs().BenchmarkAsync((unsigned int)count, event_queue_,
+		callback.get_value_or(FB::JSObjectPtr()));
+}
+
+void BlabbleAPI::AutoCodecPriority(const boost::optional<double> &budget,
+	const boost::optional<FB::JSObjectPtr> &callback)
+{
+	double value = budget.get_value_or(BLABBLE_CODEC_AUTO_BUDGET);
+	if (value <= 0)
+		throw FB::script_error("budget must be positive.");
+
+	manager_->codecs().AutoAsync(value, event_queue_, callback.get_value_or(FB::JSObjectPtr()));
+}
+
+bool BlabbleAPI::PreloadWav(const std::string& fileName)
+{
+	return manager_->audio_manager()->PreloadWav(fileName);
+}
+
 FB::VariantList BlabbleAPI::GetAudioDevices()
 {
-	unsigned int count = pjmedia_aud_dev_count();
-	pjmedia_aud_dev_info* audio_info = new pjmedia_aud_dev_info[count];
-	pj_status_t status = pjsua_enum_aud_devs(audio_info, &count);
-	if (status == PJ_SUCCESS) {
-		FB::VariantList devices;
-		for (unsigned int i = 0; i < count; i++)
-		{
-			FB::VariantMap map;
-			map["name"] = std::string(audio_info[i].name);
-			map["driver"] = std::string(audio_info[i].driver);
-			map["inputs"] = audio_info[i].input_count;
-			map["outputs"] = audio_info[i].output_count;
-			map["id"] = i;
-			devices.push_back(map);
-		}
-		delete[] audio_info;
-		return devices;
-	}
-	delete[] audio_info;
-	return FB::VariantList();
+	return manager_->audio_devices().devices();
+}
+
+void BlabbleAPI::RefreshAudioDevices()
+{
+	manager_->audio_devices().Refresh();
 }
 
 FB::VariantMap BlabbleAPI::GetCurrentAudioDevice()
 {
 	int captureId, playbackId;
 	FB::VariantMap map, capInfo, playInfo;
-	pjmedia_aud_dev_info audio_info;
 
 	pj_status_t status = pjsua_get_snd_dev(&captureId, &playbackId);
 	if (status == PJ_SUCCESS)
 	{
-		status = pjmedia_aud_dev_get_info(captureId, &audio_info);
-		if (status == PJ_SUCCESS) {
-			capInfo["name"] = std::string(audio_info.name);
-			capInfo["driver"] = std::string(audio_info.driver);
-			capInfo["inputs"] = audio_info.input_count;
-			capInfo["outputs"] = audio_info.output_count;
-			capInfo["id"] = captureId;
+		capInfo = manager_->audio_devices().device(captureId);
+		if (!capInfo.empty())
 			map["capture"] = capInfo;
-		}
-		status = pjmedia_aud_dev_get_info(playbackId, &audio_info);
-		if (status == PJ_SUCCESS) {
-			playInfo["name"] = std::string(audio_info.name);
-			playInfo["driver"] = std::string(audio_info.driver);
-			playInfo["inputs"] = audio_info.input_count;
-			playInfo["outputs"] = audio_info.output_count;
-			playInfo["id"] = playbackId;
+
+		playInfo = manager_->audio_devices().device(playbackId);
+		if (!playInfo.empty())
 			map["playback"] = playInfo;
-		}
 	} else {
 		map["error"] = status;
 	}
@@ -230,4 +438,17 @@ FB::VariantMap BlabbleAPI::GetSignalLevel()
 	}
 
 	return map;
-}
\ No newline at end of file
+}
+
+void BlabbleAPI::StartMetering(int rate, const FB::JSObjectPtr& callback)
+{
+	if (rate <= 0 || !callback)
+		throw FB::script_error("startMetering requires a rate and a callback");
+
+	manager_->level_meter().Subscribe(event_queue_, callback, (unsigned int)rate);
+}
+
+void BlabbleAPI::StopMetering()
+{
+	manager_->level_meter().Unsubscribe(event_queue_);
+}
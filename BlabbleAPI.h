@@ -30,6 +30,7 @@ FB_FORWARD_PTR(BlabbleCall)
 FB_FORWARD_PTR(BlabbleAccount)
 FB_FORWARD_PTR(BlabbleAudioManager)
 FB_FORWARD_PTR(PjsuaManager)
+FB_FORWARD_PTR(BlabbleEventQueue)
 
 /*! @class
  *  @Brief The object to return if initialization of PJSIP fails for any reason.
@@ -65,6 +66,18 @@ public:
 	 *  See the JavaScript documentation for more information.
 	 */
 	BlabbleAccountWeakPtr CreateAccount(const FB::VariantMap &params);
+
+	/*! @Brief Create several accounts and stagger their registrations.
+	 *  Takes an array of the same objects accepted by `createAccount` and
+	 *  returns an array of accounts. Rather than registering right away, each
+	 *  account registers at a random point in its own share of a window that
+	 *  grows with the number of accounts up to the registration timeout.
+	 *  The optional options object can set "window" in milliseconds, 0 or
+	 *  more, and "maxInFlight", the number of REGISTER requests allowed to
+	 *  wait on the server at once, 1 or more.
+	 */
+	FB::VariantList CreateAccounts(const FB::VariantList &params, 
+		const boost::optional<FB::VariantMap> &options);
 	
 	/*! @Brief Unsupported. Plays a wave file.
 	 */
@@ -75,6 +88,12 @@ public:
 	 *  `PlayWav(fileName)`
 	 */
 	void StopWav();
+
+	/*! @Brief Decode a wave file into memory ahead of time.
+	 *  A later `PlayWav(fileName)` then starts without reading the disk.
+	 *  Returns false if the file could not be loaded.
+	 */
+	bool PreloadWav(const std::string& fileName);
 	
 	/*! @Brief Play a busy signal on the speakers.
 	 *  When a SIP call returns an error code of busy it is left
@@ -82,24 +101,140 @@ public:
 	 *  tone like a good old fashioned phone would.
 	 */
 	void PlayBusySignal();
+
+	/*! @Brief JavaScript function to play the reorder (congestion) signal on the speakers.
+	 *  Stopped with StopBusySignal.
+	 */
+	void PlayReorderSignal();
 	
 	/*! @Brief Stops playing a busy signal.
 	 *  @sa PlayBusySignal
 	 */
 	void StopBusySignal();
+
+	/*! @Brief JavaScript property with the name of the current tone plan.
+	 */
+	std::string tone_plan();
+
+	/*! @Brief JavaScript property listing the tone plans that can be selected.
+	 */
+	FB::VariantList tone_plans();
+
+	/*! @Brief JavaScript function to switch to the ring, call waiting, busy
+	 *  and reorder tones of another region. The plan can also be set with the
+	 *  "toneplan" param when the plugin loads. Returns false if name is unknown.
+	 */
+	bool SetTonePlan(const std::string& name);
 	
 	/*! @Brief Allows JavaScript code to utilize BlabbleLogging
 	 */
 	void Log(int level, const std::wstring& msg);
+
+	/*! @Brief JavaScript function to return the asynchronous logging counters.
+	 *  Returns an object with "async", "written", "dropped", "truncated" and
+	 *  "blocked" properties.
+	 */
+	FB::VariantMap GetLogStats();
+
+	/*! @Brief JavaScript function to return every counter, gauge and latency histogram.
+	 *  @sa BlabbleMetrics::Snapshot
+	 */
+	FB::VariantMap GetMetrics();
 	
 	/*! @Brief JavaScript property to determine if TLS support is available
 	 */
 	bool has_tls() { return manager_->has_tls(); }
 
+	/*! @Brief JavaScript property listing the SIP transports with their traffic counters.
+	 *  The transports are set with the "transports" param when the plugin loads.
+	 *  @sa BlabbleTransportManager::stats
+	 */
+	FB::VariantList transports() { return manager_->transports().stats(); }
+
+	/*! @Brief JavaScript property with the DNS cache counters.
+	 *  The nameservers are set with the "nameservers" param when the plugin loads.
+	 *  @sa BlabbleResolver::stats
+	 */
+	FB::VariantMap resolver() { return manager_->resolver().stats(); }
+
+	/*! @Brief JavaScript property with the event loop settings, counters and timer lag.
+	 *  The event loop is set with the "eventloop" param when the plugin loads.
+	 *  @sa BlabbleEventLoop::stats
+	 */
+	FB::VariantMap event_loop() { return manager_->event_loop().stats(); }
+
+	/*! @Brief JavaScript property with pool memory per subsystem and calls that leaked pools.
+	 *  @sa BlabbleMemoryMonitor::stats
+	 */
+	FB::VariantMap memory() { return manager_->memory_monitor().stats(); }
+
+	/*! @Brief JavaScript property with the warm sound device settings and the time
+	 *  to first audio of the last answered call.
+	 *  Warm mode is set with the "sounddevice" param when the plugin loads.
+	 *  @sa BlabbleSoundDevice::stats
+	 */
+	FB::VariantMap sound_device() { return manager_->sound_device().stats(); }
+
+	/*! @Brief JavaScript property with the name of the current media profile.
+	 */
+	std::string media_profile() { return manager_->media_profile(); }
+
+	/*! @Brief JavaScript property listing the media profiles that can be selected.
+	 */
+	FB::VariantList media_profiles();
+
+	/*! @Brief JavaScript function to switch media profiles.
+	 *  Calls made afterwards use the profile's sound device, echo canceller
+	 *  and jitter buffer settings. The clock rate, frame length, quality and
+	 *  thread count only change when the plugin is loaded with the
+	 *  "mediaprofile" param. Returns false if name is unknown.
+	 */
+	bool SetMediaProfile(const std::string& name);
+
+	/*! @Brief JavaScript property listing the codecs in priority order.
+	 *  @sa BlabbleCodecManager::codecs
+	 */
+	FB::VariantList codecs() { return manager_->codecs().codecs(); }
+
+	/*! @Brief JavaScript function to set the priority, 0 to 255, of every codec whose id starts with id.
+	 *  0 disables the codec. Returns false if no codec matched.
+	 */
+	bool SetCodecPriority(const std::string& id, int priority);
+
+	/*! @Brief JavaScript function timing every codec on this machine in the background.
+	 *  frames defaults to 250, 5 seconds of audio at 20ms. When done,
+	 *  callback is called with an array of objects as described at
+	 *  BlabbleCodecManager::ToVariant, as part of a "codecBenchmark" event.
+	 */
+	void BenchmarkCodecs(const boost::optional<int> &frames,
+		const boost::optional<FB::JSObjectPtr> &callback);
+
+	/*! @Brief JavaScript function ranking codecs by their cost on this machine in the background.
+	 *  Codecs costing more than budget percent of one CPU core per call,
+	 *  2 by default, are moved below the others. Benchmarks first if
+	 *  nothing has been benchmarked. When done, callback is called with
+	 *  the new codecs list, as part of a "codecPriority" event.
+	 */
+	void AutoCodecPriority(const boost::optional<double> &budget,
+		const boost::optional<FB::JSObjectPtr> &callback);
+
 	/*! @Brief JavaScript function to return an array of audio devices in the system
+	 *  The list is cached and kept up to date in the background.
+	 *  @sa BlabbleAudioDevices::devices
 	 */
 	FB::VariantList GetAudioDevices();
 
+	/*! @Brief JavaScript function to look for added or removed audio devices now
+	 *  instead of at the next background refresh. Changes are reported
+	 *  through onAudioDevicesChanged.
+	 */
+	void RefreshAudioDevices();
+
+	/*! @Brief A write only JavaScript property used to set the callback function for when
+	 *  audio devices are added or removed. It is called with the new GetAudioDevices() list.
+	 */
+	void set_on_audio_devices_changed(const FB::JSObjectPtr& v);
+
 	/*! @Brief JavaScript function to get the current audio device.
 	 *  This will return a JavaScript object with "capture" and "playback"
 	 *  properties set to the current audio device ids as can be
@@ -137,11 +272,34 @@ public:
 	 */
 	FB::VariantMap GetSignalLevel();
 
+	/*! @Brief JavaScript function to receive signal levels rate times per second.
+	 *  callback is called with an object with a "microphone" property and a
+	 *  "calls" array. Each level has "peak" and "rms" properties from 0 to 1,
+	 *  and the entries in "calls" also have a "call" property.
+	 */
+	void StartMetering(int rate, const FB::JSObjectPtr& callback);
+
+	/*! @Brief JavaScript function to stop the updates started by StartMetering.
+	 */
+	void StopMetering();
+
+	/*! @Brief A write only JavaScript property to receive events in batches.
+	 *  The function is called with an array of objects, each with a "type"
+	 *  and the "args" that were passed to the event's own callback.
+	 */
+	void set_on_events(const FB::JSObjectPtr& v);
+
 	//functions to retrieve objects from userdata
 	BlabbleAccountPtr FindAcc(int accId);
 private:
+	/*! @Brief Build an account from the parameters given to `createAccount`
+	 *  without adding it to PJSIP.
+	 */
+	BlabbleAccountPtr NewAccount(const FB::VariantMap &params);
+
 	FB::BrowserHostPtr browser_host_;
 	PjsuaManagerPtr manager_;
+	BlabbleEventQueuePtr event_queue_;
 	
 	/*! @Brief Keep track of all account objects so we can 
 	 *  destroy them when this plugin is destroyed
@@ -7,32 +7,44 @@ License:    GNU General Public License, version 3.0
 Copyright 2012 Andrew Ofisher
 \**********************************************************/
 
+#include <algorithm>
 #include "JSObject.h"
 #include "variant_list.h"
 #include "Blabble.h"
 #include "BlabbleAccount.h"
 #include "BlabbleCall.h"
+#include "BlabbleConference.h"
 #include "PjsuaManager.h"
 #include "BlabbleAudioManager.h"
+#include "BlabbleEventQueue.h"
 #include "FBWriteOnlyProperty.h"
 #include "BlabbleLogging.h"
 
+/*! @Brief Static account counter used to generate account generations.
+ */
+unsigned int BlabbleAccount::generation_counter_ = 0;
+
+const BlabbleDispatchTable<BlabbleAccount> BlabbleAccount::dispatch_table_ = BlabbleDispatchTable<BlabbleAccount>()
+	.Method("makeCall", &BlabbleAccount::MakeCall)
+	.Method("createConference", &BlabbleAccount::CreateConference)
+	.Method("unregister", &BlabbleAccount::Unregister)
+	.Method("register", &BlabbleAccount::Register)
+	.Method("destroy", &BlabbleAccount::Destroy)
+	.Method("getChanges", &BlabbleAccount::GetChanges)
+	.Property("activeCall", &BlabbleAccount::active_call)
+	.Property("calls", &BlabbleAccount::calls)
+	.Property("isRegistered", &BlabbleAccount::registered)
+	.Property("host", &BlabbleAccount::server)
+	.Property("username", &BlabbleAccount::username)
+	.WriteOnlyProperty("onIncomingCall", &BlabbleAccount::set_on_incoming_call)
+	.WriteOnlyProperty("onRegState", &BlabbleAccount::set_on_reg_state);
+
 BlabbleAccount::BlabbleAccount(PjsuaManagerPtr manager) :  
-	ringing_call_(0), pjsua_manager_(manager), id_(-1), timeout_(60), retry_(15), use_tls_(false)
+	BlabbleJSAPIAuto<BlabbleAccount>(dispatch_table_), ringing_call_(0), pjsua_manager_(manager),
+	calls_(boost::make_shared<BlabbleCallList>()), change_version_(0), ended_floor_(0),
+	id_(-1), timeout_(60), retry_(15), use_tls_(false)
 {
-	registerMethod("makeCall", make_method(this, &BlabbleAccount::MakeCall));
-	registerMethod("unregister", make_method(this, &BlabbleAccount::Unregister));
-	registerMethod("register", make_method(this, &BlabbleAccount::Register));
-	registerMethod("destroy", make_method(this, &BlabbleAccount::Destroy));
-
-	registerProperty("activeCall", make_property(this, &BlabbleAccount::active_call));
-	registerProperty("calls", make_property(this, &BlabbleAccount::calls));
-	registerProperty("isRegistered", make_property(this, &BlabbleAccount::registered));
-    registerProperty("host", make_property(this, &BlabbleAccount::server));
-	registerProperty("username", make_property(this, &BlabbleAccount::username));
-
-	registerProperty("onIncomingCall", make_write_only_property(this, &BlabbleAccount::set_on_incoming_call));
-	registerProperty("onRegState", make_write_only_property(this, &BlabbleAccount::set_on_reg_state));
+	generation_ = ATOMIC_INCREMENT(&BlabbleAccount::generation_counter_);
 }
 
 void BlabbleAccount::Register()
@@ -43,41 +55,58 @@ void BlabbleAccount::Register()
 	} 
 	else 
 	{
-		if (server_.empty())
-			throw std::runtime_error("Attempt to register account with no server host set.");
-
-		PjsuaManagerPtr manager = GetManager();
-		pj_status_t status;
-		pjsua_acc_config acc_cfg;
-
-		pjsua_acc_config_default(&acc_cfg);
-
-		std::string accId = "sip:" + username_ + "@" + server_;
-		acc_cfg.id = pj_str(const_cast<char*>(accId.c_str()));
-
-		std::string regUri = "sip:" + server_;
-		if (use_tls_)
-			regUri += ";transport=tls";
-		acc_cfg.reg_uri = pj_str(const_cast<char*>(regUri.c_str()));
-		acc_cfg.reg_retry_interval = retry_;
-		acc_cfg.reg_timeout = timeout_;
-
-		if (!username_.empty()) {
-			acc_cfg.cred_count = 1;
-			acc_cfg.cred_info[0].realm = pj_str(const_cast<char*>("*"));
-			acc_cfg.cred_info[0].scheme = pj_str(const_cast<char*>("digest"));
-			acc_cfg.cred_info[0].username = pj_str(const_cast<char*>(username_.c_str()));
-			acc_cfg.cred_info[0].data_type = PJSIP_CRED_DATA_PLAIN_PASSWD;
-			acc_cfg.cred_info[0].data = pj_str(const_cast<char*>(password_.c_str()));
-		}
+		Create(true);
+	}
+}
 
-		status = pjsua_acc_add(&acc_cfg, PJ_TRUE, &id_);
+void BlabbleAccount::Create(bool sendRegister)
+{
+	if (id_ != INVALID_ACCOUNT)
+		throw std::runtime_error("Attempt to create an account that already exists.");
+
+	if (server_.empty())
+		throw std::runtime_error("Attempt to register account with no server host set.");
+
+	PjsuaManagerPtr manager = GetManager();
+	pj_status_t status;
+	pjsua_acc_config acc_cfg;
+
+	pjsua_acc_config_default(&acc_cfg);
+
+	std::string accId = "sip:" + username_ + "@" + server_;
+	acc_cfg.id = pj_str(const_cast<char*>(accId.c_str()));
+
+	std::string regUri = "sip:" + server_;
+	if (use_tls_)
+		regUri += ";transport=tls";
+	acc_cfg.reg_uri = pj_str(const_cast<char*>(regUri.c_str()));
+	acc_cfg.reg_retry_interval = retry_;
+	acc_cfg.reg_timeout = timeout_;
+	//Refresh a random amount early so accounts registered together drift apart
+	if (timeout_ > 4 * PJSIP_REGISTER_CLIENT_DELAY_BEFORE_REFRESH)
+		acc_cfg.reg_delay_before_refresh += (unsigned)pj_rand() % (timeout_ / 4);
+	acc_cfg.user_data = (void*)(pj_ssize_t)generation_;
+	if (!use_tls_)
+		acc_cfg.transport_id = manager->transports().NextUdp();
+
+	//Keep the registrar's records warm for every re-registration
+	manager->resolver().Prefetch(server_, use_tls_);
+
+	if (!username_.empty()) {
+		acc_cfg.cred_count = 1;
+		acc_cfg.cred_info[0].realm = pj_str(const_cast<char*>("*"));
+		acc_cfg.cred_info[0].scheme = pj_str(const_cast<char*>("digest"));
+		acc_cfg.cred_info[0].username = pj_str(const_cast<char*>(username_.c_str()));
+		acc_cfg.cred_info[0].data_type = PJSIP_CRED_DATA_PLAIN_PASSWD;
+		acc_cfg.cred_info[0].data = pj_str(const_cast<char*>(password_.c_str()));
+	}
 
-		if (status != PJ_SUCCESS)
-			throw std::runtime_error("pjsua_acc_add returned " + status);
+	status = pjsua_acc_add(&acc_cfg, sendRegister ? PJ_TRUE : PJ_FALSE, &id_);
 
-		manager->AddAccount(this->get_shared());
-	}
+	if (status != PJ_SUCCESS)
+		throw std::runtime_error("pjsua_acc_add returned " + status);
+
+	manager->AddAccount(this->get_shared());
 }
 
 BlabbleAccount::~BlabbleAccount()
@@ -91,15 +120,28 @@ void BlabbleAccount::Destroy()
 	PjsuaManagerPtr manager = pjsua_manager_.lock();
 	if (manager)
 	{
+		BlabbleConferenceList conferences;
+		{
+			boost::mutex::scoped_lock lock(this->calls_mutex_);
+			conferences = conferences_;
+		}
+
+		for (BlabbleConferenceList::iterator it = conferences.begin(); it != conferences.end(); it++)
 		{
-			boost::recursive_mutex::scoped_lock lock(this->calls_mutex_);
-			BlabbleCallList::iterator it;
-
-			while ((it = calls_.begin()) != calls_.end())
-			{
-				(*it)->LocalEnd();
-			}
-			calls_.clear();
+			(*it)->Destroy();
+		}
+
+		//Ending a call removes it from calls_ again, so work on a snapshot without any lock
+		BlabbleCallSnapshot calls = CallSnapshot();
+		for (BlabbleCallList::const_iterator it = calls->begin(); it != calls->end(); it++)
+		{
+			(*it)->LocalEnd();
+		}
+
+		BlabbleCallSnapshot old;
+		{
+			boost::mutex::scoped_lock lock(this->calls_mutex_);
+			old = boost::atomic_exchange(&calls_, BlabbleCallSnapshot(boost::make_shared<BlabbleCallList>()));
 		}
 	
 		if (pjsua_acc_is_valid(id_) == PJ_TRUE)
@@ -125,27 +167,14 @@ bool BlabbleAccount::OnIncomingCall(pjsua_call_id call_id, pjsip_rx_data *rdata)
 		return false;
 	}
 
-	pjsua_call_info info;
-	pjsua_call_get_info(call_id, &info);
-	std::string cid = std::string(info.remote_contact.ptr, info.remote_contact.slen);
-	unsigned int s, e;
-	for (s = 0; s < cid.length() && cid[s] != ':'; s++);
-	s++;
-	for (e = s; e < cid.length() && cid[e] != '@'; e++);
-	if (s < cid.length() && e < cid.length())
-		cid = cid.substr(s, e-s);
-
-	BlabbleCallPtr call = boost::make_shared<BlabbleCall>(get_shared());
+	BlabbleCallPtr call = BlabbleCall::Create(get_shared());
 	if (call->RegisterIncomingCall(call_id)) 
 	{
-		{
-			boost::recursive_mutex::scoped_lock lock(this->calls_mutex_);
-			calls_.push_back(call);
-		}
+		AddCall(call);
 		ringing_call_ = call->id();
 
-		if (on_incoming_call_)
-			on_incoming_call_->InvokeAsync("", FB::variant_list_of(BlabbleCallWeakPtr(call))(BlabbleAccountWeakPtr(get_shared())));
+		QueueEvent("incomingCall", on_incoming_call_, 
+			FB::variant_list_of(BlabbleCallWeakPtr(call))(BlabbleAccountWeakPtr(get_shared())));
 
 		return true;
 	}
@@ -153,68 +182,123 @@ bool BlabbleAccount::OnIncomingCall(pjsua_call_id call_id, pjsip_rx_data *rdata)
 	return false;
 }
 
-void BlabbleAccount::OnCallState(pjsua_call_id call_id, pjsip_event *e)
+BlabbleCallPtr BlabbleAccount::FindCall(pjsua_call_id call_id)
 {
-	BlabbleCallPtr call = FindCall(call_id);
-	if (call)
-	{
-		call->OnCallState(call_id, e);
-	} 
-	else
-	{
-		BLABBLE_LOG_DEBUG("Received call state change event for unknown PJSIP call id: "
-			<< call_id << ", on PJSIP account id: " << id_);
+	unsigned int internalId = (unsigned int)(pj_ssize_t)pjsua_call_get_user_data(call_id);
+	if (internalId) {
+		BlabbleCallSnapshot calls = CallSnapshot();
+		for (BlabbleCallList::const_iterator it = calls->begin(); it != calls->end(); it++) 
+		{
+			if ((*it)->id() == internalId)
+				return *it;
+		}
 	}
+
+	return BlabbleCallPtr();
 }
 
-bool BlabbleAccount::OnCallTransferStatus(pjsua_call_id call_id, int status)
+void BlabbleAccount::OnCallEnd(const BlabbleCallPtr& call, pjsua_call_id call_id)
 {
-	BlabbleCallPtr call = FindCall(call_id);
-	if (call)
+	if (call->id() == ringing_call_)
 	{
-		return call->OnCallTransferStatus(status);
+		ringing_call_ = 0;
 	}
-	
-	BLABBLE_LOG_DEBUG("Received call transfer status for unknown PJSIP call id: "
-		<< call_id << ", on PJSIP account id: " << id_);
 
-	//Stop getting notifications since we don't even have this call
-	return true;
+	PjsuaManagerPtr manager = pjsua_manager_.lock();
+	if (manager)
+	{
+		manager->UnbindCall(call_id, call->id());
+		manager->stats_sampler().Unsubscribe(call->id());
+		manager->level_meter().Unwatch(call->id());
+		manager->jitter_control().Remove(call->id());
+		manager->sound_device().Forget(call->id());
+	}
+
+	BlabbleConferencePtr conference = call->conference();
+	if (conference)
+		conference->OnCallEnd(call);
+
+	call->StopRecording();
+
+	RemoveCall(call);
+
+	boost::mutex::scoped_lock lock(changes_mutex_);
+	ended_.push_back(std::make_pair(++change_version_, call->id()));
+	if (ended_.size() > BLABBLE_CHANGES_MAX_ENDED)
+	{
+		ended_floor_ = ended_.front().first;
+		ended_.pop_front();
+	}
+}
+
+void BlabbleAccount::StampChange(volatile long* stamp)
+{
+	//Taking the version and storing it is one step for GetChanges
+	boost::mutex::scoped_lock lock(changes_mutex_);
+	*stamp = ++change_version_;
 }
 
-void BlabbleAccount::OnCallMediaState(pjsua_call_id call_id)
+void BlabbleAccount::AddCall(const BlabbleCallPtr& call)
 {
-	BlabbleCallPtr call = FindCall(call_id);
-	if (call)
+	BlabbleCallSnapshot old;
+	boost::mutex::scoped_lock lock(calls_mutex_);
+	old = boost::atomic_load(&calls_);
+
+	boost::shared_ptr<BlabbleCallList> calls = boost::make_shared<BlabbleCallList>();
+	calls->reserve(old->size() + 1);
+	calls->assign(old->begin(), old->end());
+	calls->push_back(call);
+	boost::atomic_store(&calls_, BlabbleCallSnapshot(calls));
+}
+
+void BlabbleAccount::RemoveCall(const BlabbleCallPtr& call)
+{
+	//Declared ahead of the lock so the old list, and maybe the call, goes after it is released
+	BlabbleCallSnapshot old;
+	boost::mutex::scoped_lock lock(calls_mutex_);
+	old = boost::atomic_load(&calls_);
+	if (std::find(old->begin(), old->end(), call) == old->end())
+		return;
+
+	boost::shared_ptr<BlabbleCallList> calls = boost::make_shared<BlabbleCallList>();
+	calls->reserve(old->size() - 1);
+	for (BlabbleCallList::const_iterator it = old->begin(); it != old->end(); it++)
 	{
-		call->OnCallMediaState();
+		if (*it != call)
+			calls->push_back(*it);
 	}
+	boost::atomic_store(&calls_, BlabbleCallSnapshot(calls));
 }
 
-BlabbleCallPtr BlabbleAccount::FindCall(pjsua_call_id call_id)
+FB::variant BlabbleAccount::CreateConference(const FB::VariantList &calls)
 {
-	unsigned int *internalId = (unsigned int*)pjsua_call_get_user_data(call_id);
-	if (internalId) {
-		boost::recursive_mutex::scoped_lock lock(calls_mutex_);
-		for (BlabbleCallList::iterator it = calls_.begin(); it != calls_.end(); it++) 
-		{
-			if ((*it)->id() == *internalId)
-				return *it;
-		}
+	BlabbleCallList members;
+	for (FB::VariantList::const_iterator it = calls.begin(); it != calls.end(); it++)
+	{
+		BlabbleCallPtr call = it->convert_cast<BlabbleCallPtr>();
+		if (!call)
+			throw FB::script_error("createConference expects an array of calls.");
+		members.push_back(call);
 	}
 
-	return BlabbleCallPtr();
-}
+	BlabbleConferencePtr conference = boost::make_shared<BlabbleConference>(get_shared());
+	{
+		boost::mutex::scoped_lock lock(calls_mutex_);
+		conferences_.push_back(conference);
+	}
 
-void BlabbleAccount::OnCallEnd(const BlabbleCallPtr& call)
-{
-	if (call->id() == ringing_call_)
+	for (BlabbleCallList::iterator it = members.begin(); it != members.end(); it++)
 	{
-		ringing_call_ = 0;
+		conference->Add(*it, boost::optional<double>());
 	}
 
-	boost::recursive_mutex::scoped_lock lock(calls_mutex_);
-	calls_.remove(call);
+	return BlabbleConferenceWeakPtr(conference);
+}
+
+void BlabbleAccount::RemoveConference(const BlabbleConferencePtr& conference)
+{
+	boost::mutex::scoped_lock lock(calls_mutex_);
+	conferences_.remove(conference);
 }
 
 void BlabbleAccount::OnCallRingChange(const BlabbleCallPtr& call, const pjsua_call_info& info)
@@ -233,8 +317,34 @@ void BlabbleAccount::OnRegState()
 	pjsua_acc_info info;
 	pjsua_acc_get_info(id_, &info);
 
-	if (on_reg_state_)
-		on_reg_state_->InvokeAsync("", FB::variant_list_of(BlabbleAccountWeakPtr(get_shared()))((long)info.status));
+	//Every registration counts as a use, so the resolver never forgets a live registrar
+	PjsuaManagerPtr manager = pjsua_manager_.lock();
+	if (manager)
+	{
+		manager->resolver().Prefetch(server_, use_tls_);
+		//Ahead of the first call, so even that one finds the sound device open
+		if (info.status == PJSIP_SC_OK)
+			manager->sound_device().Warm();
+	}
+
+	//Only the latest registration state of this account is interesting
+	std::stringstream key;
+	key << "regState:" << generation_;
+	QueueEvent("regState", on_reg_state_, 
+		FB::variant_list_of(BlabbleAccountWeakPtr(get_shared()))((long)info.status), key.str());
+}
+
+void BlabbleAccount::QueueEvent(const std::string &type, const FB::JSObjectPtr &callback,
+	const FB::VariantList &args, const std::string &key)
+{
+	if (event_queue_)
+	{
+		event_queue_->Post(BlabbleEvent(type, callback, args, key));
+	}
+	else if (callback)
+	{
+		callback->InvokeAsync("", args);
+	}
 }
 
 FB::variant BlabbleAccount::MakeCall(const FB::VariantMap &params)
@@ -282,7 +392,9 @@ FB::variant BlabbleAccount::MakeCall(const FB::VariantMap &params)
 		identity = default_identity;
 	}
 
-	BlabbleCallPtr call = boost::make_shared<BlabbleCall>(get_shared());
+	GetManager()->resolver().Prefetch(destination, use_tls_);
+
+	BlabbleCallPtr call = BlabbleCall::Create(get_shared());
 
 	if ((iter = params.find("onCallConnected")) != params.end() &&
 		iter->second.is_of_type<FB::JSObjectPtr>())
@@ -302,25 +414,19 @@ FB::variant BlabbleAccount::MakeCall(const FB::VariantMap &params)
 		call->set_on_call_end(iter->second.cast<FB::JSObjectPtr>());
 	}
 
-	
-	{
-		boost::recursive_mutex::scoped_lock lock(this->calls_mutex_);
-		calls_.push_back(call);
-	}
+	AddCall(call);
 
 	pj_status_t status = call->MakeCall(destination, identity);
 
 	if (status == PJ_SUCCESS)
 	{
+		GetManager()->BindCall(call->callId(), call);
 		ringing_call_ = call->id();
 		return BlabbleCallWeakPtr(call);
 	}
 
 	//Error occurred
-	{
-		boost::recursive_mutex::scoped_lock lock(this->calls_mutex_);
-		calls_.remove(call);
-	}
+	RemoveCall(call);
 
 	char error[256];
 	pj_str_t errorText = pj_strerror(status, error, 256);
@@ -335,19 +441,13 @@ FB::variant BlabbleAccount::MakeCall(const FB::VariantMap &params)
 //JS Properties
 BlabbleCallWeakPtr BlabbleAccount::active_call()
 {
-	pjsua_call_id ids[32];
-	pjsua_call_info info;
-	unsigned int count = 32;
-	if (pjsua_enum_calls(ids, &count) == PJ_SUCCESS)
+	BlabbleCallSnapshot calls = CallSnapshot();
+	for (BlabbleCallList::const_iterator it = calls->begin(); it != calls->end(); it++) 
 	{
-		for (unsigned int i = 0; i < count && 
-			pjsua_call_get_info(ids[i], &info) == PJ_SUCCESS; i++) 
+		if ((*it)->callId() != INVALID_CALL && 
+			(*it)->media_status() == PJSUA_CALL_MEDIA_ACTIVE)
 		{
-			if (info.acc_id == id_ && info.media_status == PJSUA_CALL_MEDIA_ACTIVE) {
-				BlabbleCallPtr call = FindCall(ids[i]);
-				if (call)
-					return call;
-			}
+			return *it;
 		}
 	}
 
@@ -356,9 +456,49 @@ BlabbleCallWeakPtr BlabbleAccount::active_call()
 
 FB::VariantList BlabbleAccount::calls()
 {
-	boost::recursive_mutex::scoped_lock lock(calls_mutex_);
-	FB::VariantList calls = FB::make_variant_list(calls_);
-	return calls;
+	return FB::make_variant_list(*CallSnapshot());
+}
+
+FB::VariantMap BlabbleAccount::GetChanges(long sinceVersion)
+{
+	//Every change up to version has its stamp stored by now, anything changing
+	//during the scan gets a later one and is reported again next time
+	long version;
+	FB::VariantMap changes;
+	FB::VariantList ended;
+	bool reset = sinceVersion <= 0;
+	{
+		boost::mutex::scoped_lock lock(changes_mutex_);
+		version = change_version_;
+		if (sinceVersion < ended_floor_)
+			reset = true;
+
+		for (std::deque<std::pair<long, unsigned int> >::const_iterator it = ended_.begin(); 
+			!reset && it != ended_.end(); it++)
+		{
+			if (it->first > sinceVersion && it->first <= version)
+				ended.push_back((long)it->second);
+		}
+	}
+
+	FB::VariantList calls;
+	BlabbleCallSnapshot snapshot = CallSnapshot();
+	for (BlabbleCallList::const_iterator it = snapshot->begin(); it != snapshot->end(); it++)
+	{
+		if (!reset && (*it)->changed_version() <= sinceVersion)
+			continue;
+
+		FB::VariantMap status = (*it)->status();
+		status["call"] = BlabbleCallWeakPtr(*it);
+		status["id"] = (long)(*it)->id();
+		calls.push_back(status);
+	}
+
+	changes["version"] = version;
+	changes["calls"] = calls;
+	changes["ended"] = ended;
+	changes["reset"] = reset;
+	return changes;
 }
 
 bool BlabbleAccount::registered()
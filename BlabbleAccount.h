@@ -11,7 +11,10 @@ Copyright 2012 Andrew Ofisher
 #include <sstream>
 #include "JSAPIAuto.h"
 #include "BrowserHost.h"
-#include <boost/thread/recursive_mutex.hpp>
+#include <list>
+#include <vector>
+#include <deque>
+#include <boost/thread/mutex.hpp>
 #include <pjlib.h>
 #include <pjlib-util.h>
 #include <pjnath.h>
@@ -22,6 +25,8 @@ Copyright 2012 Andrew Ofisher
 #include <pjmedia.h>
 #include <pjmedia-codec.h> 
 #include "PjsuaManager.h"
+#include "BlabbleDispatchTable.h"
+#include "BlabbleAtomic.h"
 
 #ifndef H_BlabbleAccount
 #define H_BlabbleAccount
@@ -29,11 +34,22 @@ Copyright 2012 Andrew Ofisher
 FB_FORWARD_PTR(BlabbleCall);
 FB_FORWARD_PTR(PjsuaManager);
 FB_FORWARD_PTR(BlabbleAccount);
+FB_FORWARD_PTR(BlabbleEventQueue);
+FB_FORWARD_PTR(BlabbleConference);
 
-typedef std::list<BlabbleCallPtr> BlabbleCallList;
+typedef std::vector<BlabbleCallPtr> BlabbleCallList;
+typedef boost::shared_ptr<const BlabbleCallList> BlabbleCallSnapshot;
+typedef std::list<BlabbleConferencePtr> BlabbleConferenceList;
 #define INVALID_ACCOUNT -1
 
-class BlabbleAccount : public FB::JSAPIAuto
+/*! @Brief Ended calls remembered for getChanges.
+ *  A caller asking for changes from before the oldest one gets everything.
+ */
+#ifndef BLABBLE_CHANGES_MAX_ENDED
+#define BLABBLE_CHANGES_MAX_ENDED 256
+#endif
+
+class BlabbleAccount : public BlabbleJSAPIAuto<BlabbleAccount>
 {
 public:
 	/*! @Brief Create a new Account.
@@ -57,10 +73,27 @@ public:
 	 */
 	FB::variant MakeCall(const FB::VariantMap &params);
 	
+	/*! @Brief Called from JavaScript to mix calls together into a local conference.
+	 *  calls is an array of Call objects, possibly empty; more can be added
+	 *  later with `add(call)` on the returned Conference object.
+	 */
+	FB::variant CreateConference(const FB::VariantList &calls);
+
+	/*! @Brief Called by BlabbleConference when it is destroyed.
+	 */
+	void RemoveConference(const BlabbleConferencePtr& conference);
+
 	/*! @Brief (Re)register with the server.
 	 *  Force a reregistration to the server or register after a previous unregister
 	 */
 	void Register();
+
+	/*! @Brief Add this account to PJSIP.
+	 *  If sendRegister is false the account is only created and a
+	 *  later `Register()`, usually from BlabbleRegScheduler, sends the
+	 *  first REGISTER. Throws if the account already exists.
+	 */
+	void Create(bool sendRegister);
 	
 	/*! @Brief Unregister from the server.
 	 *  This will not terminate any active calls.
@@ -78,6 +111,12 @@ public:
 	 */
 	pjsua_acc_id id() { return id_; }
 
+	/*! @Brief A globally unique id for this account.
+	 *  Stored as the PJSIP account user data so PjsuaManager can detect
+	 *  events for an account id that has since been reused.
+	 */
+	unsigned int generation() const { return generation_; }
+
 	/*! @Brief JavaScript property to return the active call (if one).
 	 *  The active call is that call that is currently utilizing audio.
 	 *  There is only one active call per account.  There is nothing
@@ -90,6 +129,23 @@ public:
 	 *  Returns an array of any valid calls on this account.
 	 */
 	FB::VariantList calls();
+
+	/*! @Brief JavaScript method returning what changed since sinceVersion in one call.
+	 *
+	 *  Returns an object with "version", to pass in next time, "calls", an
+	 *  array with the status of every call whose state, caller id or media
+	 *  status changed, and "ended", an array with the ids of the calls that
+	 *  ended. Each status carries "call" and "id" besides the properties of
+	 *  `call.status`. "reset" is true when the version was 0 or too old to
+	 *  know what ended; "calls" then holds every call and the caller should
+	 *  drop calls it does not find there.
+	 */
+	FB::VariantMap GetChanges(long sinceVersion);
+
+	/*! @Brief Stamp a change to one of this account's calls by storing the
+	 *  next version in stamp. Called by BlabbleCall.
+	 */
+	void StampChange(volatile long* stamp);
 	
 	/*! @Brief JavaScript property to return true if currently registered.
 	 */
@@ -102,33 +158,22 @@ public:
 	/*! @Brief Called by PjsuManager when the registration state of this account changes.
 	 */
 	void OnRegState();
-	
-	/*! @Brief Called by PjsuaManager when the state of a call in this account changes.
-	 */
-	void OnCallState(pjsua_call_id call_id, pjsip_event *e);
-	
-	/*! @Brief Called by PjsuaManager when the media state of a call in this account changes.
-	 */
-	void OnCallMediaState(pjsua_call_id call_id);
-	
-	/*! @Brief Called by PjsuaManager when a call in this account has transfered.
+
+	/*! @Brief Search this account's calls for the BlabbleCall attached to call_id.
+	 *  PjsuaManager dispatches through its own index and only falls back
+	 *  to this for calls it has not seen yet.
 	 */
-	bool OnCallTransferStatus(pjsua_call_id call_id, int status);
+	BlabbleCallPtr FindCall(pjsua_call_id call_id);
 
 	/*! Brief Called by BlabbleCall when a call begins or ends ringing.
 	 */
 	void OnCallRingChange(const BlabbleCallPtr& call, const pjsua_call_info& info);
 	
-	/*! @Brief Called by BlabbleCall when a call is ended by this side.
-	 *  @sa OnRemoteCallEnd
+	/*! @Brief Called by BlabbleCall when a call has ended.
+	 *  call_id is the PJSIP call id the call was using.
 	 */
-	void OnCallEnd(const BlabbleCallPtr& call);
+	void OnCallEnd(const BlabbleCallPtr& call, pjsua_call_id call_id);
 	
-	/*! @Brief Called by BlabbleCall when a call is ended by the other side.
-	 *  @sa OnCallEnd
-	 */
-	void OnRemoteCallEnd(BlabbleCallPtr call, pjsua_call_id call_id, const pjsua_call_info& info);
-
 	bool use_tls() const { return use_tls_; }
 	void set_use_tls(bool v) { use_tls_ = v; }
 	std::string server() const { return server_; }
@@ -143,17 +188,33 @@ public:
 	void set_on_incoming_call(const FB::JSObjectPtr &v) { on_incoming_call_ = v; }
 	void set_on_reg_state(const FB::JSObjectPtr &v) { on_reg_state_ = v; }
 	void set_default_identity(const std::string &i) { default_identity = i; }
+	void set_event_queue(const BlabbleEventQueuePtr &q) { event_queue_ = q; }
 	PjsuaManagerPtr GetManager();
 
+	/*! @Brief Queue an event for JavaScript on behalf of this account or one of its calls.
+	 *  Events with the same non empty key are coalesced while waiting for delivery.
+	 *  Without an event queue the callback is invoked asynchronously on its own.
+	 */
+	void QueueEvent(const std::string &type, const FB::JSObjectPtr &callback,
+		const FB::VariantList &args, const std::string &key = "");
+
 private:
 	pjsua_acc_id id_;
+	unsigned int generation_;
 	std::string server_; //!< Server's IP or DNS name
 	std::string default_identity;
 	bool use_tls_;
 	unsigned long ringing_call_;
 	PjsuaManagerWeakPtr pjsua_manager_;
-	boost::recursive_mutex calls_mutex_;
-	BlabbleCallList calls_;
+	BlabbleEventQueuePtr event_queue_;
+	boost::mutex calls_mutex_; //!< Serializes changes to calls_ and guards conferences_
+	BlabbleCallSnapshot calls_; //!< Never changed in place, see AddCall
+	BlabbleConferenceList conferences_;
+
+	boost::mutex changes_mutex_; //!< Guards change_version_, ended_ and storing call stamps
+	long change_version_;
+	std::deque<std::pair<long, unsigned int> > ended_; //!< Version and id of recently ended calls
+	long ended_floor_; //!< Calls that ended at or before this version were forgotten
 	std::string username_, password_;
 	int timeout_, retry_;
 
@@ -162,7 +223,32 @@ private:
 	FB::JSObjectPtr on_reg_state_;
 
 	BlabbleAccountPtr get_shared() { return boost::static_pointer_cast<BlabbleAccount>(this->shared_from_this()); }
-	BlabbleCallPtr FindCall(pjsua_call_id call_id);
+
+	/*! @Brief The calls of this account as of now. Never blocks.
+	 */
+	BlabbleCallSnapshot CallSnapshot() { return boost::atomic_load(&calls_); }
+
+	/*! @Brief Publish a copy of the call list with call added.
+	 *
+	 *  Changes copy the list and swap the new copy in with the shared_ptr
+	 *  atomic operations, so readers on JavaScript and PJSIP threads take a
+	 *  snapshot without waiting on each other or on a change. Only changes
+	 *  take calls_mutex_, and only for the copy. A removed call is released
+	 *  when the last reader drops the snapshot holding it, never while the
+	 *  mutex is held.
+	 */
+	void AddCall(const BlabbleCallPtr& call);
+
+	/*! @Brief Publish a copy of the call list without call.
+	 *  @sa AddCall
+	 */
+	void RemoveCall(const BlabbleCallPtr& call);
+
+	static unsigned int generation_counter_;
+
+	/*! @Brief JavaScript methods and properties, built once for every account.
+	 */
+	static const BlabbleDispatchTable<BlabbleAccount> dispatch_table_;
 };
 
 #endif // H_BlabbleAccount
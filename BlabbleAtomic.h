@@ -0,0 +1,33 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleAtomic
+#define H_BlabbleAtomic
+
+/* Atomic operations on volatile long values. All of them are full barriers.
+ * ATOMIC_COMPARE_EXCHANGE returns the value held before the operation.
+ */
+#ifdef WIN32
+	#include <Windows.h>
+	#define ATOMIC_INCREMENT(a) InterlockedIncrement(a)
+	#define ATOMIC_DECREMENT(a) InterlockedDecrement(a)
+	#define ATOMIC_ADD(a, b) (InterlockedExchangeAdd(a, b) + (b))
+	#define ATOMIC_COMPARE_EXCHANGE(a, comp, exch) InterlockedCompareExchange(a, exch, comp)
+	#define INTERLOCKED_EXCHANGE(a, b) InterlockedExchange(a, b)
+	#define MEMORY_BARRIER() MemoryBarrier()
+#else
+	#define ATOMIC_INCREMENT(a) __sync_add_and_fetch(a, 1)
+	#define ATOMIC_DECREMENT(a) __sync_sub_and_fetch(a, 1)
+	#define ATOMIC_ADD(a, b) __sync_add_and_fetch(a, b)
+	#define ATOMIC_COMPARE_EXCHANGE(a, comp, exch) __sync_val_compare_and_swap(a, comp, exch)
+	#define INTERLOCKED_EXCHANGE(a, b) __sync_lock_test_and_set(a, b)
+	#define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+#endif // H_BlabbleAtomic
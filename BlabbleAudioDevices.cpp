@@ -0,0 +1,295 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include "variant_list.h"
+#include "BlabbleAudioDevices.h"
+#include "BlabbleEventQueue.h"
+#include "BlabbleLogging.h"
+#include "BlabbleMetrics.h"
+#include <pjsua-lib/pjsua_internal.h>
+
+static BlabbleHistogram& refresh_usec = BlabbleMetrics::Histogram("audio.refresh.usec");
+static BlabbleCounter& device_changes = BlabbleMetrics::Counter("audio.deviceChanges");
+
+BlabbleAudioDevices::BlabbleAudioDevices() :
+	default_capture_(-1), default_playback_(-1), pool_(NULL), thread_(NULL),
+	refresh_(false), quit_(false)
+{
+}
+
+BlabbleAudioDevices::~BlabbleAudioDevices()
+{
+}
+
+void BlabbleAudioDevices::Start()
+{
+	//Enumerate once here so the list is there before the first refresh
+	int capture, playback;
+	DeviceList list = Enumerate(capture, playback);
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		devices_ = list;
+		default_capture_ = capture;
+		default_playback_ = playback;
+		variants_.clear();
+		for (size_t i = 0; i < list.size(); i++)
+			variants_.push_back(ToVariant(list[i], (int)i));
+	}
+
+	pool_ = pjsua_pool_create("blabble-audiodev", 512, 512);
+	if (pool_ == NULL)
+		throw std::runtime_error("Ran out of memory creating pool!");
+
+	pj_status_t status = pj_thread_create(pool_, "blabble-audiodev", &BlabbleAudioDevices::Run,
+		this, 0, 0, &thread_);
+	if (status != PJ_SUCCESS)
+	{
+		thread_ = NULL;
+		BLABBLE_LOG_ERROR("BlabbleAudioDevices::Start unable to create thread, got status: " << status);
+	}
+}
+
+void BlabbleAudioDevices::Shutdown()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		quit_ = true;
+		subscribers_.clear();
+	}
+	cond_.notify_one();
+
+	if (thread_ != NULL)
+	{
+		pj_thread_join(thread_);
+		pj_thread_destroy(thread_);
+		thread_ = NULL;
+	}
+	if (pool_ != NULL)
+	{
+		pj_pool_release(pool_);
+		pool_ = NULL;
+	}
+}
+
+void BlabbleAudioDevices::Refresh()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		refresh_ = true;
+	}
+	cond_.notify_one();
+}
+
+void BlabbleAudioDevices::Subscribe(const BlabbleEventQueuePtr& queue, const FB::JSObjectPtr& callback)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (quit_)
+		return;
+
+	SubscriberList::iterator it;
+	for (it = subscribers_.begin(); it != subscribers_.end() && it->queue.lock() != queue; it++);
+	if (it == subscribers_.end())
+		it = subscribers_.insert(subscribers_.end(), Subscriber());
+
+	it->queue = queue;
+	it->callback = callback;
+}
+
+void BlabbleAudioDevices::Unsubscribe(const BlabbleEventQueuePtr& queue)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	for (SubscriberList::iterator it = subscribers_.begin(); it != subscribers_.end(); it++)
+	{
+		if (it->queue.lock() == queue)
+		{
+			subscribers_.erase(it);
+			break;
+		}
+	}
+}
+
+FB::VariantList BlabbleAudioDevices::devices()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	return variants_;
+}
+
+FB::VariantMap BlabbleAudioDevices::device(int id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (id == PJMEDIA_AUD_DEFAULT_CAPTURE_DEV)
+		id = default_capture_;
+	else if (id == PJMEDIA_AUD_DEFAULT_PLAYBACK_DEV)
+		id = default_playback_;
+
+	if (id < 0 || id >= (int)devices_.size())
+		return FB::VariantMap();
+
+	return ToVariant(devices_[id], id);
+}
+
+//Static
+int BlabbleAudioDevices::Run(void* arg)
+{
+	BlabbleAudioDevices *devices = static_cast<BlabbleAudioDevices*>(arg);
+	boost::mutex::scoped_lock lock(devices->mutex_);
+	while (!devices->quit_)
+	{
+		if (!devices->refresh_)
+		{
+			if (BLABBLE_AUDIO_REFRESH_MSEC > 0)
+				devices->cond_.timed_wait(lock, boost::posix_time::milliseconds(BLABBLE_AUDIO_REFRESH_MSEC));
+			else
+				devices->cond_.wait(lock);
+		}
+		if (devices->quit_)
+			break;
+
+		devices->refresh_ = false;
+		lock.unlock();
+		devices->Update();
+		lock.lock();
+	}
+	return 0;
+}
+
+void BlabbleAudioDevices::Update()
+{
+	DeviceList old, list;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		old = devices_;
+	}
+
+	//PJSUA opens the sound device with its lock held, so it never sees a half refreshed list
+	PJSUA_LOCK();
+	pj_status_t status;
+	int capture = -1, playback = -1;
+	{
+		BlabbleMetricsTimer timer(refresh_usec);
+		status = pjmedia_aud_dev_refresh();
+	}
+	if (status == PJ_SUCCESS)
+	{
+		list = Enumerate(capture, playback);
+
+		//The refresh renumbered the devices, keep PJSUA pointing at the ones it had
+		pjsua_var.cap_dev = Remap(pjsua_var.cap_dev, old, list, PJMEDIA_AUD_DEFAULT_CAPTURE_DEV);
+		pjsua_var.play_dev = Remap(pjsua_var.play_dev, old, list, PJMEDIA_AUD_DEFAULT_PLAYBACK_DEV);
+	}
+	PJSUA_UNLOCK();
+
+	if (status != PJ_SUCCESS)
+	{
+		BLABBLE_LOG_ERROR("BlabbleAudioDevices::Update unable to refresh devices, got status: " << status);
+		return;
+	}
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		default_capture_ = capture;
+		default_playback_ = playback;
+	}
+	if (list == old)
+		return;
+
+	FB::VariantList variants;
+	for (size_t i = 0; i < list.size(); i++)
+		variants.push_back(ToVariant(list[i], (int)i));
+
+	SubscriberList subscribers;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		devices_ = list;
+		variants_ = variants;
+		subscribers = subscribers_;
+	}
+
+	BLABBLE_LOG_DEBUG("BlabbleAudioDevices found " << list.size() << " audio devices, was " << old.size() << ".");
+	device_changes.Increment();
+
+	for (SubscriberList::iterator it = subscribers.begin(); it != subscribers.end(); it++)
+	{
+		BlabbleEventQueuePtr queue = it->queue.lock();
+		if (queue)
+		{
+			//Only the latest list matters, so a pending change is replaced
+			queue->Post(BlabbleEvent("audioDevicesChanged", it->callback,
+				FB::variant_list_of(variants), "audioDevicesChanged"));
+		}
+	}
+}
+
+//Static
+BlabbleAudioDevices::DeviceList BlabbleAudioDevices::Enumerate(int& capture, int& playback)
+{
+	DeviceList list;
+	unsigned int count = pjmedia_aud_dev_count();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		//Unreadable devices are kept as blanks so indexes stay those of PJMEDIA
+		pjmedia_aud_dev_info info;
+		BlabbleAudioDevice device;
+		device.inputs = device.outputs = 0;
+		if (pjmedia_aud_dev_get_info((pjmedia_aud_dev_index)i, &info) == PJ_SUCCESS)
+		{
+			device.name = info.name;
+			device.driver = info.driver;
+			device.inputs = info.input_count;
+			device.outputs = info.output_count;
+		}
+		list.push_back(device);
+	}
+
+	capture = FindDefault(PJMEDIA_AUD_DEFAULT_CAPTURE_DEV, list);
+	playback = FindDefault(PJMEDIA_AUD_DEFAULT_PLAYBACK_DEV, list);
+	return list;
+}
+
+//Static
+int BlabbleAudioDevices::FindDefault(pjmedia_aud_dev_index id, const DeviceList& list)
+{
+	pjmedia_aud_dev_info info;
+	if (pjmedia_aud_dev_get_info(id, &info) != PJ_SUCCESS)
+		return -1;
+
+	for (size_t i = 0; i < list.size(); i++)
+	{
+		if (list[i].driver == info.driver && list[i].name == info.name)
+			return (int)i;
+	}
+	return -1;
+}
+
+//Static
+int BlabbleAudioDevices::Remap(int id, const DeviceList& old, const DeviceList& list, int fallback)
+{
+	if (id < 0)
+		return id;
+	if (id >= (int)old.size())
+		return fallback;
+
+	for (size_t i = 0; i < list.size(); i++)
+	{
+		if (list[i].driver == old[id].driver && list[i].name == old[id].name)
+			return (int)i;
+	}
+	return fallback;
+}
+
+//Static
+FB::VariantMap BlabbleAudioDevices::ToVariant(const BlabbleAudioDevice& device, int id)
+{
+	FB::VariantMap map;
+	map["name"] = device.name;
+	map["driver"] = device.driver;
+	map["inputs"] = device.inputs;
+	map["outputs"] = device.outputs;
+	map["id"] = id;
+	return map;
+}
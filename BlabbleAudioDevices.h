@@ -0,0 +1,152 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleAudioDevices
+#define H_BlabbleAudioDevices
+
+#include <string>
+#include <vector>
+#include "JSAPIAuto.h"
+#include "JSObject.h"
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+#include <pjmedia.h>
+
+FB_FORWARD_PTR(BlabbleEventQueue)
+
+/*! @Brief How often the device list is refreshed, in milliseconds. 0 only
+ *  refreshes when asked to.
+ */
+#ifndef BLABBLE_AUDIO_REFRESH_MSEC
+#define BLABBLE_AUDIO_REFRESH_MSEC 2000
+#endif
+
+/*! @Brief One audio device as it was last enumerated.
+ */
+struct BlabbleAudioDevice
+{
+	std::string name;
+	std::string driver;
+	unsigned int inputs;
+	unsigned int outputs;
+
+	bool operator==(const BlabbleAudioDevice& other) const
+	{
+		return name == other.name && driver == other.driver &&
+			inputs == other.inputs && outputs == other.outputs;
+	}
+	bool operator!=(const BlabbleAudioDevice& other) const { return !(*this == other); }
+};
+
+/*! @class  BlabbleAudioDevices
+ *
+ *  @brief  Keeps the list of audio devices in memory and notices when it changes.
+ *
+ *  Enumerating devices can block for tens of milliseconds on some ALSA and
+ *  PulseAudio setups. A background thread calls pjmedia_aud_dev_refresh
+ *  and enumerates the devices, so the JavaScript thread only ever copies
+ *  the cached list. It does so when Refresh is called and every
+ *  BLABBLE_AUDIO_REFRESH_MSEC, calls or not. When the list changes, e.g.
+ *  a headset is plugged in, an "audioDevicesChanged" event with the new
+ *  list is posted to each subscribed event queue.
+ *
+ *  A refresh renumbers the devices. A sound device chosen by index is
+ *  looked up again by driver and name afterwards, and falls back to the
+ *  system default if it is gone. This applies the next time the device
+ *  is opened, an open device keeps playing. The refresh and the lookup
+ *  run with the PJSUA lock held so PJSUA never opens a device from a half
+ *  built list or with an index from before the refresh. The cached list
+ *  is replaced and subscribers are told after the lock is released.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleAudioDevices
+{
+public:
+	BlabbleAudioDevices();
+	virtual ~BlabbleAudioDevices();
+
+	/*! @Brief Enumerate the devices and start the refresh thread. Must be called after pjsua_init.
+	 */
+	void Start();
+
+	/*! @Brief Stop the refresh thread. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief Refresh now instead of waiting for the next period. Does not block.
+	 */
+	void Refresh();
+
+	/*! @Brief Post "audioDevicesChanged" events to queue, invoking callback if set.
+	 *  Subscribing a queue again replaces its callback.
+	 */
+	void Subscribe(const BlabbleEventQueuePtr& queue, const FB::JSObjectPtr& callback);
+
+	/*! @Brief Stop the events started by Subscribe for queue.
+	 */
+	void Unsubscribe(const BlabbleEventQueuePtr& queue);
+
+	/*! @Brief Array for JavaScript of objects with "name", "driver", "inputs",
+	 *  "outputs" and "id" properties, as of the last refresh.
+	 */
+	FB::VariantList devices();
+
+	/*! @Brief Object for JavaScript describing device index id as devices() does.
+	 *  The default capture and playback ids are those of the system defaults.
+	 *  Empty if there is no such device.
+	 */
+	FB::VariantMap device(int id);
+
+private:
+	struct Subscriber
+	{
+		BlabbleEventQueueWeakPtr queue;
+		FB::JSObjectPtr callback;
+	};
+	typedef std::vector<Subscriber> SubscriberList;
+	typedef std::vector<BlabbleAudioDevice> DeviceList;
+
+	static int Run(void* arg);
+
+	/*! @Brief Refresh and enumerate the devices, and tell subscribers if they changed.
+	 */
+	void Update();
+
+	/*! @Brief List the devices, and set capture and playback to the indexes
+	 *  of the system defaults, or -1 if they are not in the list.
+	 */
+	static DeviceList Enumerate(int& capture, int& playback);
+
+	/*! @Brief Index in list of the device PJMEDIA opens for id, or -1.
+	 */
+	static int FindDefault(pjmedia_aud_dev_index id, const DeviceList& list);
+
+	/*! @Brief Index of the device in list matching old[id], or fallback.
+	 */
+	static int Remap(int id, const DeviceList& old, const DeviceList& list, int fallback);
+
+	static FB::VariantMap ToVariant(const BlabbleAudioDevice& device, int id);
+
+	boost::mutex mutex_;
+	boost::condition_variable cond_;
+	DeviceList devices_;		//!< Guarded by mutex_
+	FB::VariantList variants_;	//!< devices_ for JavaScript, guarded by mutex_
+	int default_capture_;		//!< Index in devices_, guarded by mutex_
+	int default_playback_;		//!< Index in devices_, guarded by mutex_
+	SubscriberList subscribers_;
+	pj_pool_t* pool_;
+	pj_thread_t* thread_;
+	bool refresh_;
+	bool quit_;
+};
+
+#endif // H_BlabbleAudioDevices
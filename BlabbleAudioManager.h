@@ -14,6 +14,7 @@ Copyright 2012 Andrew Ofisher
 #include <map>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/mutex.hpp>
 #include <pjlib.h>
 #include <pjlib-util.h>
 #include <pjnath.h>
@@ -23,11 +24,18 @@ Copyright 2012 Andrew Ofisher
 #include <pjsua-lib/pjsua.h>
 #include <pjmedia.h>
 #include <pjmedia-codec.h> 
+#include "BlabbleSoundCache.h"
+#include "BlabbleTonePlan.h"
 
 /*! @class A simple class to manage ringing.
  *  This class controls ringing (either via generated tone or
  *  a wave file used as a ringtone. It also handles playing the
- *  call waiting beep when another call comes in while on a call.
+ *  call waiting beep when another call comes in while on a call,
+ *  and the busy and reorder signals.
+ *
+ *  Tones come from a BlabbleTonePlan and are rendered once, a full
+ *  cadence at a time, at the conference bridge clock rate. Playing
+ *  one is a BlabbleSoundPlayer looping over that buffer.
  */
 class BlabbleAudioManager
 {
@@ -47,21 +55,63 @@ public:
 	 */
 	void StartInRing();
 	
+	/*! @Brief Start playing the busy signal, or the reorder signal if reorder is set.
+	 */
+	void StartBusy(bool reorder);
+
+	/*! @Brief Stop the busy or reorder signal.
+	 */
+	void StopBusy();
+
+	/*! @Brief Switch to the built in tone plan name. Tones already playing
+	 *  keep the old cadence until they are started again. Returns false if
+	 *  name is unknown.
+	 */
+	bool SetTonePlan(const std::string& name);
+
+	/*! @Brief Name of the current tone plan.
+	 */
+	std::string tone_plan();
+
 	/*! @Brief Start playing the wave file fileName located in wavPath that was passed to the constructor.
+	 *  The file is decoded into the sound cache the first time it is played.
 	 */
 	bool StartWav(const std::string& fileName);
+
+	/*! @Brief Decode fileName into the sound cache so a later StartWav does no disk I/O.
+	 */
+	bool PreloadWav(const std::string& fileName);
 	
 	/*! @Brief Stop playing a wave played with StartWav.
 	 *  @sa StartWav
 	 */
 	void StopWav();
+
+	/*! @Brief Decoded sounds shared by every player.
+	 */
+	BlabbleSoundCache& sound_cache() { return sound_cache_; }
+
 private:
+	std::string WavPath(const std::string& fileName);
+
+	/*! @Brief Clock rate of the conference bridge, which sounds are cached at.
+	 */
+	static unsigned int BridgeClockRate();
+
+	/*! @Brief The rendered cadences of one tone plan.
+	 */
+	struct Tones
+	{
+		std::string name;
+		BlabbleSoundPtr ring, in_ring, call_wait, busy, reorder;
+	};
+
 	std::string wav_path_;
-	pj_pool_t* pool_;
-	pjmedia_port *ring_port_, *in_ring_port_, *call_wait_ring_port_;
-	pjsua_player_id in_ring_player_, wav_player_;
-	pjsua_conf_port_id ring_slot_, in_ring_slot_, call_wait_slot_, 
-		wav_slot_;
+	BlabbleSoundCache sound_cache_;
+	BlabbleSoundPtr ringtone_;
+	boost::mutex tones_mutex_;
+	Tones tones_; //!< Guarded by tones_mutex_
+	BlabbleSoundPlayer ring_player_, in_ring_player_, call_wait_player_, busy_player_, wav_player_;
 };
 
 #endif
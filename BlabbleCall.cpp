@@ -10,11 +10,15 @@ Copyright 2012 Andrew Ofisher
 #include "BlabbleAudioManager.h"
 #include "BlabbleCall.h"
 #include "BlabbleAccount.h"
+#include "BlabbleConference.h"
+#include "BlabbleRecorder.h"
 #include "Blabble.h"
 #include "JSObject.h"
 #include "variant_list.h"
 #include "BlabbleLogging.h"
 #include "FBWriteOnlyProperty.h"
+#include <boost/make_shared.hpp>
+#include <boost/pool/pool_alloc.hpp>
 
 /*! @Brief Static call counter to keep track of calls.
  */
@@ -24,9 +28,69 @@ unsigned int BlabbleCall::GetNextId()
 	return ATOMIC_INCREMENT(&BlabbleCall::id_counter_);
 }
 
+/*! @Brief Point any string in info that refers to from's buffers at the same place in to.
+ */
+static void RebaseCallInfoStr(pj_str_t &str, const pjsua_call_info &from, pjsua_call_info &to)
+{
+	const char *begin = reinterpret_cast<const char*>(&from);
+	if (str.ptr >= begin && str.ptr < begin + sizeof(pjsua_call_info))
+	{
+		str.ptr = reinterpret_cast<char*>(&to) + (str.ptr - begin);
+	}
+}
+
+/*! @Brief Copy a pjsua_call_info, keeping its strings pointing at its own buffers.
+ */
+static void CopyCallInfo(const pjsua_call_info &from, pjsua_call_info &to)
+{
+	to = from;
+	RebaseCallInfoStr(to.local_info, from, to);
+	RebaseCallInfoStr(to.local_contact, from, to);
+	RebaseCallInfoStr(to.remote_info, from, to);
+	RebaseCallInfoStr(to.remote_contact, from, to);
+	RebaseCallInfoStr(to.call_id, from, to);
+	RebaseCallInfoStr(to.state_text, from, to);
+	RebaseCallInfoStr(to.last_status_text, from, to);
+}
+
+const BlabbleDispatchTable<BlabbleCall> BlabbleCall::dispatch_table_ = BlabbleDispatchTable<BlabbleCall>()
+	.Method("answer", &BlabbleCall::Answer)
+	.Method("hangup", &BlabbleCall::LocalEnd)
+	.Method("hold", &BlabbleCall::Hold)
+	.Method("unhold", &BlabbleCall::Unhold)
+	.Method("sendDTMF", &BlabbleCall::SendDTMF)
+	.Method("subscribeStats", &BlabbleCall::SubscribeStats)
+	.Method("unsubscribeStats", &BlabbleCall::UnsubscribeStats)
+	.Method("startRecording", &BlabbleCall::StartRecording)
+	.Method("stopRecording", &BlabbleCall::StopRecording)
+	.Method("transferReplace", &BlabbleCall::TransferReplace)
+	.Method("transfer", &BlabbleCall::Transfer)
+	.Method("setJitterBuffer", &BlabbleCall::SetJitterBuffer)
+	.Property("callerId", &BlabbleCall::caller_id)
+	.Property("isActive", &BlabbleCall::is_active)
+	.Property("status", &BlabbleCall::status)
+	.Property("recording", &BlabbleCall::recording)
+	.Property("jitterBuffer", &BlabbleCall::jitter_buffer)
+	.WriteOnlyProperty("onCallConnected", &BlabbleCall::set_on_call_connected)
+	.WriteOnlyProperty("onCallEnd", &BlabbleCall::set_on_call_end);
+
+//Static
+BlabbleCallPtr BlabbleCall::Create(const BlabbleAccountPtr& parent_account)
+{
+	return boost::allocate_shared<BlabbleCall>(boost::fast_pool_allocator<BlabbleCall>(), parent_account);
+}
+
 BlabbleCall::BlabbleCall(const BlabbleAccountPtr& parent_account)
-	: call_id_(-1), ringing_(false)
+	: BlabbleJSAPIAuto<BlabbleCall>(dispatch_table_), call_id_(-1), ringing_(false), info_version_(0),
+	changed_version_(0)
 {
+	pj_bzero(&info_, sizeof(info_));
+	info_.id = INVALID_CALL;
+	info_.state = PJSIP_INV_STATE_NULL;
+	info_.media_status = PJSUA_CALL_MEDIA_NONE;
+	info_.conf_slot = PJSUA_INVALID_ID;
+	info_time_.sec = info_time_.msec = 0;
+
 	if (parent_account) 
 	{
 		acct_id_ = parent_account->id();
@@ -40,21 +104,6 @@ BlabbleCall::BlabbleCall(const BlabbleAccountPtr& parent_account)
 	
 	id_ = BlabbleCall::GetNextId();
 	BLABBLE_LOG_DEBUG("New call created. Global id: " << id_);
-
-	registerMethod("answer", make_method(this, &BlabbleCall::Answer));
-	registerMethod("hangup", make_method(this, &BlabbleCall::LocalEnd));
-	registerMethod("hold", make_method(this, &BlabbleCall::Hold));
-	registerMethod("unhold", make_method(this, &BlabbleCall::Unhold));
-	registerMethod("sendDTMF", make_method(this, &BlabbleCall::SendDTMF));
-	registerMethod("transferReplace", make_method(this, &BlabbleCall::TransferReplace));
-	registerMethod("transfer", make_method(this, &BlabbleCall::Transfer));
-
-	registerProperty("callerId", make_property(this, &BlabbleCall::caller_id));
-	registerProperty("isActive", make_property(this, &BlabbleCall::is_active));
-	registerProperty("status", make_property(this, &BlabbleCall::status));
-
-	registerProperty("onCallConnected", make_write_only_property(this, &BlabbleCall::set_on_call_connected));
-	registerProperty("onCallEnd", make_write_only_property(this, &BlabbleCall::set_on_call_end));
 }
 
 void BlabbleCall::StopRinging()
@@ -84,6 +133,22 @@ void BlabbleCall::StartOutRinging()
 	}
 }
 
+//Must run before the hangup, which may tear the session down right away
+void BlabbleCall::WatchPools(const BlabbleAccountPtr& p, pjsua_call_id call_id)
+{
+	if (!p)
+		return;
+
+	try
+	{
+		p->GetManager()->memory_monitor().WatchCall(id_, call_id);
+	}
+	catch (std::runtime_error&)
+	{
+		//Manager is gone, so is the check
+	}
+}
+
 //Ended by us
 void BlabbleCall::LocalEnd()
 {
@@ -97,40 +162,24 @@ void BlabbleCall::LocalEnd()
 	StopRinging();
 
 	pjsua_call_info info;
-	if (pjsua_call_get_info(old_id, &info) == PJ_SUCCESS &&
-		info.conf_slot > 0) 
+	if (GetInfo(info) && info.conf_slot > 0) 
 	{
 		//Kill the audio
 		pjsua_conf_disconnect(info.conf_slot, 0);
 		pjsua_conf_disconnect(0, info.conf_slot);
 	}
 
+	BlabbleAccountPtr p = parent_.lock();
+	WatchPools(p, old_id);
+
 	pjsua_call_hangup(old_id, 0, NULL, NULL);
 	
-	if (on_call_end_)
+	if (p)
 	{
 		BlabbleCallPtr call = get_shared();
-		on_call_end_->getHost()->ScheduleOnMainThread(call, boost::bind(&BlabbleCall::CallOnCallEnd, call));
+		p->QueueEvent("callEnd", on_call_end_, FB::variant_list_of(BlabbleCallWeakPtr(call)));
+		p->OnCallEnd(call, old_id);
 	}
-
-	BlabbleAccountPtr p = parent_.lock();
-	if (p)
-		p->OnCallEnd(get_shared());
-}
-
-void BlabbleCall::CallOnCallEnd()
-{
-	on_call_end_->Invoke("", FB::variant_list_of(BlabbleCallWeakPtr(get_shared())));
-}
-
-void BlabbleCall::CallOnCallEnd(pjsip_status_code status)
-{
-	on_call_end_->Invoke("", FB::variant_list_of(BlabbleCallWeakPtr(get_shared()))(status));
-}
-
-void BlabbleCall::CallOnTransferStatus(int status)
-{
-	on_transfer_status_->Invoke("", FB::variant_list_of(BlabbleCallWeakPtr(get_shared()))(status));
 }
 
 //Ended by remote, could be becuase of an error
@@ -152,36 +201,26 @@ void BlabbleCall::RemoteEnd(const pjsua_call_info &info)
 		pjsua_conf_disconnect(0, info.conf_slot);
 	}
 
+	BlabbleAccountPtr p = parent_.lock();
+	WatchPools(p, old_id);
+
 	pjsua_call_hangup(old_id, 0, NULL, NULL);
 
-	if (info.last_status > 400)
+	if (p)
 	{
-		std::string callerId;
-		if (info.remote_contact.ptr == NULL)
+		BlabbleCallPtr call = get_shared();
+		if (info.last_status > 400)
 		{
-			callerId =std::string(info.remote_info.ptr, info.remote_info.slen);
-		} 
+			p->QueueEvent("callEnd", on_call_end_, 
+				FB::variant_list_of(BlabbleCallWeakPtr(call))((int)info.last_status));
+		}
 		else
 		{
-			callerId = std::string(info.remote_contact.ptr, info.remote_contact.slen);
+			p->QueueEvent("callEnd", on_call_end_, FB::variant_list_of(BlabbleCallWeakPtr(call)));
 		}
 
-		if (on_call_end_)
-		{
-			BlabbleCallPtr call = get_shared();
-			on_call_end_->getHost()->ScheduleOnMainThread(call, boost::bind(&BlabbleCall::CallOnCallEnd, call, info.last_status));
-		}
-	} else {
-		if (on_call_end_)
-		{
-			BlabbleCallPtr call = get_shared();
-			on_call_end_->getHost()->ScheduleOnMainThread(call, boost::bind(&BlabbleCall::CallOnCallEnd, call));
-		}
+		p->OnCallEnd(call, old_id);
 	}
-
-	BlabbleAccountPtr p = parent_.lock();
-	if (p)
-		p->OnCallEnd(get_shared());
 }
 
 BlabbleCall::~BlabbleCall(void)
@@ -201,11 +240,15 @@ bool BlabbleCall::RegisterIncomingCall(pjsua_call_id call_id)
 		call_id >= 0 && call_id < (long)pjsua_call_get_max_count())
 	{
 		call_id_ = call_id;
-		pjsua_call_set_user_data(call_id, &id_);
+		pjsua_call_set_user_data(call_id, (void*)(pj_ssize_t)id_);
+		p->GetManager()->BindCall(call_id, get_shared());
+
+		pjsua_call_info info;
+		RefreshInfo(call_id, info);
 
 		/* Automatically answer incoming calls with 180/RINGING */
 		pjsua_call_answer(call_id, 180, NULL, NULL);
-		
+
 		StartInRinging();
 		return true;
 	}
@@ -227,6 +270,9 @@ pj_status_t BlabbleCall::MakeCall(const std::string& dest, const std::string& id
 	desturi.ptr = const_cast<char*>(dest.c_str());
 	desturi.slen = dest.length();
 
+	//The offer's answer creates the stream, don't let it inherit another call's bounds
+	p->GetManager()->jitter_control().Prepare(id_);
+
 	if (!identity.empty())
 	{
 		pjsua_msg_data msgData;
@@ -239,12 +285,12 @@ pj_status_t BlabbleCall::MakeCall(const std::string& dest, const std::string& id
 		pj_list_push_back(&msgData.hdr_list, &cidHdr);
 
 		status = pjsua_call_make_call(acct_id_, &desturi, 0,
-			&id_, &msgData, (pjsua_call_id*)&call_id_);
+			(void*)(pj_ssize_t)id_, &msgData, (pjsua_call_id*)&call_id_);
 	}
 	else 
 	{
 		status = pjsua_call_make_call(acct_id_, &desturi, 0,
-			&id_, NULL, (pjsua_call_id*)&call_id_);
+			(void*)(pj_ssize_t)id_, NULL, (pjsua_call_id*)&call_id_);
 	}
 
 	if (status == PJ_SUCCESS) 
@@ -263,11 +309,37 @@ bool BlabbleCall::Answer()
 		return false;
 
 	StopRinging();
+	//The answer creates the stream, which takes its jitter buffer bounds from the media config
+	p->GetManager()->jitter_control().Prepare(id_);
+	p->GetManager()->sound_device().Answered(id_);
 	pj_status_t status = pjsua_call_answer(call_id_, 200, NULL, NULL);
+	if (status != PJ_SUCCESS)
+		p->GetManager()->sound_device().Forget(id_);
 
 	return status == PJ_SUCCESS;
 }
 
+void BlabbleCall::SubscribeStats(int interval, const FB::JSObjectPtr& callback)
+{
+	BlabbleAccountPtr p = CheckAndGetParent();
+	if (!p)
+		return;
+
+	if (interval <= 0 || !callback)
+		throw FB::script_error("subscribeStats requires an interval and a callback");
+
+	p->GetManager()->stats_sampler().Subscribe(get_shared(), p, (unsigned int)interval, callback);
+}
+
+void BlabbleCall::UnsubscribeStats()
+{
+	BlabbleAccountPtr p = CheckAndGetParent();
+	if (!p)
+		return;
+
+	p->GetManager()->stats_sampler().Unsubscribe(id_);
+}
+
 bool BlabbleCall::Hold()
 {
 	BlabbleAccountPtr p = CheckAndGetParent();
@@ -379,13 +451,147 @@ std::string BlabbleCall::caller_id()
 		return "INVALID CALL";
 
 	pjsua_call_info info;
-	if (pjsua_call_get_info(call_id_, &info) == PJ_SUCCESS) 
+	if (GetInfo(info)) 
 	{
 		return std::string(info.remote_contact.ptr, info.remote_contact.slen);
 	}
 	return "";
 }
 
+FB::variant BlabbleCall::StartRecording(const std::string& name, const boost::optional<FB::VariantMap>& options)
+{
+	BlabbleAccountPtr p = CheckAndGetParent();
+	if (!p)
+		return FB::variant();
+
+	if (name.empty())
+		throw FB::script_error("startRecording requires a file name");
+
+	bool stereo = false;
+	if (options)
+	{
+		FB::VariantMap::const_iterator iter = options->find("stereo");
+		if (iter != options->end() && iter->second.is_of_type<bool>())
+			stereo = iter->second.convert_cast<bool>();
+	}
+
+	{
+		boost::mutex::scoped_lock lock(info_mutex_);
+		if (recording_ && recording_->active())
+			throw FB::script_error("Call is already being recorded");
+	}
+
+	pjsua_call_info info;
+	pjsua_conf_port_id source = PJSUA_INVALID_ID;
+	if (GetInfo(info) && info.media_status == PJSUA_CALL_MEDIA_ACTIVE)
+		source = info.conf_slot;
+
+	BlabbleRecorder &recorder = p->GetManager()->recorder();
+	BlabbleRecordingPtr recording;
+	try
+	{
+		recording = recorder.Start(name, stereo, source);
+	}
+	catch (const std::runtime_error &e)
+	{
+		throw FB::script_error(e.what());
+	}
+
+	BlabbleRecordingPtr previous;
+	{
+		boost::mutex::scoped_lock lock(info_mutex_);
+		previous = recording_;
+		recording_ = recording;
+	}
+
+	//Only if startRecording raced with itself
+	if (previous)
+		recorder.Stop(previous);
+
+	return recording->name();
+}
+
+FB::variant BlabbleCall::StopRecording()
+{
+	BlabbleRecordingPtr recording;
+	{
+		boost::mutex::scoped_lock lock(info_mutex_);
+		recording = recording_;
+	}
+
+	if (!recording)
+		return FB::variant();
+
+	BlabbleAccountPtr p = parent_.lock();
+	if (p)
+		p->GetManager()->recorder().Stop(recording);
+
+	return recording->stats();
+}
+
+bool BlabbleCall::SetJitterBuffer(const FB::VariantMap& options)
+{
+	BlabbleAccountPtr p = CheckAndGetParent();
+	if (!p)
+		return false;
+
+	BlabbleJitterSettings settings;
+	bool automatic = false, renegotiate = false;
+	FB::VariantMap::const_iterator iter;
+	if ((iter = options.find("init")) != options.end())
+		settings.init = iter->second.convert_cast<int>();
+	if ((iter = options.find("minPrefetch")) != options.end())
+		settings.min_pre = iter->second.convert_cast<int>();
+	if ((iter = options.find("maxPrefetch")) != options.end())
+		settings.max_pre = iter->second.convert_cast<int>();
+	if ((iter = options.find("max")) != options.end())
+		settings.max = iter->second.convert_cast<int>();
+	if ((iter = options.find("auto")) != options.end() && iter->second.is_of_type<bool>())
+		automatic = iter->second.convert_cast<bool>();
+	if ((iter = options.find("renegotiate")) != options.end() && iter->second.is_of_type<bool>())
+		renegotiate = iter->second.convert_cast<bool>();
+
+	if (settings.init < -1 || settings.min_pre < -1 || settings.max_pre < -1 || settings.max < -1 ||
+		(settings.min_pre >= 0 && settings.max_pre >= 0 && settings.min_pre > settings.max_pre) ||
+		(settings.min_pre >= 0 && settings.max >= 0 && settings.min_pre > settings.max) ||
+		(settings.max_pre >= 0 && settings.max >= 0 && settings.max_pre > settings.max))
+	{
+		throw FB::script_error("setJitterBuffer requires minPrefetch <= maxPrefetch <= max, or -1 for the default");
+	}
+
+	return p->GetManager()->jitter_control().Set(id_, call_id_, settings, automatic, renegotiate);
+}
+
+FB::VariantMap BlabbleCall::jitter_buffer()
+{
+	BlabbleAccountPtr p = CheckAndGetParent();
+	if (!p)
+		return FB::VariantMap();
+
+	return p->GetManager()->jitter_control().State(id_, call_id_);
+}
+
+FB::variant BlabbleCall::recording()
+{
+	boost::mutex::scoped_lock lock(info_mutex_);
+	if (!recording_)
+		return FB::variant();
+
+	return recording_->stats();
+}
+
+BlabbleConferencePtr BlabbleCall::conference()
+{
+	boost::mutex::scoped_lock lock(info_mutex_);
+	return conference_.lock();
+}
+
+void BlabbleCall::set_conference(const BlabbleConferencePtr& conference)
+{
+	boost::mutex::scoped_lock lock(info_mutex_);
+	conference_ = conference;
+}
+
 bool BlabbleCall::get_valid()
 {
 	return (bool)CheckAndGetParent();
@@ -396,10 +602,8 @@ FB::VariantMap BlabbleCall::status()
 	FB::VariantMap map = FB::VariantMap();
 	map["state"] = (int)CALL_INVALID;
 	pjsua_call_info info;
-	pj_status_t status;
 
-	if (call_id_ != INVALID_CALL &&
-		(status = pjsua_call_get_info(call_id_, &info)) == PJ_SUCCESS)
+	if (call_id_ != INVALID_CALL && GetInfo(info))
 	{
 		if (info.media_status == PJSUA_CALL_MEDIA_LOCAL_HOLD ||
 			info.media_status == PJSUA_CALL_MEDIA_REMOTE_HOLD)
@@ -437,15 +641,67 @@ FB::VariantMap BlabbleCall::status()
 	return map;
 }
 
+bool BlabbleCall::RefreshInfo(pjsua_call_id call_id, pjsua_call_info &info)
+{
+	pj_status_t status;
+	if ((status = pjsua_call_get_info(call_id, &info)) != PJ_SUCCESS) {
+		BLABBLE_LOG_ERROR("Unable to get call info. PJSIP call id: " << call_id << ", global id: " << id_ << ", pjsua_call_get_info returned " << status);
+		return false;
+	}
+
+	BlabbleAccountPtr parent = parent_.lock();
+	boost::mutex::scoped_lock lock(info_mutex_);
+	bool changed = info_version_ == 0 || info.state != info_.state ||
+		info.media_status != info_.media_status ||
+		pj_strcmp(&info.remote_info, &info_.remote_info) != 0 ||
+		pj_strcmp(&info.remote_contact, &info_.remote_contact) != 0;
+
+	CopyCallInfo(info, info_);
+	pj_gettickcount(&info_time_);
+	++info_version_;
+	if (changed && parent)
+		parent->StampChange(&changed_version_);
+	return true;
+}
+
+unsigned int BlabbleCall::GetInfo(pjsua_call_info &info)
+{
+	boost::mutex::scoped_lock lock(info_mutex_);
+	if (info_version_ == 0)
+		return 0;
+
+	CopyCallInfo(info_, info);
+	if (info.state == PJSIP_INV_STATE_CONFIRMED)
+	{
+		pj_time_val now;
+		pj_gettickcount(&now);
+		PJ_TIME_VAL_SUB(now, info_time_);
+		PJ_TIME_VAL_ADD(info.connect_duration, now);
+		PJ_TIME_VAL_ADD(info.total_duration, now);
+	}
+
+	return info_version_;
+}
+
+pjsip_inv_state BlabbleCall::state()
+{
+	boost::mutex::scoped_lock lock(info_mutex_);
+	return info_.state;
+}
+
+pjsua_call_media_status BlabbleCall::media_status()
+{
+	boost::mutex::scoped_lock lock(info_mutex_);
+	return info_.media_status;
+}
+
 void BlabbleCall::OnCallMediaState()
 {
 	if (call_id_ == INVALID_CALL)
 		return;
 
 	pjsua_call_info info;
-	pj_status_t status;
-	if ((status = pjsua_call_get_info(call_id_, &info)) != PJ_SUCCESS) {
-		BLABBLE_LOG_ERROR("Unable to get call info. PJSIP call id: " << call_id_ << ", global id: " << id_ << ", pjsua_call_get_info returned " << status);
+	if (!RefreshInfo(call_id_, info)) {
 		StopRinging();
 		return;
 	}
@@ -457,13 +713,32 @@ void BlabbleCall::OnCallMediaState()
 		// When media is active, connect call to sound device.
 		pjsua_conf_connect(info.conf_slot, 0);
 		pjsua_conf_connect(0, info.conf_slot);
+
+		BlabbleAccountPtr p = parent_.lock();
+		if (p)
+		{
+			p->GetManager()->level_meter().Watch(get_shared(), info.conf_slot);
+			p->GetManager()->sound_device().MediaActive(id_, info.conf_slot);
+		}
+
+		BlabbleRecordingPtr recording;
+		{
+			boost::mutex::scoped_lock lock(info_mutex_);
+			recording = recording_;
+		}
+		if (recording)
+			recording->SetSource(info.conf_slot);
 	}
+
+	BlabbleConferencePtr conf = conference();
+	if (conf)
+		conf->OnCallMediaState(get_shared(), info);
 }
 
 void BlabbleCall::OnCallState(pjsua_call_id call_id, pjsip_event *e)
 {
 	pjsua_call_info info;
-	if (pjsua_call_get_info(call_id, &info) == PJ_SUCCESS)
+	if (RefreshInfo(call_id, info))
 	{
 		if (info.state == PJSIP_INV_STATE_DISCONNECTED) 
 		{
@@ -471,34 +746,35 @@ void BlabbleCall::OnCallState(pjsua_call_id call_id, pjsip_event *e)
 		}
 		else if (info.state == PJSIP_INV_STATE_CALLING)
 		{
-			if (on_call_ringing_)
-				on_call_ringing_->InvokeAsync("", FB::variant_list_of(BlabbleCallWeakPtr(get_shared())));
-
 			BlabbleAccountPtr p = parent_.lock();
 			if (p)
+			{
+				p->QueueEvent("callRinging", on_call_ringing_, FB::variant_list_of(BlabbleCallWeakPtr(get_shared())));
 				p->OnCallRingChange(get_shared(), info);
+			}
 		}
 		else if (info.state == PJSIP_INV_STATE_CONFIRMED)
 		{
-			if (on_call_connected_)
-				on_call_connected_->InvokeAsync("", FB::variant_list_of(BlabbleCallWeakPtr(get_shared())));
-
 			BlabbleAccountPtr p = parent_.lock();
 			if (p)
+			{
+				p->QueueEvent("callConnected", on_call_connected_, FB::variant_list_of(BlabbleCallWeakPtr(get_shared())));
 				p->OnCallRingChange(get_shared(), info);
+			}
 		}
 	}
 }
 
 bool BlabbleCall::OnCallTransferStatus(int status)
 {
-	if (call_id_ != INVALID_CALL) 
+	BlabbleAccountPtr p = CheckAndGetParent();
+	if (p) 
 	{
-		if (on_transfer_status_)
-		{
-			BlabbleCallPtr call = get_shared();
-			on_transfer_status_->getHost()->ScheduleOnMainThread(call, boost::bind(&BlabbleCall::CallOnTransferStatus, call, status));
-		}
+		//Intermediate transfer progress is superseded by the next status for this call
+		std::stringstream key;
+		key << "transferStatus:" << id_;
+		p->QueueEvent("transferStatus", on_transfer_status_, 
+			FB::variant_list_of(BlabbleCallWeakPtr(get_shared()))(status), key.str());
 	}
 
 	return false;
@@ -516,5 +792,9 @@ BlabbleAccountPtr BlabbleCall::CheckAndGetParent()
 
 bool BlabbleCall::is_active()
 { 
-	return ((bool)CheckAndGetParent() && pjsua_call_is_active(call_id_)); 
+	if (!CheckAndGetParent())
+		return false;
+
+	pjsip_inv_state s = state();
+	return s != PJSIP_INV_STATE_NULL && s != PJSIP_INV_STATE_DISCONNECTED;
 }
@@ -11,6 +11,7 @@ Copyright 2012 Andrew Ofisher
 #include <sstream>
 #include "JSAPIAuto.h"
 #include "BrowserHost.h"
+#include <boost/thread/mutex.hpp>
 #include <pjlib.h>
 #include <pjlib-util.h>
 #include <pjnath.h>
@@ -20,22 +21,17 @@ Copyright 2012 Andrew Ofisher
 #include <pjsua-lib/pjsua.h>
 #include <pjmedia.h>
 #include <pjmedia-codec.h> 
+#include "BlabbleAtomic.h"
+#include "BlabbleDispatchTable.h"
 
 #ifndef H_BlabbleCallAPI
 #define H_BlabbleCallAPI
 
-#ifdef WIN32
-	#include <Windows.h>
-	#define ATOMIC_INCREMENT(a) InterlockedIncrement(a)
-	#define INTERLOCKED_EXCHANGE(a, b) InterlockedExchange(a, b)
-#else
-	#define ATOMIC_INCREMENT(a) __sync_add_and_fetch(a, 1)
-	#define INTERLOCKED_EXCHANGE(a, b) __sync_lock_test_and_set(a, b)
-#endif
-
 FB_FORWARD_PTR(BlabbleAccount);
 FB_FORWARD_PTR(BlabbleAudioManager);
 FB_FORWARD_PTR(BlabbleCall);
+FB_FORWARD_PTR(BlabbleConference);
+FB_FORWARD_PTR(BlabbleRecording);
 
 #define INVALID_CALL -1
 
@@ -51,12 +47,18 @@ enum CallState
 	CALL_ERROR_DISCONNECTED = 6 //603
 };
 
-class BlabbleCall : public FB::JSAPIAuto
+class BlabbleCall : public BlabbleJSAPIAuto<BlabbleCall>
 {
 	public:
 		BlabbleCall(const BlabbleAccountPtr& parent_account);
 		virtual ~BlabbleCall(void);
 
+		/*! @Brief Create a call in memory taken from a pool shared by all calls.
+		 *  A burst of INVITEs then reuses the blocks freed by earlier calls
+		 *  instead of going to the heap for every one.
+		 */
+		static BlabbleCallPtr Create(const BlabbleAccountPtr& parent_account);
+
 		/*! @Brief JavaScript method to answer a ringing call
 		 */
 		bool Answer();
@@ -86,6 +88,50 @@ class BlabbleCall : public FB::JSAPIAuto
 		 */
 		bool Transfer(const FB::VariantMap &params);
 
+		/*! @Brief JavaScript method to receive media statistics every interval milliseconds.
+		 *  callback is called with an array of objects with "call", "jitter", "rtt"
+		 *  (both in ms), "loss" (percent since the last update), "rxKbps", "txKbps",
+		 *  "rxPackets", "rxLost" and "txPackets" properties. Calls subscribed with
+		 *  the same callback are reported together in one array.
+		 */
+		void SubscribeStats(int interval, const FB::JSObjectPtr& callback);
+
+		/*! @Brief JavaScript method to stop the updates started by SubscribeStats.
+		 */
+		void UnsubscribeStats();
+
+		/*! @Brief JavaScript method to record the call to the WAV file name in
+		 *  the plugin's recording directory, see BlabbleRecorder::Start.
+		 *  Set options.stereo to put the local side on the left channel and
+		 *  the remote side on the right, otherwise both are mixed. Recording
+		 *  stops when the call ends. Returns the file name used, or null if
+		 *  the call is gone. Throws if the file cannot be created.
+		 */
+		FB::variant StartRecording(const std::string& name, const boost::optional<FB::VariantMap>& options);
+
+		/*! @Brief JavaScript method to stop recording. Returns the final recording statistics.
+		 */
+		FB::variant StopRecording();
+
+		/*! @Brief JavaScript property with the statistics of the current or last recording, or null.
+		 *  @sa BlabbleRecording::stats
+		 */
+		FB::variant recording();
+
+		/*! @Brief JavaScript method to give the call its own jitter buffer bounds.
+		 *  options may hold "init", "minPrefetch", "maxPrefetch" and "max" in
+		 *  milliseconds, -1 or left out for the media profile's value. Set
+		 *  options.auto to have the bounds follow the jitter the call sees.
+		 *  The bounds apply when the stream is next created, or now with
+		 *  options.renegotiate, which sends a re-INVITE.
+		 */
+		bool SetJitterBuffer(const FB::VariantMap& options);
+
+		/*! @Brief JavaScript property with the call's jitter buffer statistics and bounds.
+		 *  @sa BlabbleJitterControl::State
+		 */
+		FB::VariantMap jitter_buffer();
+
 		/*! @Brief JavaScript property to expose the incoming caller id
 		 */
 		std::string caller_id();
@@ -130,6 +176,35 @@ class BlabbleCall : public FB::JSAPIAuto
 		 */
 		std::string destination() const { return destination_; }
 
+		/*! @Brief Refresh the cached PJSIP call info and copy it into info.
+		 *  Called once per PJSIP callback. Everything else reads the cached
+		 *  copy so it does not have to take the PJSUA lock.
+		 */
+		bool RefreshInfo(pjsua_call_id call_id, pjsua_call_info &info);
+
+		/*! @Brief Copy the cached PJSIP call info into info.
+		 *  The connect duration is advanced to the time of the read.
+		 *  Returns the version of the snapshot, or 0 if there is none yet.
+		 */
+		unsigned int GetInfo(pjsua_call_info &info);
+
+		/*! @Brief The version of the cached call info. Incremented on each refresh.
+		 */
+		unsigned int info_version() const { return info_version_; }
+
+		/*! @Brief Account change version of the last change to state, caller id or media status.
+		 *  @sa BlabbleAccount::GetChanges
+		 */
+		long changed_version() const { return changed_version_; }
+
+		/*! @Brief The invite session state from the cached call info.
+		 */
+		pjsip_inv_state state();
+
+		/*! @Brief The media status from the cached call info.
+		 */
+		pjsua_call_media_status media_status();
+
 		/*! @Brief Called by BlabbleAccount when PJSIP notifies us of a change in the media state.
 		 */
 		void OnCallMediaState();
@@ -150,6 +225,14 @@ class BlabbleCall : public FB::JSAPIAuto
 		 */
 		bool RegisterIncomingCall(pjsua_call_id callId);  
 		
+		/*! @Brief The conference this call is mixed into, if any.
+		 */
+		BlabbleConferencePtr conference();
+
+		/*! @Brief Called by BlabbleConference when this call joins or leaves it.
+		 */
+		void set_conference(const BlabbleConferencePtr& conference);
+
 		/*! @Brief A globally unique id for this call. 
 		 *
 		 *  Used to identify a call between accounts and even after it has been
@@ -164,8 +247,16 @@ class BlabbleCall : public FB::JSAPIAuto
 		pjsua_acc_id acct_id_;
 		bool ringing_;
 
+		boost::mutex info_mutex_;
+		pjsua_call_info info_;
+		pj_time_val info_time_;
+		volatile unsigned int info_version_;
+		volatile long changed_version_;
+
 		BlabbleAudioManagerPtr audio_manager_;
 		BlabbleAccountWeakPtr parent_;
+		BlabbleConferenceWeakPtr conference_; //!< Guarded by info_mutex_
+		BlabbleRecordingPtr recording_; //!< Guarded by info_mutex_
   
 		FB::JSObjectPtr on_call_connected_;
 		FB::JSObjectPtr on_call_ringing_;
@@ -179,15 +270,17 @@ class BlabbleCall : public FB::JSAPIAuto
 		BlabbleAccountPtr CheckAndGetParent();
 		//Ended by system
 		void RemoteEnd(const pjsua_call_info &info);
+		//Have the memory monitor check call_id's pools went back to the factory
+		void WatchPools(const BlabbleAccountPtr& p, pjsua_call_id call_id);
 		BlabbleCallPtr get_shared() { return boost::static_pointer_cast<BlabbleCall>(this->shared_from_this()); }
 		
 	private:
 		static unsigned int id_counter_;
 		static unsigned int GetNextId();
 
-		void CallOnCallEnd();
-		void CallOnCallEnd(pjsip_status_code status);
-		void CallOnTransferStatus(int status);
+		/*! @Brief JavaScript methods and properties, built once for every call.
+		 */
+		static const BlabbleDispatchTable<BlabbleCall> dispatch_table_;
 };
 
 #endif //H_BlabbleCallAPI
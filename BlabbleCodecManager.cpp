@@ -0,0 +1,491 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "variant_list.h"
+#include "BlabbleCodecManager.h"
+#include "BlabbleEventQueue.h"
+#include "BlabbleLogging.h"
+
+/*! @Brief Frames of test signal, repeated for longer runs.
+ */
+#define SIGNAL_FRAMES 50
+
+static std::string Trim(const std::string& s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string::npos)
+		return "";
+	return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+/*! @Brief A codec in auto mode, ordered affordable first, then by priority or cost.
+ */
+struct RankedCodec
+{
+	std::string id;
+	unsigned int priority;
+	bool affordable;
+	bool measured;
+	double cpu;
+
+	bool operator<(const RankedCodec& other) const
+	{
+		if (affordable != other.affordable)
+			return affordable;
+		if (affordable)
+			return priority > other.priority;
+		if (measured != other.measured)
+			return measured;
+		return cpu < other.cpu;
+	}
+};
+
+BlabbleCodecManager::BlabbleCodecManager() :
+	pool_(NULL), thread_(NULL), stopping_(false)
+{
+}
+
+BlabbleCodecManager::~BlabbleCodecManager()
+{
+}
+
+void BlabbleCodecManager::Start(const std::string& spec)
+{
+	pool_ = pjsua_pool_create("codecs", 512, 512);
+	if (pool_ == NULL)
+		throw std::runtime_error("Ran out of memory creating pool!");
+
+	pj_status_t status = pj_thread_create(pool_, "codecs", &BlabbleCodecManager::Run,
+		this, 0, 0, &thread_);
+	if (status != PJ_SUCCESS)
+	{
+		thread_ = NULL;
+		BLABBLE_LOG_ERROR("BlabbleCodecManager::Start unable to create thread, got status: " << status);
+	}
+
+	std::string rest = Trim(spec);
+	if (rest == "auto" || rest.compare(0, 5, "auto=") == 0)
+	{
+		double budget = BLABBLE_CODEC_AUTO_BUDGET;
+		if (rest.size() > 5)
+		{
+			char* end = NULL;
+			std::string value = Trim(rest.substr(5));
+			budget = std::strtod(value.c_str(), &end);
+			if (value.empty() || *end != '\0' || budget <= 0)
+				throw std::runtime_error("Invalid budget in codec option " + rest);
+		}
+
+		Job job;
+		job.automatic = true;
+		job.frames = 0;
+		job.budget = budget;
+		Queue(job);
+		return;
+	}
+
+	while (!rest.empty())
+	{
+		size_t comma = rest.find(',');
+		std::string entry = Trim(rest.substr(0, comma));
+		rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+		if (entry.empty())
+			continue;
+
+		size_t eq = entry.find('=');
+		if (eq == std::string::npos)
+			throw std::runtime_error("Invalid codec option " + entry);
+
+		char* end = NULL;
+		std::string id = Trim(entry.substr(0, eq)), value = Trim(entry.substr(eq + 1));
+		long priority = std::strtol(value.c_str(), &end, 10);
+		if (id.empty() || value.empty() || *end != '\0' || priority < 0 || priority > 255)
+			throw std::runtime_error("Invalid priority in codec option " + entry);
+
+		if (!SetPriority(id, (int)priority))
+			BLABBLE_LOG_WARN("BlabbleCodecManager no codec matches " << id.c_str() << ".");
+	}
+}
+
+void BlabbleCodecManager::Shutdown()
+{
+	{
+		boost::mutex::scoped_lock lock(jobs_mutex_);
+		stopping_ = true;
+		jobs_.clear();
+	}
+	jobs_cond_.notify_one();
+
+	if (thread_ != NULL)
+	{
+		pj_thread_join(thread_);
+		pj_thread_destroy(thread_);
+		thread_ = NULL;
+	}
+	if (pool_ != NULL)
+	{
+		pj_pool_release(pool_);
+		pool_ = NULL;
+	}
+}
+
+void BlabbleCodecManager::BenchmarkAsync(unsigned int frames, const BlabbleEventQueuePtr& queue,
+	const FB::JSObjectPtr& callback)
+{
+	Job job;
+	job.automatic = false;
+	job.frames = frames;
+	job.budget = 0;
+	job.queue = queue;
+	job.callback = callback;
+	Queue(job);
+}
+
+void BlabbleCodecManager::AutoAsync(double budget, const BlabbleEventQueuePtr& queue,
+	const FB::JSObjectPtr& callback)
+{
+	Job job;
+	job.automatic = true;
+	job.frames = 0;
+	job.budget = budget;
+	job.queue = queue;
+	job.callback = callback;
+	Queue(job);
+}
+
+void BlabbleCodecManager::Queue(const Job& job)
+{
+	{
+		boost::mutex::scoped_lock lock(jobs_mutex_);
+		if (stopping_)
+			return;
+		if (thread_ != NULL)
+		{
+			jobs_.push_back(job);
+			jobs_cond_.notify_one();
+			return;
+		}
+	}
+
+	//Without a thread the caller has to wait, but still gets its result
+	RunJob(job);
+}
+
+void BlabbleCodecManager::RunJob(const Job& job)
+{
+	FB::VariantList result;
+	if (job.automatic)
+	{
+		Auto(job.budget);
+		result = codecs();
+	}
+	else
+	{
+		std::vector<BlabbleCodecCost> costs = Benchmark(job.frames);
+		for (size_t i = 0; i < costs.size(); i++)
+			result.push_back(ToVariant(costs[i]));
+	}
+
+	BlabbleEventQueuePtr queue = job.queue.lock();
+	if (queue && !stopping_)
+	{
+		queue->Post(BlabbleEvent(job.automatic ? "codecPriority" : "codecBenchmark", job.callback,
+			FB::variant_list_of(result)));
+	}
+}
+
+//Static
+int BlabbleCodecManager::Run(void* arg)
+{
+	BlabbleCodecManager *manager = static_cast<BlabbleCodecManager*>(arg);
+	boost::mutex::scoped_lock lock(manager->jobs_mutex_);
+	while (!manager->stopping_)
+	{
+		if (manager->jobs_.empty())
+		{
+			manager->jobs_cond_.wait(lock);
+			continue;
+		}
+
+		Job job = manager->jobs_.front();
+		manager->jobs_.pop_front();
+		lock.unlock();
+		manager->RunJob(job);
+		lock.lock();
+	}
+	return 0;
+}
+
+bool BlabbleCodecManager::SetPriority(const std::string& id, int priority)
+{
+	if (priority < 0 || priority > 255)
+		return false;
+
+	pj_str_t codec_id = pj_str(const_cast<char*>(id.c_str()));
+	return pjsua_codec_set_priority(&codec_id, (pj_uint8_t)priority) == PJ_SUCCESS;
+}
+
+std::vector<BlabbleCodecCost> BlabbleCodecManager::Benchmark(unsigned int frames, unsigned int runs)
+{
+	if (frames == 0)
+		frames = BLABBLE_CODEC_BENCH_FRAMES;
+	else if (frames > BLABBLE_CODEC_BENCH_MAX_FRAMES)
+		frames = BLABBLE_CODEC_BENCH_MAX_FRAMES;
+	if (runs == 0)
+		runs = 1;
+
+	std::vector<BlabbleCodecCost> costs;
+	pjmedia_codec_mgr* mgr = pjmedia_endpt_get_codec_mgr(pjsua_get_pjmedia_endpt());
+	pjmedia_codec_info info[PJMEDIA_CODEC_MGR_MAX_CODECS];
+	unsigned int prio[PJMEDIA_CODEC_MGR_MAX_CODECS];
+	unsigned int count = PJMEDIA_CODEC_MGR_MAX_CODECS;
+	if (!mgr || pjmedia_codec_mgr_enum_codecs(mgr, &count, info, prio) != PJ_SUCCESS)
+		return costs;
+
+	pj_pool_t* pool = pjsua_pool_create("codecbench", 4096, 4096);
+	if (!pool)
+		return costs;
+
+	for (unsigned int i = 0; i < count && !stopping_; i++)
+	{
+		BlabbleCodecCost cost;
+		char id[64];
+		cost.id = pjmedia_codec_info_to_id(&info[i], id, sizeof(id));
+		for (unsigned int run = 0; run < runs && !stopping_; run++)
+		{
+			BlabbleCodecCost attempt;
+			attempt.id = cost.id;
+			Measure(mgr, info[i], frames, pool, attempt);
+			if (run == 0 || (attempt.ok && (!cost.ok || attempt.cpu < cost.cpu)))
+				cost = attempt;
+		}
+		costs.push_back(cost);
+
+		BLABBLE_LOG_DEBUG("BlabbleCodecManager " << cost.id.c_str() << ": encode " << cost.encode_usec <<
+			"us, decode " << cost.decode_usec << "us per frame, " << cost.cpu << "% cpu.");
+	}
+	pj_pool_release(pool);
+
+	boost::mutex::scoped_lock lock(mutex_);
+	for (size_t i = 0; i < costs.size(); i++)
+		costs_[costs[i].id] = costs[i];
+
+	return costs;
+}
+
+//Static
+void BlabbleCodecManager::Measure(pjmedia_codec_mgr* mgr, const pjmedia_codec_info& info, unsigned int frames,
+	pj_pool_t* pool, BlabbleCodecCost& cost)
+{
+	pjmedia_codec_param param;
+	if (pjmedia_codec_mgr_get_default_param(mgr, &info, &param) != PJ_SUCCESS)
+		return;
+
+	//One frame per packet, and code every frame, silence or not
+	param.setting.frm_per_pkt = 1;
+	param.setting.vad = 0;
+	param.setting.plc = 0;
+
+	cost.clock_rate = param.info.clock_rate;
+	cost.channels = param.info.channel_cnt;
+	cost.ptime = param.info.frm_ptime;
+	cost.bitrate = param.info.avg_bps;
+
+	unsigned int samples = param.info.clock_rate * param.info.frm_ptime / 1000 * param.info.channel_cnt;
+	if (samples == 0)
+		return;
+
+	pjmedia_codec* codec = NULL;
+	if (pjmedia_codec_mgr_alloc_codec(mgr, &info, &codec) != PJ_SUCCESS)
+		return;
+
+	if (pjmedia_codec_init(codec, pool) != PJ_SUCCESS || pjmedia_codec_open(codec, &param) != PJ_SUCCESS)
+	{
+		pjmedia_codec_mgr_dealloc_codec(mgr, codec);
+		return;
+	}
+
+	//Three tones under a syllable-rate envelope with some noise, so codecs
+	//that model speech do about as much work as they would on a voice
+	std::vector<pj_int16_t> signal(samples * SIGNAL_FRAMES);
+	const double pi = 3.14159265358979;
+	for (size_t n = 0; n < signal.size(); n++)
+	{
+		double t = (double)(n / param.info.channel_cnt) / param.info.clock_rate;
+		double envelope = 0.6 + 0.4 * std::sin(2 * pi * 4 * t);
+		double value = 0.5 * std::sin(2 * pi * 220 * t) + 0.3 * std::sin(2 * pi * 670 * t) +
+			0.15 * std::sin(2 * pi * 1850 * t) + 0.05 * ((double)(std::rand() % 2001) / 1000.0 - 1.0);
+		signal[n] = (pj_int16_t)(envelope * value * 12000);
+	}
+
+	std::vector<pj_int16_t> decoded(samples);
+	std::vector<pj_uint8_t> encoded(samples * sizeof(pj_int16_t) + 64);
+	pj_uint64_t encode_total = 0, decode_total = 0;
+	unsigned int decoded_frames = 0;
+
+	for (unsigned int f = 0; f < frames; f++)
+	{
+		pjmedia_frame in, out;
+		pj_bzero(&in, sizeof(in));
+		pj_bzero(&out, sizeof(out));
+		in.type = PJMEDIA_FRAME_TYPE_AUDIO;
+		in.buf = &signal[(f % SIGNAL_FRAMES) * samples];
+		in.size = samples * sizeof(pj_int16_t);
+		in.timestamp.u64 = (pj_uint64_t)f * samples;
+		out.buf = &encoded[0];
+
+		pj_timestamp start, end;
+		pj_get_timestamp(&start);
+		pj_status_t status = pjmedia_codec_encode(codec, &in, (unsigned)encoded.size(), &out);
+		pj_get_timestamp(&end);
+		if (status != PJ_SUCCESS)
+			break;
+
+		pj_uint32_t usec = pj_elapsed_usec(&start, &end);
+		encode_total += usec;
+		cost.frames++;
+		if (usec > cost.max_encode_usec)
+			cost.max_encode_usec = usec;
+
+		if (out.size == 0)
+			continue;
+
+		//Parse is part of receiving a packet, so it counts as decoding
+		pjmedia_frame parsed[8];
+		unsigned int parsed_count = sizeof(parsed) / sizeof(parsed[0]);
+		pj_get_timestamp(&start);
+		status = pjmedia_codec_parse(codec, out.buf, out.size, &in.timestamp, &parsed_count, parsed);
+		for (unsigned int p = 0; status == PJ_SUCCESS && p < parsed_count; p++)
+		{
+			pjmedia_frame pcm;
+			pj_bzero(&pcm, sizeof(pcm));
+			pcm.buf = &decoded[0];
+			status = pjmedia_codec_decode(codec, &parsed[p], (unsigned)(decoded.size() * sizeof(pj_int16_t)), &pcm);
+		}
+		pj_get_timestamp(&end);
+		if (status != PJ_SUCCESS)
+			break;
+
+		usec = pj_elapsed_usec(&start, &end);
+		decode_total += usec;
+		decoded_frames++;
+		if (usec > cost.max_decode_usec)
+			cost.max_decode_usec = usec;
+	}
+
+	pjmedia_codec_close(codec);
+	pjmedia_codec_mgr_dealloc_codec(mgr, codec);
+
+	if (cost.frames == 0)
+		return;
+
+	cost.encode_usec = (double)encode_total / cost.frames;
+	cost.decode_usec = decoded_frames ? (double)decode_total / decoded_frames : 0;
+	cost.cpu = (cost.encode_usec + cost.decode_usec) / (param.info.frm_ptime * 1000.0) * 100.0;
+	cost.ok = true;
+}
+
+void BlabbleCodecManager::Auto(double budget)
+{
+	bool measured;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		measured = !costs_.empty();
+	}
+	if (!measured)
+		Benchmark(BLABBLE_CODEC_BENCH_FRAMES, BLABBLE_CODEC_AUTO_RUNS);
+	if (stopping_)
+		return;
+
+	pjsua_codec_info info[PJMEDIA_CODEC_MGR_MAX_CODECS];
+	unsigned int count = PJMEDIA_CODEC_MGR_MAX_CODECS;
+	if (pjsua_enum_codecs(info, &count) != PJ_SUCCESS)
+		return;
+
+	std::vector<RankedCodec> ranked;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			//Leave disabled codecs alone
+			if (info[i].priority == 0)
+				continue;
+
+			RankedCodec codec;
+			codec.id = std::string(info[i].codec_id.ptr, info[i].codec_id.slen);
+			codec.priority = info[i].priority;
+			std::map<std::string, BlabbleCodecCost>::const_iterator cost = costs_.find(codec.id);
+			codec.measured = cost != costs_.end() && cost->second.ok;
+			codec.cpu = codec.measured ? cost->second.cpu : 0;
+			codec.affordable = codec.measured && codec.cpu <= budget;
+			ranked.push_back(codec);
+		}
+	}
+
+	std::stable_sort(ranked.begin(), ranked.end());
+
+	//Affordable codecs above the PJSUA default of 128, the rest below it
+	int affordable = PJMEDIA_CODEC_PRIO_HIGHEST, expensive = PJMEDIA_CODEC_PRIO_NORMAL - 1;
+	for (size_t i = 0; i < ranked.size(); i++)
+	{
+		int priority = ranked[i].affordable ? affordable-- : expensive--;
+		if (priority < 1)
+			priority = 1;
+		SetPriority(ranked[i].id, priority);
+		BLABBLE_LOG_DEBUG("BlabbleCodecManager auto " << ranked[i].id.c_str() << " priority " << priority <<
+			(ranked[i].affordable ? "" : ", over budget") << ".");
+	}
+}
+
+FB::VariantList BlabbleCodecManager::codecs()
+{
+	FB::VariantList list;
+	pjsua_codec_info info[PJMEDIA_CODEC_MGR_MAX_CODECS];
+	unsigned int count = PJMEDIA_CODEC_MGR_MAX_CODECS;
+	if (pjsua_enum_codecs(info, &count) != PJ_SUCCESS)
+		return list;
+
+	boost::mutex::scoped_lock lock(mutex_);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		FB::VariantMap codec;
+		std::string id(info[i].codec_id.ptr, info[i].codec_id.slen);
+		codec["id"] = id;
+		codec["priority"] = (int)info[i].priority;
+
+		std::map<std::string, BlabbleCodecCost>::const_iterator cost = costs_.find(id);
+		if (cost != costs_.end())
+			codec["cost"] = ToVariant(cost->second);
+		list.push_back(codec);
+	}
+	return list;
+}
+
+//Static
+FB::VariantMap BlabbleCodecManager::ToVariant(const BlabbleCodecCost& cost)
+{
+	FB::VariantMap map;
+	map["id"] = cost.id;
+	map["clockRate"] = (long)cost.clock_rate;
+	map["channels"] = (long)cost.channels;
+	map["ptime"] = (long)cost.ptime;
+	map["bitrate"] = (long)cost.bitrate;
+	map["frames"] = (long)cost.frames;
+	map["encodeUsec"] = cost.encode_usec;
+	map["decodeUsec"] = cost.decode_usec;
+	map["maxEncodeUsec"] = (long)cost.max_encode_usec;
+	map["maxDecodeUsec"] = (long)cost.max_decode_usec;
+	map["cpu"] = cost.cpu;
+	map["ok"] = cost.ok;
+	return map;
+}
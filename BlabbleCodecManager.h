@@ -0,0 +1,187 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleCodecManager
+#define H_BlabbleCodecManager
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include "JSAPIAuto.h"
+#include "JSObject.h"
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <pjlib.h>
+#include <pjmedia.h>
+#include <pjsua-lib/pjsua.h>
+
+FB_FORWARD_PTR(BlabbleEventQueue)
+
+/*! @Brief Frames each codec encodes and decodes when no count is given.
+ *  250 frames is 5 seconds of audio at the usual 20ms.
+ */
+#ifndef BLABBLE_CODEC_BENCH_FRAMES
+#define BLABBLE_CODEC_BENCH_FRAMES 250
+#endif
+
+/*! @Brief Most frames a benchmark may be asked for.
+ */
+#ifndef BLABBLE_CODEC_BENCH_MAX_FRAMES
+#define BLABBLE_CODEC_BENCH_MAX_FRAMES 5000
+#endif
+
+/*! @Brief Benchmark runs auto mode keeps the fastest of when it measures on its own.
+ */
+#ifndef BLABBLE_CODEC_AUTO_RUNS
+#define BLABBLE_CODEC_AUTO_RUNS 3
+#endif
+
+/*! @Brief Share of one CPU core a call may spend coding audio in auto mode, in percent.
+ */
+#ifndef BLABBLE_CODEC_AUTO_BUDGET
+#define BLABBLE_CODEC_AUTO_BUDGET 2.0
+#endif
+
+/*! @Brief What one codec costs on this machine.
+ */
+struct BlabbleCodecCost
+{
+	BlabbleCodecCost() : clock_rate(0), channels(0), ptime(0), bitrate(0), frames(0),
+		encode_usec(0), decode_usec(0), max_encode_usec(0), max_decode_usec(0), cpu(0), ok(false) { }
+
+	std::string id;					//!< PJMEDIA codec id, e.g. "speex/16000/1"
+	unsigned int clock_rate;
+	unsigned int channels;
+	unsigned int ptime;				//!< Frame length in milliseconds
+	unsigned int bitrate;			//!< Average bits per second
+	unsigned int frames;			//!< Frames encoded and decoded
+	double encode_usec;				//!< Mean time to encode one frame
+	double decode_usec;				//!< Mean time to decode one frame
+	unsigned long max_encode_usec;
+	unsigned long max_decode_usec;
+	double cpu;						//!< Encode and decode time per second of audio, in percent of one core
+	bool ok;						//!< False if the codec could not be opened
+};
+
+/*! @class  BlabbleCodecManager
+ *
+ *  @brief  Lists codecs, sets their priorities and measures what they cost.
+ *
+ *  Benchmark opens every codec PJMEDIA was built with and times the
+ *  encoding and decoding of a synthetic voice-like signal one frame at a
+ *  time on the calling thread. BenchmarkAsync and AutoAsync do the same
+ *  on the manager's own thread, one request after another, and post the
+ *  result as an event, so JavaScript is never held up by a benchmark.
+ *  In auto mode codecs whose measured cost
+ *  fits within a CPU budget keep their relative order at the top, and the
+ *  rest follow, cheapest first. Expensive codecs are never disabled, so a
+ *  peer that only offers one of them still gets through.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleCodecManager
+{
+public:
+	BlabbleCodecManager();
+	virtual ~BlabbleCodecManager();
+
+	/*! @Brief Start the codec thread and apply a codec specification.
+	 *  Must be called after pjsua_init.
+	 *
+	 *  The specification is either `auto` or `auto=budget`, which runs
+	 *  Auto with budget in percent on the codec thread so the benchmark
+	 *  does not hold up plugin load, PJSUA's order applies until it is
+	 *  done. Otherwise it is a comma separated list of
+	 *  `codec=priority`, e.g. `speex=0,PCMU=200`, where codec is matched
+	 *  as at pjsua_codec_set_priority and 0 disables the codec. An empty
+	 *  specification keeps PJSUA's order. Throws std::runtime_error on
+	 *  anything it does not understand.
+	 */
+	void Start(const std::string& spec);
+
+	/*! @Brief Stop the codec thread, cutting a running benchmark short, and
+	 *  drop requests not started yet. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief Set the priority of every codec whose id starts with id, 0 to 255.
+	 *  Returns false if no codec matched.
+	 */
+	bool SetPriority(const std::string& id, int priority);
+
+	/*! @Brief Time frames frames of each codec runs times and keep the
+	 *  fastest result of each, so a busy moment on the machine does not
+	 *  make a codec look expensive. Blocks the caller for the whole run.
+	 *  The results are kept for codecs() and Auto.
+	 */
+	std::vector<BlabbleCodecCost> Benchmark(unsigned int frames, unsigned int runs = 1);
+
+	/*! @Brief Rank codecs by cost against budget, in percent of one core.
+	 *  Runs Benchmark with BLABBLE_CODEC_AUTO_RUNS runs first if it has not
+	 *  run yet.
+	 */
+	void Auto(double budget);
+
+	/*! @Brief Run Benchmark with frames on the codec thread and post a
+	 *  "codecBenchmark" event to queue with the array of ToVariant results,
+	 *  invoking callback if set. Returns at once.
+	 */
+	void BenchmarkAsync(unsigned int frames, const BlabbleEventQueuePtr& queue, const FB::JSObjectPtr& callback);
+
+	/*! @Brief Run Auto with budget on the codec thread and post a
+	 *  "codecPriority" event to queue with the new codecs(), invoking
+	 *  callback if set. Returns at once.
+	 */
+	void AutoAsync(double budget, const BlabbleEventQueuePtr& queue, const FB::JSObjectPtr& callback);
+
+	/*! @Brief Array for JavaScript of objects with "id", "priority" and,
+	 *  once benchmarked, "cost" as described at ToVariant.
+	 */
+	FB::VariantList codecs();
+
+	/*! @Brief Object with "id", "clockRate", "channels", "ptime", "bitrate",
+	 *  "frames", "encodeUsec", "decodeUsec", "maxEncodeUsec", "maxDecodeUsec",
+	 *  "cpu" and "ok" properties.
+	 */
+	static FB::VariantMap ToVariant(const BlabbleCodecCost& cost);
+
+private:
+	/*! @Brief Encode and decode frames frames with the codec described by info.
+	 */
+	static void Measure(pjmedia_codec_mgr* mgr, const pjmedia_codec_info& info, unsigned int frames,
+		pj_pool_t* pool, BlabbleCodecCost& cost);
+
+	/*! @Brief A Benchmark or Auto waiting for the codec thread.
+	 */
+	struct Job
+	{
+		bool automatic;			//!< Auto with budget, else Benchmark with frames
+		unsigned int frames;
+		double budget;
+		BlabbleEventQueueWeakPtr queue;	//!< Where the result goes, empty for none
+		FB::JSObjectPtr callback;
+	};
+	typedef std::deque<Job> JobList;
+
+	void Queue(const Job& job);
+	void RunJob(const Job& job);
+	static int Run(void* arg);
+
+	boost::mutex mutex_;
+	std::map<std::string, BlabbleCodecCost> costs_;
+	boost::mutex jobs_mutex_;
+	boost::condition_variable jobs_cond_;
+	JobList jobs_;				//!< Guarded by jobs_mutex_
+	pj_pool_t* pool_;
+	pj_thread_t* thread_;
+	volatile bool stopping_;	//!< Cuts a benchmark short for Shutdown
+};
+
+#endif // H_BlabbleCodecManager
@@ -0,0 +1,262 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include "BlabbleConference.h"
+#include "BlabbleAccount.h"
+#include "BlabbleCall.h"
+#include "BlabbleAtomic.h"
+#include "BlabbleLogging.h"
+
+/*! @Brief Static conference counter used to generate conference ids.
+ */
+unsigned int BlabbleConference::id_counter_ = 0;
+
+BlabbleConference::BlabbleConference(const BlabbleAccountPtr& parent) :
+	destroyed_(false), parent_(parent)
+{
+	id_ = ATOMIC_INCREMENT(&BlabbleConference::id_counter_);
+
+	registerMethod("add", make_method(this, &BlabbleConference::Add));
+	registerMethod("remove", make_method(this, &BlabbleConference::Remove));
+	registerMethod("setGain", make_method(this, &BlabbleConference::SetGain));
+	registerMethod("destroy", make_method(this, &BlabbleConference::Destroy));
+
+	registerProperty("participants", make_property(this, &BlabbleConference::participants));
+	registerProperty("id", make_property(this, &BlabbleConference::id));
+}
+
+BlabbleConference::~BlabbleConference()
+{
+}
+
+void BlabbleConference::Link(pjsua_conf_port_id slot, const SlotList& others, bool connect)
+{
+	for (SlotList::const_iterator it = others.begin(); it != others.end(); it++)
+	{
+		if (connect)
+		{
+			pjsua_conf_connect(slot, *it);
+			pjsua_conf_connect(*it, slot);
+		}
+		else
+		{
+			pjsua_conf_disconnect(slot, *it);
+			pjsua_conf_disconnect(*it, slot);
+		}
+	}
+}
+
+BlabbleConference::SlotList BlabbleConference::OtherSlots(unsigned int call_id)
+{
+	SlotList slots;
+	for (ParticipantMap::iterator it = participants_.begin(); it != participants_.end(); it++)
+	{
+		if (it->first != call_id && it->second.slot != PJSUA_INVALID_ID)
+			slots.push_back(it->second.slot);
+	}
+	return slots;
+}
+
+bool BlabbleConference::Add(const BlabbleCallPtr& call, const boost::optional<double>& gain)
+{
+	if (!call || call->callId() == INVALID_CALL)
+		return false;
+
+	float level = gain ? (float)*gain : 1.0f;
+	if (level < 0.0f)
+		throw FB::script_error("Conference gain may not be negative.");
+
+	BlabbleConferencePtr current = call->conference();
+	if (current && current.get() != this)
+		current->Remove(call);
+
+	pjsua_call_info info;
+	bool active = call->GetInfo(info) && info.media_status == PJSUA_CALL_MEDIA_ACTIVE &&
+		info.conf_slot != PJSUA_INVALID_ID;
+
+	SlotList others;
+	pjsua_conf_port_id slot = PJSUA_INVALID_ID;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (destroyed_)
+			return false;
+
+		Participant &part = participants_[call->id()];
+		part.call = call;
+		part.gain = level;
+		if (active)
+		{
+			part.slot = slot = info.conf_slot;
+			others = OtherSlots(call->id());
+		}
+	}
+
+	call->set_conference(get_shared());
+
+	if (slot != PJSUA_INVALID_ID)
+	{
+		pjsua_conf_adjust_rx_level(slot, level);
+		Link(slot, others, true);
+	}
+
+	return true;
+}
+
+bool BlabbleConference::Remove(const BlabbleCallPtr& call)
+{
+	if (!call)
+		return false;
+
+	SlotList others;
+	pjsua_conf_port_id slot;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		ParticipantMap::iterator it = participants_.find(call->id());
+		if (it == participants_.end())
+			return false;
+
+		slot = it->second.slot;
+		participants_.erase(it);
+		if (slot != PJSUA_INVALID_ID)
+			others = OtherSlots(call->id());
+	}
+
+	BlabbleConferencePtr current = call->conference();
+	if (current.get() == this)
+		call->set_conference(BlabbleConferencePtr());
+
+	if (slot != PJSUA_INVALID_ID)
+	{
+		Link(slot, others, false);
+		pjsua_conf_adjust_rx_level(slot, 1.0f);
+	}
+
+	return true;
+}
+
+bool BlabbleConference::SetGain(const BlabbleCallPtr& call, double gain)
+{
+	if (!call)
+		return false;
+
+	if (gain < 0.0)
+		throw FB::script_error("Conference gain may not be negative.");
+
+	pjsua_conf_port_id slot;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		ParticipantMap::iterator it = participants_.find(call->id());
+		if (it == participants_.end())
+			return false;
+
+		it->second.gain = (float)gain;
+		slot = it->second.slot;
+	}
+
+	//Without active media the gain is applied once the call joins the mix
+	if (slot != PJSUA_INVALID_ID)
+		return pjsua_conf_adjust_rx_level(slot, (float)gain) == PJ_SUCCESS;
+
+	return true;
+}
+
+void BlabbleConference::Destroy()
+{
+	ParticipantMap parts;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (destroyed_)
+			return;
+
+		destroyed_ = true;
+		parts.swap(participants_);
+	}
+
+	SlotList slots;
+	for (ParticipantMap::iterator it = parts.begin(); it != parts.end(); it++)
+	{
+		BlabbleCallPtr call = it->second.call.lock();
+		if (call && call->conference().get() == this)
+			call->set_conference(BlabbleConferencePtr());
+
+		if (it->second.slot != PJSUA_INVALID_ID)
+		{
+			//Each pair is only broken once, from the side added to slots first
+			Link(it->second.slot, slots, false);
+			pjsua_conf_adjust_rx_level(it->second.slot, 1.0f);
+			slots.push_back(it->second.slot);
+		}
+	}
+
+	BlabbleAccountPtr p = parent_.lock();
+	if (p)
+		p->RemoveConference(get_shared());
+}
+
+FB::VariantList BlabbleConference::participants()
+{
+	FB::VariantList list;
+	boost::mutex::scoped_lock lock(mutex_);
+	for (ParticipantMap::iterator it = participants_.begin(); it != participants_.end(); it++)
+	{
+		BlabbleCallPtr call = it->second.call.lock();
+		if (!call)
+			continue;
+
+		FB::VariantMap part;
+		part["call"] = BlabbleCallWeakPtr(call);
+		part["gain"] = (double)it->second.gain;
+		list.push_back(part);
+	}
+	return list;
+}
+
+bool BlabbleConference::get_valid()
+{
+	return !destroyed_ && parent_.lock().get() != NULL;
+}
+
+void BlabbleConference::OnCallMediaState(const BlabbleCallPtr& call, const pjsua_call_info& info)
+{
+	bool active = info.media_status == PJSUA_CALL_MEDIA_ACTIVE &&
+		info.conf_slot != PJSUA_INVALID_ID;
+
+	SlotList others;
+	pjsua_conf_port_id old_slot = PJSUA_INVALID_ID, slot = PJSUA_INVALID_ID;
+	float gain = 1.0f;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		ParticipantMap::iterator it = participants_.find(call->id());
+		if (it == participants_.end())
+			return;
+
+		if (it->second.slot != PJSUA_INVALID_ID && (!active || it->second.slot != info.conf_slot))
+			old_slot = it->second.slot;
+
+		//Reconnect even if the slot is unchanged, a re-INVITE may have rebuilt the port
+		it->second.slot = slot = active ? info.conf_slot : PJSUA_INVALID_ID;
+		gain = it->second.gain;
+		others = OtherSlots(call->id());
+	}
+
+	if (old_slot != PJSUA_INVALID_ID)
+		Link(old_slot, others, false);
+
+	if (slot != PJSUA_INVALID_ID)
+	{
+		pjsua_conf_adjust_rx_level(slot, gain);
+		Link(slot, others, true);
+	}
+}
+
+void BlabbleConference::OnCallEnd(const BlabbleCallPtr& call)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	participants_.erase(call->id());
+}
@@ -0,0 +1,121 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleConference
+#define H_BlabbleConference
+
+#include <map>
+#include <vector>
+#include "JSAPIAuto.h"
+#include <boost/thread/mutex.hpp>
+#include <boost/optional.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+
+FB_FORWARD_PTR(BlabbleAccount)
+FB_FORWARD_PTR(BlabbleCall)
+FB_FORWARD_PTR(BlabbleConference)
+
+/*! @class  BlabbleConference
+ *
+ *  @brief  Mixes several calls together on the local PJSUA conference bridge.
+ *
+ *  Every participant with active media is connected to every other
+ *  participant and, as any call is, to the sound device in slot 0. The
+ *  bridge mixes each listener's sources separately and never feeds a port
+ *  back to itself, so every party hears everyone but themselves (mix-minus)
+ *  without any extra mixing on our side.
+ *
+ *  A participant's gain scales what it sends into the bridge, and so how
+ *  loud it is to everyone else and to the local user. Calls that go on hold
+ *  drop out of the mix and rejoin when their media becomes active again.
+ *
+ *  Bridge connections are made outside of our mutex; the PJSUA calls may
+ *  take PJSIP locks that are already held by the thread that notifies us of
+ *  media changes.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleConference : public FB::JSAPIAuto
+{
+public:
+	BlabbleConference(const BlabbleAccountPtr& parent);
+	virtual ~BlabbleConference();
+
+	/*! @Brief JavaScript method to add a call, optionally with a gain (1.0 is unchanged).
+	 *  A call can only be in one conference and is moved out of any other.
+	 */
+	bool Add(const BlabbleCallPtr& call, const boost::optional<double>& gain);
+
+	/*! @Brief JavaScript method to remove a call.
+	 *  The call keeps talking to the local user.
+	 */
+	bool Remove(const BlabbleCallPtr& call);
+
+	/*! @Brief JavaScript method to change the gain of a participant.
+	 *  0.0 mutes the participant for everyone.
+	 */
+	bool SetGain(const BlabbleCallPtr& call, double gain);
+
+	/*! @Brief JavaScript method to split the conference back into separate calls.
+	 */
+	void Destroy();
+
+	/*! @Brief JavaScript property returning an array of objects with "call" and "gain".
+	 */
+	FB::VariantList participants();
+
+	/*! @Brief Used by JavaScript to determine if the conference object is valid.
+	 */
+	virtual bool get_valid();
+
+	/*! @Brief A unique id for this conference.
+	 */
+	unsigned int id() const { return id_; }
+
+	/*! @Brief Called by BlabbleCall when the media of a participant changes.
+	 */
+	void OnCallMediaState(const BlabbleCallPtr& call, const pjsua_call_info& info);
+
+	/*! @Brief Called by BlabbleAccount when a participant has ended.
+	 *  PJSIP drops the bridge port itself, so only our record is removed.
+	 */
+	void OnCallEnd(const BlabbleCallPtr& call);
+
+private:
+	struct Participant
+	{
+		Participant() : gain(1.0f), slot(PJSUA_INVALID_ID) { }
+		BlabbleCallWeakPtr call;
+		float gain;
+		pjsua_conf_port_id slot; //!< Slot we connected, invalid while media is not active
+	};
+	typedef std::map<unsigned int, Participant> ParticipantMap;
+	typedef std::vector<pjsua_conf_port_id> SlotList;
+
+	/*! @Brief Connect or disconnect slot to and from every slot in others.
+	 */
+	static void Link(pjsua_conf_port_id slot, const SlotList& others, bool connect);
+
+	/*! @Brief Active slots of every participant except call_id. Call with mutex_ held.
+	 */
+	SlotList OtherSlots(unsigned int call_id);
+
+	BlabbleConferencePtr get_shared() { return boost::static_pointer_cast<BlabbleConference>(this->shared_from_this()); }
+
+	unsigned int id_;
+	bool destroyed_;
+	BlabbleAccountWeakPtr parent_;
+	boost::mutex mutex_;
+	ParticipantMap participants_;
+
+	static unsigned int id_counter_;
+};
+
+#endif // H_BlabbleConference
@@ -0,0 +1,103 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleDispatchIndex
+#define H_BlabbleDispatchIndex
+
+#include <vector>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/smart_ptr/make_shared.hpp>
+
+/*! @class  BlabbleDispatchIndex
+ *
+ *  @brief  Fixed size table mapping a PJSIP id (call or account) to the object
+ *          that owns it.
+ *
+ *  PJSIP reuses its call and account ids, so every entry is stamped with a
+ *  generation. A lookup only succeeds if the caller presents the generation
+ *  the entry was bound with, which catches events that arrive for an id after
+ *  it was handed to somebody else. Each slot is published with the boost
+ *  shared_ptr atomic operations so lookups never take a mutex.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+template <class T>
+class BlabbleDispatchIndex
+{
+public:
+	typedef boost::shared_ptr<T> ObjectPtr;
+
+	explicit BlabbleDispatchIndex(unsigned int size) : slots_(size) { }
+
+	/*! @Brief Associate obj with the PJSIP id slot using generation.
+	 *  Any previous entry in the slot is replaced.
+	 */
+	void Bind(int slot, unsigned int generation, const ObjectPtr& obj)
+	{
+		if (!InRange(slot))
+			return;
+
+		EntryPtr entry = boost::make_shared<Entry>(generation, obj);
+		boost::atomic_store(&slots_[slot], EntryPtr(entry));
+	}
+
+	/*! @Brief Clear slot, but only if it is still bound with generation.
+	 */
+	void Unbind(int slot, unsigned int generation)
+	{
+		if (!InRange(slot))
+			return;
+
+		EntryPtr current = boost::atomic_load(&slots_[slot]);
+		while (current && current->generation == generation)
+		{
+			if (boost::atomic_compare_exchange(&slots_[slot], &current, EntryPtr()))
+				break;
+		}
+	}
+
+	/*! @Brief Return the object bound to slot with generation, or an empty pointer.
+	 */
+	ObjectPtr Find(int slot, unsigned int generation) const
+	{
+		if (!InRange(slot))
+			return ObjectPtr();
+
+		EntryPtr entry = boost::atomic_load(&slots_[slot]);
+		if (entry && entry->generation == generation)
+			return entry->object;
+
+		return ObjectPtr();
+	}
+
+	/*! @Brief Drop every entry.
+	 */
+	void Clear()
+	{
+		for (size_t i = 0; i < slots_.size(); i++)
+		{
+			boost::atomic_store(&slots_[i], EntryPtr());
+		}
+	}
+
+private:
+	struct Entry
+	{
+		Entry(unsigned int g, const ObjectPtr& o) : generation(g), object(o) { }
+		const unsigned int generation;
+		const ObjectPtr object;
+	};
+	typedef boost::shared_ptr<const Entry> EntryPtr;
+
+	bool InRange(int slot) const { return slot >= 0 && (size_t)slot < slots_.size(); }
+
+	std::vector<EntryPtr> slots_;
+};
+
+#endif // H_BlabbleDispatchIndex
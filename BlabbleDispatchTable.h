@@ -0,0 +1,226 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleDispatchTable
+#define H_BlabbleDispatchTable
+
+#include <string>
+#include <vector>
+#include <map>
+#include "JSAPIAuto.h"
+#include "FBWriteOnlyProperty.h"
+#include <boost/function.hpp>
+
+/*! @class  BlabbleDispatchTable
+ *
+ *  @brief  JavaScript methods and properties of a class, shared by all of its objects.
+ *
+ *  registerMethod and registerProperty bind a functor to one object and
+ *  insert it into that object's own maps, which for a call happens on the
+ *  PJSIP thread handling the INVITE. A table instead stores, once per
+ *  class, functors that take the object as their first argument. It is
+ *  built during static initialization and only read afterwards, so it is
+ *  shared between threads without a lock.
+ *
+ *  The FireBreath argument conversion is bound to the object when a member
+ *  is actually used from JavaScript, which is rare next to creating objects.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+template <class T>
+class BlabbleDispatchTable
+{
+public:
+	typedef boost::function<FB::variant (T*, const FB::VariantList&)> MethodFunctor;
+	typedef boost::function<FB::variant (T*)> GetterFunctor;
+	typedef boost::function<void (T*, const FB::variant&)> SetterFunctor;
+
+	/*! @Brief Add a method, F is any member function FB::make_method accepts.
+	 */
+	template <class F>
+	BlabbleDispatchTable& Method(const std::string& name, F f)
+	{
+		methods_[name] = MethodThunk<F>(f);
+		return *this;
+	}
+
+	/*! @Brief Add a read only property, F is any getter FB::make_property accepts.
+	 */
+	template <class F>
+	BlabbleDispatchTable& Property(const std::string& name, F f)
+	{
+		accessors_[name].get = GetterThunk<F>(f);
+		return *this;
+	}
+
+	/*! @Brief Add a write only property, F is any setter FB::make_write_only_property accepts.
+	 */
+	template <class F>
+	BlabbleDispatchTable& WriteOnlyProperty(const std::string& name, F f)
+	{
+		accessors_[name].set = SetterThunk<F>(f);
+		return *this;
+	}
+
+	const MethodFunctor* FindMethod(const std::string& name) const
+	{
+		typename MethodMap::const_iterator it = methods_.find(name);
+		return it == methods_.end() ? NULL : &it->second;
+	}
+
+	bool HasProperty(const std::string& name) const
+	{
+		return accessors_.find(name) != accessors_.end();
+	}
+
+	/*! @Brief Read property name of obj. Returns false if the table does not have it.
+	 *  Write only properties throw FB::script_error.
+	 */
+	bool Get(T* obj, const std::string& name, FB::variant& value) const
+	{
+		typename AccessorMap::const_iterator it = accessors_.find(name);
+		if (it == accessors_.end())
+			return false;
+		if (!it->second.get)
+			throw FB::script_error("Access denied.");
+		value = it->second.get(obj);
+		return true;
+	}
+
+	/*! @Brief Write property name of obj. Returns false if the table does not have it.
+	 *  Read only properties throw FB::script_error.
+	 */
+	bool Set(T* obj, const std::string& name, const FB::variant& value) const
+	{
+		typename AccessorMap::const_iterator it = accessors_.find(name);
+		if (it == accessors_.end())
+			return false;
+		if (!it->second.set)
+			throw FB::script_error("Property is read only.");
+		it->second.set(obj, value);
+		return true;
+	}
+
+	void GetNames(std::vector<std::string>& names) const
+	{
+		for (typename MethodMap::const_iterator it = methods_.begin(); it != methods_.end(); it++)
+			names.push_back(it->first);
+		for (typename AccessorMap::const_iterator it = accessors_.begin(); it != accessors_.end(); it++)
+			names.push_back(it->first);
+	}
+
+	size_t size() const { return methods_.size() + accessors_.size(); }
+
+private:
+	struct Accessors
+	{
+		GetterFunctor get;
+		SetterFunctor set;
+	};
+	typedef std::map<std::string, MethodFunctor> MethodMap;
+	typedef std::map<std::string, Accessors> AccessorMap;
+
+	template <class F>
+	struct MethodThunk
+	{
+		MethodThunk(F f) : f_(f) { }
+		FB::variant operator()(T* obj, const FB::VariantList& args) const { return FB::make_method(obj, f_)(args); }
+		F f_;
+	};
+
+	template <class F>
+	struct GetterThunk
+	{
+		GetterThunk(F f) : f_(f) { }
+		FB::variant operator()(T* obj) const { return FB::make_property(obj, f_).get(); }
+		F f_;
+	};
+
+	template <class F>
+	struct SetterThunk
+	{
+		SetterThunk(F f) : f_(f) { }
+		void operator()(T* obj, const FB::variant& value) const { FB::make_write_only_property(obj, f_).set(value); }
+		F f_;
+	};
+
+	MethodMap methods_;
+	AccessorMap accessors_;
+};
+
+/*! @class  BlabbleJSAPIAuto
+ *
+ *  @brief  FB::JSAPIAuto that looks members up in a shared BlabbleDispatchTable first.
+ *
+ *  T derives from BlabbleJSAPIAuto<T> and passes its table to the
+ *  constructor. Anything not in the table, such as the "valid" property
+ *  JSAPIAuto registers itself, is handled by JSAPIAuto as before.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+template <class T>
+class BlabbleJSAPIAuto : public FB::JSAPIAuto
+{
+public:
+	using FB::JSAPIAuto::HasMethod;
+	using FB::JSAPIAuto::HasProperty;
+	using FB::JSAPIAuto::GetProperty;
+	using FB::JSAPIAuto::SetProperty;
+
+	virtual bool HasMethod(const std::string& methodName) const
+	{
+		return table_.FindMethod(methodName) || FB::JSAPIAuto::HasMethod(methodName);
+	}
+
+	virtual bool HasProperty(const std::string& propertyName) const
+	{
+		return table_.HasProperty(propertyName) || FB::JSAPIAuto::HasProperty(propertyName);
+	}
+
+	virtual FB::variant GetProperty(const std::string& propertyName)
+	{
+		FB::variant value;
+		if (table_.Get(static_cast<T*>(this), propertyName, value))
+			return value;
+		return FB::JSAPIAuto::GetProperty(propertyName);
+	}
+
+	virtual void SetProperty(const std::string& propertyName, const FB::variant& value)
+	{
+		if (!table_.Set(static_cast<T*>(this), propertyName, value))
+			FB::JSAPIAuto::SetProperty(propertyName, value);
+	}
+
+	virtual FB::variant Invoke(const std::string& methodName, const FB::VariantList& args)
+	{
+		const typename BlabbleDispatchTable<T>::MethodFunctor* method = table_.FindMethod(methodName);
+		if (method)
+			return (*method)(static_cast<T*>(this), args);
+		return FB::JSAPIAuto::Invoke(methodName, args);
+	}
+
+	virtual void getMemberNames(std::vector<std::string> &nameVector) const
+	{
+		FB::JSAPIAuto::getMemberNames(nameVector);
+		table_.GetNames(nameVector);
+	}
+
+	virtual size_t getMemberCount() const
+	{
+		return FB::JSAPIAuto::getMemberCount() + table_.size();
+	}
+
+protected:
+	explicit BlabbleJSAPIAuto(const BlabbleDispatchTable<T>& table) : table_(table) { }
+
+private:
+	const BlabbleDispatchTable<T>& table_;
+};
+
+#endif // H_BlabbleDispatchTable
@@ -0,0 +1,325 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cstdlib>
+#include <stdexcept>
+#include <sstream>
+#include "BlabbleEventLoop.h"
+#include "BlabbleMetrics.h"
+#include "BlabbleLogging.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static BlabbleCounter& loop_iterations = BlabbleMetrics::Counter("eventloop.iterations");
+static BlabbleCounter& loop_events = BlabbleMetrics::Counter("eventloop.events");
+static BlabbleCounter& loop_busy_polls = BlabbleMetrics::Counter("eventloop.busyPolls");
+static BlabbleHistogram& loop_lag_usec = BlabbleMetrics::Histogram("eventloop.lag.usec");
+
+static std::string Trim(const std::string& s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string::npos)
+		return "";
+	return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+static long ParseNumber(const std::string& value, const std::string& entry)
+{
+	char* end = NULL;
+	long n = std::strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || n < 0)
+		throw std::runtime_error("Invalid number in event loop option " + entry);
+	return n;
+}
+
+static const char* PriorityName(BlabbleEventLoopConfig::Priority priority)
+{
+	switch (priority)
+	{
+	case BlabbleEventLoopConfig::PRIORITY_HIGH:
+		return "high";
+	case BlabbleEventLoopConfig::PRIORITY_MAX:
+		return "max";
+	default:
+		return "normal";
+	}
+}
+
+//Static
+BlabbleEventLoopConfig BlabbleEventLoopConfig::Parse(const std::string& spec)
+{
+	BlabbleEventLoopConfig config;
+	std::string rest = Trim(spec);
+
+	while (!rest.empty())
+	{
+		size_t comma = rest.find(',');
+		std::string entry = Trim(rest.substr(0, comma));
+		rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+		if (entry.empty())
+			continue;
+
+		size_t eq = entry.find('=');
+		if (eq == std::string::npos)
+			throw std::runtime_error("Invalid event loop option " + entry);
+		std::string key = Trim(entry.substr(0, eq)), value = Trim(entry.substr(eq + 1));
+
+		if (key == "threads")
+		{
+			config.threads = (unsigned int)ParseNumber(value, entry);
+			if (config.threads > BLABBLE_EVENTLOOP_MAX_THREADS)
+				throw std::runtime_error("Too many threads in event loop option " + entry);
+		}
+		else if (key == "cpus")
+		{
+			config.cpus.clear();
+			while (!value.empty())
+			{
+				size_t colon = value.find(':');
+				config.cpus.push_back((int)ParseNumber(Trim(value.substr(0, colon)), entry));
+				value = colon == std::string::npos ? "" : value.substr(colon + 1);
+			}
+		}
+		else if (key == "priority")
+		{
+			if (value == "normal")
+				config.priority = PRIORITY_NORMAL;
+			else if (value == "high")
+				config.priority = PRIORITY_HIGH;
+			else if (value == "max")
+				config.priority = PRIORITY_MAX;
+			else
+				throw std::runtime_error("Unknown priority in event loop option " + entry);
+		}
+		else if (key == "busypoll")
+		{
+			config.busy_poll = (unsigned int)ParseNumber(value, entry);
+		}
+		else
+		{
+			throw std::runtime_error("Unknown event loop option " + entry);
+		}
+	}
+
+	if (config.threads == 0 && (!config.cpus.empty() || config.priority != PRIORITY_NORMAL || config.busy_poll != 0))
+		throw std::runtime_error("Event loop options need threads to be set");
+
+	return config;
+}
+
+BlabbleEventLoop::BlabbleEventLoop() :
+	pool_(NULL), quit_(false), probing_(false), shutdown_(false)
+{
+}
+
+BlabbleEventLoop::~BlabbleEventLoop()
+{
+	Shutdown();
+}
+
+void BlabbleEventLoop::Configure(const BlabbleEventLoopConfig& config, pjsua_config& cfg, pjsua_media_config& media_cfg)
+{
+	config_ = config;
+	if (config_.threads > 0)
+	{
+		//PJSUA shares one ioqueue between SIP and media, so our threads poll RTP as well
+		cfg.thread_cnt = 0;
+		media_cfg.thread_cnt = 0;
+	}
+}
+
+void BlabbleEventLoop::Start()
+{
+	if (config_.threads > 0)
+	{
+		pool_ = pjsua_pool_create("blabble-loop", 512, 512);
+		if (!pool_)
+			throw std::runtime_error("Unable to create event loop pool");
+
+		for (unsigned int i = 0; i < config_.threads; i++)
+		{
+			Worker* worker = PJ_POOL_ZALLOC_T(pool_, Worker);
+			worker->loop = this;
+			worker->index = i;
+
+			pj_status_t status = pj_thread_create(pool_, "blabble-loop", &BlabbleEventLoop::Run,
+				worker, 0, 0, &worker->thread);
+			if (status != PJ_SUCCESS)
+			{
+				BLABBLE_LOG_ERROR("BlabbleEventLoop::Start failed to create thread, got status: " << status);
+				Shutdown();
+				throw std::runtime_error("Unable to create event loop thread");
+			}
+			workers_.push_back(worker);
+		}
+
+		BLABBLE_LOG_DEBUG("BlabbleEventLoop started " << config_.threads << " threads, priority " <<
+			PriorityName(config_.priority) << ", busy poll " << config_.busy_poll << "us.");
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	ArmProbe();
+}
+
+void BlabbleEventLoop::Shutdown()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		shutdown_ = true;
+	}
+
+	quit_ = true;
+	for (size_t i = 0; i < workers_.size(); i++)
+	{
+		pj_thread_join(workers_[i]->thread);
+		pj_thread_destroy(workers_[i]->thread);
+	}
+	workers_.clear();
+
+	if (pool_)
+	{
+		pj_pool_release(pool_);
+		pool_ = NULL;
+	}
+}
+
+//Static
+int PJ_THREAD_FUNC BlabbleEventLoop::Run(void *arg)
+{
+	Worker* worker = static_cast<Worker*>(arg);
+	worker->loop->SetupThread(worker->index);
+	worker->loop->Loop();
+	return 0;
+}
+
+void BlabbleEventLoop::Loop()
+{
+	while (!quit_)
+	{
+		loop_iterations.Increment();
+		int events = pjsua_handle_events(BLABBLE_EVENTLOOP_TIMEOUT_MSEC);
+		if (events <= 0 || config_.busy_poll == 0)
+		{
+			if (events > 0)
+				loop_events.Add(events);
+			continue;
+		}
+
+		//Traffic comes in bursts; keep polling until busy_poll passes without an event
+		pj_timestamp last, now;
+		do
+		{
+			if (events > 0)
+			{
+				loop_events.Add(events);
+				pj_get_timestamp(&last);
+			}
+			loop_busy_polls.Increment();
+			events = pjsua_handle_events(0);
+			pj_get_timestamp(&now);
+		} while (!quit_ && pj_elapsed_usec(&last, &now) < config_.busy_poll);
+	}
+}
+
+void BlabbleEventLoop::SetupThread(unsigned int index)
+{
+	if (!config_.cpus.empty())
+	{
+		int cpu = config_.cpus[index % config_.cpus.size()];
+		bool pinned = false;
+#if defined(_WIN32)
+		pinned = cpu < (int)(sizeof(DWORD_PTR) * 8) &&
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+		if (!pinned)
+			BLABBLE_LOG_WARN("BlabbleEventLoop unable to pin thread " << index << " to CPU " << cpu << ".");
+	}
+
+	if (config_.priority != BlabbleEventLoopConfig::PRIORITY_NORMAL)
+	{
+		bool raised = false;
+#ifdef _WIN32
+		raised = SetThreadPriority(GetCurrentThread(),
+			config_.priority == BlabbleEventLoopConfig::PRIORITY_MAX ?
+				THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST) != 0;
+#else
+		//Normal threads have no priority levels, only realtime ones do. This needs privileges.
+		int min = sched_get_priority_min(SCHED_RR), max = sched_get_priority_max(SCHED_RR);
+		struct sched_param param;
+		param.sched_priority = config_.priority == BlabbleEventLoopConfig::PRIORITY_MAX ? max : (min + max) / 2;
+		raised = min >= 0 && max >= 0 && pthread_setschedparam(pthread_self(), SCHED_RR, &param) == 0;
+#endif
+		if (!raised)
+			BLABBLE_LOG_WARN("BlabbleEventLoop unable to raise the priority of thread " << index << ".");
+	}
+}
+
+//Static
+void BlabbleEventLoop::OnProbe(void *user_data)
+{
+	BlabbleEventLoop *loop = static_cast<BlabbleEventLoop*>(user_data);
+	pj_timestamp now;
+	pj_get_timestamp(&now);
+
+	boost::mutex::scoped_lock lock(loop->mutex_);
+	loop->probing_ = false;
+	if (loop->shutdown_)
+		return;
+
+	pj_uint32_t elapsed = pj_elapsed_usec(&loop->probe_armed_, &now);
+	loop_lag_usec.Record(elapsed > BLABBLE_EVENTLOOP_PROBE_MSEC * 1000 ?
+		elapsed - BLABBLE_EVENTLOOP_PROBE_MSEC * 1000 : 0);
+	loop->ArmProbe();
+}
+
+void BlabbleEventLoop::ArmProbe()
+{
+	if (probing_ || shutdown_)
+		return;
+
+	pj_get_timestamp(&probe_armed_);
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleEventLoop::OnProbe, this, BLABBLE_EVENTLOOP_PROBE_MSEC);
+	if (status == PJ_SUCCESS)
+	{
+		probing_ = true;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleEventLoop::ArmProbe failed to schedule timer, got status: " << status);
+	}
+}
+
+FB::VariantMap BlabbleEventLoop::stats()
+{
+	FB::VariantList cpus;
+	for (size_t i = 0; i < config_.cpus.size(); i++)
+		cpus.push_back((long)config_.cpus[i]);
+
+	FB::VariantMap map;
+	map["enabled"] = enabled();
+	map["threads"] = (long)config_.threads;
+	map["cpus"] = cpus;
+	map["priority"] = std::string(PriorityName(config_.priority));
+	map["busyPoll"] = (long)config_.busy_poll;
+	map["iterations"] = loop_iterations.value();
+	map["events"] = loop_events.value();
+	map["busyPolls"] = loop_busy_polls.value();
+	map["lag"] = loop_lag_usec.Snapshot();
+	return map;
+}
@@ -0,0 +1,146 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleEventLoop
+#define H_BlabbleEventLoop
+
+#include <string>
+#include <vector>
+#include "JSAPIAuto.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief Longest time a loop thread blocks waiting for network events, in milliseconds.
+ */
+#ifndef BLABBLE_EVENTLOOP_TIMEOUT_MSEC
+#define BLABBLE_EVENTLOOP_TIMEOUT_MSEC 10
+#endif
+
+/*! @Brief Period of the timer measuring how late PJSIP timers fire, in milliseconds.
+ */
+#ifndef BLABBLE_EVENTLOOP_PROBE_MSEC
+#define BLABBLE_EVENTLOOP_PROBE_MSEC 100
+#endif
+
+/*! @Brief Most threads the event loop may be configured with.
+ */
+#ifndef BLABBLE_EVENTLOOP_MAX_THREADS
+#define BLABBLE_EVENTLOOP_MAX_THREADS 8
+#endif
+
+/*! @Brief Event loop settings.
+ */
+struct BlabbleEventLoopConfig
+{
+	enum Priority { PRIORITY_NORMAL, PRIORITY_HIGH, PRIORITY_MAX };
+
+	BlabbleEventLoopConfig() : threads(0), priority(PRIORITY_NORMAL), busy_poll(0) { }
+
+	unsigned int threads;		//!< 0 leaves polling to PJSUA's own worker threads
+	std::vector<int> cpus;		//!< Thread n is pinned to cpus[n % cpus.size()], empty to not pin
+	Priority priority;
+	unsigned int busy_poll;		//!< Microseconds to keep polling without blocking after an event
+
+	/*! @Brief Parse an event loop specification.
+	 *
+	 *  The specification is a comma separated list of `key=value` with the
+	 *  keys threads, cpus, priority and busypoll, e.g.
+	 *  `threads=2,cpus=2:3,priority=high,busypoll=200`. cpus is a colon
+	 *  separated list of CPU numbers and priority is normal, high or max. An
+	 *  empty specification keeps PJSUA's worker threads. Throws
+	 *  std::runtime_error on anything it does not understand.
+	 */
+	static BlabbleEventLoopConfig Parse(const std::string& spec);
+};
+
+/*! @class  BlabbleEventLoop
+ *
+ *  @brief  Threads polling PJSIP's timers and sockets in place of PJSUA's workers.
+ *
+ *  PJSUA's worker threads block for up to 10ms in pjsua_handle_events at
+ *  the default priority, wherever the OS schedules them. On a loaded desktop
+ *  that delay shows up as late SIP timers and bursty RTP. When configured,
+ *  PJSUA is initialized without worker threads and this class runs
+ *  pjsua_handle_events on its own, optionally pinned to CPUs and at a raised
+ *  priority. With busy polling a thread that just handled an event keeps
+ *  polling without blocking for a short while, since RTP and SIP traffic
+ *  comes in bursts.
+ *
+ *  A probe timer measures how late PJSIP timers fire, whoever runs the
+ *  loop, and records it as "eventloop.lag.usec" in BlabbleMetrics.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleEventLoop
+{
+public:
+	BlabbleEventLoop();
+	virtual ~BlabbleEventLoop();
+
+	/*! @Brief Clear the PJSUA worker thread counts if config asks for our own threads.
+	 *  Must be called before pjsua_init.
+	 */
+	void Configure(const BlabbleEventLoopConfig& config, pjsua_config& cfg, pjsua_media_config& media_cfg);
+
+	/*! @Brief Start the threads and the lag probe. Must be called after pjsua_init.
+	 *  Throws std::runtime_error if a thread cannot be created.
+	 */
+	void Start();
+
+	/*! @Brief Stop and join the threads. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief True if PJSIP events are polled by our threads.
+	 */
+	bool enabled() const { return config_.threads > 0; }
+
+	/*! @Brief Object with "enabled", "threads", "cpus", "priority", "busyPoll",
+	 *  "iterations", "events", "busyPolls" and "lag" properties for JavaScript.
+	 *  lag is a histogram snapshot as described at BlabbleHistogram::Snapshot.
+	 */
+	FB::VariantMap stats();
+
+private:
+	struct Worker
+	{
+		BlabbleEventLoop* loop;
+		unsigned int index;
+		pj_thread_t* thread;
+	};
+
+	static int PJ_THREAD_FUNC Run(void *arg);
+
+	/*! @Brief Poll until Shutdown. Runs on every loop thread.
+	 */
+	void Loop();
+
+	/*! @Brief Apply the affinity and priority settings to the calling thread.
+	 */
+	void SetupThread(unsigned int index);
+
+	static void OnProbe(void *user_data);
+
+	/*! @Brief Schedule the next probe. Call with mutex_ held.
+	 */
+	void ArmProbe();
+
+	BlabbleEventLoopConfig config_;
+	pj_pool_t* pool_;
+	std::vector<Worker*> workers_;
+	volatile bool quit_;
+
+	boost::mutex mutex_;
+	pj_timestamp probe_armed_;	//!< When the outstanding probe was scheduled
+	bool probing_;
+	bool shutdown_;
+};
+
+#endif // H_BlabbleEventLoop
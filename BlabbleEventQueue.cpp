@@ -0,0 +1,182 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include "BlabbleEventQueue.h"
+#include "variant_list.h"
+#include "BlabbleLogging.h"
+#include "BlabbleMetrics.h"
+
+static BlabbleCounter& events_delivered = BlabbleMetrics::Counter("event.delivered");
+static BlabbleCounter& events_superseded = BlabbleMetrics::Counter("event.superseded");
+static BlabbleCounter& flushes = BlabbleMetrics::Counter("event.flushes");
+static BlabbleGauge& events_pending = BlabbleMetrics::Gauge("event.pending");
+static BlabbleHistogram& delivery_usec = BlabbleMetrics::Histogram("event.delivery.usec");
+static BlabbleHistogram& callback_usec = BlabbleMetrics::Histogram("event.jsCallback.usec");
+
+BlabbleEventQueue::BlabbleEventQueue(const FB::BrowserHostPtr& host) :
+	host_(host), flush_scheduled_(false), shutdown_(false)
+{
+}
+
+BlabbleEventQueue::~BlabbleEventQueue()
+{
+}
+
+void BlabbleEventQueue::Post(const BlabbleEvent& evt)
+{
+	BlabbleEventListener listener;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+		listener = listener_;
+	}
+
+	if (listener)
+		listener(evt);
+
+	if (!host_)
+		return;
+
+	bool schedule = false;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+
+		BlabbleEventList::iterator it = pending_.end();
+		if (!evt.key.empty())
+		{
+			for (it = pending_.begin(); it != pending_.end() && it->key != evt.key; it++);
+		}
+
+		if (it != pending_.end())
+		{
+			//Superseded, the new state goes to the back so it is never delivered ahead of
+			//events raised before it. Delivery latency still counts from the first change.
+			pj_timestamp posted = it->posted;
+			pending_.erase(it);
+			pending_.push_back(evt);
+			pending_.back().posted = posted;
+			events_superseded.Increment();
+		}
+		else
+		{
+			pending_.push_back(evt);
+			events_pending.Add(1);
+		}
+
+		if (!flush_scheduled_)
+		{
+			flush_scheduled_ = true;
+			schedule = true;
+		}
+	}
+
+	if (schedule)
+	{
+		//ScheduleOnMainThread gives no way to tell it failed, ScheduleAsyncCall does
+		BlabbleEventQueuePtr* self = new BlabbleEventQueuePtr(shared_from_this());
+		if (!host_->ScheduleAsyncCall(&BlabbleEventQueue::OnFlush, self))
+		{
+			delete self;
+
+			//The events stay pending, the next Post tries again
+			BLABBLE_LOG_ERROR("BlabbleEventQueue::Post unable to schedule a flush on the main thread.");
+			boost::mutex::scoped_lock lock(mutex_);
+			flush_scheduled_ = false;
+		}
+	}
+}
+
+//Static
+void BlabbleEventQueue::OnFlush(void* arg)
+{
+	BlabbleEventQueuePtr* self = static_cast<BlabbleEventQueuePtr*>(arg);
+	(*self)->Flush();
+	delete self;
+}
+
+void BlabbleEventQueue::set_sink(const FB::JSObjectPtr& sink)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	sink_ = sink;
+}
+
+void BlabbleEventQueue::set_listener(const BlabbleEventListener& listener)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	listener_ = listener;
+}
+
+void BlabbleEventQueue::Shutdown()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	shutdown_ = true;
+	events_pending.Add(-(long)pending_.size());
+	pending_.clear();
+	sink_.reset();
+	listener_.clear();
+}
+
+void BlabbleEventQueue::Flush()
+{
+	BlabbleEventList events;
+	FB::JSObjectPtr sink;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		events.swap(pending_);
+		flush_scheduled_ = false;
+		sink = sink_;
+	}
+	events_pending.Add(-(long)events.size());
+	flushes.Increment();
+
+	FB::VariantList batch;
+	for (BlabbleEventList::iterator it = events.begin(); it != events.end(); it++)
+	{
+		pj_timestamp now;
+		pj_get_timestamp(&now);
+		delivery_usec.Record(pj_elapsed_usec(&it->posted, &now));
+		events_delivered.Increment();
+
+		if (it->callback)
+		{
+			try
+			{
+				BlabbleMetricsTimer timer(callback_usec);
+				it->callback->Invoke("", it->args);
+			}
+			catch (const std::exception &e)
+			{
+				BLABBLE_LOG_ERROR("JavaScript callback for " << it->type.c_str() << " event failed: " << e.what());
+			}
+		}
+
+		if (sink)
+		{
+			FB::VariantMap map;
+			map["type"] = it->type;
+			map["args"] = it->args;
+			batch.push_back(map);
+		}
+	}
+
+	if (sink && !batch.empty())
+	{
+		try
+		{
+			sink->Invoke("", FB::variant_list_of(batch));
+		}
+		catch (const std::exception &e)
+		{
+			BLABBLE_LOG_ERROR("JavaScript onEvents sink failed: " << e.what());
+		}
+	}
+}
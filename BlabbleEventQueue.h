@@ -0,0 +1,108 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleEventQueue
+#define H_BlabbleEventQueue
+
+#include <string>
+#include <vector>
+#include "JSAPIAuto.h"
+#include "JSObject.h"
+#include "BrowserHost.h"
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/function.hpp>
+#include <pjlib.h>
+
+FB_FORWARD_PTR(BlabbleEventQueue)
+
+/*! @Brief A single event waiting to be delivered to JavaScript.
+ */
+struct BlabbleEvent
+{
+	BlabbleEvent(const std::string& t, const FB::JSObjectPtr& cb,
+		const FB::VariantList& a, const std::string& k = "") :
+		type(t), callback(cb), args(a), key(k) { pj_get_timestamp(&posted); }
+
+	std::string type;			//!< Event name as seen by the onEvents sink
+	FB::JSObjectPtr callback;	//!< Per object JavaScript callback, may be empty
+	FB::VariantList args;		//!< Arguments for callback
+	std::string key;			//!< Events with the same non empty key replace each other
+	pj_timestamp posted;		//!< When the event was raised, for the delivery latency metric
+};
+
+typedef boost::function<void (const BlabbleEvent&)> BlabbleEventListener;
+
+/*! @class  BlabbleEventQueue
+ *
+ *  @brief  Collects events raised on PJSIP threads and delivers them to
+ *          JavaScript in batches.
+ *
+ *  The first event posted schedules a single flush on the browser's main
+ *  thread. Everything posted before that flush runs is delivered with it,
+ *  so a burst of events costs one cross thread hop. A pending event with the
+ *  same key as a new one is dropped and the new one queued at the back, e.g.
+ *  only the latest registration state of an account is delivered, and never
+ *  ahead of events that were raised before it.
+ *
+ *  During the flush each event's own callback is invoked and, if set, the
+ *  whole batch is passed as one array to the onEvents sink. The time from
+ *  raising an event to handing it to JavaScript, and the time spent in
+ *  JavaScript callbacks, are recorded in BlabbleMetrics.
+ *
+ *  One queue is owned by each BlabbleAPI. A queue created without a browser
+ *  host delivers nothing to JavaScript and only feeds its listener, which
+ *  is how the tools in Tools/ observe events.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleEventQueue : public boost::enable_shared_from_this<BlabbleEventQueue>
+{
+public:
+	BlabbleEventQueue(const FB::BrowserHostPtr& host);
+	virtual ~BlabbleEventQueue();
+
+	/*! @Brief Queue an event. Safe to call from any thread.
+	 */
+	void Post(const BlabbleEvent& evt);
+
+	/*! @Brief Set the JavaScript function that receives each batch as an array.
+	 */
+	void set_sink(const FB::JSObjectPtr& sink);
+
+	/*! @Brief Set a function that sees every event as it is posted.
+	 *  The listener runs on the posting (PJSIP) thread and must be quick.
+	 */
+	void set_listener(const BlabbleEventListener& listener);
+
+	/*! @Brief Drop pending events and stop scheduling flushes.
+	 */
+	void Shutdown();
+
+private:
+	typedef std::vector<BlabbleEvent> BlabbleEventList;
+
+	/*! @Brief Runs on the main thread and delivers everything queued so far.
+	 */
+	void Flush();
+
+	/*! @Brief ScheduleAsyncCall callback, arg is a heap allocated BlabbleEventQueuePtr.
+	 */
+	static void OnFlush(void* arg);
+
+	FB::BrowserHostPtr host_;
+	boost::mutex mutex_;
+	BlabbleEventList pending_;
+	FB::JSObjectPtr sink_;
+	BlabbleEventListener listener_;
+	bool flush_scheduled_;
+	bool shutdown_;
+};
+
+#endif // H_BlabbleEventQueue
@@ -0,0 +1,405 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <vector>
+#include <algorithm>
+#include "BlabbleJitterControl.h"
+#include "BlabbleLogging.h"
+#include <pjsua-lib/pjsua_internal.h>
+
+pjsip_module BlabbleJitterControl::module_;
+BlabbleJitterControl* BlabbleJitterControl::instance_ = NULL;
+
+/*! @Brief A call in auto mode due for renegotiation.
+ */
+struct Retune
+{
+	unsigned int id;
+	pjsua_call_id call_id;
+};
+
+BlabbleJitterControl::BlabbleJitterControl() :
+	timer_armed_(false), shutdown_(false), registered_(false)
+{
+}
+
+BlabbleJitterControl::~BlabbleJitterControl()
+{
+}
+
+void BlabbleJitterControl::Start()
+{
+	pj_bzero(&module_, sizeof(module_));
+	module_.name = pj_str(const_cast<char*>("mod-blabble-jitter"));
+	module_.id = -1;
+	//Ahead of the transaction layer, which consumes the responses to our INVITEs
+	module_.priority = PJSIP_MOD_PRIORITY_TSX_LAYER - 1;
+	module_.on_rx_request = &BlabbleJitterControl::OnRxMessage;
+	module_.on_rx_response = &BlabbleJitterControl::OnRxMessage;
+
+	instance_ = this;
+	pj_status_t status = pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &module_);
+	if (status == PJ_SUCCESS)
+	{
+		registered_ = true;
+	}
+	else
+	{
+		instance_ = NULL;
+		BLABBLE_LOG_ERROR("BlabbleJitterControl::Start unable to register module, got status: " << status);
+	}
+}
+
+void BlabbleJitterControl::Shutdown()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		shutdown_ = true;
+		entries_.clear();
+		by_sip_call_id_.clear();
+	}
+
+	if (registered_)
+	{
+		pjsip_endpt_unregister_module(pjsua_get_pjsip_endpt(), &module_);
+		registered_ = false;
+	}
+	instance_ = NULL;
+}
+
+void BlabbleJitterControl::SetDefaults(const BlabbleJitterSettings& defaults)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	defaults_ = defaults;
+	Apply(defaults_);
+}
+
+bool BlabbleJitterControl::Set(unsigned int id, pjsua_call_id call_id, const BlabbleJitterSettings& settings,
+	bool automatic, bool renegotiate)
+{
+	pjsua_call_info info;
+	if (pjsua_call_get_info(call_id, &info) != PJ_SUCCESS || info.call_id.slen == 0)
+		return false;
+
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return false;
+
+		Entry &entry = entries_[id];
+		if (!entry.sip_call_id.empty())
+			by_sip_call_id_.erase(entry.sip_call_id);
+		entry.call_id = call_id;
+		entry.sip_call_id = std::string(info.call_id.ptr, info.call_id.slen);
+		entry.settings = settings;
+		entry.automatic = automatic;
+		by_sip_call_id_[entry.sip_call_id] = id;
+
+		if (automatic)
+			ArmTimer();
+		if (renegotiate)
+		{
+			entry.retuned = Now();
+			Apply(settings);
+		}
+	}
+
+	if (renegotiate)
+	{
+		pj_status_t status = pjsua_call_reinvite(call_id, PJ_TRUE, NULL);
+		if (status != PJ_SUCCESS)
+			BLABBLE_LOG_ERROR("BlabbleJitterControl::Set unable to renegotiate call " << id << ", got status: " << status);
+	}
+	return true;
+}
+
+void BlabbleJitterControl::Remove(unsigned int id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	EntryMap::iterator it = entries_.find(id);
+	if (it == entries_.end())
+		return;
+
+	by_sip_call_id_.erase(it->second.sip_call_id);
+	entries_.erase(it);
+}
+
+void BlabbleJitterControl::Prepare(unsigned int id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	EntryMap::const_iterator it = entries_.find(id);
+	Apply(it == entries_.end() ? defaults_ : it->second.settings);
+}
+
+void BlabbleJitterControl::Restore()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	Apply(defaults_);
+}
+
+void BlabbleJitterControl::PrepareSip(const pj_str_t& call_id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	//Nothing to do until some call has bounds of its own
+	if (entries_.empty() && applied_ == defaults_)
+		return;
+
+	std::map<std::string, unsigned int>::const_iterator id =
+		by_sip_call_id_.find(std::string(call_id.ptr, call_id.slen));
+	EntryMap::const_iterator it = id == by_sip_call_id_.end() ? entries_.end() : entries_.find(id->second);
+	Apply(it == entries_.end() ? defaults_ : it->second.settings);
+}
+
+BlabbleJitterSettings BlabbleJitterControl::Merge(const BlabbleJitterSettings& settings) const
+{
+	//-1 in media_cfg is the pjmedia default, not what the media profile asked for.
+	//A default that does not fit the call's own bounds is clamped to them.
+	BlabbleJitterSettings merged = settings;
+	if (merged.init < 0)
+		merged.init = defaults_.init;
+	if (merged.min_pre < 0 && defaults_.min_pre >= 0)
+	{
+		merged.min_pre = defaults_.min_pre;
+		if (settings.max_pre >= 0 && merged.min_pre > settings.max_pre)
+			merged.min_pre = settings.max_pre;
+		if (settings.max >= 0 && merged.min_pre > settings.max)
+			merged.min_pre = settings.max;
+	}
+	if (merged.max_pre < 0 && defaults_.max_pre >= 0)
+	{
+		merged.max_pre = defaults_.max_pre;
+		if (settings.min_pre >= 0 && merged.max_pre < settings.min_pre)
+			merged.max_pre = settings.min_pre;
+		if (settings.max >= 0 && merged.max_pre > settings.max)
+			merged.max_pre = settings.max;
+	}
+	if (merged.max < 0 && defaults_.max >= 0)
+		merged.max = std::max(defaults_.max, std::max(settings.min_pre, settings.max_pre));
+	return merged;
+}
+
+void BlabbleJitterControl::Apply(const BlabbleJitterSettings& requested)
+{
+	BlabbleJitterSettings settings = Merge(requested);
+	if (settings == applied_)
+		return;
+
+	PJSUA_LOCK();
+	pjsua_var.media_cfg.jb_init = settings.init;
+	pjsua_var.media_cfg.jb_min_pre = settings.min_pre;
+	pjsua_var.media_cfg.jb_max_pre = settings.max_pre;
+	pjsua_var.media_cfg.jb_max = settings.max;
+	PJSUA_UNLOCK();
+	applied_ = settings;
+}
+
+//Static
+pj_bool_t BlabbleJitterControl::OnRxMessage(pjsip_rx_data *rdata)
+{
+	BlabbleJitterControl* control = instance_;
+	//Only a message with a body can complete an offer and answer
+	if (control != NULL && rdata->msg_info.msg->body != NULL && rdata->msg_info.cid != NULL)
+		control->PrepareSip(rdata->msg_info.cid->id);
+
+	return PJ_FALSE;
+}
+
+//Static
+BlabbleJitterControl::Sample BlabbleJitterControl::Read(unsigned int id, pjsua_call_id call_id)
+{
+	Sample sample;
+	sample.ok = false;
+	if (call_id < 0 || call_id >= PJSUA_MAX_CALLS)
+		return sample;
+
+	PJSUA_LOCK();
+	pjsua_call *call = &pjsua_var.calls[call_id];
+	pjmedia_stream *stream = NULL;
+	if ((unsigned int)(pj_ssize_t)call->user_data == id &&
+		call->audio_idx >= 0 && call->audio_idx < (int)call->med_cnt)
+	{
+		stream = call->media[call->audio_idx].strm.a.stream;
+	}
+
+	pjmedia_rtcp_stat stat;
+	pjmedia_stream_info info;
+	if (stream && pjmedia_stream_get_stat_jbuf(stream, &sample.jb) == PJ_SUCCESS &&
+		pjmedia_stream_get_stat(stream, &stat) == PJ_SUCCESS &&
+		pjmedia_stream_get_info(stream, &info) == PJ_SUCCESS && info.param)
+	{
+		sample.ok = true;
+		sample.ptime = info.param->info.frm_ptime;
+		sample.jitter = (stat.rx.jitter.mean + 2.0 * pj_math_stat_get_stddev(&stat.rx.jitter)) / 1000.0;
+		if (stat.rx.jitter.n == 0)
+			sample.jitter = 0;
+	}
+	PJSUA_UNLOCK();
+
+	if (sample.ok && sample.ptime == 0)
+		sample.ok = false;
+	return sample;
+}
+
+//Static
+BlabbleJitterSettings BlabbleJitterControl::Tune(const Sample& sample)
+{
+	//Bursts the buffer has had to absorb count as jitter too
+	double jitter = sample.jitter;
+	if (sample.jb.avg_burst * sample.ptime > jitter)
+		jitter = sample.jb.avg_burst * sample.ptime;
+
+	int ptime = (int)sample.ptime;
+	int frames = (int)(jitter / ptime) + 1;
+
+	BlabbleJitterSettings settings;
+	settings.min_pre = frames * ptime;
+	settings.max_pre = (frames * 3 + 2) * ptime;
+	settings.init = settings.min_pre;
+	settings.max = settings.max_pre + 4 * ptime;
+	return settings;
+}
+
+//Static
+void BlabbleJitterControl::OnTimer(void *user_data)
+{
+	BlabbleJitterControl *control = static_cast<BlabbleJitterControl*>(user_data);
+	{
+		boost::mutex::scoped_lock lock(control->mutex_);
+		control->timer_armed_ = false;
+	}
+	control->Tick();
+}
+
+void BlabbleJitterControl::Tick()
+{
+	std::vector<std::pair<unsigned int, pjsua_call_id> > calls;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+		for (EntryMap::const_iterator it = entries_.begin(); it != entries_.end(); it++)
+		{
+			if (it->second.automatic)
+				calls.push_back(std::make_pair(it->first, it->second.call_id));
+		}
+	}
+
+	std::vector<Retune> retunes;
+	pj_uint64_t now = Now();
+	for (size_t i = 0; i < calls.size(); i++)
+	{
+		Sample sample = Read(calls[i].first, calls[i].second);
+		if (!sample.ok)
+			continue;
+
+		BlabbleJitterSettings tuned = Tune(sample);
+		boost::mutex::scoped_lock lock(mutex_);
+		EntryMap::iterator it = entries_.find(calls[i].first);
+		if (it == entries_.end() || !it->second.automatic)
+			continue;
+
+		//Only a change of at least a frame is worth a renegotiation
+		Entry &entry = it->second;
+		int moved = tuned.min_pre - entry.settings.min_pre;
+		if (entry.settings.min_pre >= 0 && moved < (int)sample.ptime && -moved < (int)sample.ptime)
+			continue;
+
+		entry.settings = tuned;
+		if (entry.retuned == 0 || now - entry.retuned >= BLABBLE_JB_RETUNE_MIN_SEC * 1000)
+		{
+			entry.retuned = now;
+			Retune retune = { it->first, entry.call_id };
+			retunes.push_back(retune);
+		}
+	}
+
+	for (size_t i = 0; i < retunes.size(); i++)
+	{
+		BLABBLE_LOG_DEBUG("BlabbleJitterControl retuning call " << retunes[i].id << ".");
+		Prepare(retunes[i].id);
+		pj_status_t status = pjsua_call_reinvite(retunes[i].call_id, PJ_TRUE, NULL);
+		if (status != PJ_SUCCESS)
+			BLABBLE_LOG_ERROR("BlabbleJitterControl unable to renegotiate call " << retunes[i].id << ", got status: " << status);
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	ArmTimer();
+}
+
+void BlabbleJitterControl::ArmTimer()
+{
+	if (timer_armed_ || shutdown_)
+		return;
+
+	bool automatic = false;
+	for (EntryMap::const_iterator it = entries_.begin(); !automatic && it != entries_.end(); it++)
+		automatic = it->second.automatic;
+	if (!automatic)
+		return;
+
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleJitterControl::OnTimer, this, BLABBLE_JB_AUTO_MSEC);
+	if (status == PJ_SUCCESS)
+	{
+		timer_armed_ = true;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleJitterControl::ArmTimer failed to schedule timer, got status: " << status);
+	}
+}
+
+//Static
+pj_uint64_t BlabbleJitterControl::Now()
+{
+	pj_time_val now;
+	pj_gettickcount(&now);
+	return (pj_uint64_t)now.sec * 1000 + now.msec;
+}
+
+FB::VariantMap BlabbleJitterControl::State(unsigned int id, pjsua_call_id call_id)
+{
+	FB::VariantMap map;
+	Sample sample = Read(id, call_id);
+	if (!sample.ok)
+		return map;
+
+	map["ptime"] = (long)sample.ptime;
+	map["prefetch"] = (long)sample.jb.prefetch;
+	map["minPrefetch"] = (long)sample.jb.min_prefetch;
+	map["maxPrefetch"] = (long)sample.jb.max_prefetch;
+	map["burst"] = (long)sample.jb.burst;
+	map["avgBurst"] = (long)sample.jb.avg_burst;
+	map["size"] = (long)sample.jb.size;
+	map["avgDelay"] = (long)sample.jb.avg_delay;
+	map["minDelay"] = (long)sample.jb.min_delay;
+	map["maxDelay"] = (long)sample.jb.max_delay;
+	map["devDelay"] = (long)sample.jb.dev_delay;
+	map["jitter"] = sample.jitter;
+	map["lost"] = (long)sample.jb.lost;
+	map["discard"] = (long)sample.jb.discard;
+	map["empty"] = (long)sample.jb.empty;
+
+	BlabbleJitterSettings settings;
+	bool automatic = false;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		EntryMap::const_iterator it = entries_.find(id);
+		settings = Merge(it == entries_.end() ? defaults_ : it->second.settings);
+		automatic = it != entries_.end() && it->second.automatic;
+	}
+
+	FB::VariantMap bounds;
+	bounds["init"] = settings.init;
+	bounds["minPrefetch"] = settings.min_pre;
+	bounds["maxPrefetch"] = settings.max_pre;
+	bounds["max"] = settings.max;
+	bounds["auto"] = automatic;
+	map["settings"] = bounds;
+	return map;
+}
@@ -0,0 +1,193 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleJitterControl
+#define H_BlabbleJitterControl
+
+#include <string>
+#include <map>
+#include "JSAPIAuto.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsip.h>
+#include <pjmedia.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief How often calls in auto mode are looked at, in milliseconds.
+ */
+#ifndef BLABBLE_JB_AUTO_MSEC
+#define BLABBLE_JB_AUTO_MSEC 5000
+#endif
+
+/*! @Brief Shortest time between two renegotiations of one call in auto mode, in seconds.
+ */
+#ifndef BLABBLE_JB_RETUNE_MIN_SEC
+#define BLABBLE_JB_RETUNE_MIN_SEC 60
+#endif
+
+/*! @Brief Jitter buffer bounds in milliseconds, -1 for the media profile's value.
+ *  The fields match the jb_ fields of pjsua_media_config.
+ */
+struct BlabbleJitterSettings
+{
+	BlabbleJitterSettings() : init(-1), min_pre(-1), max_pre(-1), max(-1) { }
+
+	bool operator==(const BlabbleJitterSettings& other) const
+	{
+		return init == other.init && min_pre == other.min_pre &&
+			max_pre == other.max_pre && max == other.max;
+	}
+	bool operator!=(const BlabbleJitterSettings& other) const { return !(*this == other); }
+
+	int init;
+	int min_pre;
+	int max_pre;
+	int max;
+};
+
+/*! @class  BlabbleJitterControl
+ *
+ *  @brief  Gives calls their own jitter buffer bounds and retunes them from observed jitter.
+ *
+ *  PJSUA 2.1 has no way to resize the jitter buffer of a running stream.
+ *  A stream reads its bounds from pjsua_media_config when it is created,
+ *  when an offer and answer have been exchanged. A PJSIP module ahead of
+ *  the transaction layer, which keeps the responses it matches from the
+ *  modules after it, therefore copies the bounds of the call a message
+ *  belongs to into the media config before the message can create a
+ *  stream. BlabbleCall::Answer and BlabbleCall::MakeCall do the same for
+ *  what we send. Once a stream exists the defaults are put back, so no
+ *  call's bounds are left for another. Calls without bounds of their own
+ *  get the media profile's.
+ *
+ *  New bounds take effect when the call's stream is next created, or
+ *  straight away if the caller asks for a re-INVITE. In auto mode the RTCP
+ *  jitter and the burst level the jitter buffer sees are turned into
+ *  bounds every BLABBLE_JB_AUTO_MSEC. A call is renegotiated at most
+ *  every BLABBLE_JB_RETUNE_MIN_SEC, and only when its minimum prefetch
+ *  would move by a frame or more.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleJitterControl
+{
+public:
+	BlabbleJitterControl();
+	virtual ~BlabbleJitterControl();
+
+	/*! @Brief Register the module and start auto mode. Must be called after pjsua_init.
+	 */
+	void Start();
+
+	/*! @Brief Unregister the module. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief Bounds used by calls without their own. Called with the media profile's.
+	 */
+	void SetDefaults(const BlabbleJitterSettings& defaults);
+
+	/*! @Brief Give the call with global id id its own bounds.
+	 *  call_id is the PJSUA call. With automatic set, settings are only the
+	 *  starting point. With renegotiate set, a re-INVITE applies them to
+	 *  the running stream. Returns false if the call has no SIP Call-ID yet.
+	 */
+	bool Set(unsigned int id, pjsua_call_id call_id, const BlabbleJitterSettings& settings,
+		bool automatic, bool renegotiate);
+
+	/*! @Brief Forget the call's bounds. Called when the call ends.
+	 */
+	void Remove(unsigned int id);
+
+	/*! @Brief Put the call's bounds, or the defaults, in pjsua_media_config.
+	 *  Called before sending anything that completes an offer and answer.
+	 */
+	void Prepare(unsigned int id);
+
+	/*! @Brief Put the defaults back in pjsua_media_config. Called when a call's media changes.
+	 */
+	void Restore();
+
+	/*! @Brief Object for JavaScript with the call's jitter buffer state.
+	 *  "prefetch", "minPrefetch", "maxPrefetch", "burst", "avgBurst" and
+	 *  "size" are in frames of "ptime" milliseconds. "avgDelay", "minDelay",
+	 *  "maxDelay", "devDelay" and "jitter" are in milliseconds. "lost",
+	 *  "discard" and "empty" are frame counts. "settings" holds the bounds
+	 *  the call asked for, with "init", "minPrefetch", "maxPrefetch", "max"
+	 *  and "auto". The object is empty while the call has no stream.
+	 */
+	FB::VariantMap State(unsigned int id, pjsua_call_id call_id);
+
+private:
+	struct Entry
+	{
+		Entry() : call_id(PJSUA_INVALID_ID), automatic(false), retuned(0) { }
+		pjsua_call_id call_id;
+		std::string sip_call_id;
+		BlabbleJitterSettings settings;
+		bool automatic;
+		pj_uint64_t retuned;		//!< Tick count (msec) of the last renegotiation
+	};
+	typedef std::map<unsigned int, Entry> EntryMap;
+
+	/*! @Brief What was read from one call's stream.
+	 */
+	struct Sample
+	{
+		bool ok;
+		unsigned int ptime;
+		pjmedia_jb_state jb;
+		double jitter;		//!< Mean plus two deviations of RTCP receive jitter, msec
+	};
+
+	/*! @Brief Read the stream of call_id if it still belongs to id.
+	 */
+	static Sample Read(unsigned int id, pjsua_call_id call_id);
+
+	/*! @Brief Bounds that fit the jitter in sample.
+	 */
+	static BlabbleJitterSettings Tune(const Sample& sample);
+
+	/*! @Brief settings with each -1 taken from defaults_. Call with mutex_ held.
+	 */
+	BlabbleJitterSettings Merge(const BlabbleJitterSettings& settings) const;
+
+	/*! @Brief Copy requested, merged with defaults_, into pjsua_media_config. Call with mutex_ held.
+	 */
+	void Apply(const BlabbleJitterSettings& requested);
+
+	/*! @Brief Apply the bounds for the SIP call with Call-ID call_id.
+	 */
+	void PrepareSip(const pj_str_t& call_id);
+
+	static pj_bool_t OnRxMessage(pjsip_rx_data *rdata);
+
+	void Tick();
+	static void OnTimer(void *user_data);
+
+	/*! @Brief Schedule the next auto mode pass. Call with mutex_ held.
+	 */
+	void ArmTimer();
+
+	static pj_uint64_t Now();
+
+	boost::mutex mutex_;
+	EntryMap entries_;
+	std::map<std::string, unsigned int> by_sip_call_id_;
+	BlabbleJitterSettings defaults_;
+	BlabbleJitterSettings applied_;		//!< What pjsua_media_config holds now
+	bool timer_armed_;
+	bool shutdown_;
+	bool registered_;
+
+	static pjsip_module module_;
+	static BlabbleJitterControl* instance_;
+};
+
+#endif // H_BlabbleJitterControl
@@ -0,0 +1,375 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cmath>
+#include "variant_list.h"
+#include "BlabbleLevelMeter.h"
+#include "BlabbleCall.h"
+#include "BlabbleEventQueue.h"
+#include "BlabbleAtomic.h"
+#include "BlabbleLogging.h"
+
+//Key of the microphone meter, call ids start at 1
+#define MICROPHONE_METER 0
+
+/*! @Brief Conference bridge sink that measures what it is sent.
+ */
+struct LevelMeterPort
+{
+	pjmedia_port base;
+	volatile long peak;	//!< Smoothed peak, 0 to 32767
+	volatile long rms;	//!< Smoothed RMS, 0 to 32767
+};
+
+static pj_status_t MeterPutFrame(pjmedia_port *this_port, pjmedia_frame *frame)
+{
+	LevelMeterPort *port = reinterpret_cast<LevelMeterPort*>(this_port);
+	long peak = 0, rms = 0;
+
+	if (frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->size > 0)
+	{
+		const pj_int16_t *samples = static_cast<const pj_int16_t*>(frame->buf);
+		unsigned int count = (unsigned int)(frame->size / sizeof(pj_int16_t));
+		double sum = 0;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			long v = samples[i] < 0 ? -(long)samples[i] : samples[i];
+			if (v > peak)
+				peak = v;
+			sum += (double)v * v;
+		}
+		rms = (long)std::sqrt(sum / count);
+	}
+
+	//Peaks rise at once and fall back slowly, RMS is averaged over a few frames
+	long last_peak = port->peak, last_rms = port->rms;
+	if (peak < last_peak - last_peak / 8)
+		peak = last_peak - last_peak / 8;
+	rms = last_rms + (rms - last_rms) / 4;
+
+	INTERLOCKED_EXCHANGE(&port->peak, peak);
+	INTERLOCKED_EXCHANGE(&port->rms, rms);
+	return PJ_SUCCESS;
+}
+
+static pj_status_t MeterGetFrame(pjmedia_port *, pjmedia_frame *frame)
+{
+	//Meters are sinks, they never send anything back into the bridge
+	frame->type = PJMEDIA_FRAME_TYPE_NONE;
+	frame->size = 0;
+	return PJ_SUCCESS;
+}
+
+BlabbleLevelMeter::BlabbleLevelMeter() :
+	timer_armed_(false), shutdown_(false)
+{
+}
+
+BlabbleLevelMeter::~BlabbleLevelMeter()
+{
+}
+
+void BlabbleLevelMeter::Subscribe(const BlabbleEventQueuePtr& queue, const FB::JSObjectPtr& callback, unsigned int rate)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (shutdown_)
+		return;
+
+	SubscriberList::iterator it;
+	for (it = subscribers_.begin(); it != subscribers_.end() && it->queue.lock() != queue; it++);
+	if (it == subscribers_.end())
+		it = subscribers_.insert(subscribers_.end(), Subscriber());
+
+	it->queue = queue;
+	it->callback = callback;
+	it->rate = rate > BLABBLE_METER_MAX_RATE ? BLABBLE_METER_MAX_RATE : (rate > 0 ? rate : 1);
+
+	MeterMap::iterator mic = meters_.find(MICROPHONE_METER);
+	if (mic == meters_.end())
+	{
+		Meter &meter = meters_[MICROPHONE_METER];
+		meter.source = 0;
+		meter.connected = meter.slot = PJSUA_INVALID_ID;
+		meter.pool = NULL;
+		meter.port = NULL;
+	}
+
+	ArmTimer(0);
+}
+
+void BlabbleLevelMeter::Unsubscribe(const BlabbleEventQueuePtr& queue)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	for (SubscriberList::iterator it = subscribers_.begin(); it != subscribers_.end(); it++)
+	{
+		if (it->queue.lock() == queue)
+		{
+			subscribers_.erase(it);
+			break;
+		}
+	}
+
+	//Let the timer take the meters out of the bridge if that was the last one
+	if (!shutdown_)
+		ArmTimer(0);
+}
+
+void BlabbleLevelMeter::Watch(const BlabbleCallPtr& call, pjsua_conf_port_id slot)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (shutdown_)
+		return;
+
+	MeterMap::iterator it = meters_.find(call->id());
+	if (it == meters_.end())
+	{
+		Meter &meter = meters_[call->id()];
+		meter.connected = meter.slot = PJSUA_INVALID_ID;
+		meter.pool = NULL;
+		meter.port = NULL;
+		it = meters_.find(call->id());
+	}
+
+	it->second.call = call;
+	it->second.source = slot;
+}
+
+void BlabbleLevelMeter::Unwatch(unsigned int call_id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	MeterMap::iterator it = meters_.find(call_id);
+	if (it == meters_.end())
+		return;
+
+	if (it->second.port == NULL)
+		meters_.erase(it);
+	else
+		it->second.source = PJSUA_INVALID_ID;
+}
+
+void BlabbleLevelMeter::Shutdown()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		shutdown_ = true;
+		subscribers_.clear();
+	}
+
+	{
+		boost::mutex::scoped_lock reconcile(reconcile_mutex_);
+		Reconcile(false);
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	meters_.clear();
+}
+
+//Static
+void BlabbleLevelMeter::OnTimer(void *user_data)
+{
+	static_cast<BlabbleLevelMeter*>(user_data)->Tick();
+}
+
+void BlabbleLevelMeter::Tick()
+{
+	bool enabled;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		timer_armed_ = false;
+		if (shutdown_)
+			return;
+		enabled = !subscribers_.empty();
+	}
+
+	{
+		boost::mutex::scoped_lock reconcile(reconcile_mutex_);
+		Reconcile(enabled);
+	}
+
+	if (!enabled)
+		return;
+
+	FB::VariantMap update;
+	FB::VariantList calls;
+	SubscriberList subscribers;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+
+		for (MeterMap::iterator it = meters_.begin(); it != meters_.end(); it++)
+		{
+			if (it->second.port == NULL)
+				continue;
+
+			FB::VariantMap level;
+			level["peak"] = it->second.port->peak / 32767.0;
+			level["rms"] = it->second.port->rms / 32767.0;
+
+			if (it->first == MICROPHONE_METER)
+			{
+				update["microphone"] = level;
+			}
+			else
+			{
+				BlabbleCallPtr call = it->second.call.lock();
+				if (!call)
+					continue;
+				level["call"] = BlabbleCallWeakPtr(call);
+				calls.push_back(level);
+			}
+		}
+		update["calls"] = calls;
+
+		unsigned int rate = 1;
+		for (SubscriberList::iterator it = subscribers_.begin(); it != subscribers_.end(); it++)
+		{
+			if (it->rate > rate)
+				rate = it->rate;
+		}
+		subscribers = subscribers_;
+		ArmTimer(1000 / rate);
+	}
+
+	for (SubscriberList::iterator it = subscribers.begin(); it != subscribers.end(); it++)
+	{
+		BlabbleEventQueuePtr queue = it->queue.lock();
+		if (queue)
+		{
+			//Only the latest levels matter, so a pending update is replaced
+			queue->Post(BlabbleEvent("signalLevels", it->callback, 
+				FB::variant_list_of(update), "signalLevels"));
+		}
+	}
+}
+
+void BlabbleLevelMeter::Reconcile(bool enabled)
+{
+	std::vector<Meter> destroy;
+	std::vector<std::pair<unsigned int, pjsua_conf_port_id> > create;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		MeterMap::iterator it = meters_.begin();
+		while (it != meters_.end())
+		{
+			Meter &meter = it->second;
+			bool wanted = enabled && meter.source != PJSUA_INVALID_ID &&
+				(it->first == MICROPHONE_METER || !meter.call.expired());
+
+			if (meter.port != NULL && (!wanted || meter.connected != meter.source))
+			{
+				destroy.push_back(meter);
+				meter.port = NULL;
+				meter.pool = NULL;
+				meter.connected = meter.slot = PJSUA_INVALID_ID;
+			}
+
+			if (wanted && meter.port == NULL)
+				create.push_back(std::make_pair(it->first, meter.source));
+
+			if (meter.port == NULL && (meter.source == PJSUA_INVALID_ID || 
+				(it->first != MICROPHONE_METER && meter.call.expired())))
+			{
+				meters_.erase(it++);
+			}
+			else
+			{
+				it++;
+			}
+		}
+	}
+
+	for (std::vector<Meter>::iterator it = destroy.begin(); it != destroy.end(); it++)
+	{
+		DestroyMeter(*it);
+	}
+
+	pjsua_conf_port_info bridge;
+	if (create.empty() || pjsua_conf_get_port_info(0, &bridge) != PJ_SUCCESS)
+		return;
+
+	for (size_t i = 0; i < create.size(); i++)
+	{
+		Meter meter;
+		meter.connected = create[i].second;
+		meter.slot = PJSUA_INVALID_ID;
+		meter.port = NULL;
+		meter.pool = pjsua_pool_create("meter", 512, 512);
+		if (meter.pool == NULL)
+			break;
+
+		meter.port = PJ_POOL_ZALLOC_T(meter.pool, LevelMeterPort);
+		pj_str_t name = pj_str(const_cast<char*>("meter"));
+		pjmedia_port_info_init(&meter.port->base.info, &name, PJMEDIA_SIG_CLASS_APP('B', 'L', 'M'),
+			bridge.clock_rate, bridge.channel_count, 16, bridge.samples_per_frame);
+		meter.port->base.put_frame = &MeterPutFrame;
+		meter.port->base.get_frame = &MeterGetFrame;
+
+		pj_status_t status = pjsua_conf_add_port(meter.pool, &meter.port->base, &meter.slot);
+		if (status == PJ_SUCCESS)
+			status = pjsua_conf_connect(meter.connected, meter.slot);
+
+		if (status != PJ_SUCCESS)
+		{
+			BLABBLE_LOG_ERROR("BlabbleLevelMeter::Reconcile failed to meter conference slot " 
+				<< meter.connected << ", got status: " << status);
+			DestroyMeter(meter);
+			continue;
+		}
+
+		bool orphan = true;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			MeterMap::iterator it = meters_.find(create[i].first);
+			if (it != meters_.end() && it->second.port == NULL && it->second.source == meter.connected)
+			{
+				it->second.connected = meter.connected;
+				it->second.slot = meter.slot;
+				it->second.pool = meter.pool;
+				it->second.port = meter.port;
+				orphan = false;
+			}
+		}
+
+		//Unwatched or moved while the port was being added
+		if (orphan)
+			DestroyMeter(meter);
+	}
+}
+
+void BlabbleLevelMeter::ArmTimer(unsigned int delay)
+{
+	if (timer_armed_)
+		return;
+
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleLevelMeter::OnTimer, this, delay);
+	if (status == PJ_SUCCESS)
+	{
+		timer_armed_ = true;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleLevelMeter::ArmTimer failed to schedule timer, got status: " << status);
+	}
+}
+
+//Static
+void BlabbleLevelMeter::DestroyMeter(Meter& meter)
+{
+	if (meter.slot != PJSUA_INVALID_ID)
+		pjsua_conf_remove_port(meter.slot);
+	if (meter.port != NULL)
+		pjmedia_port_destroy(&meter.port->base);
+	if (meter.pool != NULL)
+		pj_pool_release(meter.pool);
+
+	meter.slot = PJSUA_INVALID_ID;
+	meter.port = NULL;
+	meter.pool = NULL;
+}
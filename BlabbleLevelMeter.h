@@ -0,0 +1,123 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleLevelMeter
+#define H_BlabbleLevelMeter
+
+#include <map>
+#include <vector>
+#include "JSAPIAuto.h"
+#include "JSObject.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+#include <pjmedia.h>
+
+FB_FORWARD_PTR(BlabbleCall)
+FB_FORWARD_PTR(BlabbleEventQueue)
+
+/*! @Brief Highest rate, in updates per second, level updates can be pushed at.
+ */
+#ifndef BLABBLE_METER_MAX_RATE
+#define BLABBLE_METER_MAX_RATE 50
+#endif
+
+struct LevelMeterPort;
+
+/*! @class  BlabbleLevelMeter
+ *
+ *  @brief  Measures the signal level of every call and of the microphone and
+ *          pushes them to JavaScript at a fixed rate.
+ *
+ *  While anyone is subscribed, a small sink port is added to the conference
+ *  bridge for the microphone (slot 0) and for each call with active media.
+ *  The bridge hands each meter the audio of its source every frame, and the
+ *  meter keeps a smoothed peak and RMS using nothing but atomic stores. A
+ *  PJSIP timer reads every meter in one pass and posts a single update to
+ *  each subscriber's event queue. Pending updates replace each other, so a
+ *  busy main thread only ever sees the latest levels.
+ *
+ *  Ports are only added and removed from the timer, which keeps all bridge
+ *  changes on one thread and out of the PJSIP callbacks.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleLevelMeter
+{
+public:
+	BlabbleLevelMeter();
+	virtual ~BlabbleLevelMeter();
+
+	/*! @Brief Push level updates for queue to callback rate times per second.
+	 *  The timer runs at the highest rate asked for by any subscriber.
+	 */
+	void Subscribe(const BlabbleEventQueuePtr& queue, const FB::JSObjectPtr& callback, unsigned int rate);
+
+	/*! @Brief Stop the updates started by Subscribe for queue.
+	 */
+	void Unsubscribe(const BlabbleEventQueuePtr& queue);
+
+	/*! @Brief Meter call, whose audio is in conference slot.
+	 *  Called when media becomes active; calling again with a new slot moves the meter.
+	 */
+	void Watch(const BlabbleCallPtr& call, pjsua_conf_port_id slot);
+
+	/*! @Brief Stop metering the call with the global id call_id.
+	 */
+	void Unwatch(unsigned int call_id);
+
+	/*! @Brief Remove every meter from the bridge. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+private:
+	struct Meter
+	{
+		BlabbleCallWeakPtr call;
+		pjsua_conf_port_id source;		//!< Slot to meter, PJSUA_INVALID_ID once unwatched
+		pjsua_conf_port_id connected;	//!< Slot the port is connected to
+		pjsua_conf_port_id slot;		//!< Slot of the meter port itself
+		pj_pool_t* pool;
+		LevelMeterPort* port;
+	};
+	typedef std::map<unsigned int, Meter> MeterMap;
+
+	struct Subscriber
+	{
+		BlabbleEventQueueWeakPtr queue;
+		FB::JSObjectPtr callback;
+		unsigned int rate;
+	};
+	typedef std::vector<Subscriber> SubscriberList;
+
+	static void OnTimer(void *user_data);
+
+	/*! @Brief Bring the meter ports in line with what is watched and push the levels.
+	 */
+	void Tick();
+
+	/*! @Brief Add and remove meter ports in the bridge. Runs with reconcile_mutex_ held.
+	 */
+	void Reconcile(bool enabled);
+
+	/*! @Brief Arm the timer to fire after delay msec, if it is not already. mutex_ must be held.
+	 */
+	void ArmTimer(unsigned int delay);
+
+	static void DestroyMeter(Meter& meter);
+
+	boost::mutex mutex_;
+	boost::mutex reconcile_mutex_;
+	MeterMap meters_;
+	SubscriberList subscribers_;
+	bool timer_armed_;
+	bool shutdown_;
+};
+
+#endif // H_BlabbleLevelMeter
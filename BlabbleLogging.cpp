@@ -6,6 +6,11 @@
 #include "log4cplus/fileappender.h"
 #include "log4cplus/hierarchy.h"
 #include "utf8_tools.h"
+#include "BlabbleAtomic.h"
+#include <cstring>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #ifdef WIN32
 #include <Windows.h>
@@ -16,9 +21,42 @@ namespace BlabbleLogging {
 	 */
 	bool logging_started = false;
 
+	/*! True while log lines go through the asynchronous writer
+	 */
+	volatile bool async_logging = false;
+
 	/*! Keep the logger around for reference
 	 */
 	log4cplus::Logger blabble_logger, js_logger;
+
+	/*! @Brief One slot of the asynchronous log ring.
+	 *  sequence tells producers and the writer who owns the slot, see
+	 *  Dmitry Vyukov's bounded MPMC queue.
+	 */
+	struct AsyncLogRecord
+	{
+		volatile long sequence;
+		log4cplus::LogLevel level;
+		size_t len;
+		char data[BLABBLE_ASYNC_LOG_RECORD_SIZE];
+	};
+
+	AsyncLogRecord* async_ring = NULL;
+	volatile long async_enqueue_pos = 0;
+	long async_dequeue_pos = 0;
+	bool async_block = false;
+
+	volatile long async_written = 0, async_dropped = 0, 
+		async_truncated = 0, async_blocked = 0;
+
+	boost::thread async_writer;
+	boost::mutex async_mutex;
+	boost::condition_variable async_cond;
+	volatile bool async_running = false;
+
+	void asyncWriterThread();
+	void asyncDrain();
+	long asyncDistance(long a, long b) { return (long)((unsigned long)a - (unsigned long)b); }
 }
 
 void BlabbleLogging::initLogging()
@@ -57,15 +95,171 @@ void BlabbleLogging::blabbleLog(int level, const char* data, int len)
 {
 	if (BlabbleLogging::logging_started)
 	{
-		wchar_t* wdata = new wchar_t[len + 1];
-		for (int i = 0; i < len; i++) 
+		if (BlabbleLogging::async_logging)
+		{
+			BlabbleLogging::asyncLog(log4cplus::DEBUG_LOG_LEVEL, data, len);
+		}
+		else
+		{
+			LOG4CPLUS_DEBUG(BlabbleLogging::blabble_logger, std::wstring(data, data + len));
+		}
+	}
+}
+
+void BlabbleLogging::startAsyncLogging(bool block)
+{
+	if (!BlabbleLogging::logging_started || BlabbleLogging::async_running)
+		return;
+
+	if (async_ring == NULL)
+		async_ring = new AsyncLogRecord[BLABBLE_ASYNC_LOG_RECORDS];
+	for (long i = 0; i < BLABBLE_ASYNC_LOG_RECORDS; i++)
+	{
+		async_ring[i].sequence = i;
+	}
+	async_enqueue_pos = async_dequeue_pos = 0;
+	async_block = block;
+
+	async_running = true;
+	async_writer = boost::thread(&BlabbleLogging::asyncWriterThread);
+	MEMORY_BARRIER();
+	async_logging = true;
+}
+
+void BlabbleLogging::stopAsyncLogging()
+{
+	if (!async_running)
+		return;
+
+	async_logging = false;
+	{
+		boost::mutex::scoped_lock lock(async_mutex);
+		async_running = false;
+	}
+	async_cond.notify_one();
+	async_writer.join();
+
+	//Lines queued by threads that saw async_logging just before it was cleared.
+	//The ring itself is kept since such a thread may still be copying into it.
+	asyncDrain();
+}
+
+void BlabbleLogging::asyncLog(log4cplus::LogLevel level, const char* data, size_t len)
+{
+	AsyncLogRecord* record;
+	long pos = async_enqueue_pos;
+	bool waited = false;
+
+	for (;;)
+	{
+		record = &async_ring[pos & (BLABBLE_ASYNC_LOG_RECORDS - 1)];
+		long seq = record->sequence;
+		MEMORY_BARRIER();
+		long dif = asyncDistance(seq, pos);
+		if (dif == 0)
+		{
+			long prev = ATOMIC_COMPARE_EXCHANGE(&async_enqueue_pos, pos, pos + 1);
+			if (prev == pos)
+				break;
+			pos = prev;
+		}
+		else if (dif < 0)
 		{
-			wdata[i] = static_cast<wchar_t>(data[i]);
+			//Ring is full
+			if (!async_block)
+			{
+				ATOMIC_INCREMENT(&async_dropped);
+				return;
+			}
+
+			if (!waited)
+			{
+				waited = true;
+				ATOMIC_INCREMENT(&async_blocked);
+			}
+			async_cond.notify_one();
+			boost::this_thread::yield();
+			pos = async_enqueue_pos;
+		}
+		else
+		{
+			pos = async_enqueue_pos;
 		}
-		wdata[len] = 0;
-		LOG4CPLUS_DEBUG(log4cplus::Logger::getInstance(L"Blabble"), std::wstring(wdata, 0, len));
-		delete[] wdata;
 	}
+
+	if (len > BLABBLE_ASYNC_LOG_RECORD_SIZE)
+	{
+		len = BLABBLE_ASYNC_LOG_RECORD_SIZE;
+		ATOMIC_INCREMENT(&async_truncated);
+	}
+	std::memcpy(record->data, data, len);
+	record->len = len;
+	record->level = level;
+	MEMORY_BARRIER();
+	record->sequence = pos + 1;
+
+	//Wake the writer early once the ring is getting full
+	if (asyncDistance(pos, async_dequeue_pos) > BLABBLE_ASYNC_LOG_RECORDS / 2)
+		async_cond.notify_one();
+}
+
+void BlabbleLogging::asyncDrain()
+{
+	for (;;)
+	{
+		AsyncLogRecord* record = &async_ring[async_dequeue_pos & (BLABBLE_ASYNC_LOG_RECORDS - 1)];
+		long seq = record->sequence;
+		MEMORY_BARRIER();
+		if (asyncDistance(seq, async_dequeue_pos + 1) < 0)
+			return;
+
+		//Trailing newlines are added by the layout
+		size_t len = record->len;
+		while (len > 0 && (record->data[len - 1] == '\n' || record->data[len - 1] == '\r'))
+			len--;
+
+		blabble_logger.forcedLog(record->level, 
+			std::wstring(record->data, record->data + len), __FILE__, __LINE__);
+
+		MEMORY_BARRIER();
+		record->sequence = async_dequeue_pos + BLABBLE_ASYNC_LOG_RECORDS;
+		async_dequeue_pos++;
+		ATOMIC_INCREMENT(&async_written);
+	}
+}
+
+void BlabbleLogging::asyncWriterThread()
+{
+	long reported_dropped = 0;
+	for (;;)
+	{
+		asyncDrain();
+
+		long dropped = async_dropped;
+		if (dropped != reported_dropped)
+		{
+			log4cplus::tostringstream msg;
+			msg << L"Asynchronous logging dropped " << (dropped - reported_dropped) 
+				<< L" lines, " << dropped << L" in total";
+			blabble_logger.forcedLog(log4cplus::WARN_LOG_LEVEL, msg.str(), __FILE__, __LINE__);
+			reported_dropped = dropped;
+		}
+
+		boost::mutex::scoped_lock lock(async_mutex);
+		if (!async_running)
+			return;
+		async_cond.timed_wait(lock, boost::posix_time::milliseconds(20));
+	}
+}
+
+BlabbleLogging::AsyncLogStats BlabbleLogging::getAsyncLogStats()
+{
+	AsyncLogStats stats;
+	stats.written = (unsigned long)async_written;
+	stats.dropped = (unsigned long)async_dropped;
+	stats.truncated = (unsigned long)async_truncated;
+	stats.blocked = (unsigned long)async_blocked;
+	return stats;
 }
 
 log4cplus::LogLevel BlabbleLogging::mapPJSIPLogLevel(int pjsipLevel) {
@@ -29,6 +29,38 @@ namespace BlabbleLogging {
 	 */
 	void blabbleLog(int level, const char* data, int len);
 
+	/*! @Brief Switch to asynchronous logging.
+	 *  From here on log lines are copied into a preallocated ring of
+	 *  BLABBLE_ASYNC_LOG_RECORDS records and written to log4cplus by a
+	 *  single background thread, so a slow disk never stalls the thread
+	 *  that is logging. When the ring is full a line is dropped and counted,
+	 *  or, if block is true, the logging thread waits for room.
+	 *  initLogging must have been called first.
+	 */
+	void startAsyncLogging(bool block);
+
+	/*! @Brief Write out anything still queued and stop the writer thread.
+	 *  Logging continues synchronously afterwards.
+	 */
+	void stopAsyncLogging();
+
+	/*! @Brief Queue a narrow log line for the asynchronous writer.
+	 *  Lines longer than BLABBLE_ASYNC_LOG_RECORD_SIZE are truncated.
+	 */
+	void asyncLog(log4cplus::LogLevel level, const char* data, size_t len);
+	inline void asyncLog(log4cplus::LogLevel level, const std::string& data) { asyncLog(level, data.c_str(), data.size()); }
+
+	/*! @Brief Counters kept by the asynchronous logger.
+	 */
+	struct AsyncLogStats
+	{
+		unsigned long written;		//!< Lines handed to log4cplus by the writer thread
+		unsigned long dropped;		//!< Lines lost because the ring was full
+		unsigned long truncated;	//!< Lines cut to fit a record
+		unsigned long blocked;		//!< Times a logging thread had to wait for room
+	};
+	AsyncLogStats getAsyncLogStats();
+
 	/*! @Brief Return the path to the log file
 	 *  Currently the log file will be stored in the userprofile path on windows, 
 	 *  directly on the C drive if that fails, or under /tmp on unix platforms.
@@ -42,41 +74,41 @@ namespace BlabbleLogging {
 	log4cplus::LogLevel mapPJSIPLogLevel(int pjsipLevel);
 
 	extern bool logging_started;
+	extern volatile bool async_logging;
 	extern log4cplus::Logger blabble_logger;
 	extern log4cplus::Logger js_logger;
 }
 
-#define BLABBLE_LOG_TRACE(what)								\
-	do {													\
-			if (BlabbleLogging::logging_started) {			\
-				LOG4CPLUS_TRACE(							\
-					BlabbleLogging::blabble_logger, what);	\
-			}												\
-	} while(0)
-
-#define BLABBLE_LOG_DEBUG(what)								\
-	do {													\
-			if (BlabbleLogging::logging_started) {			\
-				LOG4CPLUS_DEBUG(							\
-					BlabbleLogging::blabble_logger, what);	\
-			}												\
-	} while(0)
+#ifndef BLABBLE_ASYNC_LOG_RECORDS
+	#define BLABBLE_ASYNC_LOG_RECORDS		2048	//!< Must be a power of 2
+#endif
+#ifndef BLABBLE_ASYNC_LOG_RECORD_SIZE
+	#define BLABBLE_ASYNC_LOG_RECORD_SIZE	512
+#endif
 
-#define BLABBLE_LOG_WARN(what)								\
+#define BLABBLE_LOG(log4level, what)						\
 	do {													\
-			if (BlabbleLogging::logging_started) {			\
-				LOG4CPLUS_WARN(								\
-					BlabbleLogging::blabble_logger, what);	\
+			if (BlabbleLogging::logging_started &&			\
+				BlabbleLogging::blabble_logger.isEnabledFor(log4level)) {	\
+				if (BlabbleLogging::async_logging) {		\
+					std::ostringstream _blabble_buf;		\
+					_blabble_buf << what;					\
+					BlabbleLogging::asyncLog(log4level,		\
+						_blabble_buf.str());				\
+				} else {									\
+					log4cplus::tostringstream _log4cplus_buf;	\
+					_log4cplus_buf << what;					\
+					BlabbleLogging::blabble_logger.			\
+						forcedLog(log4level,				\
+						_log4cplus_buf.str(), __FILE__, __LINE__);	\
+				}											\
 			}												\
 	} while(0)
 
-#define BLABBLE_LOG_ERROR(what)								\
-	do {													\
-			if (BlabbleLogging::logging_started) {			\
-				LOG4CPLUS_ERROR(							\
-					BlabbleLogging::blabble_logger, what);	\
-			}												\
-	} while(0)
+#define BLABBLE_LOG_TRACE(what) BLABBLE_LOG(log4cplus::TRACE_LOG_LEVEL, what)
+#define BLABBLE_LOG_DEBUG(what) BLABBLE_LOG(log4cplus::DEBUG_LOG_LEVEL, what)
+#define BLABBLE_LOG_WARN(what) BLABBLE_LOG(log4cplus::WARN_LOG_LEVEL, what)
+#define BLABBLE_LOG_ERROR(what) BLABBLE_LOG(log4cplus::ERROR_LOG_LEVEL, what)
 
 #define BLABBLE_JS_LOG(level, what)							\
     do {													\
@@ -0,0 +1,89 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include "BlabbleMediaProfile.h"
+
+/*! @Brief Settings of one built in profile.
+ */
+struct MediaProfileDef
+{
+	const char* name;
+	unsigned int clock_rate, snd_clock_rate, audio_frame_ptime, quality, ec_tail_len;
+	int jb_init, jb_min_pre, jb_max_pre, jb_max;
+	unsigned int thread_cnt;
+};
+
+static const MediaProfileDef media_profiles[] = 
+{
+	//name, clock rate, sound clock rate, ptime, quality, ec tail, jb init, jb min prefetch, jb max prefetch, jb max, threads
+	{ "default", PJSUA_DEFAULT_CLOCK_RATE, 0, PJSUA_DEFAULT_AUDIO_FRAME_PTIME, 
+		PJSUA_DEFAULT_CODEC_QUALITY, PJSUA_DEFAULT_EC_TAIL_LEN, -1, -1, -1, -1, 1 },
+	{ "low-latency", 16000, 0, 10, 4, 0, 40, 20, 80, 160, 1 },
+	{ "low-cpu", 8000, 0, 20, 2, 0, -1, -1, -1, -1, 1 },
+	{ "wideband", 32000, 0, 20, 10, PJSUA_DEFAULT_EC_TAIL_LEN, -1, -1, -1, -1, 1 }
+};
+
+#define MEDIA_PROFILE_COUNT (sizeof(media_profiles) / sizeof(media_profiles[0]))
+
+bool BlabbleMediaProfile::Find(const std::string& name, BlabbleMediaProfile& profile)
+{
+	for (unsigned int i = 0; i < MEDIA_PROFILE_COUNT; i++)
+	{
+		const MediaProfileDef &def = media_profiles[i];
+		if (name != def.name)
+			continue;
+
+		profile.name = def.name;
+		profile.clock_rate = def.clock_rate;
+		profile.snd_clock_rate = def.snd_clock_rate;
+		profile.audio_frame_ptime = def.audio_frame_ptime;
+		profile.quality = def.quality;
+		profile.ec_tail_len = def.ec_tail_len;
+		profile.jb_init = def.jb_init;
+		profile.jb_min_pre = def.jb_min_pre;
+		profile.jb_max_pre = def.jb_max_pre;
+		profile.jb_max = def.jb_max;
+		profile.thread_cnt = def.thread_cnt;
+		return true;
+	}
+
+	return false;
+}
+
+std::vector<std::string> BlabbleMediaProfile::Names()
+{
+	std::vector<std::string> names;
+	for (unsigned int i = 0; i < MEDIA_PROFILE_COUNT; i++)
+	{
+		names.push_back(media_profiles[i].name);
+	}
+	return names;
+}
+
+void BlabbleMediaProfile::Apply(pjsua_media_config& cfg) const
+{
+	cfg.clock_rate = clock_rate;
+	cfg.snd_clock_rate = snd_clock_rate;
+	cfg.audio_frame_ptime = audio_frame_ptime;
+	cfg.quality = quality;
+	cfg.ec_tail_len = ec_tail_len;
+	cfg.jb_init = jb_init;
+	cfg.jb_min_pre = jb_min_pre;
+	cfg.jb_max_pre = jb_max_pre;
+	cfg.jb_max = jb_max;
+	cfg.thread_cnt = thread_cnt;
+}
+
+bool BlabbleMediaProfile::NeedsRestart(const BlabbleMediaProfile& other) const
+{
+	return clock_rate != other.clock_rate || 
+		audio_frame_ptime != other.audio_frame_ptime ||
+		quality != other.quality ||
+		thread_cnt != other.thread_cnt;
+}
@@ -0,0 +1,63 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleMediaProfile
+#define H_BlabbleMediaProfile
+
+#include <string>
+#include <vector>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief A named set of media engine settings.
+ *
+ *  The settings are chosen to work together, e.g. short frames come with a
+ *  small jitter buffer. clock_rate, audio_frame_ptime, quality and
+ *  thread_cnt configure the conference bridge and media threads and only
+ *  take effect when PJSIP is initialized. The sound device rate, echo
+ *  canceller and jitter buffer settings can be changed at any time and are
+ *  used by the next call.
+ *
+ *  Built in profiles are "default" (PJSIP's defaults), "low-latency" (10ms
+ *  frames, small jitter buffer, no echo canceller), "low-cpu" (narrowband,
+ *  linear resampling, no echo canceller) and "wideband" (32KHz bridge and
+ *  the best resampling).
+ */
+struct BlabbleMediaProfile
+{
+	std::string name;
+	unsigned int clock_rate;		//!< Conference bridge clock rate
+	unsigned int snd_clock_rate;	//!< Sound device clock rate, 0 for the bridge's rate
+	unsigned int audio_frame_ptime;	//!< Bridge and sound device frame length in msec
+	unsigned int quality;			//!< Resampling and codec quality, 0-10
+	unsigned int ec_tail_len;		//!< Echo canceller tail in msec, 0 to disable
+	int jb_init;					//!< Jitter buffer settings in msec, -1 for the stream default
+	int jb_min_pre;
+	int jb_max_pre;
+	int jb_max;
+	unsigned int thread_cnt;		//!< Media worker threads
+
+	/*! @Brief Look up a built in profile. Returns false if name is unknown.
+	 */
+	static bool Find(const std::string& name, BlabbleMediaProfile& profile);
+
+	/*! @Brief Names of every built in profile.
+	 */
+	static std::vector<std::string> Names();
+
+	/*! @Brief Copy every setting of this profile into cfg.
+	 */
+	void Apply(pjsua_media_config& cfg) const;
+
+	/*! @Brief True if other differs in a setting that only applies at initialization.
+	 */
+	bool NeedsRestart(const BlabbleMediaProfile& other) const;
+};
+
+#endif // H_BlabbleMediaProfile
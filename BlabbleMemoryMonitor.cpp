@@ -0,0 +1,322 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cstring>
+#include "BlabbleMemoryMonitor.h"
+#include "BlabbleMetrics.h"
+#include "BlabbleLogging.h"
+#include <pjsua-lib/pjsua_internal.h>
+
+static BlabbleGauge& memory_used = BlabbleMetrics::Gauge("memory.used");
+static BlabbleCounter& memory_leaked_calls = BlabbleMetrics::Counter("memory.leakedCalls");
+
+BlabbleMemoryMonitor* BlabbleMemoryMonitor::instance_ = NULL;
+void (*BlabbleMemoryMonitor::release_pool_)(pj_pool_factory *factory, pj_pool_t *pool) = NULL;
+
+BlabbleMemoryMonitor::BlabbleMemoryMonitor() :
+	leak_count_(0), watch_serial_(0), timer_armed_(false), started_(false), shutdown_(false)
+{
+}
+
+BlabbleMemoryMonitor::~BlabbleMemoryMonitor()
+{
+}
+
+void BlabbleMemoryMonitor::Start()
+{
+	//No pool of a call exists yet, so none can be released past us
+	instance_ = this;
+	release_pool_ = pjsua_var.cp.factory.release_pool;
+	pjsua_var.cp.factory.release_pool = &BlabbleMemoryMonitor::OnReleasePool;
+
+	boost::mutex::scoped_lock lock(mutex_);
+	started_ = true;
+	ArmTimer();
+}
+
+void BlabbleMemoryMonitor::Shutdown()
+{
+	if (instance_ == this)
+	{
+		pjsua_var.cp.factory.release_pool = release_pool_;
+		instance_ = NULL;
+	}
+	{
+		boost::mutex::scoped_lock lock(watch_mutex_);
+		watched_.clear();
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	shutdown_ = true;
+	checks_.clear();
+}
+
+//Static
+void BlabbleMemoryMonitor::OnReleasePool(pj_pool_factory *factory, pj_pool_t *pool)
+{
+	BlabbleMemoryMonitor *monitor = instance_;
+	if (monitor)
+	{
+		boost::mutex::scoped_lock lock(monitor->watch_mutex_);
+		monitor->watched_.erase(pool);
+	}
+	release_pool_(factory, pool);
+}
+
+void BlabbleMemoryMonitor::WatchCall(unsigned int id, pjsua_call_id call_id)
+{
+	if (call_id < 0 || call_id >= (pjsua_call_id)pjsua_call_get_max_count())
+		return;
+
+	Check check;
+	check.id = id;
+	check.due = Now() + BLABBLE_MEMORY_LEAK_CHECK_SEC * 1000;
+
+	//The session is torn down under this lock, so while it is held inv is alive
+	PJSUA_LOCK();
+	pjsua_call *call = &pjsua_var.calls[call_id];
+	if (call->inv && (unsigned int)(pj_ssize_t)call->user_data == id)
+	{
+		pj_pool_t* pools[] = { call->inv->dlg ? call->inv->dlg->pool : NULL, call->inv->pool,
+			call->inv->pool_prov, call->inv->pool_active };
+		for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++)
+		{
+			bool seen = pools[i] == NULL;
+			for (size_t n = 0; !seen && n < check.pools.size(); n++)
+				seen = check.pools[n].pool == pools[i];
+			if (seen)
+				continue;
+
+			WatchedPool watched;
+			watched.pool = pools[i];
+			watched.name = pj_pool_getobjname(pools[i]);
+			watched.serial = 0;
+			watched.held = 0;
+			check.pools.push_back(watched);
+		}
+
+		//Still under the PJSUA lock, so none of them can have been released yet
+		boost::mutex::scoped_lock lock(watch_mutex_);
+		for (size_t n = 0; n < check.pools.size(); n++)
+		{
+			check.pools[n].serial = ++watch_serial_;
+			watched_[check.pools[n].pool] = check.pools[n].serial;
+		}
+	}
+	PJSUA_UNLOCK();
+
+	if (check.pools.empty())
+		return;
+
+	boost::mutex::scoped_lock lock(mutex_);
+	if (!shutdown_)
+		checks_.push_back(check);
+}
+
+//Static
+BlabbleMemoryMonitor::Subsystem BlabbleMemoryMonitor::Classify(const char* name)
+{
+	//PJSIP names pools after their owner, e.g. "dlg0x1234" or "tdta0x5678". First match wins.
+	static const struct
+	{
+		const char* prefix;
+		Subsystem subsystem;
+	} pool_prefixes[] = {
+		{ "blabble-loop", OTHER },
+		//Ours
+		{ "blabble", AUDIO }, { "sndcache", AUDIO }, { "sndplay", AUDIO }, { "meter", AUDIO }, { "recorder", AUDIO },
+		//Sound device, bridge and tones
+		{ "pjsua_snd", AUDIO }, { "snd", AUDIO }, { "conf", AUDIO }, { "tonegen", AUDIO }, { "ec", AUDIO }, { "wav", AUDIO },
+		//Dialogs, invite sessions, streams and SDP
+		{ "dlg", CALLS }, { "inv", CALLS }, { "strm", CALLS }, { "stream", CALLS }, { "sdp", CALLS }, { "med", CALLS },
+		{ "ice", CALLS },
+		//Transports, messages in flight and transactions
+		{ "udp", TRANSPORTS }, { "tcp", TRANSPORTS }, { "tls", TRANSPORTS }, { "sip", TRANSPORTS },
+		{ "tdta", TRANSPORTS }, { "rtd", TRANSPORTS }, { "tsx", TRANSPORTS },
+		//Accounts, registrations and subscriptions
+		{ "acc", ACCOUNTS }, { "regc", ACCOUNTS }, { "evsub", ACCOUNTS }, { "pres", ACCOUNTS }, { "buddy", ACCOUNTS },
+		{ "pub", ACCOUNTS }
+	};
+
+	for (size_t i = 0; i < sizeof(pool_prefixes) / sizeof(pool_prefixes[0]); i++)
+	{
+		if (std::strncmp(name, pool_prefixes[i].prefix, std::strlen(pool_prefixes[i].prefix)) == 0)
+			return pool_prefixes[i].subsystem;
+	}
+	return OTHER;
+}
+
+//Static
+const char* BlabbleMemoryMonitor::SubsystemName(int subsystem)
+{
+	static const char* names[SUBSYSTEM_COUNT] = { "audio", "calls", "transports", "accounts", "other" };
+	return names[subsystem];
+}
+
+void BlabbleMemoryMonitor::Sample(pj_uint64_t now)
+{
+	Usage usage[SUBSYSTEM_COUNT];
+	std::vector<Check> due;
+	while (!checks_.empty() && checks_.front().due <= now)
+	{
+		due.push_back(checks_.front());
+		checks_.pop_front();
+	}
+
+	pj_caching_pool *cp = &pjsua_var.cp;
+	pj_lock_acquire(cp->lock);
+	for (pj_pool_t* pool = (pj_pool_t*)cp->used_list.next; pool != (pj_pool_t*)&cp->used_list; pool = pool->next)
+	{
+		Usage &u = usage[Classify(pool->obj_name)];
+		u.pools++;
+		u.size += pj_pool_get_capacity(pool);
+	}
+
+	//A released pool left watched_, or is in it again for a later call with a new serial.
+	//Releasing takes cp->lock, so a pool still watched here stays alive while it is read.
+	if (!due.empty())
+	{
+		boost::mutex::scoped_lock lock(watch_mutex_);
+		for (size_t i = 0; i < due.size(); i++)
+		{
+			for (size_t n = 0; n < due[i].pools.size(); n++)
+			{
+				WatchedPool &watched = due[i].pools[n];
+				std::map<pj_pool_t*, unsigned long>::iterator it = watched_.find(watched.pool);
+				if (it != watched_.end() && it->second == watched.serial)
+				{
+					watched.held = pj_pool_get_capacity(watched.pool);
+					watched_.erase(it);
+				}
+			}
+		}
+	}
+	pj_size_t used = cp->used_size;
+	pj_lock_release(cp->lock);
+
+	memory_used.Set((long)used);
+	for (int i = 0; i < SUBSYSTEM_COUNT; i++)
+	{
+		usage_[i].pools = usage[i].pools;
+		usage_[i].size = usage[i].size;
+		if (usage[i].size > usage_[i].peak)
+			usage_[i].peak = usage[i].size;
+	}
+
+	for (size_t i = 0; i < due.size(); i++)
+	{
+		Leak leak;
+		leak.id = due[i].id;
+		leak.size = 0;
+		for (size_t n = 0; n < due[i].pools.size(); n++)
+		{
+			if (due[i].pools[n].held > 0)
+			{
+				leak.pools.push_back(due[i].pools[n].name);
+				leak.size += due[i].pools[n].held;
+			}
+		}
+		if (leak.pools.empty())
+			continue;
+
+		BLABBLE_LOG_WARN("BlabbleMemoryMonitor call " << leak.id << " still holds " << leak.pools.size() <<
+			" pools " << BLABBLE_MEMORY_LEAK_CHECK_SEC << " seconds after it ended, first is " <<
+			leak.pools.front().c_str() << ".");
+		memory_leaked_calls.Increment();
+		leak_count_++;
+		leaks_.push_back(leak);
+		if (leaks_.size() > BLABBLE_MEMORY_MAX_LEAKS)
+			leaks_.pop_front();
+	}
+}
+
+//Static
+void BlabbleMemoryMonitor::OnTimer(void *user_data)
+{
+	BlabbleMemoryMonitor *monitor = static_cast<BlabbleMemoryMonitor*>(user_data);
+	boost::mutex::scoped_lock lock(monitor->mutex_);
+	monitor->timer_armed_ = false;
+	if (monitor->shutdown_)
+		return;
+
+	monitor->Sample(Now());
+	monitor->ArmTimer();
+}
+
+void BlabbleMemoryMonitor::ArmTimer()
+{
+	if (timer_armed_ || shutdown_)
+		return;
+
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleMemoryMonitor::OnTimer, this, BLABBLE_MEMORY_SAMPLE_MSEC);
+	if (status == PJ_SUCCESS)
+	{
+		timer_armed_ = true;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleMemoryMonitor::ArmTimer failed to schedule timer, got status: " << status);
+	}
+}
+
+//Static
+pj_uint64_t BlabbleMemoryMonitor::Now()
+{
+	pj_time_val now;
+	pj_gettickcount(&now);
+	return (pj_uint64_t)now.sec * 1000 + now.msec;
+}
+
+FB::VariantMap BlabbleMemoryMonitor::stats()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	FB::VariantMap map;
+	if (!started_ || shutdown_)
+		return map;
+
+	Sample(Now());
+
+	pj_caching_pool *cp = &pjsua_var.cp;
+	pj_lock_acquire(cp->lock);
+	map["used"] = (long)cp->used_size;
+	map["peak"] = (long)cp->peak_used_size;
+	map["capacity"] = (long)cp->capacity;
+	map["maxCapacity"] = (long)cp->max_capacity;
+	map["pools"] = (long)cp->used_count;
+	pj_lock_release(cp->lock);
+
+	FB::VariantMap subsystems;
+	for (int i = 0; i < SUBSYSTEM_COUNT; i++)
+	{
+		FB::VariantMap subsystem;
+		subsystem["pools"] = (long)usage_[i].pools;
+		subsystem["size"] = (long)usage_[i].size;
+		subsystem["peak"] = (long)usage_[i].peak;
+		subsystems[SubsystemName(i)] = subsystem;
+	}
+	map["subsystems"] = subsystems;
+
+	FB::VariantList leaks;
+	for (std::deque<Leak>::const_iterator it = leaks_.begin(); it != leaks_.end(); it++)
+	{
+		FB::VariantList pools;
+		for (size_t i = 0; i < it->pools.size(); i++)
+			pools.push_back(it->pools[i]);
+
+		FB::VariantMap leak;
+		leak["id"] = (long)it->id;
+		leak["pools"] = pools;
+		leak["size"] = (long)it->size;
+		leaks.push_back(leak);
+	}
+	map["leaks"] = leak_count_;
+	map["pendingChecks"] = (long)checks_.size();
+	map["leakedCalls"] = leaks;
+	return map;
+}
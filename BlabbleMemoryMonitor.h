@@ -0,0 +1,159 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleMemoryMonitor
+#define H_BlabbleMemoryMonitor
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "JSAPIAuto.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief How often pool usage is sampled for the peaks and leak checks run, in milliseconds.
+ */
+#ifndef BLABBLE_MEMORY_SAMPLE_MSEC
+#define BLABBLE_MEMORY_SAMPLE_MSEC 10000
+#endif
+
+/*! @Brief How long after a call ends its pools must be gone, in seconds.
+ *  A dialog outlives its call until every transaction has terminated,
+ *  which is 64*T1 = 32 seconds for an unanswered INVITE over UDP.
+ */
+#ifndef BLABBLE_MEMORY_LEAK_CHECK_SEC
+#define BLABBLE_MEMORY_LEAK_CHECK_SEC 64
+#endif
+
+/*! @Brief Leaked calls kept for JavaScript; older ones are only counted.
+ */
+#ifndef BLABBLE_MEMORY_MAX_LEAKS
+#define BLABBLE_MEMORY_MAX_LEAKS 32
+#endif
+
+/*! @class  BlabbleMemoryMonitor
+ *
+ *  @brief  Accounts for the memory PJSIP pools take from PJSUA's caching pool.
+ *
+ *  Every pool, ours and PJSIP's, comes from pjsua_var.cp, which only knows
+ *  the total. The monitor walks the caching pool's list of pools in use
+ *  and sorts them into audio, calls, transports, accounts and other by
+ *  the pool name, which PJSIP derives from the object owning the pool, and
+ *  tracks the peak of each at every sample.
+ *
+ *  When a call ends the pools of its SIP session are noted. The monitor
+ *  wraps the caching pool's release_pool, so it sees each of them go back
+ *  even if the factory hands the same pool out again right away. If any
+ *  of them has not gone back BLABBLE_MEMORY_LEAK_CHECK_SEC later the call
+ *  is reported as leaking.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleMemoryMonitor
+{
+public:
+	BlabbleMemoryMonitor();
+	virtual ~BlabbleMemoryMonitor();
+
+	/*! @Brief Start sampling. Must be called after pjsua_init.
+	 */
+	void Start();
+
+	/*! @Brief Stop sampling and drop pending checks. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief Check later that the pools of call_id went back to the factory.
+	 *  id is the call's global id, which must still be the user data of
+	 *  call_id; call before pjsua_call_hangup.
+	 */
+	void WatchCall(unsigned int id, pjsua_call_id call_id);
+
+	/*! @Brief Object for JavaScript with "used", "peak", "capacity",
+	 *  "maxCapacity" and "pools" for the whole caching pool, "subsystems"
+	 *  mapping audio, calls, transports, accounts and other to objects with
+	 *  "pools", "size" and "peak", and "leaks", "pendingChecks" and
+	 *  "leakedCalls". Sizes are in bytes. leakedCalls lists recent leaks as
+	 *  objects with "id", "pools" (names) and "size".
+	 */
+	FB::VariantMap stats();
+
+private:
+	enum Subsystem { AUDIO, CALLS, TRANSPORTS, ACCOUNTS, OTHER, SUBSYSTEM_COUNT };
+
+	struct Usage
+	{
+		Usage() : pools(0), size(0), peak(0) { }
+		unsigned long pools;
+		pj_size_t size;
+		pj_size_t peak;
+	};
+
+	struct WatchedPool
+	{
+		pj_pool_t* pool;
+		std::string name;
+		unsigned long serial;	//!< Matches watched_[pool] until the pool is released
+		pj_size_t held;			//!< Capacity if still in use at the check, else 0
+	};
+
+	struct Check
+	{
+		unsigned int id;
+		pj_uint64_t due;
+		std::vector<WatchedPool> pools;
+	};
+
+	struct Leak
+	{
+		unsigned int id;
+		std::vector<std::string> pools;
+		pj_size_t size;
+	};
+
+	static Subsystem Classify(const char* name);
+	static const char* SubsystemName(int subsystem);
+
+	/*! @Brief Walk the caching pool, update usage_ and run due checks. Call with mutex_ held.
+	 */
+	void Sample(pj_uint64_t now);
+
+	static void OnTimer(void *user_data);
+
+	/*! @Brief Installed as the caching pool's release_pool, forgets pool and calls the original.
+	 */
+	static void OnReleasePool(pj_pool_factory *factory, pj_pool_t *pool);
+
+	/*! @Brief Schedule the next sample. Call with mutex_ held.
+	 */
+	void ArmTimer();
+
+	static pj_uint64_t Now();
+
+	boost::mutex mutex_;
+	Usage usage_[SUBSYSTEM_COUNT];
+	std::deque<Check> checks_;
+	std::deque<Leak> leaks_;
+	long leak_count_;
+
+	boost::mutex watch_mutex_;	//!< Taken on every pool release, never held while taking another lock
+	std::map<pj_pool_t*, unsigned long> watched_;	//!< Pools not released yet and their serial
+	unsigned long watch_serial_;
+
+	bool timer_armed_;
+	bool started_;
+	bool shutdown_;
+
+	static BlabbleMemoryMonitor* instance_;
+	static void (*release_pool_)(pj_pool_factory *factory, pj_pool_t *pool);
+};
+
+#endif // H_BlabbleMemoryMonitor
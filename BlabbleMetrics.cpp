@@ -0,0 +1,169 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include "BlabbleMetrics.h"
+
+const unsigned long BlabbleHistogram::bounds[BLABBLE_HISTOGRAM_BUCKETS - 1] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000,
+	10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+BlabbleHistogram::BlabbleHistogram() :
+	count_(0), max_(0)
+{
+	for (int i = 0; i < BLABBLE_HISTOGRAM_BUCKETS; i++)
+		buckets_[i] = 0;
+}
+
+void BlabbleHistogram::Record(unsigned long usec)
+{
+	int i = 0;
+	while (i < BLABBLE_HISTOGRAM_BUCKETS - 1 && usec > bounds[i])
+		i++;
+
+	ATOMIC_INCREMENT(&buckets_[i]);
+	ATOMIC_INCREMENT(&count_);
+
+	long value = (long)usec, max;
+	while (value > (max = max_) && ATOMIC_COMPARE_EXCHANGE(&max_, max, value) != max);
+}
+
+FB::VariantMap BlabbleHistogram::Snapshot() const
+{
+	long counts[BLABBLE_HISTOGRAM_BUCKETS];
+	long total = 0;
+	for (int i = 0; i < BLABBLE_HISTOGRAM_BUCKETS; i++)
+		total += (counts[i] = buckets_[i]);
+
+	FB::VariantList buckets;
+	const double percentiles[] = { 0.50, 0.90, 0.99 };
+	const char* names[] = { "p50", "p90", "p99" };
+	long found[] = { -1, -1, -1 };
+	long seen = 0;
+
+	for (int i = 0; i < BLABBLE_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += counts[i];
+		//The last bucket has no bound, the largest value recorded stands in for it
+		long bound = i < BLABBLE_HISTOGRAM_BUCKETS - 1 ? (long)bounds[i] : (long)max_;
+		for (int p = 0; p < 3; p++)
+		{
+			if (found[p] < 0 && total > 0 && seen >= percentiles[p] * total)
+				found[p] = bound;
+		}
+
+		FB::VariantMap bucket;
+		if (i < BLABBLE_HISTOGRAM_BUCKETS - 1)
+			bucket["le"] = (long)bounds[i];
+		bucket["count"] = counts[i];
+		buckets.push_back(bucket);
+	}
+
+	FB::VariantMap map;
+	map["count"] = total;
+	map["max"] = (long)max_;
+	for (int p = 0; p < 3; p++)
+		map[names[p]] = found[p] < 0 ? 0L : found[p];
+	map["buckets"] = buckets;
+	return map;
+}
+
+BlabbleMetricsTimer::~BlabbleMetricsTimer()
+{
+	pj_timestamp now;
+	pj_get_timestamp(&now);
+	histogram_.Record(pj_elapsed_usec(&start_, &now));
+}
+
+namespace
+{
+	struct Registry
+	{
+		boost::mutex mutex;
+		std::map<std::string, boost::shared_ptr<BlabbleCounter> > counters;
+		std::map<std::string, boost::shared_ptr<BlabbleGauge> > gauges;
+		std::map<std::string, boost::shared_ptr<BlabbleHistogram> > histograms;
+	};
+
+	//Built on first use, which is during static initialization for every metric
+	//looked up at file scope, so it exists before any other thread can get here
+	Registry& GetRegistry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	template <class T>
+	T& Find(std::map<std::string, boost::shared_ptr<T> >& metrics, const std::string& name)
+	{
+		boost::shared_ptr<T>& metric = metrics[name];
+		if (!metric)
+			metric = boost::make_shared<T>();
+		return *metric;
+	}
+}
+
+//Static
+BlabbleCounter& BlabbleMetrics::Counter(const std::string& name)
+{
+	Registry& registry = GetRegistry();
+	boost::mutex::scoped_lock lock(registry.mutex);
+	return Find(registry.counters, name);
+}
+
+//Static
+BlabbleGauge& BlabbleMetrics::Gauge(const std::string& name)
+{
+	Registry& registry = GetRegistry();
+	boost::mutex::scoped_lock lock(registry.mutex);
+	return Find(registry.gauges, name);
+}
+
+//Static
+BlabbleHistogram& BlabbleMetrics::Histogram(const std::string& name)
+{
+	Registry& registry = GetRegistry();
+	boost::mutex::scoped_lock lock(registry.mutex);
+	return Find(registry.histograms, name);
+}
+
+//Static
+FB::VariantMap BlabbleMetrics::Snapshot()
+{
+	Registry& registry = GetRegistry();
+	FB::VariantMap counters, gauges, histograms;
+	{
+		boost::mutex::scoped_lock lock(registry.mutex);
+		for (std::map<std::string, boost::shared_ptr<BlabbleCounter> >::iterator it = registry.counters.begin();
+			it != registry.counters.end(); it++)
+		{
+			counters[it->first] = it->second->value();
+		}
+		for (std::map<std::string, boost::shared_ptr<BlabbleGauge> >::iterator it = registry.gauges.begin();
+			it != registry.gauges.end(); it++)
+		{
+			gauges[it->first] = it->second->value();
+		}
+		for (std::map<std::string, boost::shared_ptr<BlabbleHistogram> >::iterator it = registry.histograms.begin();
+			it != registry.histograms.end(); it++)
+		{
+			histograms[it->first] = it->second->Snapshot();
+		}
+	}
+
+	FB::VariantMap map;
+	map["counters"] = counters;
+	map["gauges"] = gauges;
+	map["histograms"] = histograms;
+	return map;
+}
@@ -0,0 +1,129 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleMetrics
+#define H_BlabbleMetrics
+
+#include <string>
+#include "JSAPIAuto.h"
+#include <boost/noncopyable.hpp>
+#include <pjlib.h>
+#include "BlabbleAtomic.h"
+
+/*! @Brief Number of buckets in a BlabbleHistogram, the last one catching everything above 1 second.
+ */
+#define BLABBLE_HISTOGRAM_BUCKETS 17
+
+/*! @class  BlabbleCounter
+ *
+ *  @brief  A value that only goes up, e.g. events handled.
+ */
+class BlabbleCounter : boost::noncopyable
+{
+public:
+	BlabbleCounter() : value_(0) { }
+
+	void Increment() { ATOMIC_INCREMENT(&value_); }
+	void Add(long n) { ATOMIC_ADD(&value_, n); }
+	long value() const { return value_; }
+
+private:
+	volatile long value_;
+};
+
+/*! @class  BlabbleGauge
+ *
+ *  @brief  A value that goes up and down, e.g. events waiting for delivery.
+ */
+class BlabbleGauge : boost::noncopyable
+{
+public:
+	BlabbleGauge() : value_(0) { }
+
+	void Set(long n) { INTERLOCKED_EXCHANGE(&value_, n); }
+	void Add(long n) { ATOMIC_ADD(&value_, n); }
+	long value() const { return value_; }
+
+private:
+	volatile long value_;
+};
+
+/*! @class  BlabbleHistogram
+ *
+ *  @brief  Durations in microseconds counted in fixed buckets.
+ *
+ *  Bucket bounds run from 10us to 1s in 1, 2.5, 5 steps. Recording is a
+ *  short scan and two or three atomic operations, so it can be used on any
+ *  PJSIP thread. Percentiles are reported as the upper bound of the bucket
+ *  they fall in.
+ */
+class BlabbleHistogram : boost::noncopyable
+{
+public:
+	BlabbleHistogram();
+
+	void Record(unsigned long usec);
+
+	/*! @Brief Object with "count", "max", "p50", "p90", "p99" and "buckets" properties.
+	 *  buckets is an array of objects with "le" (upper bound in microseconds,
+	 *  left out for the last bucket) and "count".
+	 */
+	FB::VariantMap Snapshot() const;
+
+	static const unsigned long bounds[BLABBLE_HISTOGRAM_BUCKETS - 1];
+
+private:
+	volatile long buckets_[BLABBLE_HISTOGRAM_BUCKETS];
+	volatile long count_;
+	volatile long max_;
+};
+
+/*! @class  BlabbleMetricsTimer
+ *
+ *  @brief  Records the lifetime of the object in a histogram.
+ */
+class BlabbleMetricsTimer : boost::noncopyable
+{
+public:
+	BlabbleMetricsTimer(BlabbleHistogram& histogram) : histogram_(histogram) { pj_get_timestamp(&start_); }
+	~BlabbleMetricsTimer();
+
+private:
+	BlabbleHistogram& histogram_;
+	pj_timestamp start_;
+};
+
+/*! @class  BlabbleMetrics
+ *
+ *  @brief  Process wide registry of named counters, gauges and histograms.
+ *
+ *  Metrics are created on first lookup and live until the process exits,
+ *  so the returned references can be kept. Lookups take a lock; hot paths
+ *  look their metrics up once, at static initialization, and afterwards
+ *  only touch the atomics.
+ *
+ *  Names are dotted, e.g. "callback.onCallState.usec". Histograms hold
+ *  microseconds.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleMetrics
+{
+public:
+	static BlabbleCounter& Counter(const std::string& name);
+	static BlabbleGauge& Gauge(const std::string& name);
+	static BlabbleHistogram& Histogram(const std::string& name);
+
+	/*! @Brief Every metric as one object with "counters", "gauges" and "histograms"
+	 *  properties, each mapping names to values.
+	 */
+	static FB::VariantMap Snapshot();
+};
+
+#endif // H_BlabbleMetrics
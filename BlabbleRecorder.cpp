@@ -0,0 +1,559 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+#include <boost/bind.hpp>
+#include "BlabbleRecorder.h"
+#include "BlabbleAtomic.h"
+#include "BlabbleLogging.h"
+
+#define WAV_HEADER_SIZE 44
+
+/*! @Brief Conference bridge sink feeding one channel of a recording.
+ */
+struct RecordPort
+{
+	pjmedia_port base;
+	BlabbleRecording* recording;
+	unsigned int channel;
+};
+
+static pj_status_t RecordPutFrame(pjmedia_port *this_port, pjmedia_frame *frame)
+{
+	RecordPort *port = reinterpret_cast<RecordPort*>(this_port);
+	port->recording->Capture(port->channel, frame);
+	return PJ_SUCCESS;
+}
+
+static pj_status_t RecordGetFrame(pjmedia_port *, pjmedia_frame *frame)
+{
+	//Recordings are sinks, they never send anything back into the bridge
+	frame->type = PJMEDIA_FRAME_TYPE_NONE;
+	frame->size = 0;
+	return PJ_SUCCESS;
+}
+
+//Windows opens these devices whatever the extension, e.g. NUL.wav
+static bool IsReservedName(const std::string& name)
+{
+	static const char* reserved[] = { "CON", "PRN", "AUX", "NUL" };
+
+	std::string base = name.substr(0, name.find('.'));
+	base.erase(base.find_last_not_of(' ') + 1);
+	for (size_t i = 0; i < base.size(); i++)
+		base[i] = (char)std::toupper((unsigned char)base[i]);
+
+	for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++)
+	{
+		if (base == reserved[i])
+			return true;
+	}
+	return base.size() == 4 && (base.compare(0, 3, "COM") == 0 || base.compare(0, 3, "LPT") == 0) &&
+		base[3] >= '1' && base[3] <= '9';
+}
+
+//WAV files are little endian whatever the host is
+static void PutLE(char* out, pj_uint32_t value, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++)
+	{
+		out[i] = (char)((value >> (8 * i)) & 0xff);
+	}
+}
+
+static void BuildWavHeader(char* out, unsigned int channels, unsigned int clock_rate, pj_uint32_t data_bytes)
+{
+	std::memcpy(out, "RIFF", 4);
+	PutLE(out + 4, 36 + data_bytes, 4);
+	std::memcpy(out + 8, "WAVEfmt ", 8);
+	PutLE(out + 16, 16, 4);
+	PutLE(out + 20, 1, 2); //PCM
+	PutLE(out + 22, channels, 2);
+	PutLE(out + 24, clock_rate, 4);
+	PutLE(out + 28, clock_rate * channels * 2, 4);
+	PutLE(out + 32, channels * 2, 2);
+	PutLE(out + 34, 16, 2);
+	std::memcpy(out + 36, "data", 4);
+	PutLE(out + 40, data_bytes, 4);
+}
+
+BlabbleRecording::BlabbleRecording(BlabbleRecorder* recorder, const std::string& path, const std::string& name,
+	bool stereo, unsigned int clock_rate, unsigned int samples_per_frame) :
+	recorder_(recorder), path_(path), name_(name), channels_(stereo ? 2 : 1), clock_rate_(clock_rate),
+	samples_per_frame_(samples_per_frame), file_(NULL), data_bytes_(0), pool_(NULL),
+	source_(PJSUA_INVALID_ID), detached_(false), stopping_(false), overruns_(0),
+	write_errors_(0), bytes_written_(0)
+{
+	ring_frames_ = (long)(BLABBLE_RECORD_RING_MSEC * (clock_rate / 1000) / samples_per_frame);
+	if (ring_frames_ < 4)
+		ring_frames_ = 4;
+
+	for (unsigned int i = 0; i < channels_; i++)
+	{
+		rings_[i].samples.resize(ring_frames_ * samples_per_frame_);
+		rings_[i].seq.resize(ring_frames_);
+		ports_[i] = NULL;
+		slots_[i] = PJSUA_INVALID_ID;
+	}
+	silence_.resize(samples_per_frame_, 0);
+	buffer_.reserve(BLABBLE_RECORD_WRITE_BYTES + samples_per_frame_ * channels_ * 2);
+}
+
+BlabbleRecording::~BlabbleRecording()
+{
+	Detach();
+	if (file_ != NULL)
+		std::fclose(file_);
+}
+
+void BlabbleRecording::Open()
+{
+	//Never replace a file, the directory also holds the plugin's own sounds
+#ifdef WIN32
+	int fd = _open(path_.c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+#endif
+	if (fd < 0)
+	{
+		if (errno == EEXIST)
+			throw std::runtime_error(name_ + " already exists.");
+		throw std::runtime_error("Unable to open " + path_ + " for recording.");
+	}
+
+#ifdef WIN32
+	file_ = _fdopen(fd, "wb");
+#else
+	file_ = fdopen(fd, "wb");
+#endif
+	if (file_ == NULL)
+	{
+#ifdef WIN32
+		_close(fd);
+#else
+		close(fd);
+#endif
+		throw std::runtime_error("Unable to open " + path_ + " for recording.");
+	}
+
+	//Writes are already batched, so skip the stdio buffer
+	std::setvbuf(file_, NULL, _IONBF, 0);
+
+	char header[WAV_HEADER_SIZE];
+	BuildWavHeader(header, channels_, clock_rate_, 0);
+	if (std::fwrite(header, 1, WAV_HEADER_SIZE, file_) != WAV_HEADER_SIZE)
+	{
+		std::fclose(file_);
+		file_ = NULL;
+		throw std::runtime_error("Unable to write to " + path_ + ".");
+	}
+}
+
+void BlabbleRecording::Attach(pjsua_conf_port_id source)
+{
+	pool_ = pjsua_pool_create("recorder", 512, 512);
+	if (pool_ == NULL)
+		throw std::runtime_error("Unable to allocate memory for recording.");
+
+	pj_str_t name = pj_str(const_cast<char*>("recorder"));
+	for (unsigned int i = 0; i < channels_; i++)
+	{
+		ports_[i] = PJ_POOL_ZALLOC_T(pool_, RecordPort);
+		pjmedia_port_info_init(&ports_[i]->base.info, &name, PJMEDIA_SIG_CLASS_APP('B', 'R', 'C'),
+			clock_rate_, 1, 16, samples_per_frame_);
+		ports_[i]->base.put_frame = &RecordPutFrame;
+		ports_[i]->base.get_frame = &RecordGetFrame;
+		ports_[i]->recording = this;
+		ports_[i]->channel = i;
+
+		pj_status_t status = pjsua_conf_add_port(pool_, &ports_[i]->base, &slots_[i]);
+		if (status != PJ_SUCCESS)
+		{
+			BLABBLE_LOG_ERROR("BlabbleRecording::Attach failed to add port, got status: " << status);
+			throw std::runtime_error("Unable to add the recording to the conference bridge.");
+		}
+	}
+
+	//The microphone goes to the first channel, the call to the last
+	pjsua_conf_connect(0, slots_[0]);
+	source_ = source;
+	if (source_ != PJSUA_INVALID_ID)
+		pjsua_conf_connect(source_, slots_[channels_ - 1]);
+}
+
+void BlabbleRecording::SetSource(pjsua_conf_port_id source)
+{
+	pjsua_conf_port_id old, sink;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (detached_ || source == source_)
+			return;
+
+		old = source_;
+		source_ = source;
+		sink = slots_[channels_ - 1];
+	}
+
+	if (sink == PJSUA_INVALID_ID)
+		return;
+	if (old != PJSUA_INVALID_ID)
+		pjsua_conf_disconnect(old, sink);
+	if (source != PJSUA_INVALID_ID)
+		pjsua_conf_connect(source, sink);
+}
+
+void BlabbleRecording::Detach()
+{
+	pjsua_conf_port_id slots[2] = { PJSUA_INVALID_ID, PJSUA_INVALID_ID };
+	pj_pool_t* pool;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (detached_)
+			return;
+
+		detached_ = true;
+		for (unsigned int i = 0; i < channels_; i++)
+		{
+			slots[i] = slots_[i];
+			slots_[i] = PJSUA_INVALID_ID;
+			ports_[i] = NULL;
+		}
+		pool = pool_;
+		pool_ = NULL;
+	}
+
+	//Once a port is removed the bridge will not call it again
+	for (unsigned int i = 0; i < channels_; i++)
+	{
+		if (slots[i] != PJSUA_INVALID_ID)
+			pjsua_conf_remove_port(slots[i]);
+	}
+
+	if (pool != NULL)
+		pj_pool_release(pool);
+}
+
+void BlabbleRecording::Capture(unsigned int channel, const pjmedia_frame* frame)
+{
+	Ring &ring = rings_[channel];
+	unsigned long seq = ring.next_seq++;
+	long head = ring.head;
+
+	if (Queued(ring) >= ring_frames_)
+	{
+		ATOMIC_INCREMENT(&overruns_);
+		return;
+	}
+
+	unsigned long index = (unsigned long)head % ring_frames_;
+	pj_int16_t* dest = &ring.samples[index * samples_per_frame_];
+	size_t bytes = samples_per_frame_ * sizeof(pj_int16_t), copied = 0;
+	if (frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->buf != NULL)
+	{
+		copied = frame->size < bytes ? frame->size : bytes;
+		std::memcpy(dest, frame->buf, copied);
+	}
+	if (copied < bytes)
+		std::memset((char*)dest + copied, 0, bytes - copied);
+	ring.seq[index] = seq;
+
+	MEMORY_BARRIER();
+	ring.head = head + 1;
+
+	if (Queued(ring) >= ring_frames_ / 2)
+		recorder_->Wake();
+}
+
+void BlabbleRecording::AppendSamples(const pj_int16_t* left, const pj_int16_t* right)
+{
+	size_t offset = buffer_.size();
+	buffer_.resize(offset + samples_per_frame_ * channels_ * 2);
+	char* out = &buffer_[offset];
+
+	for (unsigned int i = 0; i < samples_per_frame_; i++)
+	{
+		PutLE(out, (pj_uint16_t)left[i], 2);
+		out += 2;
+		if (right != NULL)
+		{
+			PutLE(out, (pj_uint16_t)right[i], 2);
+			out += 2;
+		}
+	}
+}
+
+void BlabbleRecording::Drain(bool final)
+{
+	if (channels_ == 1)
+	{
+		Ring &ring = rings_[0];
+		long queued = Queued(ring);
+		MEMORY_BARRIER();
+		for (long i = 0; i < queued; i++)
+		{
+			unsigned long index = (unsigned long)ring.tail % ring_frames_;
+			AppendSamples(&ring.samples[index * samples_per_frame_], NULL);
+			MEMORY_BARRIER();
+			ring.tail = ring.tail + 1;
+		}
+	}
+	else
+	{
+		Ring &left = rings_[0], &right = rings_[1];
+		for (;;)
+		{
+			long queued_left = Queued(left), queued_right = Queued(right);
+			MEMORY_BARRIER();
+			if (queued_left == 0 && queued_right == 0)
+				break;
+
+			//The partner frame is usually just a moment behind, so wait for it
+			//unless this is the end or the other channel has fallen well behind
+			if ((queued_left == 0 || queued_right == 0) && !final &&
+				queued_left + queued_right < ring_frames_ / 4)
+			{
+				break;
+			}
+
+			unsigned long left_index = (unsigned long)left.tail % ring_frames_;
+			unsigned long right_index = (unsigned long)right.tail % ring_frames_;
+			bool take_left = queued_left > 0 && (queued_right == 0 ||
+				(long)(left.seq[left_index] - right.seq[right_index]) <= 0);
+			bool take_right = queued_right > 0 && (queued_left == 0 ||
+				(long)(right.seq[right_index] - left.seq[left_index]) <= 0);
+
+			AppendSamples(take_left ? &left.samples[left_index * samples_per_frame_] : &silence_[0],
+				take_right ? &right.samples[right_index * samples_per_frame_] : &silence_[0]);
+
+			MEMORY_BARRIER();
+			if (take_left)
+				left.tail = left.tail + 1;
+			if (take_right)
+				right.tail = right.tail + 1;
+		}
+	}
+
+	if (final || buffer_.size() >= BLABBLE_RECORD_WRITE_BYTES)
+		Flush();
+}
+
+void BlabbleRecording::Flush()
+{
+	if (file_ != NULL && !buffer_.empty())
+	{
+		size_t written = std::fwrite(&buffer_[0], 1, buffer_.size(), file_);
+		if (written != buffer_.size())
+			ATOMIC_INCREMENT(&write_errors_);
+
+		data_bytes_ += (unsigned long)written;
+		INTERLOCKED_EXCHANGE(&bytes_written_, (long)data_bytes_);
+	}
+	buffer_.clear();
+}
+
+void BlabbleRecording::Close()
+{
+	Flush();
+	if (file_ == NULL)
+		return;
+
+	char header[WAV_HEADER_SIZE];
+	BuildWavHeader(header, channels_, clock_rate_, (pj_uint32_t)data_bytes_);
+	if (std::fseek(file_, 0, SEEK_SET) != 0 ||
+		std::fwrite(header, 1, WAV_HEADER_SIZE, file_) != WAV_HEADER_SIZE)
+	{
+		ATOMIC_INCREMENT(&write_errors_);
+	}
+
+	if (std::fclose(file_) != 0)
+		ATOMIC_INCREMENT(&write_errors_);
+	file_ = NULL;
+
+	if (write_errors_ > 0 || overruns_ > 0)
+	{
+		BLABBLE_LOG_ERROR("BlabbleRecording::Close " << path_.c_str() << " finished with " << write_errors_
+			<< " write errors and " << overruns_ << " overruns.");
+	}
+}
+
+FB::VariantMap BlabbleRecording::stats()
+{
+	FB::VariantMap map;
+	long bytes = bytes_written_;
+	map["file"] = name_;
+	map["stereo"] = channels_ == 2;
+	map["seconds"] = (double)bytes / (clock_rate_ * channels_ * 2);
+	map["bytes"] = bytes;
+	map["overruns"] = (long)overruns_;
+	map["writeErrors"] = (long)write_errors_;
+	map["recording"] = active();
+	return map;
+}
+
+BlabbleRecorder::BlabbleRecorder() :
+	running_(false), shutdown_(false)
+{
+}
+
+BlabbleRecorder::~BlabbleRecorder()
+{
+	Shutdown();
+}
+
+void BlabbleRecorder::set_directory(const std::string& directory)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	directory_ = directory;
+}
+
+std::string BlabbleRecorder::directory()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	return directory_;
+}
+
+BlabbleRecordingPtr BlabbleRecorder::Start(const std::string& name, bool stereo, pjsua_conf_port_id source)
+{
+	//The name comes from JavaScript, keep it inside the recording directory
+	if (name.empty() || name[0] == '.' || name.find_first_of("/\\:") != std::string::npos ||
+		IsReservedName(name))
+	{
+		throw std::runtime_error("Recording name must be a plain file name.");
+	}
+
+	std::string directory = this->directory();
+	if (directory.empty())
+		throw std::runtime_error("No recording directory is set.");
+
+	std::string file = name;
+	if (file.size() < 4 || file.compare(file.size() - 4, 4, ".wav") != 0)
+		file += ".wav";
+
+	std::string path = 
+#if WIN32
+		directory + "\\" + file;
+#else
+		directory + "/" + file;
+#endif
+
+	pjsua_conf_port_info bridge;
+	if (pjsua_conf_get_port_info(0, &bridge) != PJ_SUCCESS)
+		throw std::runtime_error("Unable to read the conference bridge settings.");
+
+	BlabbleRecordingPtr recording = boost::make_shared<BlabbleRecording>(this, path, file, stereo,
+		bridge.clock_rate, bridge.samples_per_frame);
+	recording->Open();
+
+	try
+	{
+		recording->Attach(source);
+
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			throw std::runtime_error("Recorder has been shut down.");
+
+		recordings_.push_back(recording);
+		if (!running_)
+		{
+			running_ = true;
+			writer_ = boost::thread(boost::bind(&BlabbleRecorder::WriterThread, this));
+		}
+	}
+	catch (...)
+	{
+		recording->Detach();
+		recording->Close();
+		throw;
+	}
+
+	return recording;
+}
+
+void BlabbleRecorder::Stop(const BlabbleRecordingPtr& recording)
+{
+	recording->Detach();
+	MEMORY_BARRIER();
+	recording->stopping_ = true;
+	Wake();
+}
+
+void BlabbleRecorder::Shutdown()
+{
+	RecordingList recordings;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+		shutdown_ = true;
+		recordings = recordings_;
+	}
+
+	for (RecordingList::iterator it = recordings.begin(); it != recordings.end(); it++)
+	{
+		Stop(*it);
+	}
+
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		running_ = false;
+	}
+	cond_.notify_one();
+
+	if (writer_.joinable())
+		writer_.join();
+}
+
+void BlabbleRecorder::WriterThread()
+{
+	for (;;)
+	{
+		RecordingList recordings, finished;
+		bool running;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			recordings = recordings_;
+			running = running_;
+		}
+
+		for (RecordingList::iterator it = recordings.begin(); it != recordings.end(); it++)
+		{
+			//Read before draining, so a stopped recording's last frames are in the ring
+			bool last = (*it)->stopping_ || !running;
+			MEMORY_BARRIER();
+			(*it)->Drain(last);
+			if (last)
+			{
+				(*it)->Close();
+				finished.push_back(*it);
+			}
+		}
+
+		boost::mutex::scoped_lock lock(mutex_);
+		for (RecordingList::iterator it = finished.begin(); it != finished.end(); it++)
+		{
+			recordings_.erase(std::remove(recordings_.begin(), recordings_.end(), *it), recordings_.end());
+		}
+
+		if (!running)
+			return;
+		if (running_)
+			cond_.timed_wait(lock, boost::posix_time::milliseconds(BLABBLE_RECORD_WRITER_MSEC));
+	}
+}
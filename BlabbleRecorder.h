@@ -0,0 +1,220 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleRecorder
+#define H_BlabbleRecorder
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "JSAPIAuto.h"
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+#include <pjmedia.h>
+
+FB_FORWARD_PTR(BlabbleRecording)
+
+/*! @Brief Audio each recording can buffer in memory before frames are dropped.
+ */
+#ifndef BLABBLE_RECORD_RING_MSEC
+#define BLABBLE_RECORD_RING_MSEC 4000
+#endif
+
+/*! @Brief Bytes collected before they are handed to the file in one write.
+ */
+#ifndef BLABBLE_RECORD_WRITE_BYTES
+#define BLABBLE_RECORD_WRITE_BYTES (128 * 1024)
+#endif
+
+/*! @Brief How often the writer thread looks for audio when it is not woken early.
+ */
+#ifndef BLABBLE_RECORD_WRITER_MSEC
+#define BLABBLE_RECORD_WRITER_MSEC 100
+#endif
+
+class BlabbleRecorder;
+struct RecordPort;
+
+/*! @class  BlabbleRecording
+ *
+ *  @brief  One WAV file being recorded from the conference bridge.
+ *
+ *  Every channel is a sink port in the bridge. The bridge's clock thread
+ *  copies each frame into that channel's single producer ring and returns;
+ *  it never waits on a lock or on the disk. A full ring drops the frame and
+ *  counts an overrun. The writer thread of BlabbleRecorder drains the rings
+ *  and writes the file.
+ *
+ *  A mono recording mixes the call and the microphone into one port. A
+ *  stereo recording has the microphone (local) on the left and the call
+ *  (remote) on the right. Frames carry a sequence number so the writer can
+ *  keep the channels aligned when one of them dropped frames.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleRecording : boost::noncopyable
+{
+public:
+	BlabbleRecording(BlabbleRecorder* recorder, const std::string& path, const std::string& name,
+		bool stereo, unsigned int clock_rate, unsigned int samples_per_frame);
+	virtual ~BlabbleRecording();
+
+	/*! @Brief Copy frame into the ring of channel. Called by the bridge clock thread.
+	 */
+	void Capture(unsigned int channel, const pjmedia_frame* frame);
+
+	/*! @Brief Connect the recording to the call audio in conference slot source.
+	 *  PJSUA_INVALID_ID disconnects the call but keeps recording the microphone.
+	 */
+	void SetSource(pjsua_conf_port_id source);
+
+	/*! @Brief Object with "file", "stereo", "seconds", "bytes", "overruns",
+	 *  "writeErrors" and "recording" properties for JavaScript. "file" is
+	 *  the file name only, JavaScript never sees where it is stored.
+	 */
+	FB::VariantMap stats();
+
+	const std::string& path() const { return path_; }
+	const std::string& name() const { return name_; }
+
+	/*! @Brief False once BlabbleRecorder::Stop has been called.
+	 */
+	bool active() const { return !stopping_; }
+
+private:
+	friend class BlabbleRecorder;
+
+	struct Ring
+	{
+		Ring() : head(0), tail(0), next_seq(0) { }
+		std::vector<pj_int16_t> samples;
+		std::vector<unsigned long> seq;
+		volatile long head;			//!< Written by the bridge only
+		volatile long tail;			//!< Written by the writer only
+		unsigned long next_seq;		//!< Bridge only
+	};
+
+	/*! @Brief Create the WAV file and write a placeholder header. Throws on
+	 *  failure, including when the file already exists.
+	 */
+	void Open();
+
+	/*! @Brief Add the ports to the bridge. Throws on failure.
+	 */
+	void Attach(pjsua_conf_port_id source);
+
+	/*! @Brief Take the ports out of the bridge. No frames arrive afterwards.
+	 */
+	void Detach();
+
+	/*! @Brief Move queued frames to the write buffer, writing it out once it is large enough.
+	 *  If final is set everything, including a channel without a partner, is written.
+	 *  Writer thread only.
+	 */
+	void Drain(bool final);
+
+	/*! @Brief Write whatever is buffered, fix the header and close the file. Writer thread only.
+	 */
+	void Close();
+
+	void Flush();
+	void AppendSamples(const pj_int16_t* left, const pj_int16_t* right);
+	long Queued(const Ring& ring) const { return (long)((unsigned long)ring.head - (unsigned long)ring.tail); }
+
+	BlabbleRecorder* recorder_;
+	std::string path_;
+	std::string name_;
+	unsigned int channels_;
+	unsigned int clock_rate_;
+	unsigned int samples_per_frame_;
+	long ring_frames_;
+	Ring rings_[2];
+	std::vector<pj_int16_t> silence_;
+
+	std::FILE* file_;
+	std::vector<char> buffer_;
+	unsigned long data_bytes_;
+
+	boost::mutex mutex_;			//!< Guards the bridge bookkeeping below
+	pj_pool_t* pool_;
+	RecordPort* ports_[2];
+	pjsua_conf_port_id slots_[2];
+	pjsua_conf_port_id source_;
+	bool detached_;
+
+	volatile bool stopping_;
+	volatile long overruns_;
+	volatile long write_errors_;
+	volatile long bytes_written_;
+};
+
+/*! @class  BlabbleRecorder
+ *
+ *  @brief  Starts and stops call recordings and owns the thread that writes them.
+ *
+ *  One writer thread serves every recording. It sleeps until a ring is half
+ *  full or BLABBLE_RECORD_WRITER_MSEC passes, then drains each recording and
+ *  writes them in chunks of BLABBLE_RECORD_WRITE_BYTES. Many calls recording
+ *  to the same disk therefore produce few, large, sequential writes, and a
+ *  slow disk only ever delays the writer, never the mixer.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleRecorder
+{
+public:
+	BlabbleRecorder();
+	virtual ~BlabbleRecorder();
+
+	/*! @Brief Start recording to the WAV file name in the recording directory.
+	 *  name must be a plain file name, anything with a path separator, a
+	 *  drive, a leading dot or a Windows device name such as NUL or COM1 is
+	 *  refused, and ".wav" is added if missing.
+	 *  An existing file is never overwritten.
+	 *  source is the call's conference slot, or PJSUA_INVALID_ID if its
+	 *  media is not active yet. Throws std::runtime_error on failure.
+	 */
+	BlabbleRecordingPtr Start(const std::string& name, bool stereo, pjsua_conf_port_id source);
+
+	/*! @Brief Directory recordings are written to. Set by the plugin, never by JavaScript.
+	 */
+	void set_directory(const std::string& directory);
+	std::string directory();
+
+	/*! @Brief Stop recording. The rest of the audio is written out in the background.
+	 */
+	void Stop(const BlabbleRecordingPtr& recording);
+
+	/*! @Brief Wake the writer thread early. Safe to call from the bridge clock thread.
+	 */
+	void Wake() { cond_.notify_one(); }
+
+	/*! @Brief Stop every recording and wait for the writer. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+private:
+	typedef std::vector<BlabbleRecordingPtr> RecordingList;
+
+	void WriterThread();
+
+	boost::mutex mutex_;
+	boost::condition_variable cond_;
+	boost::thread writer_;
+	RecordingList recordings_;
+	std::string directory_;
+	bool running_;
+	bool shutdown_;
+};
+
+#endif // H_BlabbleRecorder
@@ -0,0 +1,184 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <vector>
+#include "BlabbleRegScheduler.h"
+#include "BlabbleLogging.h"
+
+BlabbleRegScheduler::BlabbleRegScheduler() :
+	timer_due_(0), shutdown_(false), max_in_flight_(BLABBLE_REG_MAX_IN_FLIGHT)
+{
+}
+
+BlabbleRegScheduler::~BlabbleRegScheduler()
+{
+}
+
+void BlabbleRegScheduler::Schedule(pjsua_acc_id acc_id, unsigned int generation, unsigned int delay)
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+
+		PendingReg reg;
+		reg.acc_id = acc_id;
+		reg.generation = generation;
+		pending_.insert(std::make_pair(Now() + delay, reg));
+	}
+
+	Pump();
+}
+
+void BlabbleRegScheduler::Cancel(pjsua_acc_id acc_id)
+{
+	bool pump = false;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		PendingRegMap::iterator it = pending_.begin();
+		while (it != pending_.end())
+		{
+			if (it->second.acc_id == acc_id)
+				pending_.erase(it++);
+			else
+				it++;
+		}
+
+		pump = in_flight_.erase(acc_id) > 0;
+	}
+
+	if (pump)
+		Pump();
+}
+
+void BlabbleRegScheduler::OnRegState(pjsua_acc_id acc_id)
+{
+	bool pump = false;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		pump = in_flight_.erase(acc_id) > 0;
+	}
+
+	if (pump)
+		Pump();
+}
+
+void BlabbleRegScheduler::Shutdown()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	shutdown_ = true;
+	pending_.clear();
+	in_flight_.clear();
+}
+
+void BlabbleRegScheduler::set_max_in_flight(unsigned int v)
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		max_in_flight_ = v > 0 ? v : 1;
+	}
+
+	Pump();
+}
+
+unsigned int BlabbleRegScheduler::Spread(unsigned int index, unsigned int count, unsigned int window)
+{
+	if (count == 0)
+		return 0;
+
+	unsigned int share = window / count;
+	return index * share + (share > 0 ? (unsigned int)pj_rand() % share : 0);
+}
+
+//Static
+void BlabbleRegScheduler::OnTimer(void *user_data)
+{
+	BlabbleRegScheduler *scheduler = static_cast<BlabbleRegScheduler*>(user_data);
+	{
+		boost::mutex::scoped_lock lock(scheduler->mutex_);
+		if (scheduler->timer_due_ <= Now())
+			scheduler->timer_due_ = 0;
+	}
+
+	scheduler->Pump();
+}
+
+void BlabbleRegScheduler::Pump()
+{
+	std::vector<PendingReg> start;
+	do
+	{
+		start.clear();
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			if (shutdown_)
+				return;
+
+			pj_uint64_t now = Now();
+			while (in_flight_.size() < max_in_flight_ && !pending_.empty() &&
+				pending_.begin()->first <= now)
+			{
+				PendingReg reg = pending_.begin()->second;
+				pending_.erase(pending_.begin());
+
+				//Skip accounts that were deleted, or whose id was reused, while waiting
+				if (pjsua_acc_is_valid(reg.acc_id) == PJ_TRUE &&
+					(unsigned int)(pj_ssize_t)pjsua_acc_get_user_data(reg.acc_id) == reg.generation)
+				{
+					in_flight_[reg.acc_id] = reg.generation;
+					start.push_back(reg);
+				}
+			}
+
+			//While the in flight limit is reached the next completion pumps instead
+			if (!pending_.empty() && in_flight_.size() < max_in_flight_ &&
+				(timer_due_ == 0 || pending_.begin()->first < timer_due_))
+			{
+				unsigned wait = (unsigned)(pending_.begin()->first - now);
+				pj_status_t status = pjsua_schedule_timer2(&BlabbleRegScheduler::OnTimer, this, wait);
+				if (status == PJ_SUCCESS)
+				{
+					timer_due_ = pending_.begin()->first;
+				}
+				else
+				{
+					BLABBLE_LOG_ERROR("BlabbleRegScheduler::Pump failed to schedule timer, got status: " << status);
+				}
+			}
+		}
+
+		//Registering may call back into OnRegState right away, so do it unlocked
+		for (std::vector<PendingReg>::iterator it = start.begin(); it != start.end(); )
+		{
+			pj_status_t status = pjsua_acc_set_registration(it->acc_id, PJ_TRUE);
+			if (status == PJ_SUCCESS)
+			{
+				it = start.erase(it);
+				continue;
+			}
+
+			BLABBLE_LOG_ERROR("BlabbleRegScheduler::Pump failed to register PJSIP account id: " 
+				<< it->acc_id << ", got status: " << status);
+
+			boost::mutex::scoped_lock lock(mutex_);
+			in_flight_.erase(it->acc_id);
+			it++;
+		}
+
+		//Anything left failed to start and freed its in flight slot, try the next ones
+	} while (!start.empty());
+}
+
+//Static
+pj_uint64_t BlabbleRegScheduler::Now()
+{
+	pj_time_val now;
+	pj_gettickcount(&now);
+	return (pj_uint64_t)now.sec * 1000 + now.msec;
+}
@@ -0,0 +1,109 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleRegScheduler
+#define H_BlabbleRegScheduler
+
+#include <map>
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsip.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief Default number of REGISTER transactions the scheduler keeps outstanding.
+ */
+#ifndef BLABBLE_REG_MAX_IN_FLIGHT
+#define BLABBLE_REG_MAX_IN_FLIGHT 4
+#endif
+
+/*! @Brief Default spacing between scheduled registrations in milliseconds.
+ *  The spread window grows with the number of accounts until it reaches
+ *  the registration timeout.
+ */
+#ifndef BLABBLE_REG_SPACING_MSEC
+#define BLABBLE_REG_SPACING_MSEC 200
+#endif
+
+/*! @class  BlabbleRegScheduler
+ *
+ *  @brief  Staggers account registrations so a large set of accounts does
+ *          not send all of its REGISTER requests at the same moment.
+ *
+ *  Accounts are added to PJSIP without registering and handed to the
+ *  scheduler with a delay. A PJSIP timer, armed for the earliest pending
+ *  account, starts each registration once it is due while never letting
+ *  more than max_in_flight of them wait on the registrar. A registration
+ *  stops counting as in flight when PJSIP reports the account's
+ *  registration state. Only these first registrations are limited, PJSIP
+ *  sends the refreshes on its own timers.
+ *
+ *  Accounts are remembered by PJSIP id and generation so an account that is
+ *  destroyed before its turn is simply skipped.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleRegScheduler
+{
+public:
+	BlabbleRegScheduler();
+	virtual ~BlabbleRegScheduler();
+
+	/*! @Brief Register acc_id (owned by generation) after delay milliseconds.
+	 */
+	void Schedule(pjsua_acc_id acc_id, unsigned int generation, unsigned int delay);
+
+	/*! @Brief Forget any pending or in flight registration for acc_id.
+	 */
+	void Cancel(pjsua_acc_id acc_id);
+
+	/*! @Brief Called by PjsuaManager when the registration state of acc_id changes.
+	 */
+	void OnRegState(pjsua_acc_id acc_id);
+
+	/*! @Brief Drop everything. A timer already armed still fires but does
+	 *  nothing. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	void set_max_in_flight(unsigned int v);
+	unsigned int max_in_flight() const { return max_in_flight_; }
+
+	/*! @Brief Return a random delay for slot index of count spread over window
+	 *  milliseconds. Each slot gets an equal share of the window and a random
+	 *  point inside it.
+	 */
+	static unsigned int Spread(unsigned int index, unsigned int count, unsigned int window);
+
+private:
+	struct PendingReg
+	{
+		pjsua_acc_id acc_id;
+		unsigned int generation;
+	};
+	typedef std::multimap<pj_uint64_t, PendingReg> PendingRegMap;
+	typedef std::map<pjsua_acc_id, unsigned int> InFlightRegMap;
+
+	static void OnTimer(void *user_data);
+
+	/*! @Brief Start every due registration the in flight limit allows and
+	 *  arm the timer for the next one.
+	 */
+	void Pump();
+	
+	static pj_uint64_t Now();
+
+	boost::mutex mutex_;
+	PendingRegMap pending_;
+	InFlightRegMap in_flight_;
+	pj_uint64_t timer_due_; //!< When the earliest outstanding timer fires, 0 if none
+	bool shutdown_;
+	unsigned int max_in_flight_;
+};
+
+#endif // H_BlabbleRegScheduler
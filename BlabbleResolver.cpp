@@ -0,0 +1,464 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cstdlib>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "BlabbleResolver.h"
+#include "BlabbleAtomic.h"
+#include "BlabbleLogging.h"
+
+static std::string Trim(const std::string& s)
+{
+	size_t start = s.find_first_not_of(" \t\r");
+	if (start == std::string::npos)
+		return "";
+	return s.substr(start, s.find_last_not_of(" \t\r") - start + 1);
+}
+
+static bool IsIPv4(const std::string& host)
+{
+	pj_in_addr addr;
+	pj_str_t str = pj_str(const_cast<char*>(host.c_str()));
+	return pj_inet_aton(&str, &addr) != 0;
+}
+
+BlabbleResolver::BlabbleResolver() :
+	timer_due_(0), idle_sec_(BLABBLE_DNS_IDLE_SEC), shutdown_(false), shared_(NULL), refresh_(NULL),
+	query_count_(0), refresh_count_(0), negative_count_(0), failure_count_(0)
+{
+}
+
+BlabbleResolver::~BlabbleResolver()
+{
+}
+
+void BlabbleResolver::Start(const std::string& nameservers)
+{
+	std::vector<std::string> addresses;
+	std::vector<pj_uint16_t> ports;
+	std::string spec = Trim(nameservers);
+	ParseNameservers(spec.empty() ? SystemNameservers() : spec, addresses, ports);
+	if (addresses.empty())
+	{
+		BLABBLE_LOG_DEBUG("BlabbleResolver: no nameservers, PJSIP will use blocking lookups.");
+		return;
+	}
+
+	std::vector<pj_str_t> servers(addresses.size());
+	std::stringstream list;
+	for (size_t i = 0; i < addresses.size(); i++)
+	{
+		servers[i] = pj_str(const_cast<char*>(addresses[i].c_str()));
+		list << (i ? "," : "") << addresses[i] << ":" << ports[i];
+	}
+
+	pjsip_endpoint *endpt = pjsua_get_pjsip_endpt();
+	pj_dns_resolver *shared = NULL, *refresh = NULL;
+	pj_dns_settings settings;
+
+	pj_status_t status = pjsip_endpt_create_resolver(endpt, &shared);
+	if (status == PJ_SUCCESS)
+		status = pj_dns_resolver_set_ns(shared, (unsigned)servers.size(), &servers[0], &ports[0]);
+	if (status == PJ_SUCCESS)
+	{
+		pj_dns_resolver_get_settings(shared, &settings);
+		settings.cache_max_ttl = BLABBLE_DNS_MAX_TTL;
+		status = pj_dns_resolver_set_settings(shared, &settings);
+	}
+	if (status == PJ_SUCCESS)
+		status = pj_dns_resolver_create(pjsua_get_pool_factory(), "blabbledns", 0,
+			pjsip_endpt_get_timer_heap(endpt), pjsip_endpt_get_ioqueue(endpt), &refresh);
+	if (status == PJ_SUCCESS)
+		status = pj_dns_resolver_set_ns(refresh, (unsigned)servers.size(), &servers[0], &ports[0]);
+	if (status == PJ_SUCCESS)
+	{
+		//Every refresh has to reach the network
+		pj_dns_resolver_get_settings(refresh, &settings);
+		settings.cache_max_ttl = 0;
+		status = pj_dns_resolver_set_settings(refresh, &settings);
+	}
+	if (status == PJ_SUCCESS)
+		status = pjsip_endpt_set_resolver(endpt, shared);
+
+	if (status != PJ_SUCCESS)
+	{
+		BLABBLE_LOG_ERROR("BlabbleResolver::Start failed, PJSIP will use blocking lookups. Got status: " << status);
+		if (refresh)
+			pj_dns_resolver_destroy(refresh, PJ_FALSE);
+		if (shared)
+			pj_dns_resolver_destroy(shared, PJ_FALSE);
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	shared_ = shared;
+	refresh_ = refresh;
+	nameservers_ = list.str();
+	BLABBLE_LOG_DEBUG("BlabbleResolver: resolving through " << nameservers_.c_str());
+}
+
+void BlabbleResolver::Shutdown()
+{
+	pj_dns_resolver *refresh;
+	std::set<Query*> queries;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+		shutdown_ = true;
+		entries_.clear();
+		refresh = refresh_;
+		refresh_ = NULL;
+		queries.swap(queries_);
+	}
+
+	//Without notification no callback runs after this, so the queries are ours
+	if (refresh)
+		pj_dns_resolver_destroy(refresh, PJ_FALSE);
+	for (std::set<Query*>::iterator it = queries.begin(); it != queries.end(); it++)
+		delete *it;
+
+	//The endpoint destroys the shared resolver
+	shared_ = NULL;
+}
+
+void BlabbleResolver::Prefetch(const std::string& target, bool tls)
+{
+	if (!enabled())
+		return;
+
+	std::string host = Trim(target);
+	size_t pos;
+	if ((pos = host.find(':')) != std::string::npos &&
+		(host.substr(0, pos) == "sip" || host.substr(0, pos) == "sips"))
+	{
+		tls = tls || host.substr(0, pos) == "sips";
+		host = host.substr(pos + 1);
+	}
+	if ((pos = host.find('@')) != std::string::npos)
+		host = host.substr(pos + 1);
+	if ((pos = host.find_first_of(";>?")) != std::string::npos)
+		host = host.substr(0, pos);
+
+	//IPv6 literals never need a lookup
+	if (host.empty() || host[0] == '[')
+		return;
+
+	bool has_port = false;
+	if ((pos = host.find(':')) != std::string::npos)
+	{
+		host = host.substr(0, pos);
+		has_port = true;
+	}
+	for (size_t i = 0; i < host.size(); i++)
+		host[i] = (char)std::tolower(host[i]);
+	if (host.empty() || IsIPv4(host))
+		return;
+
+	boost::mutex::scoped_lock lock(mutex_);
+	if (shutdown_)
+		return;
+
+	pj_uint64_t now = Now();
+	//PJSIP only looks for SRV records when the URI has no port
+	if (!has_port)
+		Track((tls ? "_sips._tcp." : "_sip._udp.") + host, PJ_DNS_TYPE_SRV, now, now);
+	Track(host, PJ_DNS_TYPE_A, now, now);
+	ArmTimer(now);
+}
+
+bool BlabbleResolver::tracking(const std::string& host)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	return entries_.find(Key(host, PJ_DNS_TYPE_A)) != entries_.end();
+}
+
+void BlabbleResolver::set_idle_sec(unsigned int seconds)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	idle_sec_ = seconds;
+}
+
+FB::VariantMap BlabbleResolver::stats()
+{
+	FB::VariantMap map;
+	boost::mutex::scoped_lock lock(mutex_);
+	map["nameservers"] = nameservers_;
+	map["cached"] = shared_ ? (long)pj_dns_resolver_get_cached_count(shared_) : 0L;
+	map["tracked"] = (long)entries_.size();
+	map["queries"] = (long)query_count_;
+	map["refreshes"] = (long)refresh_count_;
+	map["negative"] = (long)negative_count_;
+	map["failures"] = (long)failure_count_;
+	return map;
+}
+
+void BlabbleResolver::Track(const std::string& name, int type, pj_uint64_t used, pj_uint64_t now)
+{
+	std::string key = Key(name, type);
+	EntryMap::iterator it = entries_.find(key);
+	if (it != entries_.end())
+	{
+		if (used > it->second.used)
+			it->second.used = used;
+		return;
+	}
+
+	Entry &entry = entries_[key];
+	entry.name = name;
+	entry.type = type;
+	entry.due = now;
+	entry.used = used;
+}
+
+void BlabbleResolver::Tick()
+{
+	std::vector<std::pair<Query*, std::string> > start;
+	pj_dns_resolver *refresh;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+		refresh = refresh_;
+
+		pj_uint64_t now = Now();
+		EntryMap::iterator it = entries_.begin();
+		while (it != entries_.end())
+		{
+			Entry &entry = it->second;
+			if (!entry.pending && now - entry.used > (pj_uint64_t)idle_sec_ * 1000)
+			{
+				entries_.erase(it++);
+				continue;
+			}
+
+			if (!entry.pending && entry.due <= now)
+			{
+				Query *query = new Query();
+				query->resolver = this;
+				query->key = it->first;
+				queries_.insert(query);
+				start.push_back(std::make_pair(query, it->first));
+				entry.pending = true;
+			}
+			it++;
+		}
+	}
+
+	//The resolver may answer from inside start_query, which takes our mutex
+	for (size_t i = 0; i < start.size(); i++)
+	{
+		//Shutdown may free the query at any point, only the copied key is safe to read
+		Query *query = start[i].first;
+		size_t colon = start[i].second.find(':');
+		int type = std::atoi(start[i].second.substr(0, colon).c_str());
+		std::string name = start[i].second.substr(colon + 1);
+		pj_str_t qname = pj_str(const_cast<char*>(name.c_str()));
+
+		ATOMIC_INCREMENT(&query_count_);
+		pj_status_t status = pj_dns_resolver_start_query(refresh, &qname, type, 0,
+			&BlabbleResolver::OnQuery, query, NULL);
+		if (status != PJ_SUCCESS)
+		{
+			BLABBLE_LOG_ERROR("BlabbleResolver::Tick unable to query " << name.c_str() << ", got status: " << status);
+			OnAnswer(query, status, NULL);
+		}
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	if (!shutdown_)
+		ArmTimer(Now());
+}
+
+void BlabbleResolver::ArmTimer(pj_uint64_t now)
+{
+	pj_uint64_t next = 0;
+	for (EntryMap::iterator it = entries_.begin(); it != entries_.end(); it++)
+	{
+		if (!it->second.pending && (next == 0 || it->second.due < next))
+			next = it->second.due;
+	}
+
+	if (next == 0 || (timer_due_ != 0 && timer_due_ <= next))
+		return;
+
+	unsigned wait = next > now ? (unsigned)(next - now) : 0;
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleResolver::OnTimer, this, wait);
+	if (status == PJ_SUCCESS)
+	{
+		timer_due_ = next;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleResolver::ArmTimer failed to schedule timer, got status: " << status);
+	}
+}
+
+//Static
+void BlabbleResolver::OnTimer(void *user_data)
+{
+	BlabbleResolver *resolver = static_cast<BlabbleResolver*>(user_data);
+	{
+		boost::mutex::scoped_lock lock(resolver->mutex_);
+		if (resolver->timer_due_ <= Now())
+			resolver->timer_due_ = 0;
+	}
+
+	resolver->Tick();
+}
+
+//Static
+void BlabbleResolver::OnQuery(void *user_data, pj_status_t status, pj_dns_parsed_packet *response)
+{
+	Query *query = static_cast<Query*>(user_data);
+	query->resolver->OnAnswer(query, status, response);
+}
+
+void BlabbleResolver::OnAnswer(Query *query, pj_status_t status, pj_dns_parsed_packet *response)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (queries_.erase(query) == 0)
+		return;
+
+	std::string key = query->key;
+	delete query;
+
+	if (shutdown_)
+		return;
+
+	bool answered = status == PJ_SUCCESS && response && response->hdr.anscount > 0;
+	if (response && (response->hdr.anscount > 0 || response->hdr.qdcount > 0))
+	{
+		//Negative answers go in too, the shared cache then remembers them
+		pj_dns_resolver_add_entry(shared_, response, PJ_TRUE);
+	}
+
+	EntryMap::iterator it = entries_.find(key);
+	if (it == entries_.end())
+		return;
+
+	Entry &entry = it->second;
+	pj_uint64_t now = Now();
+	entry.pending = false;
+
+	if (answered)
+	{
+		unsigned ttl = BLABBLE_DNS_MAX_TTL;
+		for (unsigned i = 0; i < response->hdr.anscount; i++)
+		{
+			const pj_dns_parsed_rr &rr = response->ans[i];
+			if (rr.ttl < ttl)
+				ttl = rr.ttl;
+
+			//Track the targets so the A lookups after the SRV answer are warm too
+			if (rr.type == PJ_DNS_TYPE_SRV)
+			{
+				std::string target(rr.rdata.srv.target.ptr, rr.rdata.srv.target.slen);
+				Track(target, PJ_DNS_TYPE_A, entry.used, now);
+			}
+		}
+
+		unsigned refresh = ttl * BLABBLE_DNS_REFRESH_PERCENT / 100;
+		if (refresh < BLABBLE_DNS_MIN_REFRESH_SEC)
+			refresh = BLABBLE_DNS_MIN_REFRESH_SEC;
+		entry.due = now + (pj_uint64_t)refresh * 1000;
+		entry.failures = 0;
+		ATOMIC_INCREMENT(&refresh_count_);
+	}
+	else
+	{
+		unsigned wait = BLABBLE_DNS_NEGATIVE_SEC;
+		for (unsigned i = 0; i < entry.failures && wait < BLABBLE_DNS_MAX_BACKOFF_SEC; i++)
+			wait *= 2;
+		if (wait > BLABBLE_DNS_MAX_BACKOFF_SEC)
+			wait = BLABBLE_DNS_MAX_BACKOFF_SEC;
+		entry.due = now + (pj_uint64_t)wait * 1000;
+		entry.failures++;
+
+		if (response)
+			ATOMIC_INCREMENT(&negative_count_);
+		else
+			ATOMIC_INCREMENT(&failure_count_);
+	}
+
+	ArmTimer(now);
+}
+
+//Static
+void BlabbleResolver::ParseNameservers(const std::string& spec, std::vector<std::string>& addresses,
+	std::vector<pj_uint16_t>& ports)
+{
+	std::string rest = spec;
+	while (!rest.empty())
+	{
+		size_t comma = rest.find(',');
+		std::string entry = Trim(rest.substr(0, comma));
+		rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+		if (entry.empty())
+			continue;
+
+		std::string address = entry;
+		long port = 53;
+		size_t colon = entry.find(':');
+		if (colon != std::string::npos)
+		{
+			char* end = NULL;
+			std::string value = entry.substr(colon + 1);
+			address = entry.substr(0, colon);
+			port = std::strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end != '\0' || port <= 0 || port > 65535)
+				throw std::runtime_error("Invalid port in nameserver " + entry);
+		}
+
+		//PJLIB only talks to IPv4 nameservers
+		if (!IsIPv4(address))
+			throw std::runtime_error("Nameserver is not an IPv4 address: " + entry);
+
+		addresses.push_back(address);
+		ports.push_back((pj_uint16_t)port);
+	}
+}
+
+//Static
+std::string BlabbleResolver::SystemNameservers()
+{
+	std::string servers;
+#ifndef WIN32
+	std::ifstream conf("/etc/resolv.conf");
+	std::string line;
+	while (std::getline(conf, line))
+	{
+		std::istringstream words(line);
+		std::string keyword, address;
+		if (!(words >> keyword >> address) || keyword != "nameserver" || !IsIPv4(address))
+			continue;
+		servers += (servers.empty() ? "" : ",") + address;
+	}
+#endif
+	return servers;
+}
+
+//Static
+pj_uint64_t BlabbleResolver::Now()
+{
+	pj_time_val now;
+	pj_gettickcount(&now);
+	return (pj_uint64_t)now.sec * 1000 + now.msec;
+}
+
+//Static
+std::string BlabbleResolver::Key(const std::string& name, int type)
+{
+	std::stringstream key;
+	key << type << ":" << name;
+	return key.str();
+}
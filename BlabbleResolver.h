@@ -0,0 +1,190 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleResolver
+#define H_BlabbleResolver
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "JSAPIAuto.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjlib-util.h>
+#include <pjsip.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief Longest TTL the shared cache honours, in seconds.
+ *  PJLIB's default of 5 minutes would expire most SIP records long before
+ *  their TTL does.
+ */
+#ifndef BLABBLE_DNS_MAX_TTL
+#define BLABBLE_DNS_MAX_TTL 3600
+#endif
+
+/*! @Brief Percentage of a record's TTL after which it is fetched again.
+ */
+#ifndef BLABBLE_DNS_REFRESH_PERCENT
+#define BLABBLE_DNS_REFRESH_PERCENT 80
+#endif
+
+/*! @Brief Shortest time between two fetches of the same record, in seconds.
+ */
+#ifndef BLABBLE_DNS_MIN_REFRESH_SEC
+#define BLABBLE_DNS_MIN_REFRESH_SEC 10
+#endif
+
+/*! @Brief Wait before retrying a name that failed or does not exist, in seconds.
+ *  Doubles with every further failure up to BLABBLE_DNS_MAX_BACKOFF_SEC.
+ */
+#ifndef BLABBLE_DNS_NEGATIVE_SEC
+#define BLABBLE_DNS_NEGATIVE_SEC 30
+#endif
+
+#ifndef BLABBLE_DNS_MAX_BACKOFF_SEC
+#define BLABBLE_DNS_MAX_BACKOFF_SEC 600
+#endif
+
+/*! @Brief Names nobody has asked for in this long stop being refreshed, in seconds.
+ */
+#ifndef BLABBLE_DNS_IDLE_SEC
+#define BLABBLE_DNS_IDLE_SEC 3600
+#endif
+
+/*! @class  BlabbleResolver
+ *
+ *  @brief  Gives PJSIP an asynchronous DNS resolver and keeps its cache warm.
+ *
+ *  Without a resolver PJSIP looks hosts up with a blocking gethostbyname on
+ *  the thread sending the request and never uses SRV records. Start creates
+ *  one PJLIB resolver for the SIP endpoint, so every account shares one
+ *  cache that honours record TTLs and remembers failed lookups for a while.
+ *
+ *  Registrars and call targets are passed to Prefetch. Their SRV and A
+ *  records, and the A records of every SRV target, are fetched again by a
+ *  second resolver without a cache shortly before they expire, and each
+ *  answer is copied into the shared cache. PJSIP therefore finds a fresh
+ *  entry when it re-registers or places a call and never waits on the
+ *  network. Failed names are retried with a growing delay and names not
+ *  asked for in BLABBLE_DNS_IDLE_SEC are forgotten. Accounts prefetch
+ *  their registrar again on every registration state change, so a
+ *  registrar is only forgotten once nothing registers with it.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleResolver
+{
+public:
+	BlabbleResolver();
+	virtual ~BlabbleResolver();
+
+	/*! @Brief Create the resolvers. Must be called after pjsua_init.
+	 *  nameservers is a comma separated list of `address[:port]`. If it is
+	 *  empty the servers in /etc/resolv.conf are used where there is one;
+	 *  with no servers at all PJSIP keeps its blocking lookups. Throws
+	 *  std::runtime_error on a malformed list.
+	 */
+	void Start(const std::string& nameservers);
+
+	/*! @Brief Stop refreshing. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief True if PJSIP resolves through us.
+	 */
+	bool enabled() const { return shared_ != NULL; }
+
+	/*! @Brief Keep the records for target cached.
+	 *  target is a host, `host:port` or a SIP URI. IP addresses are ignored.
+	 *  A host without a port has its SRV records tracked as well.
+	 */
+	void Prefetch(const std::string& target, bool tls);
+
+	/*! @Brief True if the A records of host are being kept cached.
+	 */
+	bool tracking(const std::string& host);
+
+	/*! @Brief Forget names after seconds without use instead of BLABBLE_DNS_IDLE_SEC.
+	 */
+	void set_idle_sec(unsigned int seconds);
+
+	/*! @Brief Object with "nameservers", "cached", "tracked", "queries",
+	 *  "refreshes", "negative" and "failures" properties for JavaScript.
+	 */
+	FB::VariantMap stats();
+
+private:
+	struct Entry
+	{
+		Entry() : type(0), due(0), used(0), failures(0), pending(false) { }
+		std::string name;
+		int type;
+		pj_uint64_t due;	//!< When to fetch again
+		pj_uint64_t used;	//!< Last time a user asked for it
+		unsigned int failures;
+		bool pending;
+	};
+	typedef std::map<std::string, Entry> EntryMap;
+
+	struct Query
+	{
+		BlabbleResolver* resolver;
+		std::string key;
+	};
+
+	/*! @Brief Parse a nameserver list. Throws std::runtime_error on a malformed entry.
+	 */
+	static void ParseNameservers(const std::string& spec, std::vector<std::string>& addresses,
+		std::vector<pj_uint16_t>& ports);
+
+	/*! @Brief Nameservers configured for the system, comma separated.
+	 */
+	static std::string SystemNameservers();
+
+	/*! @Brief Start tracking name, or mark it as used. Call with mutex_ held.
+	 */
+	void Track(const std::string& name, int type, pj_uint64_t used, pj_uint64_t now);
+
+	/*! @Brief Fetch every record that is due.
+	 */
+	void Tick();
+
+	/*! @Brief Schedule the timer for the earliest due record. Call with mutex_ held.
+	 */
+	void ArmTimer(pj_uint64_t now);
+
+	static void OnTimer(void *user_data);
+	static void OnQuery(void *user_data, pj_status_t status, pj_dns_parsed_packet *response);
+
+	/*! @Brief Cache the answer to query and schedule the next fetch. Frees query.
+	 */
+	void OnAnswer(Query *query, pj_status_t status, pj_dns_parsed_packet *response);
+
+	static pj_uint64_t Now();
+	static std::string Key(const std::string& name, int type);
+
+	boost::mutex mutex_;
+	EntryMap entries_;
+	std::set<Query*> queries_;	//!< In flight, freed on Shutdown if never answered
+	pj_uint64_t timer_due_;
+	unsigned int idle_sec_;
+	bool shutdown_;
+
+	pj_dns_resolver* shared_;	//!< Owned by the SIP endpoint
+	pj_dns_resolver* refresh_;	//!< Ours, without a cache
+	std::string nameservers_;
+
+	volatile long query_count_;
+	volatile long refresh_count_;
+	volatile long negative_count_;
+	volatile long failure_count_;
+};
+
+#endif // H_BlabbleResolver
@@ -0,0 +1,226 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include "BlabbleSoundCache.h"
+#include "BlabbleLogging.h"
+#include <boost/smart_ptr/make_shared.hpp>
+
+//Frame duration used while decoding and playing
+#define SOUND_PTIME 20
+
+BlabbleSoundCache::BlabbleSoundCache(unsigned int clock_rate) :
+	clock_rate_(clock_rate)
+{
+}
+
+BlabbleSoundCache::~BlabbleSoundCache()
+{
+}
+
+BlabbleSoundPtr BlabbleSoundCache::Load(const std::string& path)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	BlabbleSoundMap::iterator it = sounds_.find(path);
+	if (it != sounds_.end())
+		return it->second;
+
+	BlabbleSoundPtr sound = Decode(path, clock_rate_);
+	if (sound)
+		sounds_[path] = sound;
+
+	return sound;
+}
+
+void BlabbleSoundCache::Clear()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	sounds_.clear();
+}
+
+size_t BlabbleSoundCache::size_bytes()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	size_t size = 0;
+	for (BlabbleSoundMap::iterator it = sounds_.begin(); it != sounds_.end(); it++)
+	{
+		size += it->second->samples.size() * sizeof(pj_int16_t);
+	}
+	return size;
+}
+
+//Static
+BlabbleSoundPtr BlabbleSoundCache::Decode(const std::string& path, unsigned int clock_rate)
+{
+	pj_pool_t* pool = pjsua_pool_create("sndcache", 4096, 4096);
+	if (pool == NULL)
+		return BlabbleSoundPtr();
+
+	pjmedia_port* file;
+	pj_status_t status = pjmedia_wav_player_port_create(pool, path.c_str(), SOUND_PTIME, 
+		PJMEDIA_FILE_NO_LOOP, 0, &file);
+	if (status != PJ_SUCCESS)
+	{
+		BLABBLE_LOG_DEBUG("BlabbleSoundCache::Decode unable to open " << path.c_str() << ", got status: " << status);
+		pj_pool_release(pool);
+		return BlabbleSoundPtr();
+	}
+
+	unsigned int rate = PJMEDIA_PIA_SRATE(&file->info);
+	unsigned int channels = PJMEDIA_PIA_CCNT(&file->info);
+	size_t max_samples = (size_t)rate * BLABBLE_SOUND_MAX_SECONDS;
+
+	std::vector<pj_int16_t> mono;
+	std::vector<pj_int16_t> buf(PJMEDIA_PIA_SPF(&file->info));
+	while (mono.size() < max_samples)
+	{
+		pjmedia_frame frame;
+		frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+		frame.buf = &buf[0];
+		frame.size = buf.size() * sizeof(pj_int16_t);
+
+		if (pjmedia_port_get_frame(file, &frame) != PJ_SUCCESS ||
+			frame.type != PJMEDIA_FRAME_TYPE_AUDIO)
+		{
+			break;
+		}
+
+		unsigned int count = (unsigned int)(frame.size / sizeof(pj_int16_t) / channels);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			int sum = 0;
+			for (unsigned int c = 0; c < channels; c++)
+				sum += buf[i * channels + c];
+			mono.push_back((pj_int16_t)(sum / (int)channels));
+		}
+	}
+	pjmedia_port_destroy(file);
+
+	boost::shared_ptr<BlabbleSound> sound = boost::make_shared<BlabbleSound>();
+	sound->clock_rate = clock_rate;
+
+	if (rate == clock_rate || mono.empty())
+	{
+		sound->samples.swap(mono);
+	}
+	else
+	{
+		unsigned int in_spf = rate * SOUND_PTIME / 1000;
+		unsigned int out_spf = clock_rate * SOUND_PTIME / 1000;
+		pjmedia_resample *resample;
+
+		status = pjmedia_resample_create(pool, PJ_TRUE, PJ_FALSE, 1, rate, clock_rate, in_spf, &resample);
+		if (status != PJ_SUCCESS)
+		{
+			BLABBLE_LOG_ERROR("BlabbleSoundCache::Decode failed to resample " << path.c_str() << ", got status: " << status);
+			pj_pool_release(pool);
+			return BlabbleSoundPtr();
+		}
+
+		size_t frames = (mono.size() + in_spf - 1) / in_spf;
+		mono.resize(frames * in_spf, 0);
+		sound->samples.resize(frames * out_spf);
+		for (size_t f = 0; f < frames; f++)
+		{
+			pjmedia_resample_run(resample, &mono[f * in_spf], &sound->samples[f * out_spf]);
+		}
+		pjmedia_resample_destroy(resample);
+	}
+
+	pj_pool_release(pool);
+
+	if (sound->samples.empty())
+		return BlabbleSoundPtr();
+
+	BLABBLE_LOG_DEBUG("BlabbleSoundCache::Decode loaded " << path.c_str() << ", " << 
+		sound->samples.size() << " samples at " << clock_rate << "Hz");
+	return sound;
+}
+
+BlabbleSoundPlayer::BlabbleSoundPlayer() :
+	pool_(NULL), port_(NULL), slot_(PJSUA_INVALID_ID)
+{
+}
+
+BlabbleSoundPlayer::~BlabbleSoundPlayer()
+{
+	Stop();
+}
+
+bool BlabbleSoundPlayer::Start(const BlabbleSoundPtr& sound, bool loop, pjsua_conf_port_id sink)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	StopLocked();
+
+	if (!sound)
+		return false;
+
+	pool_ = pjsua_pool_create("sndplay", 512, 512);
+	if (pool_ == NULL)
+		return false;
+
+	pj_status_t status = pjmedia_mem_player_create(pool_, &sound->samples[0], 
+		sound->samples.size() * sizeof(pj_int16_t), sound->clock_rate, 1, 
+		sound->clock_rate * SOUND_PTIME / 1000, 16, loop ? 0 : PJMEDIA_MEM_NO_LOOP, &port_);
+	if (status == PJ_SUCCESS)
+	{
+		status = pjsua_conf_add_port(pool_, port_, &slot_);
+		if (status != PJ_SUCCESS)
+		{
+			pjmedia_port_destroy(port_);
+			slot_ = PJSUA_INVALID_ID;
+		}
+	}
+
+	if (status != PJ_SUCCESS)
+	{
+		BLABBLE_LOG_ERROR("BlabbleSoundPlayer::Start failed, got status: " << status);
+		port_ = NULL;
+		pj_pool_release(pool_);
+		pool_ = NULL;
+		return false;
+	}
+
+	sound_ = sound;
+	pjsua_conf_connect(slot_, sink);
+	return true;
+}
+
+void BlabbleSoundPlayer::Stop()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	StopLocked();
+}
+
+bool BlabbleSoundPlayer::playing()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	return slot_ != PJSUA_INVALID_ID;
+}
+
+void BlabbleSoundPlayer::StopLocked()
+{
+	if (slot_ != PJSUA_INVALID_ID)
+	{
+		pjsua_conf_remove_port(slot_);
+		slot_ = PJSUA_INVALID_ID;
+	}
+	if (port_ != NULL)
+	{
+		pjmedia_port_destroy(port_);
+		port_ = NULL;
+	}
+	if (pool_ != NULL)
+	{
+		pj_pool_release(pool_);
+		pool_ = NULL;
+	}
+
+	//The samples must outlive the port, which is gone now
+	sound_.reset();
+}
@@ -0,0 +1,121 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleSoundCache
+#define H_BlabbleSoundCache
+
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+#include <pjmedia.h>
+
+/*! @Brief Longest sound, in seconds, the cache will decode from a single file.
+ */
+#ifndef BLABBLE_SOUND_MAX_SECONDS
+#define BLABBLE_SOUND_MAX_SECONDS 120
+#endif
+
+/*! @Brief A sound decoded into memory.
+ *  Samples are 16 bit mono at clock_rate and are never modified once
+ *  decoded, so any number of players can share them.
+ */
+struct BlabbleSound
+{
+	unsigned int clock_rate;
+	std::vector<pj_int16_t> samples;
+};
+
+typedef boost::shared_ptr<const BlabbleSound> BlabbleSoundPtr;
+
+/*! @class  BlabbleSoundCache
+ *
+ *  @brief  Decodes WAV files once and keeps the PCM in memory.
+ *
+ *  A file is read, mixed down to mono and resampled to the conference
+ *  bridge clock rate the first time it is loaded. Later loads of the same
+ *  path return the same buffer without touching the disk.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleSoundCache
+{
+public:
+	BlabbleSoundCache(unsigned int clock_rate);
+	virtual ~BlabbleSoundCache();
+
+	/*! @Brief Return the sound for path, decoding it if it is not cached yet.
+	 *  Returns an empty pointer if the file could not be read.
+	 */
+	BlabbleSoundPtr Load(const std::string& path);
+
+	/*! @Brief Drop every cached sound. Sounds still playing stay alive
+	 *  until their players stop.
+	 */
+	void Clear();
+
+	/*! @Brief Total bytes of PCM held by the cache.
+	 */
+	size_t size_bytes();
+
+private:
+	typedef std::map<std::string, BlabbleSoundPtr> BlabbleSoundMap;
+
+	/*! @Brief Read path with a PJMEDIA WAV player and convert it to clock_rate mono.
+	 */
+	static BlabbleSoundPtr Decode(const std::string& path, unsigned int clock_rate);
+
+	boost::mutex mutex_;
+	BlabbleSoundMap sounds_;
+	unsigned int clock_rate_;
+};
+
+/*! @class  BlabbleSoundPlayer
+ *
+ *  @brief  Plays a BlabbleSound into the conference bridge through a
+ *          pjmedia_mem_player port.
+ *
+ *  Each Start creates a new memory port (the memory player cannot be
+ *  rewound) in its own small pool, so playing again from the beginning is
+ *  just Stop and Start and no memory builds up.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleSoundPlayer : private boost::noncopyable
+{
+public:
+	BlabbleSoundPlayer();
+	virtual ~BlabbleSoundPlayer();
+
+	/*! @Brief Start playing sound from the beginning into sink.
+	 *  Anything this player was already playing is stopped first.
+	 */
+	bool Start(const BlabbleSoundPtr& sound, bool loop, pjsua_conf_port_id sink = 0);
+
+	/*! @Brief Stop playing and release the port.
+	 */
+	void Stop();
+
+	bool playing();
+
+private:
+	void StopLocked();
+
+	boost::mutex mutex_;
+	BlabbleSoundPtr sound_;
+	pj_pool_t* pool_;
+	pjmedia_port* port_;
+	pjsua_conf_port_id slot_;
+};
+
+#endif // H_BlabbleSoundCache
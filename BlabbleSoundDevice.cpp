@@ -0,0 +1,475 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+#include "BlabbleSoundDevice.h"
+#include "BlabbleAtomic.h"
+#include "BlabbleLogging.h"
+#include "BlabbleMetrics.h"
+#include <pjsua-lib/pjsua_internal.h>
+
+static BlabbleCounter& warm_opens = BlabbleMetrics::Counter("sound.warmOpens");
+static BlabbleHistogram& open_usec = BlabbleMetrics::Histogram("sound.open.usec");
+static BlabbleHistogram& first_capture_usec = BlabbleMetrics::Histogram("call.firstCapture.usec");
+static BlabbleHistogram& first_playback_usec = BlabbleMetrics::Histogram("call.firstPlayback.usec");
+static BlabbleCounter& first_audio_timeouts = BlabbleMetrics::Counter("call.firstAudioTimeouts");
+
+/*! @Brief Conference bridge sink that notes when it first hears anything.
+ */
+struct FirstAudioPort
+{
+	pjmedia_port base;
+	pj_timestamp at;		//!< Valid once seen is set
+	volatile long seen;
+};
+
+static pj_status_t FirstAudioPutFrame(pjmedia_port *this_port, pjmedia_frame *frame)
+{
+	FirstAudioPort *port = reinterpret_cast<FirstAudioPort*>(this_port);
+	if (port->seen || frame->type != PJMEDIA_FRAME_TYPE_AUDIO || frame->size == 0)
+		return PJ_SUCCESS;
+
+	//The bridge sends silence before either side has anything to say
+	const pj_int16_t *samples = static_cast<const pj_int16_t*>(frame->buf);
+	unsigned int count = (unsigned int)(frame->size / sizeof(pj_int16_t));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (samples[i] != 0)
+		{
+			pj_get_timestamp(&port->at);
+			MEMORY_BARRIER();
+			INTERLOCKED_EXCHANGE(&port->seen, 1);
+			break;
+		}
+	}
+	return PJ_SUCCESS;
+}
+
+static pj_status_t FirstAudioGetFrame(pjmedia_port *, pjmedia_frame *frame)
+{
+	frame->type = PJMEDIA_FRAME_TYPE_NONE;
+	frame->size = 0;
+	return PJ_SUCCESS;
+}
+
+static std::string Trim(const std::string& str)
+{
+	size_t start = str.find_first_not_of(" \t");
+	if (start == std::string::npos)
+		return "";
+	size_t end = str.find_last_not_of(" \t");
+	return str.substr(start, end - start + 1);
+}
+
+//Static
+BlabbleSoundDeviceConfig BlabbleSoundDeviceConfig::Parse(const std::string& spec)
+{
+	BlabbleSoundDeviceConfig config;
+	bool close_set = false;
+	std::string rest = Trim(spec);
+
+	while (!rest.empty())
+	{
+		size_t comma = rest.find(',');
+		std::string entry = Trim(rest.substr(0, comma));
+		rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+		if (entry.empty())
+			continue;
+
+		size_t eq = entry.find('=');
+		if (eq == std::string::npos)
+			throw std::runtime_error("Invalid sound device option " + entry);
+		std::string key = Trim(entry.substr(0, eq)), value = Trim(entry.substr(eq + 1));
+
+		if (key == "warm")
+		{
+			if (value == "on")
+				config.warm = true;
+			else if (value == "off")
+				config.warm = false;
+			else
+				throw std::runtime_error("Invalid sound device option " + entry);
+		}
+		else if (key == "close")
+		{
+			if (value == "never")
+			{
+				config.auto_close = -1;
+			}
+			else
+			{
+				char* end = NULL;
+				long n = std::strtol(value.c_str(), &end, 10);
+				if (value.empty() || *end != '\0' || n < 0)
+					throw std::runtime_error("Invalid number in sound device option " + entry);
+				config.auto_close = (int)n;
+			}
+			close_set = true;
+		}
+		else
+		{
+			throw std::runtime_error("Unknown sound device option " + entry);
+		}
+	}
+
+	if (config.warm && !close_set)
+		config.auto_close = BLABBLE_SND_WARM_CLOSE_SEC;
+
+	return config;
+}
+
+BlabbleSoundDevice::BlabbleSoundDevice() :
+	warm_pool_(NULL), warm_thread_(NULL), warming_(false), timer_armed_(false), shutdown_(false)
+{
+	last_usec_[CAPTURE] = -1;
+	last_usec_[PLAYBACK] = -1;
+}
+
+BlabbleSoundDevice::~BlabbleSoundDevice()
+{
+}
+
+void BlabbleSoundDevice::Configure(const BlabbleSoundDeviceConfig& config, pjsua_media_config& media_cfg)
+{
+	config_ = config;
+	media_cfg.snd_auto_close_time = config.auto_close;
+}
+
+void BlabbleSoundDevice::Shutdown()
+{
+	ProbeMap probes;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		shutdown_ = true;
+		probes.swap(probes_);
+	}
+	JoinWarm();
+
+	for (ProbeMap::iterator it = probes.begin(); it != probes.end(); it++)
+		Detach(it->second);
+}
+
+void BlabbleSoundDevice::Warm()
+{
+	//With a close timeout it would only be closed again before any call came
+	if (!config_.warm || config_.auto_close >= 0 || !IsClosed())
+		return;
+
+	boost::mutex::scoped_lock lock(mutex_);
+	if (shutdown_ || warming_)
+		return;
+
+	//The last open has finished, so this only tidies up after it
+	JoinWarm();
+	warm_pool_ = pjsua_pool_create("blabble-warm", 512, 512);
+	if (warm_pool_ == NULL)
+		return;
+
+	warming_ = true;
+	pj_status_t status = pj_thread_create(warm_pool_, "blabble-warm", &BlabbleSoundDevice::WarmThread,
+		this, 0, 0, &warm_thread_);
+	if (status != PJ_SUCCESS)
+	{
+		warming_ = false;
+		warm_thread_ = NULL;
+		BLABBLE_LOG_ERROR("BlabbleSoundDevice::Warm unable to create thread, got status: " << status);
+	}
+}
+
+void BlabbleSoundDevice::JoinWarm()
+{
+	if (warm_thread_ != NULL)
+	{
+		pj_thread_join(warm_thread_);
+		pj_thread_destroy(warm_thread_);
+		warm_thread_ = NULL;
+	}
+	if (warm_pool_ != NULL)
+	{
+		pj_pool_release(warm_pool_);
+		warm_pool_ = NULL;
+	}
+}
+
+//Static
+bool BlabbleSoundDevice::IsClosed()
+{
+	//An open device, or an app running without one, is left alone
+	PJSUA_LOCK();
+	bool closed = !pjsua_var.no_snd && pjsua_var.null_snd == NULL && pjsua_var.snd_port == NULL;
+	PJSUA_UNLOCK();
+	return closed;
+}
+
+//Static
+int BlabbleSoundDevice::WarmThread(void* arg)
+{
+	BlabbleSoundDevice *device = static_cast<BlabbleSoundDevice*>(arg);
+	device->Open();
+
+	boost::mutex::scoped_lock lock(device->mutex_);
+	device->warming_ = false;
+	return 0;
+}
+
+void BlabbleSoundDevice::Open()
+{
+	if (!IsClosed())
+		return;
+
+	int capture, playback;
+	pj_status_t status = pjsua_get_snd_dev(&capture, &playback);
+	if (status == PJ_SUCCESS)
+	{
+		BlabbleMetricsTimer timer(open_usec);
+		status = pjsua_set_snd_dev(capture, playback);
+	}
+
+	if (status == PJ_SUCCESS)
+	{
+		warm_opens.Increment();
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleSoundDevice::Warm unable to open the sound device, got status: " << status);
+	}
+}
+
+void BlabbleSoundDevice::Answered(unsigned int id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (shutdown_ || probes_.find(id) != probes_.end())
+		return;
+
+	Probe &probe = probes_[id];
+	pj_get_timestamp(&probe.answered);
+	probe.source = PJSUA_INVALID_ID;
+	probe.attached = false;
+	probe.forgotten = false;
+	probe.pool = NULL;
+	for (int i = 0; i < PROBE_COUNT; i++)
+	{
+		probe.ports[i] = NULL;
+		probe.slots[i] = PJSUA_INVALID_ID;
+		probe.recorded[i] = false;
+	}
+	ArmTimer();
+}
+
+void BlabbleSoundDevice::MediaActive(unsigned int id, pjsua_conf_port_id slot)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	ProbeMap::iterator it = probes_.find(id);
+	//Only the media of the answer counts, not a later hold or unhold
+	if (it == probes_.end() || it->second.source != PJSUA_INVALID_ID)
+		return;
+
+	it->second.source = slot;
+	ArmTimer();
+}
+
+void BlabbleSoundDevice::Forget(unsigned int id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	ProbeMap::iterator it = probes_.find(id);
+	if (it == probes_.end())
+		return;
+
+	it->second.forgotten = true;
+	ArmTimer();
+}
+
+//Static
+void BlabbleSoundDevice::OnTimer(void *user_data)
+{
+	BlabbleSoundDevice *device = static_cast<BlabbleSoundDevice*>(user_data);
+	{
+		boost::mutex::scoped_lock lock(device->mutex_);
+		device->timer_armed_ = false;
+	}
+	device->Tick();
+}
+
+void BlabbleSoundDevice::Tick()
+{
+	std::vector<Probe> detach;
+	std::vector<std::pair<unsigned int, Probe> > attach;
+	pj_timestamp now;
+	pj_get_timestamp(&now);
+
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+
+		for (ProbeMap::iterator it = probes_.begin(); it != probes_.end();)
+		{
+			Probe &probe = it->second;
+			if (probe.attached)
+			{
+				for (int i = 0; i < PROBE_COUNT; i++)
+				{
+					if (probe.recorded[i] || !probe.ports[i]->seen)
+						continue;
+
+					MEMORY_BARRIER();
+					pj_uint32_t usec = pj_elapsed_usec(&probe.answered, &probe.ports[i]->at);
+					(i == CAPTURE ? first_capture_usec : first_playback_usec).Record(usec);
+					last_usec_[i] = (long)usec;
+					probe.recorded[i] = true;
+				}
+			}
+
+			bool done = probe.recorded[CAPTURE] && probe.recorded[PLAYBACK];
+			bool expired = pj_elapsed_msec(&probe.answered, &now) >= BLABBLE_SND_PROBE_TIMEOUT_MSEC;
+			if (done || expired || probe.forgotten)
+			{
+				if (expired && !done && !probe.forgotten)
+				{
+					BLABBLE_LOG_DEBUG("BlabbleSoundDevice no first audio " << BLABBLE_SND_PROBE_TIMEOUT_MSEC <<
+						"ms after call " << it->first << " was answered.");
+					first_audio_timeouts.Increment();
+				}
+				detach.push_back(probe);
+				probes_.erase(it++);
+				continue;
+			}
+
+			if (!probe.attached && probe.source != PJSUA_INVALID_ID)
+				attach.push_back(std::make_pair(it->first, probe));
+			it++;
+		}
+	}
+
+	//Bridge changes happen without mutex_, which PJSIP callbacks take
+	for (size_t i = 0; i < detach.size(); i++)
+		Detach(detach[i]);
+
+	for (size_t i = 0; i < attach.size(); i++)
+	{
+		Probe &probe = attach[i].second;
+		if (!Attach(probe))
+			Detach(probe);
+
+		boost::mutex::scoped_lock lock(mutex_);
+		ProbeMap::iterator it = probes_.find(attach[i].first);
+		if (it == probes_.end() || shutdown_)
+		{
+			Detach(probe);
+		}
+		else if (!probe.attached)
+		{
+			//Unable to probe this call, give up on it rather than retry every tick
+			probes_.erase(it);
+		}
+		else
+		{
+			it->second.attached = true;
+			it->second.pool = probe.pool;
+			for (int p = 0; p < PROBE_COUNT; p++)
+			{
+				it->second.ports[p] = probe.ports[p];
+				it->second.slots[p] = probe.slots[p];
+			}
+		}
+	}
+
+	boost::mutex::scoped_lock lock(mutex_);
+	if (!probes_.empty())
+		ArmTimer();
+}
+
+//Static
+bool BlabbleSoundDevice::Attach(Probe& probe)
+{
+	pjsua_conf_port_info bridge;
+	if (pjsua_conf_get_port_info(0, &bridge) != PJ_SUCCESS)
+		return false;
+
+	probe.pool = pjsua_pool_create("firstaudio", 512, 512);
+	if (probe.pool == NULL)
+		return false;
+
+	//Slot 0 carries the microphone, the call's slot what will be played
+	pjsua_conf_port_id sources[PROBE_COUNT] = { 0, probe.source };
+	for (int i = 0; i < PROBE_COUNT; i++)
+	{
+		probe.ports[i] = PJ_POOL_ZALLOC_T(probe.pool, FirstAudioPort);
+		pj_str_t name = pj_str(const_cast<char*>("firstaudio"));
+		pjmedia_port_info_init(&probe.ports[i]->base.info, &name, PJMEDIA_SIG_CLASS_APP('B', 'F', 'A'),
+			bridge.clock_rate, bridge.channel_count, 16, bridge.samples_per_frame);
+		probe.ports[i]->base.put_frame = &FirstAudioPutFrame;
+		probe.ports[i]->base.get_frame = &FirstAudioGetFrame;
+
+		pj_status_t status = pjsua_conf_add_port(probe.pool, &probe.ports[i]->base, &probe.slots[i]);
+		if (status == PJ_SUCCESS)
+			status = pjsua_conf_connect(sources[i], probe.slots[i]);
+
+		if (status != PJ_SUCCESS)
+		{
+			BLABBLE_LOG_ERROR("BlabbleSoundDevice::Attach failed to probe conference slot "
+				<< sources[i] << ", got status: " << status);
+			return false;
+		}
+	}
+
+	probe.attached = true;
+	return true;
+}
+
+//Static
+void BlabbleSoundDevice::Detach(Probe& probe)
+{
+	for (int i = 0; i < PROBE_COUNT; i++)
+	{
+		if (probe.slots[i] != PJSUA_INVALID_ID)
+			pjsua_conf_remove_port(probe.slots[i]);
+		if (probe.ports[i] != NULL)
+			pjmedia_port_destroy(&probe.ports[i]->base);
+		probe.slots[i] = PJSUA_INVALID_ID;
+		probe.ports[i] = NULL;
+	}
+
+	if (probe.pool != NULL)
+		pj_pool_release(probe.pool);
+	probe.pool = NULL;
+	probe.attached = false;
+}
+
+void BlabbleSoundDevice::ArmTimer()
+{
+	if (timer_armed_ || shutdown_)
+		return;
+
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleSoundDevice::OnTimer, this, BLABBLE_SND_PROBE_MSEC);
+	if (status == PJ_SUCCESS)
+	{
+		timer_armed_ = true;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleSoundDevice::ArmTimer failed to schedule timer, got status: " << status);
+	}
+}
+
+FB::VariantMap BlabbleSoundDevice::stats()
+{
+	FB::VariantMap map;
+	map["warm"] = config_.warm;
+	map["autoClose"] = config_.auto_close;
+	map["active"] = pjsua_snd_is_active() ? true : false;
+	map["warmOpens"] = warm_opens.value();
+
+	boost::mutex::scoped_lock lock(mutex_);
+	map["lastCaptureUsec"] = last_usec_[CAPTURE];
+	map["lastPlaybackUsec"] = last_usec_[PLAYBACK];
+	return map;
+}
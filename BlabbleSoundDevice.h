@@ -0,0 +1,178 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleSoundDevice
+#define H_BlabbleSoundDevice
+
+#include <string>
+#include <map>
+#include "JSAPIAuto.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+#include <pjmedia.h>
+
+/*! @Brief Seconds the sound device stays open after its last use in warm mode,
+ *  unless the specification sets close.
+ */
+#ifndef BLABBLE_SND_WARM_CLOSE_SEC
+#define BLABBLE_SND_WARM_CLOSE_SEC 30
+#endif
+
+/*! @Brief How often the first audio probes are looked at, in milliseconds.
+ */
+#ifndef BLABBLE_SND_PROBE_MSEC
+#define BLABBLE_SND_PROBE_MSEC 20
+#endif
+
+/*! @Brief Longest time after Answer the first audio is waited for, in milliseconds.
+ */
+#ifndef BLABBLE_SND_PROBE_TIMEOUT_MSEC
+#define BLABBLE_SND_PROBE_TIMEOUT_MSEC 10000
+#endif
+
+/*! @Brief Sound device settings.
+ */
+struct BlabbleSoundDeviceConfig
+{
+	BlabbleSoundDeviceConfig() : warm(false), auto_close(1) { }
+
+	bool warm;			//!< Keep the device open between calls
+	int auto_close;		//!< snd_auto_close_time, seconds idle before closing, -1 for never
+
+	/*! @Brief Parse a sound device specification.
+	 *
+	 *  The specification is a comma separated list of `key=value` with the
+	 *  keys warm, on or off, and close, the seconds the device stays open
+	 *  when idle or never, e.g. `warm=on,close=60`. warm=on on its own
+	 *  closes after BLABBLE_SND_WARM_CLOSE_SEC. An empty specification
+	 *  keeps PJSUA's behaviour of opening the device on first use and
+	 *  closing it a second after. Throws std::runtime_error on anything it
+	 *  does not understand.
+	 */
+	static BlabbleSoundDeviceConfig Parse(const std::string& spec);
+};
+
+struct FirstAudioPort;
+
+/*! @class  BlabbleSoundDevice
+ *
+ *  @brief  Keeps the sound device warm and measures how long answered calls take to sound.
+ *
+ *  PJSUA opens the sound device when something is first connected to
+ *  conference slot 0 and closes it again once nothing has been for
+ *  snd_auto_close_time. The open can take hundreds of milliseconds. An
+ *  incoming call's ringtone already opens it before the answer, so what
+ *  warm mode changes is the close timeout: the device stays open for
+ *  BLABBLE_SND_WARM_CLOSE_SEC, or the configured close, after its last
+ *  use, and back to back calls skip the open. With close=never the
+ *  device is also opened once an account registers, so the first call
+ *  skips it as well. That open runs on a thread of its own, so SIP
+ *  processing never waits for it. Nothing is opened when a call starts
+ *  ringing, since the ringtone does that already.
+ *
+ *  From Answer, two sink ports in the conference bridge watch the
+ *  microphone and the call's audio. The time to the first frame with any
+ *  signal on each is recorded as "call.firstCapture.usec" and
+ *  "call.firstPlayback.usec" in BlabbleMetrics. As in BlabbleLevelMeter,
+ *  ports are only added and removed from a PJSIP timer.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleSoundDevice
+{
+public:
+	BlabbleSoundDevice();
+	virtual ~BlabbleSoundDevice();
+
+	/*! @Brief Apply config to media_cfg. Must be called before pjsua_init.
+	 */
+	void Configure(const BlabbleSoundDeviceConfig& config, pjsua_media_config& media_cfg);
+
+	/*! @Brief Remove every probe from the bridge. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief Open the sound device on a thread of its own if warm mode is
+	 *  on with close=never and it is closed. Called when an account
+	 *  registers, returns at once.
+	 */
+	void Warm();
+
+	/*! @Brief Start timing the first audio of the call with global id id.
+	 *  Called just before the call is answered.
+	 */
+	void Answered(unsigned int id);
+
+	/*! @Brief The call's audio is in conference slot. Called when media becomes active.
+	 */
+	void MediaActive(unsigned int id, pjsua_conf_port_id slot);
+
+	/*! @Brief Stop timing the call. Called when the call ends.
+	 */
+	void Forget(unsigned int id);
+
+	/*! @Brief Object for JavaScript with "warm", "autoClose", "active",
+	 *  "warmOpens", "lastCaptureUsec" and "lastPlaybackUsec" properties.
+	 *  The last two are -1 until a call has been measured.
+	 */
+	FB::VariantMap stats();
+
+private:
+	enum { CAPTURE, PLAYBACK, PROBE_COUNT };
+
+	struct Probe
+	{
+		pj_timestamp answered;
+		pjsua_conf_port_id source;		//!< Call's slot, PJSUA_INVALID_ID until media is active
+		bool attached;
+		bool forgotten;
+		pj_pool_t* pool;
+		FirstAudioPort* ports[PROBE_COUNT];
+		pjsua_conf_port_id slots[PROBE_COUNT];
+		bool recorded[PROBE_COUNT];
+	};
+	typedef std::map<unsigned int, Probe> ProbeMap;
+
+	static void OnTimer(void *user_data);
+	void Tick();
+
+	static int WarmThread(void* arg);
+
+	/*! @Brief Open the sound device if it is closed. Blocks for as long as the open takes.
+	 */
+	void Open();
+
+	/*! @Brief Wait for the warm thread and free it. mutex_ must be held, or Shutdown be running.
+	 */
+	void JoinWarm();
+
+	static bool IsClosed();
+
+	/*! @Brief Add the probe ports to the bridge. Returns false on failure.
+	 */
+	static bool Attach(Probe& probe);
+	static void Detach(Probe& probe);
+
+	/*! @Brief Arm the timer if it is not already. mutex_ must be held.
+	 */
+	void ArmTimer();
+
+	boost::mutex mutex_;
+	ProbeMap probes_;
+	BlabbleSoundDeviceConfig config_;
+	long last_usec_[PROBE_COUNT];
+	pj_pool_t* warm_pool_;
+	pj_thread_t* warm_thread_;
+	bool warming_;				//!< The warm thread is opening the device
+	bool timer_armed_;
+	bool shutdown_;
+};
+
+#endif // H_BlabbleSoundDevice
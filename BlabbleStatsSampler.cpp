@@ -0,0 +1,246 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <vector>
+#include <sstream>
+#include "variant_list.h"
+#include "BlabbleStatsSampler.h"
+#include <pjsua-lib/pjsua_internal.h>
+#include "BlabbleCall.h"
+#include "BlabbleAccount.h"
+#include "BlabbleLogging.h"
+
+BlabbleStatsSampler::BlabbleStatsSampler() :
+	timer_due_(0), shutdown_(false)
+{
+}
+
+BlabbleStatsSampler::~BlabbleStatsSampler()
+{
+}
+
+void BlabbleStatsSampler::Subscribe(const BlabbleCallPtr& call, const BlabbleAccountPtr& account,
+	unsigned int interval, const FB::JSObjectPtr& callback)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	if (shutdown_)
+		return;
+
+	pj_uint64_t now = Now();
+	Subscription &sub = subscriptions_[call->id()];
+	sub.call = call;
+	sub.account = account;
+	sub.callback = callback;
+	sub.interval = interval < BLABBLE_STATS_MIN_INTERVAL ? BLABBLE_STATS_MIN_INTERVAL : interval;
+	sub.due = now + sub.interval;
+	sub.last_time = 0;
+	pj_bzero(&sub.last, sizeof(sub.last));
+
+	ArmTimer(now);
+}
+
+void BlabbleStatsSampler::Unsubscribe(unsigned int call_id)
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	subscriptions_.erase(call_id);
+}
+
+void BlabbleStatsSampler::Shutdown()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	shutdown_ = true;
+	subscriptions_.clear();
+}
+
+//Static
+void BlabbleStatsSampler::OnTimer(void *user_data)
+{
+	BlabbleStatsSampler *sampler = static_cast<BlabbleStatsSampler*>(user_data);
+	{
+		boost::mutex::scoped_lock lock(sampler->mutex_);
+		if (sampler->timer_due_ <= Now())
+			sampler->timer_due_ = 0;
+	}
+
+	sampler->Tick();
+}
+
+/*! @Brief A call whose stats are due this tick.
+ */
+struct DueCall
+{
+	unsigned int id;
+	pjsua_call_id call_id;
+	bool sampled;
+	pjmedia_rtcp_stat stat;
+};
+
+/*! @Brief Updates going to the same JavaScript callback.
+ */
+struct StatsBatch
+{
+	BlabbleAccountPtr account;
+	FB::JSObjectPtr callback;
+	FB::VariantList updates;
+	std::vector<unsigned int> ids;	//!< Global call ids of updates, ascending
+};
+
+void BlabbleStatsSampler::Tick()
+{
+	std::vector<DueCall> due;
+	pj_uint64_t now = Now();
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+
+		SubscriptionMap::iterator it = subscriptions_.begin();
+		while (it != subscriptions_.end())
+		{
+			BlabbleCallPtr call = it->second.call.lock();
+			if (!call)
+			{
+				subscriptions_.erase(it++);
+				continue;
+			}
+
+			if (it->second.due <= now)
+			{
+				DueCall d;
+				d.id = it->first;
+				d.call_id = call->callId();
+				d.sampled = false;
+				due.push_back(d);
+			}
+			it++;
+		}
+	}
+
+	if (!due.empty())
+	{
+		//A single pass under one PJSUA lock for every due call
+		PJSUA_LOCK();
+		for (std::vector<DueCall>::iterator it = due.begin(); it != due.end(); it++)
+		{
+			if (it->call_id < 0 || it->call_id >= PJSUA_MAX_CALLS)
+				continue;
+
+			pjsua_call *call = &pjsua_var.calls[it->call_id];
+			if ((unsigned int)(pj_ssize_t)call->user_data != it->id ||
+				call->audio_idx < 0 || call->audio_idx >= (int)call->med_cnt)
+			{
+				continue;
+			}
+
+			pjmedia_stream *stream = call->media[call->audio_idx].strm.a.stream;
+			if (stream && pjmedia_stream_get_stat(stream, &it->stat) == PJ_SUCCESS)
+				it->sampled = true;
+		}
+		PJSUA_UNLOCK();
+	}
+
+	std::map<FB::JSObject*, StatsBatch> batches;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (shutdown_)
+			return;
+
+		for (std::vector<DueCall>::iterator it = due.begin(); it != due.end(); it++)
+		{
+			SubscriptionMap::iterator sub_it = subscriptions_.find(it->id);
+			if (sub_it == subscriptions_.end())
+				continue;
+
+			Subscription &sub = sub_it->second;
+			sub.due = now + sub.interval;
+
+			//No stream yet (or anymore), try again next interval
+			BlabbleCallPtr call = sub.call.lock();
+			BlabbleAccountPtr account = sub.account.lock();
+			if (!it->sampled || !call || !account)
+				continue;
+
+			const pjmedia_rtcp_stat &stat = it->stat;
+			pj_uint32_t pkt = stat.rx.pkt, loss = stat.rx.loss;
+			double elapsed = 0;
+			if (sub.last_time != 0)
+			{
+				pkt -= sub.last.rx.pkt;
+				loss -= sub.last.rx.loss;
+				elapsed = (double)(now - sub.last_time);
+			}
+
+			FB::VariantMap update;
+			update["call"] = BlabbleCallWeakPtr(call);
+			update["jitter"] = stat.rx.jitter.last / 1000.0;
+			update["rtt"] = stat.rtt.last / 1000.0;
+			update["loss"] = pkt + loss > 0 ? 100.0 * loss / (pkt + loss) : 0.0;
+			update["rxKbps"] = elapsed > 0 ? (pj_uint32_t)(stat.rx.bytes - sub.last.rx.bytes) * 8 / elapsed : 0.0;
+			update["txKbps"] = elapsed > 0 ? (pj_uint32_t)(stat.tx.bytes - sub.last.tx.bytes) * 8 / elapsed : 0.0;
+			update["rxPackets"] = (double)stat.rx.pkt;
+			update["rxLost"] = (double)stat.rx.loss;
+			update["txPackets"] = (double)stat.tx.pkt;
+
+			sub.last = stat;
+			sub.last_time = now;
+
+			StatsBatch &batch = batches[sub.callback.get()];
+			batch.account = account;
+			batch.callback = sub.callback;
+			batch.updates.push_back(update);
+			batch.ids.push_back(it->id);
+		}
+
+		ArmTimer(now);
+	}
+
+	for (std::map<FB::JSObject*, StatsBatch>::iterator it = batches.begin(); it != batches.end(); it++)
+	{
+		//Only a batch for the same calls may replace this one, calls on other
+		//intervals must not lose their update
+		std::stringstream key;
+		key << "callStats:" << it->first;
+		for (size_t i = 0; i < it->second.ids.size(); i++)
+			key << ":" << it->second.ids[i];
+		it->second.account->QueueEvent("callStats", it->second.callback, 
+			FB::variant_list_of(it->second.updates), key.str());
+	}
+}
+
+void BlabbleStatsSampler::ArmTimer(pj_uint64_t now)
+{
+	pj_uint64_t next = 0;
+	for (SubscriptionMap::iterator it = subscriptions_.begin(); it != subscriptions_.end(); it++)
+	{
+		if (next == 0 || it->second.due < next)
+			next = it->second.due;
+	}
+
+	if (next == 0 || (timer_due_ != 0 && timer_due_ <= next))
+		return;
+
+	unsigned wait = next > now ? (unsigned)(next - now) : 0;
+	pj_status_t status = pjsua_schedule_timer2(&BlabbleStatsSampler::OnTimer, this, wait);
+	if (status == PJ_SUCCESS)
+	{
+		timer_due_ = next;
+	}
+	else
+	{
+		BLABBLE_LOG_ERROR("BlabbleStatsSampler::ArmTimer failed to schedule timer, got status: " << status);
+	}
+}
+
+//Static
+pj_uint64_t BlabbleStatsSampler::Now()
+{
+	pj_time_val now;
+	pj_gettickcount(&now);
+	return (pj_uint64_t)now.sec * 1000 + now.msec;
+}
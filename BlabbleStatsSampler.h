@@ -0,0 +1,95 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleStatsSampler
+#define H_BlabbleStatsSampler
+
+#include <map>
+#include "JSAPIAuto.h"
+#include "JSObject.h"
+#include <boost/thread/mutex.hpp>
+#include <pjlib.h>
+#include <pjsua-lib/pjsua.h>
+#include <pjmedia.h>
+
+FB_FORWARD_PTR(BlabbleCall)
+FB_FORWARD_PTR(BlabbleAccount)
+
+/*! @Brief Shortest stats interval a call can subscribe with, in milliseconds.
+ */
+#ifndef BLABBLE_STATS_MIN_INTERVAL
+#define BLABBLE_STATS_MIN_INTERVAL 250
+#endif
+
+/*! @class  BlabbleStatsSampler
+ *
+ *  @brief  Samples RTP/RTCP statistics of subscribed calls and pushes them
+ *          to JavaScript.
+ *
+ *  One PJSIP timer serves every subscription. Each tick takes the PJSUA
+ *  lock once, reads the stream statistics of every call that is due and
+ *  then, with the lock released, turns them into compact updates. Updates
+ *  for calls sharing a callback are delivered together as one array through
+ *  the account's event queue, and a batch still waiting for the main thread
+ *  is replaced by a newer one for the same calls.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleStatsSampler
+{
+public:
+	BlabbleStatsSampler();
+	virtual ~BlabbleStatsSampler();
+
+	/*! @Brief Start sending stats for call to callback every interval milliseconds.
+	 *  A call has at most one subscription, subscribing again replaces it.
+	 */
+	void Subscribe(const BlabbleCallPtr& call, const BlabbleAccountPtr& account,
+		unsigned int interval, const FB::JSObjectPtr& callback);
+
+	/*! @Brief Stop sending stats for the call with the global id call_id.
+	 */
+	void Unsubscribe(unsigned int call_id);
+
+	/*! @Brief Drop every subscription. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+private:
+	struct Subscription
+	{
+		BlabbleCallWeakPtr call;
+		BlabbleAccountWeakPtr account;
+		FB::JSObjectPtr callback;
+		unsigned int interval;
+		pj_uint64_t due;			//!< Tick count (msec) of the next sample
+		pj_uint64_t last_time;		//!< Tick count of the previous sample, 0 if none
+		pjmedia_rtcp_stat last;		//!< Counters at the previous sample
+	};
+	typedef std::map<unsigned int, Subscription> SubscriptionMap;
+
+	static void OnTimer(void *user_data);
+
+	/*! @Brief Sample every due subscription and deliver the updates.
+	 */
+	void Tick();
+
+	/*! @Brief Arm the timer for the earliest due subscription. mutex_ must be held.
+	 */
+	void ArmTimer(pj_uint64_t now);
+
+	static pj_uint64_t Now();
+
+	boost::mutex mutex_;
+	SubscriptionMap subscriptions_;
+	pj_uint64_t timer_due_; //!< When the earliest outstanding timer fires, 0 if none
+	bool shutdown_;
+};
+
+#endif // H_BlabbleStatsSampler
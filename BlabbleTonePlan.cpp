@@ -0,0 +1,151 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cmath>
+#include "BlabbleTonePlan.h"
+#include <boost/smart_ptr/make_shared.hpp>
+
+//Most steps in one cadence, a step with on_msec 0 ends it early
+#define TONE_MAX_STEPS 3
+
+/*! @Brief Cadences of one built in plan.
+ */
+struct TonePlanDef
+{
+	const char* name;
+	BlabbleToneSegment ring[TONE_MAX_STEPS];
+	BlabbleToneSegment in_ring[TONE_MAX_STEPS];
+	BlabbleToneSegment call_wait[TONE_MAX_STEPS];
+	BlabbleToneSegment busy[TONE_MAX_STEPS];
+	BlabbleToneSegment reorder[TONE_MAX_STEPS];
+};
+
+static const TonePlanDef tone_plans[] =
+{
+	//freq1, freq2, on msec, off msec
+	{ "us",
+		{ { 440, 480, 2000, 4000 }, { 440, 480, 2000, 4000 }, { 440, 480, 2000, 3000 } },
+		{ { 440, 480, 2000, 1000 } },
+		{ { 440, 0, 500, 2000 }, { 440, 0, 500, 4000 } },
+		{ { 480, 620, 500, 500 } },
+		{ { 480, 620, 250, 250 } } },
+	{ "uk",
+		{ { 400, 450, 400, 200 }, { 400, 450, 400, 2000 } },
+		{ { 400, 450, 400, 200 }, { 400, 450, 400, 2000 } },
+		{ { 400, 0, 100, 3000 } },
+		{ { 400, 0, 375, 375 } },
+		{ { 400, 0, 400, 350 }, { 400, 0, 225, 525 } } },
+	{ "eu",
+		{ { 425, 0, 1000, 4000 } },
+		{ { 425, 0, 1000, 4000 } },
+		{ { 425, 0, 200, 200 }, { 425, 0, 200, 4400 } },
+		{ { 425, 0, 500, 500 } },
+		{ { 425, 0, 250, 250 } } },
+	{ "au",
+		{ { 400, 450, 400, 200 }, { 400, 450, 400, 2000 } },
+		{ { 400, 450, 400, 200 }, { 400, 450, 400, 2000 } },
+		{ { 425, 0, 200, 200 }, { 425, 0, 200, 4400 } },
+		{ { 425, 0, 375, 375 } },
+		{ { 425, 0, 2500, 500 } } },
+	{ "jp",
+		{ { 400, 0, 1000, 2000 } },
+		{ { 400, 0, 1000, 2000 } },
+		{ { 400, 0, 100, 100 }, { 400, 0, 100, 3000 } },
+		{ { 400, 0, 500, 500 } },
+		{ { 400, 0, 250, 250 } } }
+};
+
+#define TONE_PLAN_COUNT (sizeof(tone_plans) / sizeof(tone_plans[0]))
+
+static BlabbleCadence ToCadence(const BlabbleToneSegment* steps)
+{
+	BlabbleCadence cadence;
+	for (unsigned int i = 0; i < TONE_MAX_STEPS && steps[i].on_msec > 0; i++)
+	{
+		cadence.push_back(steps[i]);
+	}
+	return cadence;
+}
+
+bool BlabbleTonePlan::Find(const std::string& name, BlabbleTonePlan& plan)
+{
+	for (unsigned int i = 0; i < TONE_PLAN_COUNT; i++)
+	{
+		const TonePlanDef &def = tone_plans[i];
+		if (name != def.name)
+			continue;
+
+		plan.name = def.name;
+		plan.ring = ToCadence(def.ring);
+		plan.in_ring = ToCadence(def.in_ring);
+		plan.call_wait = ToCadence(def.call_wait);
+		plan.busy = ToCadence(def.busy);
+		plan.reorder = ToCadence(def.reorder);
+		return true;
+	}
+
+	return false;
+}
+
+std::vector<std::string> BlabbleTonePlan::Names()
+{
+	std::vector<std::string> names;
+	for (unsigned int i = 0; i < TONE_PLAN_COUNT; i++)
+	{
+		names.push_back(tone_plans[i].name);
+	}
+	return names;
+}
+
+//Static
+BlabbleSoundPtr BlabbleTonePlan::Render(const BlabbleCadence& cadence, unsigned int clock_rate)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < cadence.size(); i++)
+	{
+		total += (size_t)(cadence[i].on_msec + cadence[i].off_msec) * clock_rate / 1000;
+	}
+	if (total == 0)
+		return BlabbleSoundPtr();
+
+	boost::shared_ptr<BlabbleSound> sound = boost::make_shared<BlabbleSound>();
+	sound->clock_rate = clock_rate;
+	sound->samples.assign(total, 0);
+
+	const double two_pi = 6.283185307179586;
+	size_t ramp = (size_t)clock_rate * BLABBLE_TONE_RAMP_MSEC / 1000;
+	size_t pos = 0;
+	for (size_t i = 0; i < cadence.size(); i++)
+	{
+		const BlabbleToneSegment &step = cadence[i];
+		size_t on = (size_t)step.on_msec * clock_rate / 1000;
+		size_t off = (size_t)step.off_msec * clock_rate / 1000;
+		double amplitude = step.freq2 ? BLABBLE_TONE_AMPLITUDE / 2.0 : BLABBLE_TONE_AMPLITUDE;
+		double w1 = two_pi * step.freq1 / clock_rate;
+		double w2 = two_pi * step.freq2 / clock_rate;
+
+		for (size_t n = 0; n < on; n++)
+		{
+			double value = std::sin(w1 * n);
+			if (step.freq2)
+				value += std::sin(w2 * n);
+
+			double gain = 1.0;
+			if (n < ramp)
+				gain = (double)n / ramp;
+			else if (on - n <= ramp)
+				gain = (double)(on - n - 1) / ramp;
+
+			sound->samples[pos + n] = (pj_int16_t)(value * amplitude * gain);
+		}
+		pos += on + off;
+	}
+
+	return sound;
+}
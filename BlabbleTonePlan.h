@@ -0,0 +1,77 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleTonePlan
+#define H_BlabbleTonePlan
+
+#include <string>
+#include <vector>
+#include <pjlib.h>
+#include "BlabbleSoundCache.h"
+
+/*! @Brief Peak amplitude of a rendered tone, shared between its frequencies.
+ */
+#ifndef BLABBLE_TONE_AMPLITUDE
+#define BLABBLE_TONE_AMPLITUDE 12288
+#endif
+
+/*! @Brief Length of the fade in and out at each edge of a tone, in milliseconds.
+ *  Keeps the cadence from clicking.
+ */
+#ifndef BLABBLE_TONE_RAMP_MSEC
+#define BLABBLE_TONE_RAMP_MSEC 2
+#endif
+
+/*! @Brief One step of a cadence, on_msec of tone followed by off_msec of silence.
+ *  freq2 is 0 for a single frequency.
+ */
+struct BlabbleToneSegment
+{
+	unsigned int freq1;
+	unsigned int freq2;
+	unsigned int on_msec;
+	unsigned int off_msec;
+};
+
+typedef std::vector<BlabbleToneSegment> BlabbleCadence;
+
+/*! @Brief The call progress tones of one region.
+ *
+ *  Each cadence is rendered once with Render into a loop buffer at the
+ *  conference bridge clock rate and then played from memory, so a tone
+ *  that is playing costs a copy per frame instead of synthesis.
+ *
+ *  Built in plans are "us" (the default), "uk", "eu" (ETSI/CEPT 425Hz),
+ *  "au" and "jp". in_ring is what plays locally for an incoming call when
+ *  there is no ringtone.wav.
+ */
+struct BlabbleTonePlan
+{
+	std::string name;
+	BlabbleCadence ring;			//!< Ringback for outgoing calls
+	BlabbleCadence in_ring;			//!< Incoming call
+	BlabbleCadence call_wait;		//!< Incoming call while on another call
+	BlabbleCadence busy;
+	BlabbleCadence reorder;			//!< Congestion or number unobtainable
+
+	/*! @Brief Look up a built in plan. Returns false if name is unknown.
+	 */
+	static bool Find(const std::string& name, BlabbleTonePlan& plan);
+
+	/*! @Brief Names of every built in plan.
+	 */
+	static std::vector<std::string> Names();
+
+	/*! @Brief Render one full cycle of cadence as 16 bit mono at clock_rate.
+	 *  Returns an empty pointer for an empty cadence.
+	 */
+	static BlabbleSoundPtr Render(const BlabbleCadence& cadence, unsigned int clock_rate);
+};
+
+#endif // H_BlabbleTonePlan
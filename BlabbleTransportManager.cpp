@@ -0,0 +1,370 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#include <cstdlib>
+#include <cctype>
+#include <stdexcept>
+#include "BlabbleTransportManager.h"
+#include "BlabbleAtomic.h"
+#include "BlabbleLogging.h"
+#include <pjsua-lib/pjsua_internal.h>
+
+pjsip_module BlabbleTransportManager::module_;
+BlabbleTransportManager* BlabbleTransportManager::instance_ = NULL;
+
+static std::string Trim(const std::string& s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string::npos)
+		return "";
+	return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+static long ParseNumber(const std::string& value, const std::string& entry)
+{
+	char* end = NULL;
+	long n = std::strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || n < 0)
+		throw std::runtime_error("Invalid number in SIP transport " + entry);
+	return n;
+}
+
+//Static
+std::vector<BlabbleTransportConfig> BlabbleTransportConfig::Parse(const std::string& spec)
+{
+	std::vector<BlabbleTransportConfig> configs;
+	std::string rest = Trim(spec);
+	if (rest.empty())
+		rest = "udp,tls";
+
+	while (!rest.empty())
+	{
+		size_t comma = rest.find(',');
+		std::string entry = Trim(rest.substr(0, comma));
+		rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+		if (entry.empty())
+			continue;
+
+		BlabbleTransportConfig config;
+		size_t semi = entry.find(';');
+		std::string head = Trim(entry.substr(0, semi));
+		std::string options = semi == std::string::npos ? "" : entry.substr(semi + 1);
+
+		size_t colon = head.find(':');
+		std::string proto = head.substr(0, colon);
+		for (size_t i = 0; i < proto.size(); i++)
+			proto[i] = (char)std::tolower(proto[i]);
+
+		if (proto == "udp")
+			config.type = PJSIP_TRANSPORT_UDP;
+		else if (proto == "tcp")
+			config.type = PJSIP_TRANSPORT_TCP;
+		else if (proto == "tls")
+			config.type = PJSIP_TRANSPORT_TLS;
+		else
+			throw std::runtime_error("Unknown SIP transport " + entry);
+
+		if (colon != std::string::npos)
+		{
+			long port = ParseNumber(head.substr(colon + 1), entry);
+			if (port > 65535)
+				throw std::runtime_error("Invalid port in SIP transport " + entry);
+			config.port = (unsigned int)port;
+		}
+
+		while (!options.empty())
+		{
+			semi = options.find(';');
+			std::string option = Trim(options.substr(0, semi));
+			options = semi == std::string::npos ? "" : options.substr(semi + 1);
+			if (option.empty())
+				continue;
+
+			size_t eq = option.find('=');
+			if (eq == std::string::npos)
+				throw std::runtime_error("Invalid option in SIP transport " + entry);
+			std::string key = Trim(option.substr(0, eq)), value = Trim(option.substr(eq + 1));
+
+			if (key == "bind")
+				config.bound_addr = value;
+			else if (key == "public")
+				config.public_addr = value;
+			else if (key == "rcvbuf")
+				config.rcvbuf = (int)ParseNumber(value, entry);
+			else if (key == "sndbuf")
+				config.sndbuf = (int)ParseNumber(value, entry);
+			else if (key == "count" && config.type == PJSIP_TRANSPORT_UDP)
+				config.count = (unsigned int)ParseNumber(value, entry);
+			else
+				throw std::runtime_error("Unknown option " + key + " in SIP transport " + entry);
+		}
+
+		if (config.count == 0 || (config.port != 0 && config.port + config.count - 1 > 65535))
+			throw std::runtime_error("Invalid count in SIP transport " + entry);
+
+		configs.push_back(config);
+	}
+
+	return configs;
+}
+
+BlabbleTransportManager::BlabbleTransportManager() :
+	next_udp_(0), has_tcp_(false), has_tls_(false), registered_(false)
+{
+}
+
+BlabbleTransportManager::~BlabbleTransportManager()
+{
+}
+
+void BlabbleTransportManager::Start(const std::string& spec)
+{
+	std::vector<BlabbleTransportConfig> configs = BlabbleTransportConfig::Parse(spec);
+	for (size_t i = 0; i < configs.size(); i++)
+	{
+		for (unsigned int n = 0; n < configs[i].count; n++)
+		{
+			Create(configs[i], configs[i].port == 0 ? 0 : configs[i].port + n);
+		}
+	}
+
+	pj_bzero(&module_, sizeof(module_));
+	module_.name = pj_str(const_cast<char*>("mod-blabble-transport-stats"));
+	module_.id = -1;
+	//Below the message printer, so outgoing messages have been printed by the time we see them
+	module_.priority = PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 1;
+	module_.on_rx_request = &BlabbleTransportManager::OnRxMessage;
+	module_.on_rx_response = &BlabbleTransportManager::OnRxMessage;
+	module_.on_tx_request = &BlabbleTransportManager::OnTxMessage;
+	module_.on_tx_response = &BlabbleTransportManager::OnTxMessage;
+
+	instance_ = this;
+	pj_status_t status = pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &module_);
+	if (status == PJ_SUCCESS)
+	{
+		registered_ = true;
+	}
+	else
+	{
+		instance_ = NULL;
+		BLABBLE_LOG_ERROR("BlabbleTransportManager::Start unable to register statistics module, got status: " << status);
+	}
+}
+
+void BlabbleTransportManager::Shutdown()
+{
+	if (registered_)
+	{
+		pjsip_endpt_unregister_module(pjsua_get_pjsip_endpt(), &module_);
+		registered_ = false;
+	}
+	instance_ = NULL;
+}
+
+void BlabbleTransportManager::Create(const BlabbleTransportConfig& config, unsigned int port)
+{
+	pjsua_transport_config cfg;
+	pjsua_transport_config_default(&cfg);
+	cfg.port = port;
+	if (!config.bound_addr.empty())
+		cfg.bound_addr = pj_str(const_cast<char*>(config.bound_addr.c_str()));
+	if (!config.public_addr.empty())
+		cfg.public_addr = pj_str(const_cast<char*>(config.public_addr.c_str()));
+	if (config.type == PJSIP_TRANSPORT_TLS)
+	{
+		//cfg.tls_setting.verify_server = PJ_TRUE;
+		cfg.tls_setting.timeout.sec = 5;
+		cfg.tls_setting.method = PJSIP_TLSV1_METHOD;
+	}
+
+	std::string name = pjsip_transport_get_type_name(config.type);
+	Transport transport;
+	pj_status_t status = pjsua_transport_create(config.type, &cfg, &transport.id);
+	if (status != PJ_SUCCESS)
+	{
+		if (config.type == PJSIP_TRANSPORT_TLS)
+		{
+			BLABBLE_LOG_DEBUG("Error in tls pjsua_transport_create. Tls will not be enabled");
+			return;
+		}
+		BLABBLE_LOG_ERROR("BlabbleTransportManager::Create failed for " << name.c_str() <<
+			" port " << port << ", got status: " << status);
+		throw std::runtime_error("Error in pjsua_transport_create for " + name + " transport");
+	}
+
+	transport.type = config.type;
+	transport.udp = NULL;
+	transport.port = port;
+	transport.rcvbuf = transport.sndbuf = 0;
+	transport.rx_packets = transport.tx_packets = 0;
+	transport.rx_bytes = transport.tx_bytes = 0;
+	transport.errors = 0;
+
+	pjsua_transport_info info;
+	if (pjsua_transport_get_info(transport.id, &info) == PJ_SUCCESS)
+	{
+		transport.address = std::string(info.local_name.host.ptr, info.local_name.host.slen);
+		transport.port = info.local_name.port;
+	}
+
+	if (config.type == PJSIP_TRANSPORT_UDP)
+	{
+		transport.udp = pjsua_var.tpdata[transport.id].data.tp;
+		SetBuffers(transport, config);
+		udp_ids_.push_back(transport.id);
+	}
+	else if (config.type == PJSIP_TRANSPORT_TCP)
+	{
+		has_tcp_ = true;
+	}
+	else if (config.type == PJSIP_TRANSPORT_TLS)
+	{
+		has_tls_ = true;
+	}
+
+	BLABBLE_LOG_DEBUG("Created " << name.c_str() << " transport on " << transport.address.c_str() <<
+		":" << transport.port);
+	transports_.push_back(transport);
+}
+
+void BlabbleTransportManager::SetBuffers(Transport& transport, const BlabbleTransportConfig& config)
+{
+	pj_sock_t sock = pjsip_udp_transport_get_socket(transport.udp);
+	if (sock == PJ_INVALID_SOCKET)
+		return;
+
+	int value;
+	pj_status_t status;
+	if (config.rcvbuf > 0)
+	{
+		value = config.rcvbuf;
+		status = pj_sock_setsockopt(sock, pj_SOL_SOCKET(), pj_SO_RCVBUF(), &value, sizeof(value));
+		if (status != PJ_SUCCESS)
+			BLABBLE_LOG_ERROR("Unable to set SO_RCVBUF to " << value << ", got status: " << status);
+	}
+	if (config.sndbuf > 0)
+	{
+		value = config.sndbuf;
+		status = pj_sock_setsockopt(sock, pj_SOL_SOCKET(), pj_SO_SNDBUF(), &value, sizeof(value));
+		if (status != PJ_SUCCESS)
+			BLABBLE_LOG_ERROR("Unable to set SO_SNDBUF to " << value << ", got status: " << status);
+	}
+
+	//The OS may round or cap what was asked for, so report what it actually uses
+	int len = sizeof(value);
+	if (pj_sock_getsockopt(sock, pj_SOL_SOCKET(), pj_SO_RCVBUF(), &value, &len) == PJ_SUCCESS)
+		transport.rcvbuf = value;
+	len = sizeof(value);
+	if (pj_sock_getsockopt(sock, pj_SOL_SOCKET(), pj_SO_SNDBUF(), &value, &len) == PJ_SUCCESS)
+		transport.sndbuf = value;
+}
+
+pjsua_transport_id BlabbleTransportManager::NextUdp()
+{
+	//Binding to UDP would stop PJSIP from using TCP when the server asks for it
+	if (udp_ids_.size() < 2 || has_tcp_)
+		return PJSUA_INVALID_ID;
+
+	unsigned long n = (unsigned long)ATOMIC_INCREMENT(&next_udp_);
+	return udp_ids_[n % udp_ids_.size()];
+}
+
+BlabbleTransportManager::Transport* BlabbleTransportManager::Find(pjsip_transport* tp)
+{
+	if (tp == NULL)
+		return NULL;
+
+	int type = tp->key.type & ~PJSIP_TRANSPORT_IPV6;
+	Transport* first = NULL;
+	for (TransportList::iterator it = transports_.begin(); it != transports_.end(); it++)
+	{
+		if (it->udp != NULL)
+		{
+			if (it->udp == tp)
+				return &*it;
+			continue;
+		}
+
+		if ((it->type & ~PJSIP_TRANSPORT_IPV6) != type)
+			continue;
+		if (it->port == (unsigned int)tp->local_name.port)
+			return &*it;
+		if (first == NULL)
+			first = &*it;
+	}
+
+	return first;
+}
+
+//Static
+pj_bool_t BlabbleTransportManager::OnRxMessage(pjsip_rx_data *rdata)
+{
+	BlabbleTransportManager* manager = instance_;
+	if (manager != NULL)
+	{
+		Transport* transport = manager->Find(rdata->tp_info.transport);
+		if (transport != NULL)
+		{
+			ATOMIC_INCREMENT(&transport->rx_packets);
+			ATOMIC_ADD(&transport->rx_bytes, (long)rdata->msg_info.len);
+		}
+	}
+
+	return PJ_FALSE;
+}
+
+//Static
+pj_status_t BlabbleTransportManager::OnTxMessage(pjsip_tx_data *tdata)
+{
+	BlabbleTransportManager* manager = instance_;
+	if (manager != NULL)
+	{
+		Transport* transport = manager->Find(tdata->tp_info.transport);
+		if (transport != NULL)
+		{
+			ATOMIC_INCREMENT(&transport->tx_packets);
+			ATOMIC_ADD(&transport->tx_bytes, (long)(tdata->buf.cur - tdata->buf.start));
+		}
+	}
+
+	return PJ_SUCCESS;
+}
+
+void BlabbleTransportManager::OnTransportState(pjsip_transport *tp, pjsip_transport_state state,
+	const pjsip_transport_state_info *info)
+{
+	if (state != PJSIP_TP_STATE_DISCONNECTED || info == NULL || info->status == PJ_SUCCESS)
+		return;
+
+	Transport* transport = Find(tp);
+	if (transport != NULL)
+		ATOMIC_INCREMENT(&transport->errors);
+}
+
+FB::VariantList BlabbleTransportManager::stats()
+{
+	FB::VariantList list;
+	for (TransportList::iterator it = transports_.begin(); it != transports_.end(); it++)
+	{
+		FB::VariantMap map;
+		map["id"] = (int)it->id;
+		map["type"] = std::string(pjsip_transport_get_type_name(it->type));
+		map["address"] = it->address;
+		map["port"] = it->port;
+		map["rcvbuf"] = it->rcvbuf;
+		map["sndbuf"] = it->sndbuf;
+		map["rxPackets"] = (long)it->rx_packets;
+		map["txPackets"] = (long)it->tx_packets;
+		map["rxBytes"] = (long)it->rx_bytes;
+		map["txBytes"] = (long)it->tx_bytes;
+		map["errors"] = (long)it->errors;
+		list.push_back(map);
+	}
+	return list;
+}
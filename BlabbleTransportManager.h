@@ -0,0 +1,153 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+#ifndef H_BlabbleTransportManager
+#define H_BlabbleTransportManager
+
+#include <string>
+#include <vector>
+#include "JSAPIAuto.h"
+#include <pjlib.h>
+#include <pjsip.h>
+#include <pjsua-lib/pjsua.h>
+
+/*! @Brief Receive buffer given to UDP sockets that do not set one.
+ *  config_site.h shrinks the PJSIP default to 4000 bytes, which is not
+ *  enough for a burst of REGISTER responses or NOTIFYs.
+ */
+#ifndef BLABBLE_SIP_UDP_RCVBUF
+#define BLABBLE_SIP_UDP_RCVBUF (256 * 1024)
+#endif
+
+/*! @Brief Send buffer given to UDP sockets that do not set one.
+ */
+#ifndef BLABBLE_SIP_UDP_SNDBUF
+#define BLABBLE_SIP_UDP_SNDBUF (64 * 1024)
+#endif
+
+/*! @Brief One entry of the transport configuration.
+ */
+struct BlabbleTransportConfig
+{
+	BlabbleTransportConfig() : type(PJSIP_TRANSPORT_UDP), port(0), count(1),
+		rcvbuf(BLABBLE_SIP_UDP_RCVBUF), sndbuf(BLABBLE_SIP_UDP_SNDBUF) { }
+
+	pjsip_transport_type_e type;
+	unsigned int port;			//!< 0 lets the OS pick
+	unsigned int count;			//!< UDP only, transports on consecutive ports
+	std::string bound_addr;		//!< Empty binds to every interface
+	std::string public_addr;	//!< Address advertised in Via and Contact
+	int rcvbuf;					//!< UDP SO_RCVBUF in bytes, 0 leaves the PJSIP default
+	int sndbuf;					//!< UDP SO_SNDBUF in bytes, 0 leaves the PJSIP default
+
+	/*! @Brief Parse a transport specification into entries.
+	 *
+	 *  The specification is a comma separated list of
+	 *  `proto[:port][;key=value]...` where proto is udp, tcp or tls and the
+	 *  keys are bind, public, rcvbuf, sndbuf and count, e.g.
+	 *  `udp:5060;count=4;rcvbuf=1048576,tcp:5060,tls:5061`. An empty
+	 *  specification gives the old behaviour of one UDP and one TLS
+	 *  transport on ports picked by the OS. Throws std::runtime_error on
+	 *  a malformed specification.
+	 */
+	static std::vector<BlabbleTransportConfig> Parse(const std::string& spec);
+};
+
+/*! @class  BlabbleTransportManager
+ *
+ *  @brief  Creates the SIP transports and counts the traffic on each.
+ *
+ *  Transports are built from a BlabbleTransportConfig list before
+ *  pjsua_start. UDP sockets get their buffer sizes set directly, since
+ *  PJSIP 2.1 has no per transport socket options. A TLS transport that
+ *  fails to start is skipped, as PJSIP may be built without TLS; any other
+ *  failure is fatal.
+ *
+ *  A PJSIP module sitting just above the transport layer counts packets
+ *  and bytes in each direction. UDP traffic is matched to its transport
+ *  directly. TCP and TLS connections are counted against the listener on
+ *  the same local port, or the first listener of their type. Connections
+ *  lost with an error are counted as errors.
+ *
+ *  @author Andrew Ofisher (zaltar)
+ */
+class BlabbleTransportManager
+{
+public:
+	BlabbleTransportManager();
+	virtual ~BlabbleTransportManager();
+
+	/*! @Brief Create the transports described by spec. Throws std::runtime_error on failure.
+	 *  Must be called between pjsua_init and pjsua_start.
+	 */
+	void Start(const std::string& spec);
+
+	/*! @Brief Stop counting. Must run before pjsua_destroy.
+	 */
+	void Shutdown();
+
+	/*! @Brief True if a TLS transport was created.
+	 */
+	bool has_tls() const { return has_tls_; }
+
+	/*! @Brief The UDP transport a new non TLS account should be bound to.
+	 *  With more than one UDP transport and no TCP transport accounts are
+	 *  spread over them in turn, otherwise PJSUA_INVALID_ID lets PJSIP
+	 *  choose.
+	 */
+	pjsua_transport_id NextUdp();
+
+	/*! @Brief Called by PjsuaManager when a transport changes state.
+	 */
+	void OnTransportState(pjsip_transport *tp, pjsip_transport_state state,
+		const pjsip_transport_state_info *info);
+
+	/*! @Brief JavaScript array with an object for each transport with "id", "type",
+	 *  "address", "port", "rcvbuf", "sndbuf", "rxPackets", "txPackets",
+	 *  "rxBytes", "txBytes" and "errors" properties.
+	 */
+	FB::VariantList stats();
+
+private:
+	struct Transport
+	{
+		pjsua_transport_id id;
+		pjsip_transport_type_e type;
+		pjsip_transport* udp;	//!< The transport itself for UDP, NULL for listeners
+		std::string address;
+		unsigned int port;
+		int rcvbuf, sndbuf;		//!< As reported by the OS
+		volatile long rx_packets, tx_packets;
+		volatile long rx_bytes, tx_bytes;
+		volatile long errors;
+	};
+	typedef std::vector<Transport> TransportList;
+
+	void Create(const BlabbleTransportConfig& config, unsigned int port);
+	void SetBuffers(Transport& transport, const BlabbleTransportConfig& config);
+
+	/*! @Brief The entry tp is counted against, or NULL.
+	 */
+	Transport* Find(pjsip_transport* tp);
+
+	static pj_bool_t OnRxMessage(pjsip_rx_data *rdata);
+	static pj_status_t OnTxMessage(pjsip_tx_data *tdata);
+
+	TransportList transports_;	//!< Fixed once Start returns
+	std::vector<pjsua_transport_id> udp_ids_;
+	volatile long next_udp_;
+	bool has_tcp_;
+	bool has_tls_;
+	bool registered_;
+
+	static pjsip_module module_;
+	static BlabbleTransportManager* instance_;
+};
+
+#endif // H_BlabbleTransportManager
@@ -7,6 +7,9 @@ License:    GNU General Public License, version 3.0
 Copyright 2012 Andrew Ofisher
 \**********************************************************/
 
+#ifndef H_FBWriteOnlyProperty
+#define H_FBWriteOnlyProperty
+
 #include "JSExceptions.h"
 #include "PropertyConverter.h"
 
@@ -33,3 +36,5 @@ namespace FB {
             FB::detail::properties::setter<C, F1>::result::f(instance, f1));
     }
 }
+
+#endif // H_FBWriteOnlyProperty
@@ -13,16 +13,41 @@ Copyright 2012 Andrew Ofisher
 #include "BlabbleCall.h"
 #include "BlabbleAudioManager.h"
 #include "BlabbleLogging.h"
+#include "BlabbleMetrics.h"
+#include <pjsua-lib/pjsua_internal.h>
 
 PjsuaManagerWeakPtr PjsuaManager::instance_;
 
+//Looked up once here so the callbacks only touch atomics
+static BlabbleCounter& callbacks = BlabbleMetrics::Counter("callback.count");
+static BlabbleGauge& account_count = BlabbleMetrics::Gauge("account.count");
+static BlabbleHistogram& on_transport_state_usec = BlabbleMetrics::Histogram("callback.onTransportState.usec");
+static BlabbleHistogram& on_incoming_call_usec = BlabbleMetrics::Histogram("callback.onIncomingCall.usec");
+static BlabbleHistogram& on_call_media_state_usec = BlabbleMetrics::Histogram("callback.onCallMediaState.usec");
+static BlabbleHistogram& on_call_state_usec = BlabbleMetrics::Histogram("callback.onCallState.usec");
+static BlabbleHistogram& on_reg_state_usec = BlabbleMetrics::Histogram("callback.onRegState.usec");
+static BlabbleHistogram& on_call_transfer_status_usec = BlabbleMetrics::Histogram("callback.onCallTransferStatus.usec");
+
+static BlabbleJitterSettings JitterDefaults(const BlabbleMediaProfile& profile)
+{
+	BlabbleJitterSettings settings;
+	settings.init = profile.jb_init;
+	settings.min_pre = profile.jb_min_pre;
+	settings.max_pre = profile.jb_max_pre;
+	settings.max = profile.jb_max;
+	return settings;
+}
+
 PjsuaManagerPtr PjsuaManager::GetManager(const std::string& path, bool enableIce,
-		const std::string& stunServer)
+		const std::string& stunServer, const std::string& mediaProfile, const std::string& transports,
+		const std::string& nameservers, const std::string& eventLoop, const std::string& codecs,
+		const std::string& soundDevice)
 {
 	PjsuaManagerPtr tmp = instance_.lock();
 	if(!tmp) 
 	{ 
-		tmp = PjsuaManagerPtr(new PjsuaManager(path, enableIce, stunServer));
+		tmp = PjsuaManagerPtr(new PjsuaManager(path, enableIce, stunServer, mediaProfile, transports,
+			nameservers, eventLoop, codecs, soundDevice));
 		instance_ = boost::weak_ptr<PjsuaManager>(tmp);
 	}
 	
@@ -30,16 +55,16 @@ PjsuaManagerPtr PjsuaManager::GetManager(const std::string& path, bool enableIce
 }
 
 PjsuaManager::PjsuaManager(const std::string& executionPath, bool enableIce,
-		const std::string& stunServer)
+		const std::string& stunServer, const std::string& mediaProfile,
+		const std::string& transports, const std::string& nameservers,
+		const std::string& eventLoop, const std::string& codecs, const std::string& soundDevice) :
+	acc_index_(PJSUA_MAX_ACC), call_index_(PJSUA_MAX_CALLS)
 {
 	pj_status_t status;
 	pjsua_config cfg;
 	pjsua_logging_config log_cfg;
 	pjsua_media_config media_cfg;
-	pjsua_transport_config tran_cfg, tls_tran_cfg;
 
-	pjsua_transport_config_default(&tran_cfg);
-	pjsua_transport_config_default(&tls_tran_cfg);
 	pjsua_media_config_default(&media_cfg);
 	pjsua_config_default(&cfg);
 	pjsua_logging_config_default(&log_cfg);
@@ -59,11 +84,13 @@ PjsuaManager::PjsuaManager(const std::string& executionPath, bool enableIce,
 	log_cfg.decor = PJ_LOG_HAS_SENDER | PJ_LOG_HAS_SPACE | PJ_LOG_HAS_LEVEL_TEXT;
 	log_cfg.cb = BlabbleLogging::blabbleLog;
 
-	tls_tran_cfg.port = 0;
-	//tran_cfg.tls_setting.verify_server = PJ_TRUE;
-	tls_tran_cfg.tls_setting.timeout.sec = 5;
-	tls_tran_cfg.tls_setting.method = PJSIP_TLSV1_METHOD;
-	tran_cfg.port = 0;
+	if (!BlabbleMediaProfile::Find(mediaProfile, media_profile_))
+	{
+		BLABBLE_LOG_ERROR("Unknown media profile " << mediaProfile.c_str() << ", using default.");
+		BlabbleMediaProfile::Find("default", media_profile_);
+	}
+	media_profile_.Apply(media_cfg);
+	init_media_profile_ = media_profile_;
 
 	media_cfg.no_vad = 1;
 	media_cfg.enable_ice = enableIce ? PJ_TRUE : PJ_FALSE;
@@ -73,6 +100,9 @@ PjsuaManager::PjsuaManager(const std::string& executionPath, bool enableIce,
 		cfg.stun_srv[0] = pj_str(const_cast<char*>(stunServer.c_str()));
 	}
 
+	event_loop_.Configure(BlabbleEventLoopConfig::Parse(eventLoop), cfg, media_cfg);
+	sound_device_.Configure(BlabbleSoundDeviceConfig::Parse(soundDevice), media_cfg);
+
 	status = pjsua_create();
 	if (status != PJ_SUCCESS)
 		throw std::runtime_error("pjsua_create failed");
@@ -83,16 +113,14 @@ PjsuaManager::PjsuaManager(const std::string& executionPath, bool enableIce,
 
 	try
 	{
-		status = pjsua_transport_create(PJSIP_TRANSPORT_TLS, &tls_tran_cfg, &this->tls_transport);
-		has_tls_ = status == PJ_SUCCESS;
-		if (!has_tls_) {
-			BLABBLE_LOG_DEBUG("Error in tls pjsua_transport_create. Tls will not be enabled");
-			this->tls_transport = -1;
-		}
-
-		status = pjsua_transport_create(PJSIP_TRANSPORT_UDP, &tran_cfg, &this->udp_transport);
-		if (status != PJ_SUCCESS)
-			throw std::runtime_error("Error in pjsua_transport_create for UDP transport");
+		event_loop_.Start();
+		memory_monitor_.Start();
+		transports_.Start(transports);
+		resolver_.Start(nameservers);
+		codecs_.Start(codecs);
+		jitter_control_.Start();
+		jitter_control_.SetDefaults(JitterDefaults(media_profile_));
+		audio_devices_.Start();
 
 		status = pjsua_start();
 		if (status != PJ_SUCCESS)
@@ -110,12 +138,22 @@ PjsuaManager::PjsuaManager(const std::string& executionPath, bool enableIce,
 			path = path.substr(0, tmp - 1);
 		}
 		audio_manager_ = boost::make_shared<BlabbleAudioManager>(path);
+		//Not a page param, those are as untrusted as the page's JavaScript
+		recorder_.set_directory(path);
 
 		BLABBLE_LOG_DEBUG("PjsuaManager startup complete.");
 	}
 	catch (std::runtime_error& e)
 	{
 		BLABBLE_LOG_ERROR("Error in PjsuaManager. " << e.what());
+		audio_devices_.Shutdown();
+		sound_device_.Shutdown();
+		jitter_control_.Shutdown();
+		codecs_.Shutdown();
+		memory_monitor_.Shutdown();
+		resolver_.Shutdown();
+		transports_.Shutdown();
+		event_loop_.Shutdown();
 		pjsua_destroy();
 		throw e;
 	}
@@ -123,41 +161,137 @@ PjsuaManager::PjsuaManager(const std::string& executionPath, bool enableIce,
 
 PjsuaManager::~PjsuaManager()
 {
+	reg_scheduler_.Shutdown();
+	stats_sampler_.Shutdown();
+	level_meter_.Shutdown();
+	recorder_.Shutdown();
+	resolver_.Shutdown();
+	memory_monitor_.Shutdown();
+	codecs_.Shutdown();
+	jitter_control_.Shutdown();
+	sound_device_.Shutdown();
+	audio_devices_.Shutdown();
 	pjsua_call_hangup_all();
 
+	call_index_.Clear();
+	acc_index_.Clear();
 	accounts_.clear();
+	account_count.Set(0);
 
 	if (audio_manager_)
 		audio_manager_.reset();
 
+	transports_.Shutdown();
+	//pjsua_destroy polls for itself when there are no worker threads
+	event_loop_.Shutdown();
 	pjsua_destroy();
 }
 
+bool PjsuaManager::SetMediaProfile(const std::string& name)
+{
+	BlabbleMediaProfile profile;
+	if (!BlabbleMediaProfile::Find(name, profile))
+		return false;
+
+	//Streams read these when they are created, so the next call picks them up
+	PJSUA_LOCK();
+	pjsua_var.media_cfg.snd_clock_rate = profile.snd_clock_rate;
+	unsigned int ec_options = pjsua_var.media_cfg.ec_options;
+	PJSUA_UNLOCK();
+	//Calls with bounds of their own keep them
+	jitter_control_.SetDefaults(JitterDefaults(profile));
+
+	pj_status_t status = pjsua_set_ec(profile.ec_tail_len, ec_options);
+	if (status != PJ_SUCCESS)
+	{
+		BLABBLE_LOG_ERROR("PjsuaManager::SetMediaProfile failed to set echo canceller, got status: " << status);
+	}
+
+	if (profile.NeedsRestart(init_media_profile_))
+	{
+		BLABBLE_LOG_DEBUG("Media profile " << name.c_str() << " bridge settings apply once the plugin is reloaded.");
+	}
+
+	media_profile_ = profile;
+	return true;
+}
+
 void PjsuaManager::AddAccount(const BlabbleAccountPtr &account)
 {
 	if (account->id() == INVALID_ACCOUNT)
 		throw std::runtime_error("Attempt to add uninitialized account.");
 
 	accounts_[account->id()] = account;
+	acc_index_.Bind(account->id(), account->generation(), account);
+	account_count.Set((long)accounts_.size());
 }
 
 void PjsuaManager::RemoveAccount(pjsua_acc_id acc_id)
 {
-	accounts_.erase(acc_id);
+	BlabbleAccountMap::iterator it = accounts_.find(acc_id);
+	if (it != accounts_.end())
+	{
+		acc_index_.Unbind(acc_id, it->second->generation());
+		reg_scheduler_.Cancel(acc_id);
+		accounts_.erase(it);
+		account_count.Set((long)accounts_.size());
+	}
+}
+
+//Static
+long PjsuaManager::callback_count()
+{
+	return callbacks.value();
 }
 
 BlabbleAccountPtr PjsuaManager::FindAcc(int acc_id)
 {
 	if (pjsua_acc_is_valid(acc_id) == PJ_TRUE) 
 	{
-		BlabbleAccountMap::iterator it = accounts_.find(acc_id);
-		if (it != accounts_.end()) 
+		unsigned int generation = (unsigned int)(pj_ssize_t)pjsua_acc_get_user_data(acc_id);
+		return acc_index_.Find(acc_id, generation);
+	}
+
+	return BlabbleAccountPtr();
+}
+
+void PjsuaManager::BindCall(pjsua_call_id call_id, const BlabbleCallPtr &call)
+{
+	call_index_.Bind(call_id, call->id(), call);
+}
+
+void PjsuaManager::UnbindCall(pjsua_call_id call_id, unsigned int generation)
+{
+	call_index_.Unbind(call_id, generation);
+}
+
+BlabbleCallPtr PjsuaManager::FindCall(pjsua_call_id call_id)
+{
+	if (call_id < 0 || call_id >= (long)pjsua_call_get_max_count())
+		return BlabbleCallPtr();
+
+	unsigned int generation = (unsigned int)(pj_ssize_t)pjsua_call_get_user_data(call_id);
+	if (generation == 0)
+		return BlabbleCallPtr();
+
+	BlabbleCallPtr call = call_index_.Find(call_id, generation);
+	if (call)
+		return call;
+
+	//PJSIP reports the first state of an outgoing call from inside
+	//pjsua_call_make_call, before we know the call id. Fall back to
+	//searching the account and bind the call for the following events.
+	pjsua_call_info info;
+	if (pjsua_call_get_info(call_id, &info) == PJ_SUCCESS)
+	{
+		BlabbleAccountPtr acc = FindAcc(info.acc_id);
+		if (acc && (call = acc->FindCall(call_id)))
 		{
-			return it->second;
+			call_index_.Bind(call_id, generation, call);
 		}
 	}
 
-	return BlabbleAccountPtr();
+	return call;
 }
 
 //Event handlers
@@ -166,7 +300,15 @@ BlabbleAccountPtr PjsuaManager::FindAcc(int acc_id)
 void PjsuaManager::OnTransportState(pjsip_transport *tp, pjsip_transport_state state, 
 	const pjsip_transport_state_info *info)
 {
-	if (state == PJSIP_TP_STATE_DISCONNECTED) 
+	BlabbleMetricsTimer timer(on_transport_state_usec);
+	callbacks.Increment();
+	PjsuaManagerPtr manager = PjsuaManager::instance_.lock();
+	if (manager)
+		manager->transports_.OnTransportState(tp, state, info);
+
+	//Only TLS transports carry TLS state info
+	if (state == PJSIP_TP_STATE_DISCONNECTED && info != NULL && info->ext_info != NULL &&
+		(tp->key.type & ~PJSIP_TRANSPORT_IPV6) == PJSIP_TRANSPORT_TLS) 
 	{
 		pjsip_tls_state_info *tmp = ((pjsip_tls_state_info*)info->ext_info);
 		if (tmp->ssl_sock_info->verify_status != PJ_SSL_CERT_ESUCCESS) 
@@ -179,6 +321,8 @@ void PjsuaManager::OnTransportState(pjsip_transport *tp, pjsip_transport_state s
 //Static
 void PjsuaManager::OnIncomingCall(pjsua_acc_id acc_id, pjsua_call_id call_id, pjsip_rx_data *rdata)
 {
+	BlabbleMetricsTimer timer(on_incoming_call_usec);
+	callbacks.Increment();
 	BLABBLE_LOG_TRACE("OnIncomingCall called for PJSIP account id: " << acc_id << 
 		", PJSIP call id: " << call_id);
 	PjsuaManagerPtr manager = PjsuaManager::instance_.lock();
@@ -203,50 +347,57 @@ void PjsuaManager::OnIncomingCall(pjsua_acc_id acc_id, pjsua_call_id call_id, pj
 //Static
 void PjsuaManager::OnCallMediaState(pjsua_call_id call_id)
 {
+	BlabbleMetricsTimer timer(on_call_media_state_usec);
+	callbacks.Increment();
 	PjsuaManagerPtr manager = PjsuaManager::instance_.lock();
 
 	if (!manager)
 		return;
 	
-	pjsua_call_info info;
-	pj_status_t status;
-	if ((status = pjsua_call_get_info(call_id, &info)) == PJ_SUCCESS) 
-	{
-		BLABBLE_LOG_TRACE("PjsuaManager::OnCallMediaState called with PJSIP call id: " 
-			<< call_id << ", state: " << info.state);
-		BlabbleAccountPtr acc = manager->FindAcc(info.acc_id);
-		if (acc)
-		{
-			acc->OnCallMediaState(call_id);
-		}
-	}
-	else
+	BLABBLE_LOG_TRACE("PjsuaManager::OnCallMediaState called with PJSIP call id: " << call_id);
+	//The stream has its jitter buffer bounds by now
+	manager->jitter_control().Restore();
+
+	BlabbleCallPtr call = manager->FindCall(call_id);
+	if (call)
 	{
-		BLABBLE_LOG_ERROR("PjsuaManager::OnCallMediaState failed to call pjsua_call_get_info for PJSIP call id: " 
-			<< call_id << ", got status: " << status);
+		call->OnCallMediaState();
 	}
-
 }
 
 //Static
 void PjsuaManager::OnCallState(pjsua_call_id call_id, pjsip_event *e)
 {
+	BlabbleMetricsTimer timer(on_call_state_usec);
+	callbacks.Increment();
 	PjsuaManagerPtr manager = PjsuaManager::instance_.lock();
 
 	if (!manager)
 		return;
 
-	pjsua_call_info info;
-	pj_status_t status;
-	if ((status = pjsua_call_get_info(call_id, &info)) == PJ_SUCCESS) 
+	BlabbleCallPtr call = manager->FindCall(call_id);
+	if (call)
 	{
+		//The call refreshes its cached call info, use that instead of asking PJSIP again
+		call->OnCallState(call_id, e);
+		pjsip_inv_state state = call->state();
+
 		BLABBLE_LOG_TRACE("PjsuaManager::OnCallState called with PJSIP call id: " 
-			<< call_id << ", state: " << info.state);
-		BlabbleAccountPtr acc = manager->FindAcc(info.acc_id);
-		if (acc)
+			<< call_id << ", state: " << state);
+		if (state == PJSIP_INV_STATE_DISCONNECTED)
 		{
-			acc->OnCallState(call_id, e);
+			//Just make sure we get rid of the call
+			pjsua_call_hangup(call_id, 0, NULL, NULL);
 		}
+		return;
+	}
+
+	pjsua_call_info info;
+	pj_status_t status;
+	if ((status = pjsua_call_get_info(call_id, &info)) == PJ_SUCCESS) 
+	{
+		BLABBLE_LOG_DEBUG("Received call state change event for unknown PJSIP call id: "
+			<< call_id << ", on PJSIP account id: " << info.acc_id << ", state: " << info.state);
 
 		if (info.state == PJSIP_INV_STATE_DISCONNECTED)
 		{
@@ -264,11 +415,15 @@ void PjsuaManager::OnCallState(pjsua_call_id call_id, pjsip_event *e)
 //Static
 void PjsuaManager::OnRegState(pjsua_acc_id acc_id)
 {
+	BlabbleMetricsTimer timer(on_reg_state_usec);
+	callbacks.Increment();
 	PjsuaManagerPtr manager = PjsuaManager::instance_.lock();
 
 	if (!manager)
 		return;
 
+	manager->reg_scheduler_.OnRegState(acc_id);
+
 	BlabbleAccountPtr acc = manager->FindAcc(acc_id);
 	if (acc)
 	{
@@ -284,6 +439,8 @@ void PjsuaManager::OnRegState(pjsua_acc_id acc_id)
 //Static
 void PjsuaManager::OnCallTransferStatus(pjsua_call_id call_id, int st_code, const pj_str_t *st_text, pj_bool_t final, pj_bool_t *p_cont)
 {
+	BlabbleMetricsTimer timer(on_call_transfer_status_usec);
+	callbacks.Increment();
 	BLABBLE_LOG_TRACE("PjsuaManager::OnCallTransferState called with PJSIP call id: " 
 		<< call_id << ", state: " << st_code);
 	PjsuaManagerPtr manager = PjsuaManager::instance_.lock();
@@ -291,20 +448,15 @@ void PjsuaManager::OnCallTransferStatus(pjsua_call_id call_id, int st_code, cons
 	if (!manager)
 		return;
 
-	pjsua_call_info info;
-	pj_status_t status;
-	if ((status = pjsua_call_get_info(call_id, &info)) == PJ_SUCCESS) 
+	BlabbleCallPtr call = manager->FindCall(call_id);
+	if (call)
 	{
-		BlabbleAccountPtr acc = manager->FindAcc(info.acc_id);
-		if (acc)
-		{
-			if (acc->OnCallTransferStatus(call_id, st_code))
-				(*p_cont) = PJ_TRUE;
-		}
+		if (call->OnCallTransferStatus(st_code))
+			(*p_cont) = PJ_TRUE;
 	}
 	else
 	{
-		BLABBLE_LOG_ERROR("PjsuaManager::OnCallTransferStatus failed to call pjsua_call_get_info for PJSIP call id: " 
-			<< call_id << ", got status: " << status);
+		BLABBLE_LOG_DEBUG("Received call transfer status for unknown PJSIP call id: " << call_id);
+		(*p_cont) = PJ_TRUE;
 	}
 }
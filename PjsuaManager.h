@@ -24,6 +24,20 @@ Copyright 2012 Andrew Ofisher
 #include <pjsua-lib/pjsua.h>
 #include <pjmedia.h>
 #include <pjmedia-codec.h> 
+#include "BlabbleDispatchIndex.h"
+#include "BlabbleRegScheduler.h"
+#include "BlabbleStatsSampler.h"
+#include "BlabbleMediaProfile.h"
+#include "BlabbleLevelMeter.h"
+#include "BlabbleRecorder.h"
+#include "BlabbleTransportManager.h"
+#include "BlabbleResolver.h"
+#include "BlabbleEventLoop.h"
+#include "BlabbleMemoryMonitor.h"
+#include "BlabbleCodecManager.h"
+#include "BlabbleJitterControl.h"
+#include "BlabbleSoundDevice.h"
+#include "BlabbleAudioDevices.h"
 
 FB_FORWARD_PTR(BlabbleCall)
 FB_FORWARD_PTR(BlabbleAccount)
@@ -42,8 +56,22 @@ class PjsuaManager : public boost::enable_shared_from_this<PjsuaManager>
 {
 public:
 	
+	/*! @Brief Return the manager, creating it if needed.
+	 *  mediaProfile names the BlabbleMediaProfile used to initialize PJSIP
+	 *  and transports is the SIP transport specification described at
+	 *  BlabbleTransportConfig::Parse. nameservers is the DNS server list
+	 *  described at BlabbleResolver::Start, eventLoop the event loop
+	 *  specification described at BlabbleEventLoopConfig::Parse, codecs
+	 *  the codec specification described at BlabbleCodecManager::Start and
+	 *  soundDevice the sound device specification described at
+	 *  BlabbleSoundDeviceConfig::Parse. All six are ignored if the manager
+	 *  already exists.
+	 */
 	static PjsuaManagerPtr GetManager(const std::string& path, bool enableIce,
-		const std::string& stunServer);
+		const std::string& stunServer, const std::string& mediaProfile = "default",
+		const std::string& transports = "", const std::string& nameservers = "",
+		const std::string& eventLoop = "", const std::string& codecs = "",
+		const std::string& soundDevice = "");
 	virtual ~PjsuaManager();
 
 	/*! @Brief Retrive the current audio manager.
@@ -54,10 +82,88 @@ public:
 	void AddAccount(const BlabbleAccountPtr &account);
 	void RemoveAccount(pjsua_acc_id acc_id);
 	BlabbleAccountPtr FindAcc(int accId);
+
+	/*! @Brief Make call reachable from PJSIP callbacks through call_id.
+	 *  The call's global id is used as the generation and must match the
+	 *  user data attached to the PJSIP call.
+	 */
+	void BindCall(pjsua_call_id call_id, const BlabbleCallPtr &call);
+	
+	/*! @Brief Remove call_id from the dispatch index if it still belongs to generation.
+	 */
+	void UnbindCall(pjsua_call_id call_id, unsigned int generation);
 	
+	/*! @Brief Find the BlabbleCall for a PJSIP call id without taking any account lock.
+	 */
+	BlabbleCallPtr FindCall(pjsua_call_id call_id);
+
+	/*! @Brief Scheduler used to stagger registrations of accounts added in bulk.
+	 */
+	BlabbleRegScheduler& reg_scheduler() { return reg_scheduler_; }
+
+	/*! @Brief Sampler delivering RTP/RTCP statistics to subscribed calls.
+	 */
+	BlabbleStatsSampler& stats_sampler() { return stats_sampler_; }
+
+	/*! @Brief Meters measuring the microphone and every call's audio.
+	 */
+	BlabbleLevelMeter& level_meter() { return level_meter_; }
+
+	/*! @Brief Recorder writing call recordings from its own thread.
+	 */
+	BlabbleRecorder& recorder() { return recorder_; }
+	
+	/*! @Brief Switch to another media profile.
+	 *  Sound device, echo canceller and jitter buffer settings apply to calls
+	 *  made after the switch. Bridge settings keep the values PJSIP was
+	 *  initialized with. Returns false if name is not a known profile.
+	 */
+	bool SetMediaProfile(const std::string& name);
+
+	/*! @Brief Name of the current media profile.
+	 */
+	std::string media_profile() const { return media_profile_.name; }
+
 	/*! Return true if we have TLS/SSL capability.
 	 */
-	bool has_tls() { return has_tls_; }
+	bool has_tls() { return transports_.has_tls(); }
+
+	/*! @Brief The SIP transports and their traffic counters.
+	 */
+	BlabbleTransportManager& transports() { return transports_; }
+
+	/*! @Brief The DNS resolver shared by every account.
+	 */
+	BlabbleResolver& resolver() { return resolver_; }
+
+	/*! @Brief The threads polling PJSIP events, if Blabble runs its own.
+	 */
+	BlabbleEventLoop& event_loop() { return event_loop_; }
+
+	/*! @Brief Pool memory accounting and the per-call leak check.
+	 */
+	BlabbleMemoryMonitor& memory_monitor() { return memory_monitor_; }
+
+	/*! @Brief Codec priorities and benchmarks.
+	 */
+	BlabbleCodecManager& codecs() { return codecs_; }
+
+	/*! @Brief Per-call jitter buffer bounds and statistics.
+	 */
+	BlabbleJitterControl& jitter_control() { return jitter_control_; }
+
+	/*! @Brief Warm sound device mode and the time to first audio after answering.
+	 */
+	BlabbleSoundDevice& sound_device() { return sound_device_; }
+
+	/*! @Brief Cached list of audio devices, refreshed in the background.
+	 */
+	BlabbleAudioDevices& audio_devices() { return audio_devices_; }
+
+	/*! @Brief Total number of PJSIP callbacks handled so far.
+	 *  Also reported as "callback.count" by BlabbleMetrics.
+	 */
+	static long callback_count();
 	
 public:
 	/*! @Brief Callback for PJSIP.
@@ -92,14 +198,30 @@ public:
 
 private:
 	BlabbleAccountMap accounts_;
+	BlabbleDispatchIndex<BlabbleAccount> acc_index_;
+	BlabbleDispatchIndex<BlabbleCall> call_index_;
+	BlabbleRegScheduler reg_scheduler_;
+	BlabbleStatsSampler stats_sampler_;
+	BlabbleLevelMeter level_meter_;
+	BlabbleRecorder recorder_;
+	BlabbleMediaProfile media_profile_;
+	BlabbleMediaProfile init_media_profile_; //!< Profile PJSIP was initialized with
 	BlabbleAudioManagerPtr audio_manager_;
-	pjsua_transport_id udp_transport, tls_transport;
-	bool has_tls_;
+	BlabbleTransportManager transports_;
+	BlabbleResolver resolver_;
+	BlabbleEventLoop event_loop_;
+	BlabbleMemoryMonitor memory_monitor_;
+	BlabbleCodecManager codecs_;
+	BlabbleJitterControl jitter_control_;
+	BlabbleSoundDevice sound_device_;
+	BlabbleAudioDevices audio_devices_;
 
 	static PjsuaManagerWeakPtr instance_;
 	//PjsuaManager is a singleton. Only one should ever exist so that PjSip callbacks work.
 	PjsuaManager(const std::string& executionPath, bool enableIce,
-		const std::string& stunServer);
+		const std::string& stunServer, const std::string& mediaProfile,
+		const std::string& transports, const std::string& nameservers,
+		const std::string& eventLoop, const std::string& codecs, const std::string& soundDevice);
 };
 
 #endif // H_PjsuaManagerPLUGIN
@@ -0,0 +1,114 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+/*! @file CodecBench.cpp
+ *
+ *  @brief  Measures what each codec compiled into pjmedia costs on this machine.
+ *
+ *  Starts PjsuaManager with the null sound device and runs
+ *  BlabbleCodecManager::Benchmark, which encodes and decodes a voice-like
+ *  test signal one frame at a time with every codec. For each codec the
+ *  mean and worst time per frame are printed, with the share of one CPU
+ *  core a call using it would spend on coding audio. The run is repeated
+ *  -n times and the fastest result per codec kept, so a busy moment on the
+ *  machine does not make a codec look expensive.
+ *
+ *  With -b the codecs are then ranked as the "auto" codecs param would rank
+ *  them with that budget, in percent, and the resulting order is printed.
+ *
+ *  Usage: blabble_codecbench [-f frames] [-n runs] [-b budget]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <map>
+
+#include "PjsuaManager.h"
+#include "BlabbleCodecManager.h"
+
+namespace
+{
+	void Usage()
+	{
+		printf("Usage: blabble_codecbench [-f frames] [-n runs] [-b budget]\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int frames = BLABBLE_CODEC_BENCH_FRAMES, runs = 3;
+	double budget = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 < argc && strcmp(argv[i], "-f") == 0)
+			frames = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			runs = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-b") == 0)
+			budget = atof(argv[++i]);
+		else
+		{
+			Usage();
+			return 1;
+		}
+	}
+
+	if (frames == 0 || runs == 0 || budget < 0)
+	{
+		Usage();
+		return 1;
+	}
+
+	try
+	{
+		PjsuaManagerPtr manager = PjsuaManager::GetManager(".", false, "");
+		pjsua_set_null_snd_dev();
+
+		//The fastest run is also what -b ranks by
+		std::vector<BlabbleCodecCost> best = manager->codecs().Benchmark(frames, runs);
+
+		printf("%-24s %6s %7s %10s %10s %10s %10s %7s\n", "codec", "ptime", "kbps",
+			"enc us", "enc max", "dec us", "dec max", "cpu %");
+		for (size_t i = 0; i < best.size(); i++)
+		{
+			const BlabbleCodecCost& cost = best[i];
+			if (!cost.ok)
+			{
+				printf("%-24s unable to open\n", cost.id.c_str());
+				continue;
+			}
+			printf("%-24s %6u %7.1f %10.1f %10lu %10.1f %10lu %7.3f\n", cost.id.c_str(), cost.ptime,
+				cost.bitrate / 1000.0, cost.encode_usec, cost.max_encode_usec, cost.decode_usec,
+				cost.max_decode_usec, cost.cpu);
+		}
+
+		if (budget > 0)
+		{
+			manager->codecs().Auto(budget);
+			FB::VariantList codecs = manager->codecs().codecs();
+			printf("\npriorities with a budget of %.2f%%:\n", budget);
+			for (size_t i = 0; i < codecs.size(); i++)
+			{
+				FB::VariantMap codec = codecs[i].cast<FB::VariantMap>();
+				printf("%-24s %3d\n", codec["id"].convert_cast<std::string>().c_str(),
+					codec["priority"].convert_cast<int>());
+			}
+		}
+	}
+	catch (std::exception& e)
+	{
+		printf("Error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,610 @@
+/**********************************************************\
+Original Author: Andrew Ofisher (zaltar)
+
+License:    GNU General Public License, version 3.0
+            http://www.gnu.org/licenses/gpl-3.0.txt
+
+Copyright 2012 Andrew Ofisher
+\**********************************************************/
+
+/*! @file LoadTest.cpp
+ *
+ *  @brief  Headless SIP load generator for the Blabble core.
+ *
+ *  Runs PjsuaManager, BlabbleAccount and BlabbleCall outside of the browser
+ *  with the null sound device. A minimal UAS is registered as a PJSIP module
+ *  on a second loopback UDP transport in the same endpoint. It accepts
+ *  REGISTER, answers every INVITE with 200/SDP and answers BYE. Accounts
+ *  register with it, calls are placed against it, and the tool reports call
+ *  setup latency percentiles, PJSIP callbacks per second, time spent in the
+ *  call state callback and CPU per call.
+ *
+ *  With -d a stand-in DNS server is started on the given loopback port and
+ *  used as the only nameserver. It answers an SRV and an A record for a
+ *  test domain pointing at the UAS, and accounts and calls use that domain,
+ *  so every registration and call goes through the DNS resolver and cache.
+ *  After the run the resolver is checked: a prefetched name must be a cache
+ *  hit, must still be one after its TTL ran out, and must be forgotten once
+ *  it stays unused for longer than the idle time. A failed check makes the
+ *  tool exit with 1. The checks take about a minute.
+ *
+ *  -e takes an event loop specification, see BlabbleEventLoopConfig::Parse,
+ *  and the tool then reports how late PJSIP timers fired.
+ *
+ *  pjproject must be built with X_LOAD_TESTING in config_site.h for more
+ *  than the default 32 concurrent calls.
+ *
+ *  Usage: blabble_loadtest [-a accounts] [-c calls] [-r calls/sec] [-t hold secs]
+ *                          [-m media profile] [-s sip transports] [-d dns port]
+ *                          [-e event loop]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <sstream>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "PjsuaManager.h"
+#include "BlabbleAccount.h"
+#include "BlabbleCall.h"
+#include "BlabbleEventQueue.h"
+#include "BlabbleMetrics.h"
+
+namespace
+{
+	/* The in-process UAS */
+	pjsip_module uas_module;
+	int uas_port = 0;
+	const char* uas_sdp =
+		"v=0\r\n"
+		"o=uas 1 1 IN IP4 127.0.0.1\r\n"
+		"s=blabble_loadtest\r\n"
+		"c=IN IP4 127.0.0.1\r\n"
+		"t=0 0\r\n"
+		"m=audio 4000 RTP/AVP 0 8 101\r\n"
+		"a=rtpmap:0 PCMU/8000\r\n"
+		"a=rtpmap:8 PCMA/8000\r\n"
+		"a=rtpmap:101 telephone-event/8000\r\n"
+		"a=sendrecv\r\n";
+
+	void UasRespond(pjsip_rx_data *rdata, int code, bool stateful)
+	{
+		pjsip_endpoint *endpt = pjsua_get_pjsip_endpt();
+		pjsip_tx_data *tdata;
+		if (pjsip_endpt_create_response(endpt, rdata, code, NULL, &tdata) != PJ_SUCCESS)
+			return;
+
+		pjsip_to_hdr *to = PJSIP_MSG_TO_HDR(tdata->msg);
+		if (to->tag.slen == 0)
+			pj_create_unique_string(tdata->pool, &to->tag);
+
+		pjsip_method_e method = rdata->msg_info.msg->line.req.method.id;
+		if (method == PJSIP_INVITE_METHOD || method == PJSIP_REGISTER_METHOD)
+		{
+			char buf[64];
+			pj_ansi_snprintf(buf, sizeof(buf), "<sip:uas@127.0.0.1:%d>", uas_port);
+			pj_str_t name = pj_str(const_cast<char*>("Contact"));
+			pj_str_t value = pj_strdup3(tdata->pool, buf);
+			pjsip_generic_string_hdr *contact = pjsip_generic_string_hdr_create(tdata->pool, &name, &value);
+			pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)contact);
+		}
+
+		if (method == PJSIP_REGISTER_METHOD)
+		{
+			pjsip_expires_hdr *expires = pjsip_expires_hdr_create(tdata->pool, 300);
+			pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)expires);
+		}
+		else if (method == PJSIP_INVITE_METHOD && code == 200)
+		{
+			pj_str_t type = pj_str(const_cast<char*>("application"));
+			pj_str_t subtype = pj_str(const_cast<char*>("sdp"));
+			pj_str_t text = pj_str(const_cast<char*>(uas_sdp));
+			tdata->msg->body = pjsip_msg_body_create(tdata->pool, &type, &subtype, &text);
+		}
+
+		if (stateful)
+		{
+			pjsip_transaction *tsx;
+			if (pjsip_tsx_create_uas(&uas_module, rdata, &tsx) != PJ_SUCCESS)
+			{
+				pjsip_tx_data_dec_ref(tdata);
+				return;
+			}
+			pjsip_tsx_recv_msg(tsx, rdata);
+			pjsip_tsx_send_msg(tsx, tdata);
+		}
+		else
+		{
+			pjsip_response_addr addr;
+			if (pjsip_get_response_addr(tdata->pool, rdata, &addr) == PJ_SUCCESS)
+				pjsip_endpt_send_response(endpt, &addr, tdata, NULL, NULL);
+			else
+				pjsip_tx_data_dec_ref(tdata);
+		}
+	}
+
+	pj_bool_t UasOnRxRequest(pjsip_rx_data *rdata)
+	{
+		//Only requests that arrived on the UAS transport are ours
+		if (rdata->tp_info.transport->local_name.port != uas_port)
+			return PJ_FALSE;
+
+		switch (rdata->msg_info.msg->line.req.method.id)
+		{
+		case PJSIP_ACK_METHOD:
+			break;
+		case PJSIP_INVITE_METHOD:
+			UasRespond(rdata, 200, true);
+			break;
+		default:
+			UasRespond(rdata, 200, false);
+			break;
+		}
+
+		return PJ_TRUE;
+	}
+
+	pj_status_t StartUas()
+	{
+		pjsua_transport_config cfg;
+		pjsua_transport_id tid;
+		pjsua_transport_info info;
+		pj_status_t status;
+
+		pjsua_transport_config_default(&cfg);
+		cfg.port = 0;
+		cfg.bound_addr = pj_str(const_cast<char*>("127.0.0.1"));
+		if ((status = pjsua_transport_create(PJSIP_TRANSPORT_UDP, &cfg, &tid)) != PJ_SUCCESS)
+			return status;
+		if ((status = pjsua_transport_get_info(tid, &info)) != PJ_SUCCESS)
+			return status;
+		uas_port = info.local_name.port;
+
+		pj_bzero(&uas_module, sizeof(uas_module));
+		uas_module.name = pj_str(const_cast<char*>("mod-blabble-loadtest-uas"));
+		uas_module.id = -1;
+		//Ahead of pjsua so calls to the UAS never reach its incoming call handling
+		uas_module.priority = PJSIP_MOD_PRIORITY_APPLICATION - 1;
+		uas_module.on_rx_request = &UasOnRxRequest;
+		return pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &uas_module);
+	}
+
+	/* The stand-in DNS server */
+	pj_dns_server* dns_server = NULL;
+	const char* dns_domain = "loadtest.blabble.invalid";
+	const char* dns_srv_name = "_sip._udp.loadtest.blabble.invalid";
+	const char* dns_target = "uas.loadtest.blabble.invalid";
+	//Only ever looked up through Prefetch, PJSIP never asks for it
+	const char* dns_prefetch = "prefetch.loadtest.blabble.invalid";
+	const unsigned int dns_ttl = 30;
+
+	pj_status_t StartDns(unsigned int port)
+	{
+		pj_status_t status = pj_dns_server_create(pjsua_get_pool_factory(),
+			pjsip_endpt_get_ioqueue(pjsua_get_pjsip_endpt()), pj_AF_INET(), port, 0, &dns_server);
+		if (status != PJ_SUCCESS)
+			return status;
+
+		pj_str_t srv_name = pj_str(const_cast<char*>(dns_srv_name));
+		pj_str_t target = pj_str(const_cast<char*>(dns_target));
+		pj_str_t prefetch = pj_str(const_cast<char*>(dns_prefetch));
+		pj_str_t loopback = pj_str(const_cast<char*>("127.0.0.1"));
+		pj_in_addr addr;
+		pj_inet_aton(&loopback, &addr);
+
+		//Short TTLs so a long run sees the records refreshed
+		pj_dns_parsed_rr rr[3];
+		pj_dns_init_srv_rr(&rr[0], &srv_name, PJ_DNS_CLASS_IN, dns_ttl, 0, 0, uas_port, &target);
+		pj_dns_init_a_rr(&rr[1], &target, PJ_DNS_CLASS_IN, dns_ttl, &addr);
+		pj_dns_init_a_rr(&rr[2], &prefetch, PJ_DNS_CLASS_IN, dns_ttl, &addr);
+		return pj_dns_server_add_rec(dns_server, 3, rr);
+	}
+
+	struct CacheProbe
+	{
+		bool answered;
+		bool found;
+	};
+
+	void OnCacheProbe(void *user_data, pj_status_t status, pj_dns_parsed_packet *response)
+	{
+		CacheProbe* probe = static_cast<CacheProbe*>(user_data);
+		probe->answered = true;
+		probe->found = status == PJ_SUCCESS && response && response->hdr.anscount > 0;
+	}
+
+	/* True if PJSIP's resolver answers name straight from its cache */
+	bool Cached(const char* name)
+	{
+		pj_dns_resolver* shared = pjsip_endpt_get_resolver(pjsua_get_pjsip_endpt());
+		if (shared == NULL)
+			return false;
+
+		CacheProbe* probe = new CacheProbe();
+		probe->answered = probe->found = false;
+		pj_dns_async_query* query = NULL;
+		pj_str_t qname = pj_str(const_cast<char*>(name));
+		pj_status_t status = pj_dns_resolver_start_query(shared, &qname, PJ_DNS_TYPE_A, 0,
+			&OnCacheProbe, probe, &query);
+
+		//A miss went to the network and answers later, so the probe is left to it
+		if (status != PJ_SUCCESS || query != NULL)
+			return false;
+
+		bool found = probe->answered && probe->found;
+		delete probe;
+		return found;
+	}
+
+	bool Check(const char* what, bool ok)
+	{
+		printf("dns check: %s: %s\n", what, ok ? "ok" : "FAILED");
+		return ok;
+	}
+
+	/* Returns the number of failed checks */
+	unsigned int CheckDns(BlabbleResolver& resolver)
+	{
+		unsigned int failed = 0;
+
+		//The port keeps it to the one A record
+		std::string target = std::string(dns_prefetch) + ":5060";
+		resolver.Prefetch(target, false);
+		pj_timestamp fetched;
+		pj_get_timestamp(&fetched);
+
+		//Probing earlier would fill the cache by itself, the loopback server answers in far less
+		boost::this_thread::sleep(boost::posix_time::seconds(1));
+		failed += Check("cache hit after prefetch", Cached(dns_prefetch)) ? 0 : 1;
+
+		//Past the TTL the cached answer is only there if it was fetched again in time
+		pj_timestamp now;
+		pj_get_timestamp(&now);
+		pj_uint32_t elapsed = pj_elapsed_msec(&fetched, &now);
+		if (elapsed < (dns_ttl + 5) * 1000)
+			boost::this_thread::sleep(boost::posix_time::milliseconds((dns_ttl + 5) * 1000 - elapsed));
+		failed += Check("refreshed before TTL expiry", Cached(dns_prefetch)) ? 0 : 1;
+
+		//Pruning happens when the next refresh falls due, within the TTL
+		resolver.set_idle_sec(1);
+		bool pruned = false;
+		for (int wait = 0; wait < (int)dns_ttl * 10 && !(pruned = !resolver.tracking(dns_prefetch)); wait++)
+			boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+		failed += Check("pruned when idle", pruned) ? 0 : 1;
+		resolver.set_idle_sec(BLABBLE_DNS_IDLE_SEC);
+
+		return failed;
+	}
+
+	/* Measurements, fed by the event queue listener on PJSIP threads */
+	struct CallTiming
+	{
+		pj_timestamp started;
+		bool done;
+	};
+
+	boost::mutex timing_mutex;
+	pj_timestamp next_start;
+	std::map<unsigned int, CallTiming> timings;
+	std::vector<double> setup_ms;
+	unsigned int failed_calls = 0;
+	volatile long events_seen = 0;
+
+	void OnEvent(const BlabbleEvent& evt)
+	{
+		ATOMIC_INCREMENT(&events_seen);
+		if (evt.args.empty() || !evt.args[0].is_of_type<BlabbleCallWeakPtr>())
+			return;
+
+		BlabbleCallPtr call = evt.args[0].cast<BlabbleCallWeakPtr>().lock();
+		if (!call)
+			return;
+
+		pj_timestamp now;
+		pj_get_timestamp(&now);
+
+		boost::mutex::scoped_lock lock(timing_mutex);
+		if (evt.type == "callRinging")
+		{
+			//Raised from inside MakeCall on the main thread, before it returns
+			//the call, so answers can never arrive ahead of the timing entry
+			CallTiming timing;
+			timing.started = next_start;
+			timing.done = false;
+			timings.insert(std::make_pair(call->id(), timing));
+			return;
+		}
+
+		if (evt.type != "callConnected" && evt.type != "callEnd")
+			return;
+
+		std::map<unsigned int, CallTiming>::iterator it = timings.find(call->id());
+		if (it == timings.end() || it->second.done)
+			return;
+
+		it->second.done = true;
+		if (evt.type == "callConnected")
+			setup_ms.push_back(pj_elapsed_usec(&it->second.started, &now) / 1000.0);
+		else
+			failed_calls++;
+	}
+
+	double CpuSeconds()
+	{
+#ifdef WIN32
+		FILETIME created, exited, kernel, user;
+		GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+		ULARGE_INTEGER k, u;
+		k.LowPart = kernel.dwLowDateTime;
+		k.HighPart = kernel.dwHighDateTime;
+		u.LowPart = user.dwLowDateTime;
+		u.HighPart = user.dwHighDateTime;
+		return (k.QuadPart + u.QuadPart) / 1e7;
+#else
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+			usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+	}
+
+	double Percentile(const std::vector<double>& sorted, double p)
+	{
+		if (sorted.empty())
+			return 0;
+		size_t idx = (size_t)(p * sorted.size());
+		if (idx >= sorted.size())
+			idx = sorted.size() - 1;
+		return sorted[idx];
+	}
+
+	void Usage()
+	{
+		printf("Usage: blabble_loadtest [-a accounts] [-c calls] [-r calls/sec] [-t hold secs]\n"
+			"                        [-m media profile] [-s sip transports] [-d dns port]\n"
+			"                        [-e event loop]\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int account_count = 1, call_count = 10, hold_secs = 5, dns_port = 0, dns_failed = 0;
+	double rate = 50;
+	std::string profile = "default", transports, event_loop;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 < argc && strcmp(argv[i], "-a") == 0)
+			account_count = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-c") == 0)
+			call_count = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-r") == 0)
+			rate = atof(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-t") == 0)
+			hold_secs = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-m") == 0)
+			profile = argv[++i];
+		else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+			transports = argv[++i];
+		else if (i + 1 < argc && strcmp(argv[i], "-d") == 0)
+			dns_port = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-e") == 0)
+			event_loop = argv[++i];
+		else
+		{
+			Usage();
+			return 1;
+		}
+	}
+
+	if (account_count == 0 || call_count == 0 || rate <= 0)
+	{
+		Usage();
+		return 1;
+	}
+
+	//X_LOAD_TESTING has to be set when pjproject is built, see config_site.h
+	if (call_count > PJSUA_MAX_CALLS)
+	{
+		printf("Warning: pjproject was built with PJSUA_MAX_CALLS %d, calls past it will fail\n",
+			PJSUA_MAX_CALLS);
+	}
+
+	try
+	{
+		std::string nameservers;
+		if (dns_port != 0)
+		{
+			std::stringstream ns;
+			ns << "127.0.0.1:" << dns_port;
+			nameservers = ns.str();
+		}
+
+		PjsuaManagerPtr manager = PjsuaManager::GetManager(".", false, "", profile, transports, nameservers,
+			event_loop);
+		pjsua_set_null_snd_dev();
+
+		pj_status_t status = StartUas();
+		if (status != PJ_SUCCESS)
+		{
+			printf("Unable to start the loopback UAS, status %d\n", status);
+			return 1;
+		}
+
+		BlabbleEventQueuePtr events = boost::make_shared<BlabbleEventQueue>(FB::BrowserHostPtr());
+		events->set_listener(&OnEvent);
+
+		std::stringstream server;
+		if (dns_port != 0)
+		{
+			status = StartDns(dns_port);
+			if (status != PJ_SUCCESS)
+			{
+				printf("Unable to start the DNS server on port %u, status %d\n", dns_port, status);
+				return 1;
+			}
+			server << dns_domain;
+		}
+		else
+		{
+			server << "127.0.0.1:" << uas_port;
+		}
+
+		std::vector<BlabbleAccountPtr> accounts;
+		for (unsigned int i = 0; i < account_count; i++)
+		{
+			std::stringstream user;
+			user << "load" << i;
+
+			BlabbleAccountPtr acc = boost::make_shared<BlabbleAccount>(manager);
+			acc->set_event_queue(events);
+			acc->set_server(server.str());
+			acc->set_username(user.str());
+			acc->set_password("load");
+			acc->Register();
+			accounts.push_back(acc);
+		}
+
+		//Give registrations up to 10 seconds
+		for (int wait = 0; wait < 1000; wait++)
+		{
+			unsigned int registered = 0;
+			for (size_t i = 0; i < accounts.size(); i++)
+				registered += accounts[i]->registered() ? 1 : 0;
+			if (registered == accounts.size())
+				break;
+			boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+		}
+
+		printf("%u accounts, %u calls at %.1f calls/sec against UAS on port %d\n",
+			account_count, call_count, rate, uas_port);
+
+		double cpu_start = CpuSeconds();
+		long callbacks_start = PjsuaManager::callback_count();
+		pj_timestamp run_start, run_end;
+		pj_get_timestamp(&run_start);
+
+		std::vector<BlabbleCallPtr> calls;
+		std::string destination = "sip:uas@" + server.str();
+		for (unsigned int i = 0; i < call_count; i++)
+		{
+			//Pace the calls
+			pj_timestamp now;
+			pj_get_timestamp(&now);
+			double due_ms = i * 1000.0 / rate;
+			double elapsed_ms = pj_elapsed_usec(&run_start, &now) / 1000.0;
+			if (due_ms > elapsed_ms)
+				boost::this_thread::sleep(boost::posix_time::microseconds((long)((due_ms - elapsed_ms) * 1000)));
+
+			FB::VariantMap params;
+			params["destination"] = destination;
+
+			CallTiming timing;
+			timing.done = false;
+			pj_get_timestamp(&timing.started);
+			{
+				boost::mutex::scoped_lock lock(timing_mutex);
+				next_start = timing.started;
+			}
+			FB::variant result = accounts[i % accounts.size()]->MakeCall(params);
+
+			BlabbleCallPtr call;
+			if (result.is_of_type<BlabbleCallWeakPtr>())
+				call = result.cast<BlabbleCallWeakPtr>().lock();
+
+			boost::mutex::scoped_lock lock(timing_mutex);
+			if (call)
+			{
+				calls.push_back(call);
+				timings.insert(std::make_pair(call->id(), timing));
+			}
+			else
+			{
+				failed_calls++;
+			}
+		}
+
+		//Wait for every call to connect or fail, at most 30 seconds
+		for (int wait = 0; wait < 3000; wait++)
+		{
+			boost::mutex::scoped_lock lock(timing_mutex);
+			if (setup_ms.size() + failed_calls >= call_count)
+				break;
+			lock.unlock();
+			boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+		}
+
+		boost::this_thread::sleep(boost::posix_time::seconds(hold_secs));
+
+		for (size_t i = 0; i < calls.size(); i++)
+			calls[i]->LocalEnd();
+
+		pj_get_timestamp(&run_end);
+		double cpu = CpuSeconds() - cpu_start;
+		long callbacks = PjsuaManager::callback_count() - callbacks_start;
+		double run_secs = pj_elapsed_usec(&run_start, &run_end) / 1e6;
+
+		std::vector<double> sorted;
+		{
+			boost::mutex::scoped_lock lock(timing_mutex);
+			sorted = setup_ms;
+		}
+		std::sort(sorted.begin(), sorted.end());
+
+		printf("connected: %u, failed: %u, unanswered: %u\n", (unsigned int)sorted.size(), failed_calls,
+			call_count - (unsigned int)sorted.size() - failed_calls);
+		printf("setup latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+			Percentile(sorted, 0.50), Percentile(sorted, 0.90), Percentile(sorted, 0.99),
+			sorted.empty() ? 0.0 : sorted.back());
+		printf("callbacks: %ld (%.1f/sec), events: %ld\n", callbacks, callbacks / run_secs, (long)events_seen);
+		printf("cpu: %.3f sec total, %.3f ms per call\n", cpu, cpu * 1000 / call_count);
+		FB::VariantMap state = BlabbleMetrics::Histogram("callback.onCallState.usec").Snapshot();
+		printf("onCallState usec: p50 <= %ld, p99 <= %ld, max %ld\n", state["p50"].convert_cast<long>(),
+			state["p99"].convert_cast<long>(), state["max"].convert_cast<long>());
+		if (!event_loop.empty())
+		{
+			FB::VariantMap lag = BlabbleMetrics::Histogram("eventloop.lag.usec").Snapshot();
+			printf("timer lag usec: p50 <= %ld, p99 <= %ld, max %ld\n", lag["p50"].convert_cast<long>(),
+				lag["p99"].convert_cast<long>(), lag["max"].convert_cast<long>());
+		}
+		if (dns_port != 0)
+		{
+			FB::VariantMap dns = manager->resolver().stats();
+			printf("dns: %ld cached, %ld tracked, %ld queries, %ld negative, %ld failed\n",
+				dns["cached"].convert_cast<long>(), dns["tracked"].convert_cast<long>(),
+				dns["queries"].convert_cast<long>(), dns["negative"].convert_cast<long>(),
+				dns["failures"].convert_cast<long>());
+
+			dns_failed = CheckDns(manager->resolver());
+		}
+
+		events->Shutdown();
+		calls.clear();
+		for (size_t i = 0; i < accounts.size(); i++)
+			accounts[i]->Destroy();
+		accounts.clear();
+
+		if (dns_server)
+			pj_dns_server_destroy(dns_server);
+	}
+	catch (const std::exception& e)
+	{
+		printf("Load test failed: %s\n", e.what());
+		return 1;
+	}
+
+	return dns_failed == 0 ? 0 : 1;
+}
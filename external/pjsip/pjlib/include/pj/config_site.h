@@ -42,6 +42,10 @@
 	#define PJSUA_MAX_CONF_PORTS		(PJSUA_MAX_CALLS+2*PJSUA_MAX_PLAYERS)
 	#undef PJ_IOQUEUE_MAX_HANDLES
 	#define PJ_IOQUEUE_MAX_HANDLES		(PJSUA_MAX_CALLS*2)
+	#undef PJSIP_MAX_TSX_COUNT
+	#define PJSIP_MAX_TSX_COUNT		(PJSUA_MAX_CALLS*4)
+	#undef PJSIP_MAX_DIALOG_COUNT
+	#define PJSIP_MAX_DIALOG_COUNT	(PJSUA_MAX_CALLS*2)
 #endif
 
 #include "config_site_sample.h"
\ No newline at end of file